@@ -2,19 +2,26 @@
 // COP-KMEANS (Constrained K-means Algorithm)
 // http://www.wkiri.com/research/cop-kmeans/
 //
+// Build:
+//  % g++ -I../../sparse cop_kmeans.cc -o cop_kmeans -Wall -O3 -fopenmp
+//
 
+#include <stdint.h>
+#include <unistd.h>
+#include <algorithm>
 #include <cassert>
 #include <cstdio>
+#include <cstdlib>
 #include <ctime>
-#include <fstream>
-#include <map>
 #include <vector>
 #include <google/dense_hash_map>
+#include "job_stats.h"
+#include "sparse_matrix.h"
+#include "tsv_reader.h"
 
-typedef uint64_t VecKey;
 typedef size_t VecId;
-typedef google::dense_hash_map<VecKey, double> Vector;
-typedef google::dense_hash_map<std::string, VecKey> KeyMap;
+typedef sparse::Matrix<float> VectorStore;  // sorted by keys
+typedef VectorStore::Element Element;
 
 class KMeans;
 
@@ -23,65 +30,160 @@ int main(int argc, char **argv);
 void usage(const char *progname);
 void read_vectors(const char *filename, KMeans &kmeans);
 void read_constraints(const char *filename, KMeans &kmeans);
-size_t splitstring(std::string s, const std::string &delimiter,
-                   std::vector<std::string> &splited);
 
 /* constants */
 const size_t MAX_ITER  = 10;
-const VecKey EMPTY_KEY = 0;
 const double LONG_DIST = 1000000000000000;
-const std::string DELIMITER("\t");
+const char DELIMITER = '\t';
 
 class KMeans {
  public:
   typedef google::dense_hash_map<std::string, size_t> LabelMap;
-  typedef std::multimap<size_t, size_t> ConstraintMap;
+  typedef std::vector<std::pair<size_t, size_t> > ConstraintList;
   enum Constraint {
     CONSTRAINT_MUST,
     CONSTRAINT_CANNOT
   };
 
  private:
-  std::vector<Vector *> vectors_;
-  std::vector<Vector *> centers_;
-  LabelMap labels_;
-  ConstraintMap must_;
-  ConstraintMap cannot_;
-
-  double euclid_distance_squared(const Vector &vec1, const Vector &vec2) const {
-    google::dense_hash_map<VecKey, bool> check;
-    check.set_empty_key(EMPTY_KEY);
-    double dist = 0.0;
-    Vector::const_iterator it1, it2;
-    for (it1 = vec1.begin(); it1 != vec1.end(); ++it1) {
-      double val1 = it1->second;
-      double val2 = 0.0;
-      it2 = vec2.find(it1->first);
-      if (it2 != vec2.end()) val2 = it2->second;
-      dist += (val1 - val2) * (val1 - val2);
-      check[it1->first] = true;
+  VectorStore vectors_;
+  std::vector<std::string> labels_;
+  LabelMap label_ids_;
+  ConstraintList must_;
+  ConstraintList cannot_;
+  size_t ncenters_;
+  size_t dimension_;
+  std::vector<float> centers_;        // ncenters_ x dimension_ (dense)
+  std::vector<double> center_norms_;  // squared norms
+
+  // must-linked vectors collapsed into components (super-points)
+  VectorStore components_;             // sum of the member vectors
+  std::vector<double> component_norms_;  // sum of squared norms of members
+  std::vector<size_t> weights_;        // the number of members
+  std::vector<size_t> component_;      // component of each vector
+  std::vector<size_t> cannot_offsets_;
+  std::vector<size_t> cannot_targets_;  // cannot-linked components (sorted)
+  std::vector<size_t> free_;           // components with no cannot-links
+  std::vector<size_t> constrained_;    // components with cannot-links
+  sparse::JobStats stats_;
+
+  const float *center(size_t idx) const {
+    return &centers_[0] + idx * dimension_;
+  }
+
+  double euclid_distance_squared(VecId id, size_t idx) const {
+    return vectors_.squared_distance(id, center(idx), center_norms_[idx]);
+  }
+
+  // sum of squared distances from the members of a component to a center
+  double component_distance(size_t comp, size_t idx) const {
+    double dist = component_norms_[comp] + weights_[comp] * center_norms_[idx]
+                  - 2.0 * components_.dot(comp, center(idx));
+    return (dist > 0.0) ? dist : 0.0;
+  }
+
+  static size_t find_root(std::vector<size_t> &parents, size_t i) {
+    while (parents[i] != i) {
+      parents[i] = parents[parents[i]];
+      i = parents[i];
+    }
+    return i;
+  }
+
+  // collapse must-links with union-find and merge cannot-links
+  void build_components() {
+    size_t vsiz = vectors_.size();
+    std::vector<size_t> parents(vsiz);
+    for (size_t i = 0; i < vsiz; i++) parents[i] = i;
+    for (size_t i = 0; i < must_.size(); i++) {
+      size_t root1 = find_root(parents, must_[i].first);
+      size_t root2 = find_root(parents, must_[i].second);
+      if (root1 != root2) parents[std::max(root1, root2)] = std::min(root1, root2);
+    }
+    // components are numbered in order of their first vectors
+    component_.assign(vsiz, vsiz);
+    size_t ncomp = 0;
+    for (size_t i = 0; i < vsiz; i++) {
+      size_t root = find_root(parents, i);
+      if (component_[root] == vsiz) component_[root] = ncomp++;
+      component_[i] = component_[root];
+    }
+    std::vector<std::vector<VecId> > members(ncomp);
+    for (size_t i = 0; i < vsiz; i++) members[component_[i]].push_back(i);
+    components_.clear();
+    component_norms_.assign(ncomp, 0.0);
+    weights_.assign(ncomp, 0);
+    std::vector<Element> elements;
+    for (size_t c = 0; c < ncomp; c++) {
+      elements.clear();
+      for (size_t m = 0; m < members[c].size(); m++) {
+        VecId id = members[c][m];
+        for (size_t k = 0; k < vectors_.length(id); k++) {
+          elements.push_back(Element(vectors_.ids(id)[k],
+                                     vectors_.values(id)[k]));
+        }
+        component_norms_[c] += vectors_.squared_norm(id);
+      }
+      components_.add(elements, VectorStore::DUPLICATE_SUM);
+      weights_[c] = members[c].size();
     }
-    for (it2 = vec2.begin(); it2 != vec2.end(); ++it2) {
-      if (check.find(it2->first) != check.end()) continue;
-      double val2 = it2->second;
-      double val1 = 0.0;
-      it1 = vec1.find(it2->first);
-      if (it1 != vec1.end()) val1 = it1->second;
-      dist += (val1 - val2) * (val1 - val2);
+
+    std::vector<std::pair<size_t, size_t> > links;
+    for (size_t i = 0; i < cannot_.size(); i++) {
+      size_t comp1 = component_[cannot_[i].first];
+      size_t comp2 = component_[cannot_[i].second];
+      if (comp1 == comp2) {
+        fprintf(stderr, "constraint inconsistency: must target contained in 'cannot' cluster\n");
+        exit(1);
+      }
+      links.push_back(std::make_pair(comp1, comp2));
+      links.push_back(std::make_pair(comp2, comp1));
+    }
+    std::sort(links.begin(), links.end());
+    links.erase(std::unique(links.begin(), links.end()), links.end());
+    cannot_offsets_.assign(ncomp + 1, 0);
+    cannot_targets_.resize(links.size());
+    for (size_t i = 0; i < links.size(); i++) {
+      cannot_offsets_[links[i].first + 1]++;
+      cannot_targets_[i] = links[i].second;
     }
-    return dist;
+    for (size_t c = 0; c < ncomp; c++) cannot_offsets_[c+1] += cannot_offsets_[c];
+    free_.clear();
+    constrained_.clear();
+    for (size_t c = 0; c < ncomp; c++) {
+      if (cannot_offsets_[c] == cannot_offsets_[c+1]) {
+        free_.push_back(c);
+      } else {
+        constrained_.push_back(c);
+      }
+    }
+    fprintf(stderr, "%ld components (%ld with cannot-links)\n",
+            ncomp, constrained_.size());
+  }
+
+  void init_centers(size_t ncenters) {
+    ncenters_ = ncenters;
+    dimension_ = vectors_.dimension();
+    centers_.assign(ncenters_ * dimension_, 0.0);
+    center_norms_.assign(ncenters_, 0.0);
+  }
+
+  void set_center(size_t idx, VecId id) {
+    float *c = &centers_[0] + idx * dimension_;
+    std::fill(c, c + dimension_, 0.0);
+    vectors_.add_to(id, c);
+    center_norms_[idx] = vectors_.squared_norm(id);
   }
 
   void choose_random_centers(size_t ncenters) {
-    centers_.clear();
+    init_centers(ncenters);
     google::dense_hash_map<size_t, bool> check;
     check.set_empty_key(vectors_.size());
     size_t cnt = 0;
     while (cnt < ncenters) {
       size_t index = rand() % vectors_.size();
       if (check.find(index) == check.end()) {
-        Vector *center = new Vector(*vectors_[index]);
-        centers_.push_back(center);
+        set_center(cnt, index);
         cnt++;
         check[index] = true;
       }
@@ -89,19 +191,20 @@ class KMeans {
   }
 
   void choose_smart_centers(size_t ncenters) {
-    centers_.clear();
-    double closest_dist[vectors_.size()];
+    init_centers(ncenters);
+    int vsiz = static_cast<int>(vectors_.size());
+    std::vector<double> closest_dist(vsiz);
     double potential = 0.0;
     size_t cnt = 0;
 
     // choose one random center
     size_t index = rand() % vectors_.size();
-    Vector *center = new Vector(*vectors_[index]);
-    centers_.push_back(center);
+    set_center(cnt, index);
     cnt++;
     // update closest distance
-    for (size_t i = 0; i < vectors_.size(); i++) {
-      double dist = euclid_distance_squared(*vectors_[i], *centers_[0]);
+    #pragma omp parallel for reduction(+:potential)
+    for (int i = 0; i < vsiz; i++) {
+      double dist = euclid_distance_squared(i, 0);
       closest_dist[i] = dist;
       potential += dist;
     }
@@ -109,7 +212,7 @@ class KMeans {
     while (cnt < ncenters) {
       double randval = static_cast<double>(rand()) / RAND_MAX * potential;
       size_t index = 0;
-      for (size_t i = 0; i < vectors_.size(); i++) {
+      for (int i = 0; i < vsiz; i++) {
         if (randval <= closest_dist[i]) {
           index = i;
           break;
@@ -117,143 +220,122 @@ class KMeans {
           randval -= closest_dist[i];
         }
       }
-      Vector *center = new Vector(*vectors_[index]);
+      set_center(cnt, index);
       double potential_new = 0.0;
-      for (size_t i = 0; i < vectors_.size(); i++) {
-        double dist = euclid_distance_squared(*vectors_[i], *center);
+      #pragma omp parallel for reduction(+:potential_new)
+      for (int i = 0; i < vsiz; i++) {
+        double dist = euclid_distance_squared(i, cnt);
         if (closest_dist[i] > dist) closest_dist[i] = dist;
         potential_new += closest_dist[i];
       }
-      centers_.push_back(center);
       cnt++;
       potential = potential_new;
     }
   }
 
-  void assign_clusters(size_t *assign) const {
-    // clear assignments
-    size_t init_index = centers_.size();
-    for (size_t i = 0; i < vectors_.size(); i++) {
-      assign[i] = init_index;
-    }
-    google::dense_hash_map<size_t, bool> cannot_cluster;
-    cannot_cluster.set_empty_key(init_index);
-    for (size_t i = 0; i < vectors_.size(); i++) {
-      size_t min_index = init_index;
-      double min_dist = LONG_DIST;
-      // check must constraint
-      for (ConstraintMap::const_iterator it = must_.lower_bound(i);
-           it != must_.upper_bound(i); ++it) {
-        if (assign[it->second] != init_index) {
-          if (min_index == init_index) {
-            min_index = assign[it->second];
-          } else if (min_index != assign[it->second]) {
-            fprintf(stderr, "constraint inconsistency: multiple must target\n");
-            exit(1);
-          }
-        }
-      }
-      // check cannot constraint
-      cannot_cluster.clear();
-      for (ConstraintMap::const_iterator it = cannot_.lower_bound(i);
-           it != cannot_.upper_bound(i); ++it) {
-        if (assign[it->second] != init_index) {
-          cannot_cluster[assign[it->second]] = true;
-        }
-      }
-      if (min_index != init_index) {
-        if (cannot_cluster.find(min_index) != cannot_cluster.end()) {
-          fprintf(stderr, "constraint inconsistency: must target contained in 'cannot' cluster\n");
-          exit(1);
-        } else {
-          assign[i] = min_index;
-          continue;
-        }
+  // the nearest center of a component except banned clusters
+  size_t find_nearest(size_t comp, const std::vector<bool> *banned) const {
+    size_t min_index = ncenters_;
+    double min_dist = LONG_DIST;
+    for (size_t j = 0; j < ncenters_; j++) {
+      if (banned && (*banned)[j]) continue;
+      double dist = component_distance(comp, j);
+      if (dist < min_dist) {
+        min_index = j;
+        min_dist = dist;
       }
+    }
+    return min_index;
+  }
 
-      for (size_t j = 0; j < centers_.size(); j++) {
-        if (cannot_cluster.find(j) != cannot_cluster.end()) continue;
-        double dist = euclid_distance_squared(*vectors_[i], *centers_[j]);
-        if (dist < min_dist) {
-          min_index = j;
-          min_dist = dist;
-        }
+  // components with no cannot-links are assigned in parallel, and those
+  // with cannot-links in order, avoiding the clusters of the linked
+  // components already assigned in this pass
+  void assign_clusters(std::vector<size_t> &assign) const {
+    std::vector<size_t> comp_assign(weights_.size(), ncenters_);
+    int fsiz = static_cast<int>(free_.size());
+    #pragma omp parallel for schedule(dynamic, 256)
+    for (int i = 0; i < fsiz; i++) {
+      comp_assign[free_[i]] = find_nearest(free_[i], NULL);
+    }
+    std::vector<bool> banned(ncenters_);
+    for (size_t i = 0; i < constrained_.size(); i++) {
+      size_t comp = constrained_[i];
+      std::fill(banned.begin(), banned.end(), false);
+      for (size_t j = cannot_offsets_[comp]; j < cannot_offsets_[comp+1]; j++) {
+        size_t target = comp_assign[cannot_targets_[j]];
+        if (target != ncenters_) banned[target] = true;
       }
-      if (min_index == vectors_.size()) {
+      comp_assign[comp] = find_nearest(comp, &banned);
+      if (comp_assign[comp] == ncenters_) {
         fprintf(stderr, "cannot find closest cluster. exit now\n");
         exit(1);
-      } else {
-        assign[i] = min_index;
       }
     }
+    int vsiz = static_cast<int>(vectors_.size());
+    #pragma omp parallel for
+    for (int i = 0; i < vsiz; i++) assign[i] = comp_assign[component_[i]];
   }
 
-  void move_centers(const size_t *assign) {
-    for (size_t i = 0; i < centers_.size(); i++) {
-      centers_[i]->clear();
-    }
-    std::vector<size_t> count(centers_.size());
-    Vector::iterator cit;
-    for (size_t i = 0; i < vectors_.size(); i++) {
-      for (Vector::iterator it = vectors_[i]->begin();
-           it != vectors_[i]->end(); ++it) {
-        cit = centers_[assign[i]]->find(it->first);
-        if (cit != centers_[assign[i]]->end()) {
-          cit->second += it->second;
-        } else {
-          centers_[assign[i]]->insert(
-            std::pair<VecKey, double>(it->first, it->second));
-        }
+  // each center is summed up by one thread
+  void move_centers(const std::vector<size_t> &assign) {
+    int csiz = static_cast<int>(ncenters_);
+    std::vector<size_t> offsets(ncenters_ + 1, 0);
+    for (size_t i = 0; i < assign.size(); i++) offsets[assign[i] + 1]++;
+    for (size_t i = 0; i < ncenters_; i++) offsets[i+1] += offsets[i];
+    std::vector<VecId> members(assign.size());
+    std::vector<size_t> fill(offsets.begin(), offsets.end() - 1);
+    for (size_t i = 0; i < assign.size(); i++) members[fill[assign[i]]++] = i;
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int i = 0; i < csiz; i++) {
+      float *c = &centers_[0] + i * dimension_;
+      std::fill(c, c + dimension_, 0.0);
+      size_t count = offsets[i+1] - offsets[i];
+      for (size_t m = offsets[i]; m < offsets[i+1]; m++) {
+        vectors_.add_to(members[m], c);
       }
-      count[assign[i]]++;
-    }
-    for (size_t i = 0; i < count.size(); i++) {
-      if (count[i] == 0) continue;
-      for (Vector::iterator it = centers_[i]->begin();
-           it != centers_[i]->end(); ++it) {
-        it->second /= count[i];
+      double norm = 0.0;
+      for (size_t k = 0; k < dimension_; k++) {
+        if (count > 0) c[k] /= count;
+        norm += c[k] * c[k];
       }
+      center_norms_[i] = norm;
     }
   }
 
-  bool is_same_array(size_t *array1, size_t *array2, size_t size) {
-    for (size_t i = 0; i < size; i++) {
-      if (array1[i] != array2[i]) return false;
-    }
-    return true;
+ public:
+  KMeans() : ncenters_(0), dimension_(0), stats_("points") {
+    label_ids_.set_empty_key("");
   }
 
- public:
-  KMeans() { labels_.set_empty_key(""); }
+  ~KMeans() { }
 
-  ~KMeans() {
-    for (size_t i = 0; i < vectors_.size(); i++) {
-      if (vectors_[i]) delete vectors_[i];
-    }
-    for (size_t i = 0; i < centers_.size(); i++) {
-      if (centers_[i]) delete centers_[i];
-    }
-  }
+  // phases and iterations are recorded by stats() when it is opened
+  sparse::JobStats &stats() { return stats_; }
 
-  void add_vector(const std::string &label, Vector *vec) {
-    assert(!label.empty() && !vec->empty());
-    labels_[label] = vectors_.size();
-    vectors_.push_back(vec);
+  size_t size() const { return vectors_.size(); }
+
+  void add_vector(const std::string &label, std::vector<Element> &elements) {
+    assert(!label.empty() && !elements.empty());
+    label_ids_[label] = labels_.size();
+    labels_.push_back(label);
+    vectors_.add(elements);
   }
 
   void add_constraint(const std::string &label1, const std::string &label2,
                       Constraint type) {
     size_t index1, index2;
     LabelMap::iterator it;
-    it = labels_.find(label1);
-    if (it != labels_.end()) {
+    it = label_ids_.find(label1);
+    if (it != label_ids_.end()) {
       index1 = it->second;
     } else {
       fprintf(stderr, "label not found in add_constraint: %s\n", label1.c_str());
       return;
     }
-    it = labels_.find(label2);
-    if (it != labels_.end()) {
+    it = label_ids_.find(label2);
+    if (it != label_ids_.end()) {
       index2 = it->second;
     } else {
       fprintf(stderr, "label not found in add_constraint: %s\n", label2.c_str());
@@ -262,12 +344,10 @@ class KMeans {
 
     switch(type) {
     case CONSTRAINT_MUST:
-      must_.insert(std::pair<size_t, size_t>(index1, index2));
-      must_.insert(std::pair<size_t, size_t>(index2, index1));
+      must_.push_back(std::make_pair(index1, index2));
       break;
     case CONSTRAINT_CANNOT:
-      cannot_.insert(std::pair<size_t, size_t>(index1, index2));
-      cannot_.insert(std::pair<size_t, size_t>(index2, index1));
+      cannot_.push_back(std::make_pair(index1, index2));
       break;
     default:
       break;
@@ -276,35 +356,53 @@ class KMeans {
 
   void execute(size_t nclusters) {
     assert(nclusters <= vectors_.size());
+    size_t vsiz = vectors_.size();
+    double start = stats_.start();
+    build_components();
 //    choose_random_centers(nclusters);
     choose_smart_centers(nclusters);
-    size_t assign[vectors_.size()];
-    size_t prev_assign[vectors_.size()];
-    memset(assign, nclusters, sizeof(nclusters) * vectors_.size());
-    memset(prev_assign, nclusters, sizeof(nclusters) * vectors_.size());
+    stats_.phase("seed", start, vsiz);
+    std::vector<size_t> assign(vsiz, nclusters);
+    std::vector<size_t> prev_assign(vsiz, nclusters);
     for (size_t i = 0; i < MAX_ITER; i++) {
-      fprintf(stderr, "kmeans loop No.%d ...\n", i);
+      fprintf(stderr, "kmeans loop No.%ld ...\n", i);
+      start = stats_.start();
       assign_clusters(assign);
+      double assigned = stats_.start();
       move_centers(assign);
-      if (is_same_array(assign, prev_assign, vectors_.size())) {
+      if (stats_.enabled()) {
+        double moved = stats_.start();
+        size_t nchanged = 0;
+        double sse = 0.0;
+        for (size_t j = 0; j < vsiz; j++) {
+          if (assign[j] != prev_assign[j]) nchanged++;
+          sse += euclid_distance_squared(j, assign[j]);
+        }
+        stats_.iteration(i + 1, start, vsiz).value("sse", sse)
+              .count("changed", nchanged)
+              .value("assign_seconds", assigned - start)
+              .value("move_seconds", moved - assigned).end();
+      }
+      if (assign == prev_assign) {
         break;
       } else {
-        std::copy(assign, assign + vectors_.size(), prev_assign);
+        prev_assign = assign;
       }
     }
     // show clustering result
-    for (LabelMap::iterator it = labels_.begin(); it != labels_.end(); ++it) {
-      printf("%s\t%d\n", it->first.c_str(), assign[it->second]);
+    start = stats_.start();
+    for (size_t i = 0; i < labels_.size(); i++) {
+      printf("%s\t%ld\n", labels_[i].c_str(), assign[i]);
     }
+    fflush(stdout);
+    stats_.phase("save", start, vsiz);
   }
 
   void show_vectors() const {
-    for (LabelMap::const_iterator lit = labels_.begin();
-         lit != labels_.end(); ++lit) {
-      printf("%s", lit->first.c_str());
-      for (Vector::const_iterator vit = vectors_[lit->second]->begin();
-           vit != vectors_[lit->second]->end(); ++vit) {
-        printf("\t%d\t%.3f", vit->first, vit->second);
+    for (size_t i = 0; i < labels_.size(); i++) {
+      printf("%s", labels_[i].c_str());
+      for (size_t j = 0; j < vectors_.length(i); j++) {
+        printf("\t%u\t%.3f", vectors_.ids(i)[j], vectors_.values(i)[j]);
       }
       printf("\n");
     }
@@ -312,92 +410,89 @@ class KMeans {
 };
 
 int main(int argc, char **argv) {
+  const char *stats = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "S:")) != -1) {
+    switch (opt) {
+    case 'S':
+      stats = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
   if (argc < 3) usage(argv[0]);
   srand((unsigned int) time(NULL));
   KMeans kmeans;
+  if (stats != NULL && !kmeans.stats().open(stats)) {
+    fprintf(stderr, "cannot open %s\n", stats);
+    exit(1);
+  }
+  double start = kmeans.stats().start();
   read_vectors(argv[2], kmeans);
 //  kmeans.show_vectors();
   if (argc == 4) read_constraints(argv[3], kmeans);
+  kmeans.stats().phase("load", start, kmeans.size());
   kmeans.execute(atoi(argv[1]));
   return 0;
 }
 
 void usage(const char *progname) {
-  fprintf(stderr, "%s: ncluster data [constraint]\n", progname);
+  fprintf(stderr, "%s: [-S file] ncluster data [constraint]\n", progname);
+  fprintf(stderr, "  -S file : append statistics of phases and iterations to file\n"
+                  "            (\"-\": stderr)\n");
   exit(1);
 }
 
 void read_vectors(const char *filename, KMeans &kmeans) {
-  std::ifstream ifs(filename);
-  if (!ifs) {
+  sparse::TsvReader reader;
+  if (!reader.open(filename)) {
     fprintf(stderr, "cannot open %s\n", filename);
     exit(1);
   }
-  KeyMap keymap;
-  keymap.set_empty_key("");
-  VecKey curkey = EMPTY_KEY + 1;
-  std::string line;
-  std::vector<std::string> splited;
-  while (getline(ifs, line)) {
-    splitstring(line, DELIMITER, splited);
-    if (splited.size() % 2 != 1) {
-      fprintf(stderr, "format error: %s\n", line.c_str());
+  sparse::FeatureDict features;
+  const char *line;
+  size_t size;
+  std::vector<sparse::Field> fields;
+  std::vector<Element> elements;
+  while (reader.next_line(&line, &size)) {
+    sparse::split(line, line + size, DELIMITER, fields);
+    if (fields.size() % 2 != 1) {
+      fprintf(stderr, "format error: %s\n", line);
       continue;
     }
-    Vector *vec = new Vector;
-    vec->set_empty_key(EMPTY_KEY);
-    for (size_t i = 1; i < splited.size(); i += 2) {
-      KeyMap::iterator kit = keymap.find(splited[i]);
-      VecKey key;
-      if (kit != keymap.end()) {
-        key = kit->second;
-      } else {
-        key = curkey;
-        keymap[splited[i]] = curkey++;
-      }
-      double point = 0.0;
-      point = atof(splited[i+1].c_str());
+    elements.clear();
+    for (size_t i = 1; i < fields.size(); i += 2) {
+      uint32_t key = features.intern(fields[i]);
+      double point = fields[i+1].to_double();
       if (point != 0) {
-        vec->insert(std::pair<VecKey, double>(key, point));
+        elements.push_back(Element(key, point));
       }
     }
-    if (!splited[0].empty() && !vec->empty()) {
-      kmeans.add_vector(splited[0], vec);
+    if (!fields[0].empty() && !elements.empty()) {
+      kmeans.add_vector(fields[0].str(), elements);
     }
-    splited.clear();
   }
 }
 
 void read_constraints(const char *filename, KMeans &kmeans) {
-  std::ifstream ifs(filename);
-  if (!ifs) {
+  sparse::TsvReader reader;
+  if (!reader.open(filename)) {
     fprintf(stderr, "cannot open %s\n", filename);
     exit(1);
   }
-  std::vector<std::string> splited;
-  std::string line;
-  while (getline(ifs, line)) {
-    splitstring(line, DELIMITER, splited);
-    if (splited.size() == 3) {
-      if (splited[2] == "c") {
-        kmeans.add_constraint(splited[0], splited[1], KMeans::CONSTRAINT_CANNOT);
-      } else if (splited[2] == "m") {
-        kmeans.add_constraint(splited[0], splited[1], KMeans::CONSTRAINT_MUST);
+  std::vector<sparse::Field> fields;
+  while (reader.next(DELIMITER, fields)) {
+    if (fields.size() == 3) {
+      if (fields[2].equals("c")) {
+        kmeans.add_constraint(fields[0].str(), fields[1].str(),
+                              KMeans::CONSTRAINT_CANNOT);
+      } else if (fields[2].equals("m")) {
+        kmeans.add_constraint(fields[0].str(), fields[1].str(),
+                              KMeans::CONSTRAINT_MUST);
       }
     }
-    splited.clear();
-  }
-}
-
-size_t splitstring(std::string s, const std::string &delimiter,
-                   std::vector<std::string> &splited) {
-  size_t cnt = 0;
-  for (size_t p = 0; (p = s.find(delimiter)) != s.npos; ) {
-    splited.push_back(s.substr(0, p));
-    ++cnt;
-    s = s.substr(p + delimiter.size());
   }
-  splited.push_back(s);
-  ++cnt;
-  return cnt;
 }
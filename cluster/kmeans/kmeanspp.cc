@@ -3,66 +3,70 @@
  * (Ref: http://www.stanford.edu/~darthur/kMeansPlusPlus.pdf)
  *
  * Usage:
- *  kmeanpp -i inputdb -o txt -n ncenters
+ *  kmeanpp -i inputdb -o txt -n ncenters [-m metric]
  *    -i, --input dbm  ... input TCHDB file
  *    -o, --output txt ... output text file
  *    -n, --number n   ... number of centers (n > 0)
+ *    -m, --metric m   ... cosine or euclid (default: cosine)
+ *
+ * The input dbm is read once into memory (sparse/sparse_matrix.h), and
+ * the vectors are assigned and the centers are moved in parallel (OpenMP).
  *
  * Requirement:
  *  - Tokyo Cabinet (http://tokyocabinet.sourceforge.net/)
  *
  * Build:
- *  % g++ `tcucodec conf -l` kmeanspp.cc -o kmeanspp
+ *  % g++ -O3 -fopenmp -I../../sparse `tcucodec conf -l` kmeanspp.cc -o kmeanspp
  *
  */
 
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <ctime>
+#include <algorithm>
 #include <fstream>
 #include <iostream>
-#include <map>
-#include <sstream>
+#include <string>
 #include <vector>
 #include <unistd.h>
 #include <tchdb.h>
-#include <ext/hash_map>
+#include "sparse_matrix.h"
+#include "tsv_reader.h"
 
 using namespace std;
 
-struct stringhash { // hash function for string
-  size_t operator()(const string& str) const {
-    const char *ptr = str.data();
-    int size = str.size();
-    size_t idx = 19780211;
-    while(size--){
-      idx = idx * 37 + *(uint8_t *)ptr++;
-    }
-    return idx;
-  }
+typedef vector<double> Center;  // dense center
+
+/* all vectors of the input dbm in memory (sparse rows of interned ids) */
+struct Matrix {
+  vector<string> keys;          // record keys
+  sparse::FeatureDict features;
+  sparse::Matrix<double> rows;
 };
 
-//typedef map<string, double> Vector;
-//typedef map<string, double>::iterator VecIt;
-typedef __gnu_cxx::hash_map<string, double, stringhash> Vector;
-typedef __gnu_cxx::hash_map<string, double, stringhash>::iterator VecIt;
+enum Metric {
+  METRIC_EUCLID,
+  METRIC_COSINE
+};
 
 /* function prototypes */
 int main(int, char **);
 void usage_exit();
-void print_vector(Vector &);
-void add_vector(Vector &, Vector &);
-void mult_each(Vector &, double);
-double squared_dist(Vector &, Vector &);
-double product(Vector &, Vector &);
-double length(Vector &);
-double cosine(Vector &, Vector &);
-double cosine_dist(Vector &, Vector &);
-void parse_dbmdata(const char *, Vector &);
-void choose_random_centers(TCHDB *, vector<Vector> &);
-void choose_smart_centers(TCHDB *, vector<Vector> &);
-void assign_clusters(TCHDB *, map<string, int> &, vector<Vector> &);
-void move_centers(TCHDB *, map<string, int> &, vector<Vector> &);
-void kmeans(TCHDB *, map<string, int> &, vector<Vector> &);
-void save_clusters(map<string, int> &, const char *);
+void load_matrix(TCHDB *, Matrix &);
+void parse_dbmdata(const char *, int, Matrix &);
+double length(const Center &);
+double squared_dist(const Matrix &, size_t, const Center &, double);
+double cosine_dist(const Matrix &, size_t, const Center &, double);
+double distance(const Matrix &, size_t, const Center &, double, Metric);
+void set_center(const Matrix &, size_t, Center &);
+void choose_random_centers(const Matrix &, vector<Center> &);
+void choose_smart_centers(const Matrix &, vector<Center> &, Metric);
+void assign_clusters(const Matrix &, vector<int> &, const vector<Center> &,
+                     Metric);
+void move_centers(const Matrix &, const vector<int> &, vector<Center> &);
+void kmeans(const Matrix &, vector<int> &, vector<Center> &, Metric);
+void save_clusters(const Matrix &, const vector<int> &, const char *);
 
 /* Constants */
 const int MAX_ITERATION = 10;
@@ -73,7 +77,8 @@ int main(int argc, char **argv) {
   int ncenters = 0;
   char *input  = NULL;
   char *output = NULL;
-  while ((opt = getopt(argc, argv, "n:i:o:")) != -1) {
+  Metric metric = METRIC_COSINE;
+  while ((opt = getopt(argc, argv, "n:i:o:m:")) != -1) {
     switch (opt) {
     case 'i':
       input = optarg;
@@ -84,6 +89,15 @@ int main(int argc, char **argv) {
     case 'n':
       ncenters = atoi(optarg);
       break;
+    case 'm':
+      if (strcmp(optarg, "cosine") == 0) {
+        metric = METRIC_COSINE;
+      } else if (strcmp(optarg, "euclid") == 0) {
+        metric = METRIC_EUCLID;
+      } else {
+        usage_exit();
+      }
+      break;
     }
   }
   if (input == NULL || output == NULL || ncenters <= 0) usage_exit();
@@ -96,357 +110,240 @@ int main(int argc, char **argv) {
     exit(1);
   }
 
+  cout << "Load vectors" << endl;
+  Matrix matrix;
+  load_matrix(vecdb, matrix);
+  tchdbdel(vecdb);
+  if (matrix.keys.size() < static_cast<size_t>(ncenters)) {
+    cerr << "too few vectors: " << matrix.keys.size() << endl;
+    exit(1);
+  }
+  cout << " " << matrix.keys.size() << " vectors, "
+       << matrix.features.size() << " features" << endl;
+
   cout << "Choose initial centers" << endl;
-  vector<Vector> centers(ncenters);
-  choose_smart_centers(vecdb, centers);
-  //choose_random_centers(vecdb, centers);
-//  for (unsigned int i = 0; i < centers.size(); i++) {
-//    cout << "center-" << i << "\t";
-//    print_vector(centers[i]);
-//  }
+  vector<Center> centers(ncenters);
+  choose_smart_centers(matrix, centers, metric);
+  //choose_random_centers(matrix, centers);
 
   cout << "Do k-means clustering" << endl;
-  map<string, int> assign;
-  kmeans(vecdb, assign, centers);
+  vector<int> assign;
+  kmeans(matrix, assign, centers, metric);
 
   cout << "Save clusters" << endl;
-  save_clusters(assign, output);
-
-  tchdbdel(vecdb);
+  save_clusters(matrix, assign, output);
   return 0;
 }
 
 void usage_exit() {
   cerr << "Usage: " << endl
-       << " kmeanpp -i inputdb -o outputdb -n ncenters"       << endl
+       << " kmeanpp -i inputdb -o outputdb -n ncenters [-m metric]" << endl
        << "   -i, --input dbm  ... input TCHDB file"          << endl
        << "   -o, --output dbm ... output TCHDB file"         << endl
-       << "   -n, --number n   ... number of centers (n > 0)" << endl;
+       << "   -n, --number n   ... number of centers (n > 0)" << endl
+       << "   -m, --metric m   ... cosine or euclid (default: cosine)" << endl;
   exit(1);
 }
 
-void print_vector(Vector &vec) {
-  VecIt it = vec.begin();
-  while (it != vec.end()) {
-    cout << it->first << ":" << it->second << " ";
-    ++it;
-  }
-  cout << endl;
-}
-
-void add_vector(Vector &vec1, Vector &vec2) {
-  VecIt it = vec2.begin();
-  while (it != vec2.end()) {
-    string key = it->first;
-    double point = it->second;
-    vec1[key] += point;
-    ++it;
+/* read all records in one sequential pass */
+void load_matrix(TCHDB *vecdb, Matrix &matrix) {
+  TCXSTR *key = tcxstrnew();
+  TCXSTR *value = tcxstrnew();
+  tchdbiterinit(vecdb);
+  while (tchdbiternext3(vecdb, key, value)) {
+    matrix.keys.push_back(string(static_cast<const char *>(tcxstrptr(key)),
+                                 tcxstrsize(key)));
+    parse_dbmdata(static_cast<const char *>(tcxstrptr(value)),
+                  tcxstrsize(value), matrix);
   }
+  tcxstrdel(key);
+  tcxstrdel(value);
 }
 
-void mult_each(Vector &vec, double x) {
-  VecIt it = vec.begin();
-  while (it != vec.end()) {
-    vec[it->first] = it->second * x;
-    ++it;
+/* parse "word point word point ..." and append it as a row */
+void parse_dbmdata(const char *data, int size, Matrix &matrix) {
+  vector<sparse::Field> fields;
+  sparse::split_spaces(data, data + size, fields);
+  vector<sparse::Matrix<double>::Element> row;
+  for (size_t i = 0; i + 1 < fields.size(); i += 2) {
+    row.push_back(make_pair(matrix.features.intern(fields[i]),
+                            fields[i+1].to_double()));
   }
+  // the last value of a duplicated word is used
+  matrix.rows.add(row, sparse::Matrix<double>::DUPLICATE_LAST);
 }
 
-void parse_dbmdata(char *data, Vector &vec) {
-  istringstream iss(data);
-  string token;
-  string word;
-  int cnt = 0;
-  while (iss >> token) {
-    if (cnt % 2 == 0) {
-      word = token;
-    } else {
-      double point = atof(token.c_str());
-      vec[word] = point;
-    }
-    ++cnt;
-  }
+double length(const Center &center) {
+  const double *x = sparse::data(center);
+  return sqrt(sparse::dot(x, x, center.size()));
 }
 
-double length(Vector &vec) {
-  VecIt it = vec.begin();
-  double sum = 0;
-  while (it != vec.end()) {
-    double point = it->second;
-    sum += point * point;
-    ++it;
-  }
-  return sqrt(sum);
+double squared_dist(const Matrix &matrix, size_t row, const Center &center,
+                    double center_length) {
+  return matrix.rows.squared_distance(row, sparse::data(center),
+                                      center_length * center_length);
 }
 
-double squared_dist(Vector &vec1, Vector &vec2) {
-  map<string, bool> check;
-  double dist = 0;
-  VecIt it = vec1.begin();
-  while (it != vec1.end()) {
-    string key = it->first;
-    double p1 = vec1[key];
-    double p2 = vec2[key];
-    dist += (p1 - p2) * (p1 - p2);
-    check[key] = true;
-    ++it;
-  }
-  it = vec2.begin();
-  while (it != vec2.end()) {
-    string key = it->first;
-    if (!check[key]) {
-      double p1 = vec1[key];
-      double p2 = vec2[key];
-      dist += (p1 - p2) * (p1 - p2);
-      check[key] = true;
-    }
-    ++it;
-  }
-  return dist;
-}
-
-double product(Vector &vec1, Vector &vec2) {
-  VecIt it, end;
-  if (vec1.size() < vec2.size()) {
-    it = vec1.begin();
-    end = vec1.end();
+double cosine_dist(const Matrix &matrix, size_t row, const Center &center,
+                   double center_length) {
+  double len = matrix.rows.norm(row);
+  if (len == 0 || center_length == 0) return 1;
+  double result = matrix.rows.dot(row, sparse::data(center)) /
+                  (len * center_length);
+  if (isnan(result)) {
+    return 1;
   } else {
-    it = vec2.begin();
-    end = vec2.end();
-  }
-  double prod = 0;
-  while (it != end) {
-    string key = it->first;
-    double point1 = vec1[key];
-    double point2 = vec2[key];
-    prod += point1 * point2;
-    ++it;
+    return 1 - result;
   }
-  return prod;
 }
 
-double cosine(Vector &vec1, Vector &vec2) {
-  double len1 = length(vec1);
-  double len2 = length(vec2);
-  if (len1 == 0 || len2 == 0) return 0;
-
-  double prod = product(vec1, vec2);
-  double result = prod / (len1 * len2);
-  if (isnan(result)) {
-    return 0;
+double distance(const Matrix &matrix, size_t row, const Center &center,
+                double center_length, Metric metric) {
+  if (metric == METRIC_EUCLID) {
+    return squared_dist(matrix, row, center, center_length);
   } else {
-    return result;
+    return cosine_dist(matrix, row, center, center_length);
   }
 }
 
-double cosine_dist(Vector &vec1, Vector &vec2) {
-  return 1 - cosine(vec1, vec2);
+void set_center(const Matrix &matrix, size_t row, Center &center) {
+  center.assign(matrix.features.size(), 0);
+  matrix.rows.add_to(row, sparse::data(center));
 }
 
-void choose_random_centers(TCHDB *vecdb, vector<Vector> &centers) {
-  map<int, bool> idxmap;
-  int rnum = tchdbrnum(vecdb);
+void choose_random_centers(const Matrix &matrix, vector<Center> &centers) {
+  vector<bool> chosen(matrix.keys.size(), false);
   unsigned int ncenters = 0;
   srand((unsigned) time(NULL));
   while (ncenters < centers.size()) {
-    int idx = rand() % rnum;
-    if (idxmap.find(idx) == idxmap.end()) {
-      idxmap[idx] = true;
-      ++ncenters;
+    int idx = rand() % matrix.keys.size();
+    if (!chosen[idx]) {
+      chosen[idx] = true;
+      set_center(matrix, idx, centers[ncenters++]);
     }
   }
-
-  ncenters = 0;
-  int idx = 0;
-  char *key;
-  tchdbiterinit(vecdb);
-  while ((key = tchdbiternext2(vecdb)) != NULL) {
-    if (idxmap[idx]) {
-      char *value = tchdbget2(vecdb, key);
-      free(key);
-      if (value == NULL) continue;
-      parse_dbmdata(value, centers[ncenters]);
-      free(value);
-      ++ncenters;
-    } else {
-      free(key);
-    }
-    ++idx;
-  }
 }
 
-void choose_smart_centers(TCHDB *vecdb, vector<Vector> &centers) {
-  map<int, bool> idxmap;
-  map<string, double> closest_dist;
-  int rnum = tchdbrnum(vecdb);
+void choose_smart_centers(const Matrix &matrix, vector<Center> &centers,
+                          Metric metric) {
+  int rnum = static_cast<int>(matrix.keys.size());
+  vector<double> closest_dist(rnum);
   double potential = 0;
   unsigned int ncenters = 0;
-  char *key, *value;
 
   /* choose one random center */
   srand((unsigned) time(NULL));
-  int initidx = rand() % rnum;
-  int idx = 0;
-  tchdbiterinit(vecdb);
-  while ((key = tchdbiternext2(vecdb)) != NULL) {
-    if (idx == initidx) {
-      value = tchdbget2(vecdb, key);
-      free(key);
-      if (value == NULL) continue;
-      parse_dbmdata(value, centers[ncenters]);
-      free(value);
-      ++ncenters;
-      break;
-    } else {
-      free(key);
-    }
-    ++idx;
-  }
+  set_center(matrix, rand() % rnum, centers[ncenters++]);
 
   /* update closest distance */
-  tchdbiterinit(vecdb);
-  while ((key = tchdbiternext2(vecdb)) != NULL) {
-    value = tchdbget2(vecdb, key);
-    if (value == NULL) {
-      free(key);
-      continue;
-    }
-    Vector vec;
-    parse_dbmdata(value, vec);
-    free(value);
-    //double dist = squared_dist(vec, centers[0]);
-    double dist = cosine_dist(vec, centers[0]);
-    closest_dist[key] = dist;
+  double center_length = length(centers[0]);
+  #pragma omp parallel for reduction(+:potential)
+  for (int i = 0; i < rnum; i++) {
+    double dist = distance(matrix, i, centers[0], center_length, metric);
+    closest_dist[i] = dist;
     potential += dist;
-    free(key);
   }
 
   /* choose each center */
   while (ncenters < centers.size()) {
     double randval = static_cast<double>(rand()) / RAND_MAX * potential;
-    string centkey = "";
-    tchdbiterinit(vecdb);
-    while ((key = tchdbiternext2(vecdb)) != NULL) {
-      centkey = key;
-      double dist = closest_dist[key];
-      free(key);
-      if (randval <= dist) break;
-      randval -= dist;
+    int centidx = rnum - 1;
+    for (int i = 0; i < rnum; i++) {
+      if (randval <= closest_dist[i]) {
+        centidx = i;
+        break;
+      }
+      randval -= closest_dist[i];
     }
-    Vector centvec;
-    value = tchdbget2(vecdb, centkey.c_str());
-    if (value == NULL) continue;
-    parse_dbmdata(value, centvec);
-    free(value);
+    Center &centvec = centers[ncenters];
+    set_center(matrix, centidx, centvec);
+    center_length = length(centvec);
 
     double newpotential = 0;
-    tchdbiterinit(vecdb);
-    while ((key = tchdbiternext2(vecdb)) != NULL) {
-      value = tchdbget2(vecdb, key);
-      if (value == NULL) {
-        free(key);
-        continue;
-      }
-      Vector vec;
-      parse_dbmdata(value, vec);
-      free(value);
-      //double dist = squared_dist(vec, centvec);
-      double dist = cosine_dist(vec, centvec);
-      closest_dist[key] = dist;
-      newpotential += dist;
-      free(key);
+    #pragma omp parallel for reduction(+:newpotential)
+    for (int i = 0; i < rnum; i++) {
+      double dist = distance(matrix, i, centvec, center_length, metric);
+      if (closest_dist[i] > dist) closest_dist[i] = dist;
+      newpotential += closest_dist[i];
     }
-    centers[ncenters++] = centvec;
+    ++ncenters;
     potential = newpotential;
     cout << " center No." << ncenters << endl;
   }
 }
 
-void assign_clusters(TCHDB *vecdb, map<string, int> &assign, vector<Vector> &centers) {
-  char *key, *value;
-  tchdbiterinit(vecdb);
-  while ((key = tchdbiternext2(vecdb)) != NULL) {
-    value = tchdbget2(vecdb, key);
-    if (value == NULL) {
-      free(key);
-      continue;
-    }
-    Vector vec;
-    parse_dbmdata(value, vec);
-    free(value);
+void assign_clusters(const Matrix &matrix, vector<int> &assign,
+                     const vector<Center> &centers, Metric metric) {
+  int rnum = static_cast<int>(matrix.keys.size());
+  vector<double> center_lengths(centers.size());
+  for (size_t i = 0; i < centers.size(); i++) {
+    center_lengths[i] = length(centers[i]);
+  }
+  assign.resize(rnum);
+  #pragma omp parallel for
+  for (int j = 0; j < rnum; j++) {
     double mindist = -1;
     int minidx = 0;
     for (unsigned int i = 0; i < centers.size(); ++i) {
-      //double dist = squared_dist(vec, centers[i]);
-      double dist = cosine_dist(vec, centers[i]);
+      double dist = distance(matrix, j, centers[i], center_lengths[i], metric);
       if (mindist < 0 || mindist > dist) {
         mindist = dist;
         minidx = i;
       }
     }
-    assign[key] = minidx;
-    free(key);
+    assign[j] = minidx;
   }
 }
 
-void move_centers(TCHDB *vecdb, map<string, int> &assign, vector<Vector> &centers) {
-  vector<vector<string> > clusters(centers.size());
-  map<string, int>::iterator it = assign.begin();
-  while (it != assign.end()) {
-    string key = it->first;
-    int idx = it->second;
-    clusters[idx].push_back(key);
-    ++it;
-  }
-  for (unsigned int i = 0; i < centers.size(); ++i) {
+void move_centers(const Matrix &matrix, const vector<int> &assign,
+                  vector<Center> &centers) {
+  vector<vector<size_t> > clusters(centers.size());
+  for (size_t j = 0; j < assign.size(); j++) clusters[assign[j]].push_back(j);
+  int csiz = static_cast<int>(centers.size());
+  #pragma omp parallel for schedule(dynamic, 1)
+  for (int i = 0; i < csiz; ++i) {
     if (clusters[i].size() == 0) continue;
-    centers[i].clear();
-    for (unsigned int j = 0; j < clusters[i].size(); ++j) {
-      string key = clusters[i][j];
-      char *value = tchdbget2(vecdb, key.c_str());
-      if (value == NULL) continue;
-      Vector vec;
-      parse_dbmdata(value, vec);
-      free(value);
-      add_vector(centers[i], vec);
+    Center &center = centers[i];
+    center.assign(matrix.features.size(), 0);
+    for (size_t j = 0; j < clusters[i].size(); ++j) {
+      matrix.rows.add_to(clusters[i][j], sparse::data(center));
     }
-    mult_each(centers[i], static_cast<double>(1) / clusters[i].size());
+    double scale = static_cast<double>(1) / clusters[i].size();
+    for (size_t k = 0; k < center.size(); k++) center[k] *= scale;
   }
 }
 
-void kmeans(TCHDB *vecdb, map<string, int> &assign, vector<Vector> &centers) {
-  assign_clusters(vecdb, assign, centers);
+void kmeans(const Matrix &matrix, vector<int> &assign,
+            vector<Center> &centers, Metric metric) {
+  assign_clusters(matrix, assign, centers, metric);
 
+  vector<int> newassign;
   for (int i = 0; i < MAX_ITERATION; ++i) {
     cout << " k-kmeans loop No." << i+1 << endl;
-    move_centers(vecdb, assign, centers);
-//    for (unsigned int j = 0; j < centers.size(); j++) {
-//      cout << "center-" << j << "\t";
-//      print_vector(centers[j]);
-//    }
-
-    map<string, int> newassign;
-    assign_clusters(vecdb, newassign, centers);
-    map<string, int>::iterator it = assign.begin();
-    bool changed = false;
-    while (it != assign.end()) {
-      string key = it->first;
-      if (assign[key] != newassign[key]) {
-        changed = true;
-        break;
-      }
-      ++it;
-    }
-    if (!changed) break;
-    assign = newassign;
+    move_centers(matrix, assign, centers);
+
+    assign_clusters(matrix, newassign, centers, metric);
+    if (newassign == assign) break;
+    assign.swap(newassign);
   }
 }
 
-void save_clusters(map<string, int> &assign, const char *path) {
+struct KeyLess {
+  const Matrix &matrix;
+  explicit KeyLess(const Matrix &m) : matrix(m) { }
+  bool operator()(size_t left, size_t right) const {
+    return matrix.keys[left] < matrix.keys[right];
+  }
+};
+
+void save_clusters(const Matrix &matrix, const vector<int> &assign,
+                   const char *path) {
+  // in order of keys
+  vector<size_t> rows(assign.size());
+  for (size_t i = 0; i < rows.size(); i++) rows[i] = i;
+  sort(rows.begin(), rows.end(), KeyLess(matrix));
   ofstream ofs(path);
-  map<string, int>::iterator it = assign.begin();
-  while (it != assign.end()) {
-    ofs << it->second << "\t" << it->first << endl;
-    ++it;
+  for (size_t i = 0; i < rows.size(); i++) {
+    ofs << assign[rows[i]] << "\t" << matrix.keys[rows[i]] << endl;
   }
 }
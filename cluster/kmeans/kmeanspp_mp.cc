@@ -1,23 +1,27 @@
 // K-means++ + OpenMP
 //
 // Build:
-//  % g++ kmeanspp_mp.cc -o kmeanspp_mp -Wall -O3 -fopenmp
+//  % g++ -I../../sparse kmeanspp_mp.cc -o kmeanspp_mp -Wall -O3 -fopenmp
 //
 
 #include <stdint.h>
+#include <algorithm>
+#include <unistd.h>
 #include <cassert>
+#include <cmath>
 #include <cstdio>
 #include <cstring>
 #include <ctime>
-#include <fstream>
 #include <vector>
 #include <google/dense_hash_map>
 #include <omp.h>
+#include "job_stats.h"
+#include "sparse_matrix.h"
+#include "tsv_reader.h"
 
-typedef uint64_t VecKey;
 typedef size_t VecId;
-typedef google::dense_hash_map<VecKey, double> Vector;
-typedef google::dense_hash_map<std::string, VecKey> KeyMap;
+typedef sparse::Matrix<float> VectorStore;  // sorted by keys
+typedef VectorStore::Element Element;
 
 class KMeans;
 
@@ -25,78 +29,79 @@ class KMeans;
 int main(int argc, char **argv);
 void usage(const char *progname);
 void read_vectors(const char *filename, KMeans &kmeans);
-size_t splitstring(std::string s, const std::string &delimiter,
-                   std::vector<std::string> &splited);
 
 /* constants */
 const size_t MAX_ITER  = 10;
-const VecKey EMPTY_KEY = 0;
 const double LONG_DIST = 1000000000000000;
-const std::string DELIMITER("\t");
+const char DELIMITER = '\t';
 
 class KMeans {
- public:
-  typedef google::dense_hash_map<std::string, size_t> LabelMap;
-
  private:
-  std::vector<Vector *> vectors_;
-  std::vector<Vector *> centers_;
-  LabelMap labels_;
-
-  double euclid_distance_squared(const Vector &vec1, const Vector &vec2) const {
-    google::dense_hash_map<VecKey, bool> check;
-    check.set_empty_key(EMPTY_KEY);
-    double dist = 0.0;
-    Vector::const_iterator it1, it2;
-    for (it1 = vec1.begin(); it1 != vec1.end(); ++it1) {
-      double val1 = it1->second;
-      double val2 = 0.0;
-      it2 = vec2.find(it1->first);
-      if (it2 != vec2.end()) val2 = it2->second;
-      dist += (val1 - val2) * (val1 - val2);
-      check[it1->first] = true;
-    }
-    for (it2 = vec2.begin(); it2 != vec2.end(); ++it2) {
-      if (check.find(it2->first) != check.end()) continue;
-      double val2 = it2->second;
-      double val1 = 0.0;
-      it1 = vec1.find(it2->first);
-      if (it1 != vec1.end()) val1 = it1->second;
-      dist += (val1 - val2) * (val1 - val2);
-    }
-    return dist;
+  VectorStore vectors_;
+  std::vector<std::string> labels_;
+  size_t ncenters_;
+  size_t dimension_;
+  std::vector<float> centers_;        // ncenters_ x dimension_ (dense)
+  std::vector<double> center_norms_;  // squared norms
+  std::vector<double> center_gaps_;   // half distance to the closest center
+  std::vector<size_t> assign_;
+  std::vector<double> upper_;         // upper bound of the assigned center
+  std::vector<double> lower_;         // lower bound of the other centers
+  size_t max_iter_;
+  double tolerance_;
+  bool smart_;
+  sparse::JobStats stats_;
+
+  // ||x||^2 + ||c||^2 - 2 x.c
+  double euclid_distance_squared(VecId id, size_t idx) const {
+    return vectors_.squared_distance(id, center(idx), center_norms_[idx]);
+  }
+
+  void init_centers(size_t ncenters) {
+    ncenters_ = ncenters;
+    dimension_ = vectors_.dimension();
+    centers_.assign(ncenters_ * dimension_, 0.0);
+    center_norms_.assign(ncenters_, 0.0);
+  }
+
+  void set_center(size_t idx, VecId id) {
+    float *c = &centers_[0] + idx * dimension_;
+    std::fill(c, c + dimension_, 0.0);
+    vectors_.add_to(id, c);
+    center_norms_[idx] = vectors_.squared_norm(id);
   }
 
   void choose_random_centers(size_t ncenters) {
-    centers_.clear();
+    init_centers(ncenters);
     google::dense_hash_map<size_t, bool> check;
     check.set_empty_key(vectors_.size());
     size_t cnt = 0;
     while (cnt < ncenters) {
       size_t idx = rand() % vectors_.size();
       if (check.find(idx) == check.end()) {
-        Vector *center = new Vector(*vectors_[idx]);
-        centers_.push_back(center);
+        set_center(cnt, idx);
         cnt++;
         check[idx] = true;
       }
     }
   }
 
+  // k-means++ seeding (distances to the new center in parallel)
   void choose_smart_centers(size_t ncenters) {
-    centers_.clear();
-    double closest_dist[vectors_.size()];
+    init_centers(ncenters);
+    int vsiz = static_cast<int>(vectors_.size());
+    std::vector<double> closest_dist(vsiz);
     double potential = 0.0;
     size_t cnt = 0;
 
     // choose one random center
     size_t idx = rand() % vectors_.size();
-    Vector *center = new Vector(*vectors_[idx]);
-    centers_.push_back(center);
+    set_center(cnt, idx);
     cnt++;
     // update closest distance
-    for (size_t i = 0; i < vectors_.size(); i++) {
-      double dist = euclid_distance_squared(*vectors_[i], *centers_[0]);
+    #pragma omp parallel for reduction(+:potential)
+    for (int i = 0; i < vsiz; i++) {
+      double dist = euclid_distance_squared(i, 0);
       closest_dist[i] = dist;
       potential += dist;
     }
@@ -104,7 +109,7 @@ class KMeans {
     while (cnt < ncenters) {
       double randval = static_cast<double>(rand()) / RAND_MAX * potential;
       size_t idx = 0;
-      for (size_t i = 0; i < vectors_.size(); i++) {
+      for (int i = 0; i < vsiz; i++) {
         if (randval <= closest_dist[i]) {
           idx = i;
           break;
@@ -112,193 +117,632 @@ class KMeans {
           randval -= closest_dist[i];
         }
       }
-      Vector *center = new Vector(*vectors_[idx]);
+      set_center(cnt, idx);
       double potential_new = 0.0;
-      for (size_t i = 0; i < vectors_.size(); i++) {
-        double dist = euclid_distance_squared(*vectors_[i], *center);
+      #pragma omp parallel for reduction(+:potential_new)
+      for (int i = 0; i < vsiz; i++) {
+        double dist = euclid_distance_squared(i, cnt);
         if (closest_dist[i] > dist) closest_dist[i] = dist;
         potential_new += closest_dist[i];
       }
-      centers_.push_back(center);
       cnt++;
       potential = potential_new;
     }
   }
 
-  void assign_clusters(size_t *assign) const {
+  // the nearest and the second nearest centers of a vector
+  void find_nearest(VecId id, size_t &nearest, double &dist1,
+                    double &dist2) const {
+    nearest = 0;
+    dist1 = LONG_DIST;
+    dist2 = LONG_DIST;
+    for (size_t j = 0; j < ncenters_; j++) {
+      double dist = euclid_distance_squared(id, j);
+      if (dist < dist1) {
+        nearest = j;
+        dist2 = dist1;
+        dist1 = dist;
+      } else if (dist < dist2) {
+        dist2 = dist;
+      }
+    }
+    dist1 = sqrt(dist1);
+    dist2 = sqrt(dist2);
+  }
+
+  // half of the distance from each center to the closest other center
+  void update_center_gaps() {
+    int csiz = static_cast<int>(ncenters_);
+    center_gaps_.assign(ncenters_, LONG_DIST);
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int i = 0; i < csiz; i++) {
+      const float *ci = center(i);
+      for (int j = 0; j < csiz; j++) {
+        if (i == j) continue;
+        const float *cj = center(j);
+        double dot = sparse::dot(ci, cj, dimension_);
+        double dist = center_norms_[i] + center_norms_[j] - 2.0 * dot;
+        dist = 0.5 * sqrt((dist > 0.0) ? dist : 0.0);
+        if (dist < center_gaps_[i]) center_gaps_[i] = dist;
+      }
+    }
+  }
+
+  // assign all vectors with no bounds
+  void init_assign() {
     int vsiz = static_cast<int>(vectors_.size());
+    assign_.resize(vsiz);
+    upper_.resize(vsiz);
+    lower_.resize(vsiz);
     #pragma omp parallel for
     for (int i = 0; i < vsiz; i++) {
-      size_t min_idx = 0;
-      double min_dist = LONG_DIST;
-      for (size_t j = 0; j < centers_.size(); j++) {
-        double dist = euclid_distance_squared(*vectors_[i], *centers_[j]);
-        if (dist < min_dist) {
-          min_idx = j;
-          min_dist = dist;
+      find_nearest(i, assign_[i], upper_[i], lower_[i]);
+    }
+  }
+
+  // Hamerly's algorithm: distances are computed only for vectors whose
+  // upper bound (to the assigned center) exceeds the lower bound (to the
+  // other centers) or half the gap between the assigned center and others
+  size_t assign_clusters() {
+    int vsiz = static_cast<int>(vectors_.size());
+    size_t nchanged = 0;
+    #pragma omp parallel for reduction(+:nchanged)
+    for (int i = 0; i < vsiz; i++) {
+      double bound = std::max(center_gaps_[assign_[i]], lower_[i]);
+      if (upper_[i] <= bound) continue;
+      upper_[i] = sqrt(euclid_distance_squared(i, assign_[i]));
+      if (upper_[i] <= bound) continue;
+      size_t prev = assign_[i];
+      find_nearest(i, assign_[i], upper_[i], lower_[i]);
+      if (assign_[i] != prev) nchanged++;
+    }
+    return nchanged;
+  }
+
+  // sum of squared distances to the assigned centers
+  double sse() const {
+    int vsiz = static_cast<int>(vectors_.size());
+    double sum = 0.0;
+    #pragma omp parallel for reduction(+:sum)
+    for (int i = 0; i < vsiz; i++) sum += euclid_distance_squared(i, assign_[i]);
+    return sum;
+  }
+
+  // move centers to the means of their vectors; each center is summed by
+  // one thread, and the bounds are loosened by the moved distances
+  void move_centers() {
+    int csiz = static_cast<int>(ncenters_);
+    std::vector<size_t> offsets(ncenters_ + 1, 0);
+    for (size_t i = 0; i < assign_.size(); i++) offsets[assign_[i] + 1]++;
+    for (size_t i = 0; i < ncenters_; i++) offsets[i+1] += offsets[i];
+    std::vector<VecId> members(assign_.size());
+    std::vector<size_t> fill(offsets.begin(), offsets.end() - 1);
+    for (size_t i = 0; i < assign_.size(); i++) members[fill[assign_[i]]++] = i;
+
+    std::vector<double> moved(ncenters_, 0.0);
+    #pragma omp parallel
+    {
+      std::vector<float> prev(dimension_);
+      #pragma omp for schedule(dynamic, 1)
+      for (int i = 0; i < csiz; i++) {
+        size_t count = offsets[i+1] - offsets[i];
+        if (count == 0) continue;
+        float *c = &centers_[0] + i * dimension_;
+        std::copy(c, c + dimension_, prev.begin());
+        std::fill(c, c + dimension_, 0.0);
+        for (size_t m = offsets[i]; m < offsets[i+1]; m++) {
+          vectors_.add_to(members[m], c);
+        }
+        double norm = 0.0, diff = 0.0;
+        for (size_t k = 0; k < dimension_; k++) {
+          c[k] /= count;
+          norm += c[k] * c[k];
+          diff += (c[k] - prev[k]) * (c[k] - prev[k]);
         }
+        center_norms_[i] = norm;
+        moved[i] = sqrt(diff);
+      }
+    }
+
+    size_t farthest = 0;
+    double max_moved = 0.0, second_moved = 0.0;
+    for (size_t i = 0; i < ncenters_; i++) {
+      if (moved[i] > max_moved) {
+        second_moved = max_moved;
+        max_moved = moved[i];
+        farthest = i;
+      } else if (moved[i] > second_moved) {
+        second_moved = moved[i];
       }
-      assign[i] = min_idx;
     }
+    int vsiz = static_cast<int>(vectors_.size());
+    #pragma omp parallel for
+    for (int i = 0; i < vsiz; i++) {
+      upper_[i] += moved[assign_[i]];
+      lower_[i] -= (assign_[i] == farthest) ? second_moved : max_moved;
+    }
+    // the gaps cost ncenters^2 x dimension, so they are used only when
+    // that is not larger than the distances of one full assignment
+    if (ncenters_ * dimension_ <= vectors_.nonzeros()) {
+      update_center_gaps();
+    } else {
+      center_gaps_.assign(ncenters_, 0.0);
+    }
+  }
+
+ public:
+  KMeans() : ncenters_(0), dimension_(0), max_iter_(MAX_ITER),
+             tolerance_(0.0), smart_(false), stats_("points") { }
+
+  ~KMeans() { }
+
+  void add_vector(const std::string &label, std::vector<Element> &elements) {
+    assert(!label.empty() && !elements.empty());
+    labels_.push_back(label);
+    vectors_.add(elements);
+  }
+
+  void set_max_iter(size_t max_iter) { max_iter_ = max_iter; }
+
+  // stop when the rate of vectors changing their clusters is not larger
+  void set_tolerance(double tolerance) { tolerance_ = tolerance; }
+
+  // k-means++ seeding or random seeding
+  void set_smart(bool smart) { smart_ = smart; }
+
+  // phases and iterations are recorded by stats() when it is opened
+  sparse::JobStats &stats() { return stats_; }
+
+  size_t size() const { return vectors_.size(); }
+  size_t dimension() const { return dimension_; }
+
+  const float *center(size_t idx) const {
+    return &centers_[0] + idx * dimension_;
   }
 
-  void move_centers(const size_t *assign) {
-    for (size_t i = 0; i < centers_.size(); i++) {
-      centers_[i]->clear();
+  void choose_centers(size_t nclusters) {
+    assert(nclusters <= vectors_.size());
+    if (smart_) {
+      choose_smart_centers(nclusters);
+    } else {
+      choose_random_centers(nclusters);
     }
-    std::vector<size_t> count(centers_.size());
-    Vector::iterator cit;
-    for (size_t i = 0; i < vectors_.size(); i++) {
-      for (Vector::iterator it = vectors_[i]->begin();
-           it != vectors_[i]->end(); ++it) {
-        cit = centers_[assign[i]]->find(it->first);
-        if (cit != centers_[assign[i]]->end()) {
-          cit->second += it->second;
-        } else {
-          centers_[assign[i]]->insert(
-            std::pair<VecKey, double>(it->first, it->second));
-        }
+  }
+
+  void execute(size_t nclusters) {
+    size_t vsiz = vectors_.size();
+    double start = stats_.start();
+    choose_centers(nclusters);
+    stats_.phase("seed", start, vsiz);
+    fprintf(stderr, "kmeans loop No.0 ...\n");
+    start = stats_.start();
+    init_assign();
+    stats_.phase("assign", start, vsiz);
+    for (size_t i = 1; i < max_iter_; i++) {
+      start = stats_.start();
+      move_centers();
+      double moved = stats_.start();
+      size_t nchanged = assign_clusters();
+      double assigned = stats_.start();
+      fprintf(stderr, "kmeans loop No.%ld ... %ld changed\n", i, nchanged);
+      if (stats_.enabled()) {
+        stats_.iteration(i, start, vsiz).value("sse", sse())
+              .count("changed", nchanged)
+              .value("move_seconds", moved - start)
+              .value("assign_seconds", assigned - moved).end();
       }
-      count[assign[i]]++;
+      if (nchanged <= tolerance_ * vsiz) break;
     }
-    for (size_t i = 0; i < count.size(); i++) {
-      if (count[i] == 0) continue;
-      for (Vector::iterator it = centers_[i]->begin();
-           it != centers_[i]->end(); ++it) {
-        it->second /= count[i];
+    // show clustering result
+    start = stats_.start();
+    for (size_t i = 0; i < labels_.size(); i++) {
+      printf("%s\t%ld\n", labels_[i].c_str(), assign_[i]);
+    }
+    fflush(stdout);
+    stats_.phase("save", start, vsiz);
+  }
+
+  void show_vectors() const {
+    for (size_t i = 0; i < labels_.size(); i++) {
+      printf("%s", labels_[i].c_str());
+      for (size_t j = 0; j < vectors_.length(i); j++) {
+        printf("\t%u\t%.3f", vectors_.ids(i)[j], vectors_.values(i)[j]);
       }
+      printf("\n");
     }
   }
+};
 
-  bool is_same_array(size_t *array1, size_t *array2, size_t size) {
-    for (size_t i = 0; i < size; i++) {
-      if (array1[i] != array2[i]) return false;
+/* streaming reader of vectors with hashed feature keys (1 .. dimension-1),
+ * so that no dictionary of feature strings is kept */
+class VectorReader {
+ private:
+  std::string filename_;
+  sparse::TsvReader reader_;
+  size_t dimension_;
+  std::vector<sparse::Field> fields_;
+
+  static uint64_t hash_string(const sparse::Field &s) {
+    uint64_t hash = 14695981039346656037ULL;  // FNV-1a
+    for (size_t i = 0; i < s.size; i++) {
+      hash ^= static_cast<unsigned char>(s.data[i]);
+      hash *= 1099511628211ULL;
     }
-    return true;
+    return hash;
   }
 
  public:
-  KMeans() { labels_.set_empty_key(""); }
+  VectorReader(const char *filename, size_t dimension)
+    : filename_(filename), dimension_(dimension) {
+    assert(dimension_ > 1);
+    if (!reader_.open(filename)) {
+      fprintf(stderr, "cannot open %s\n", filename);
+      exit(1);
+    }
+  }
+
+  void rewind() { reader_.rewind(); }
 
-  ~KMeans() {
-    for (size_t i = 0; i < vectors_.size(); i++) {
-      if (vectors_[i]) delete vectors_[i];
+  // read a vector (false at the end of the file)
+  bool next(std::string &label, std::vector<Element> &elements) {
+    const char *line;
+    size_t size;
+    while (reader_.next_line(&line, &size)) {
+      sparse::split(line, line + size, DELIMITER, fields_);
+      if (fields_.size() % 2 != 1) {
+        fprintf(stderr, "format error: %s\n", line);
+        continue;
+      }
+      elements.clear();
+      for (size_t i = 1; i < fields_.size(); i += 2) {
+        double point = fields_[i+1].to_double();
+        if (point == 0) continue;
+        uint32_t key = hash_string(fields_[i]) % (dimension_ - 1) + 1;
+        elements.push_back(Element(key, point));
+      }
+      if (fields_[0].empty() || elements.empty()) continue;
+      label = fields_[0].str();
+      return true;
     }
-    for (size_t i = 0; i < centers_.size(); i++) {
-      if (centers_[i]) delete centers_[i];
+    return false;
+  }
+};
+
+/* mini-batch k-means (Sculley, 2010) on a stream of vectors.
+ * The memory is bounded by the centers, a batch and a reservoir sample.
+ * A center is kept as scale * weight, so that the update
+ * c = (1 - eta) c + eta x costs the length of x. */
+class MiniBatchKMeans {
+ private:
+  size_t ncenters_;
+  size_t dimension_;
+  std::vector<float> weights_;        // ncenters_ x dimension_ (dense)
+  std::vector<double> scales_;
+  std::vector<double> weight_norms_;  // squared norms of weights
+  std::vector<size_t> counts_;        // the number of updates
+
+  float *weight(size_t idx) { return &weights_[0] + idx * dimension_; }
+
+  double euclid_distance_squared(const VectorStore &batch, VecId id,
+                                 size_t idx) const {
+    const float *w = &weights_[0] + idx * dimension_;
+    double dist = batch.squared_norm(id)
+                  + scales_[idx] * scales_[idx] * weight_norms_[idx]
+                  - 2.0 * scales_[idx] * batch.dot(id, w);
+    return (dist > 0.0) ? dist : 0.0;
+  }
+
+  size_t find_nearest(const VectorStore &batch, VecId id,
+                      double &min_dist) const {
+    size_t min_idx = 0;
+    min_dist = LONG_DIST;
+    for (size_t j = 0; j < ncenters_; j++) {
+      double dist = euclid_distance_squared(batch, id, j);
+      if (dist < min_dist) {
+        min_idx = j;
+        min_dist = dist;
+      }
     }
+    return min_idx;
   }
 
-  void add_vector(const std::string &label, Vector *vec) {
-    assert(!label.empty() && !vec->empty());
-    labels_[label] = vectors_.size();
-    vectors_.push_back(vec);
+  // fold the scale into the weights
+  void normalize(size_t idx) {
+    float *w = weight(idx);
+    for (size_t k = 0; k < dimension_; k++) w[k] *= scales_[idx];
+    weight_norms_[idx] *= scales_[idx] * scales_[idx];
+    scales_[idx] = 1.0;
   }
 
-  void execute(size_t nclusters) {
-    assert(nclusters <= vectors_.size());
-    choose_random_centers(nclusters);
-//    choose_smart_centers(nclusters);
-    size_t assign[vectors_.size()];
-    size_t prev_assign[vectors_.size()];
-    memset(assign, nclusters, sizeof(nclusters) * vectors_.size());
-    memset(prev_assign, nclusters, sizeof(nclusters) * vectors_.size());
-    for (size_t i = 0; i < MAX_ITER; i++) {
-      fprintf(stderr, "kmeans loop No.%ld ...\n", i);
-      assign_clusters(assign);
-      move_centers(assign);
-      if (is_same_array(assign, prev_assign, vectors_.size())) {
-        break;
-      } else {
-        std::copy(assign, assign + vectors_.size(), prev_assign);
+  // move a center to a vector with per-center learning rate 1 / count
+  void update(const VectorStore &batch, VecId id, size_t idx) {
+    counts_[idx]++;
+    double eta = 1.0 / counts_[idx];
+    float *w = weight(idx);
+    if (eta >= 1.0) {
+      std::fill(w, w + dimension_, 0.0);
+      weight_norms_[idx] = 0.0;
+      scales_[idx] = 1.0;
+    } else {
+      scales_[idx] *= 1.0 - eta;
+      if (scales_[idx] < 1e-6) normalize(idx);
+    }
+    const uint32_t *keys = batch.ids(id);
+    const float *values = batch.values(id);
+    double coeff = eta / scales_[idx];
+    for (size_t i = 0; i < batch.length(id); i++) {
+      float prev = w[keys[i]];
+      w[keys[i]] += coeff * values[i];
+      weight_norms_[idx] += w[keys[i]] * w[keys[i]] - prev * prev;
+    }
+  }
+
+ public:
+  MiniBatchKMeans(size_t ncenters, size_t dimension)
+    : ncenters_(ncenters), dimension_(dimension),
+      weights_(ncenters * dimension, 0.0), scales_(ncenters, 1.0),
+      weight_norms_(ncenters, 0.0), counts_(ncenters, 0) { }
+
+  // copy seeds chosen from a sample
+  void set_seeds(const KMeans &sample) {
+    size_t dim = std::min(sample.dimension(), dimension_);
+    for (size_t i = 0; i < ncenters_; i++) {
+      const float *c = sample.center(i);
+      float *w = weight(i);
+      double norm = 0.0;
+      for (size_t k = 0; k < dim; k++) {
+        w[k] = c[k];
+        norm += c[k] * c[k];
       }
+      weight_norms_[i] = norm;
     }
-    // show clustering result
-    for (LabelMap::iterator it = labels_.begin(); it != labels_.end(); ++it) {
-      printf("%s\t%ld\n", it->first.c_str(), assign[it->second]);
+  }
+
+  // assign a batch in parallel, then update the centers in order
+  // (the sum of squared distances before the updates is returned)
+  double train(const VectorStore &batch, std::vector<size_t> &assign) {
+    double sse = assign_batch(batch, assign);
+    for (size_t i = 0; i < batch.size(); i++) update(batch, i, assign[i]);
+    return sse;
+  }
+
+  // the sum of squared distances to the assigned centers
+  double assign_batch(const VectorStore &batch,
+                      std::vector<size_t> &assign) const {
+    int bsiz = static_cast<int>(batch.size());
+    assign.resize(bsiz);
+    double sse = 0.0;
+    #pragma omp parallel for reduction(+:sse)
+    for (int i = 0; i < bsiz; i++) {
+      double dist;
+      assign[i] = find_nearest(batch, i, dist);
+      sse += dist;
     }
+    return sse;
   }
 
-  void show_vectors() const {
-    for (LabelMap::const_iterator lit = labels_.begin();
-         lit != labels_.end(); ++lit) {
-      printf("%s", lit->first.c_str());
-      for (Vector::const_iterator vit = vectors_[lit->second]->begin();
-           vit != vectors_[lit->second]->end(); ++vit) {
-        printf("\t%ld\t%.3f", vit->first, vit->second);
+  void show_centers() const {
+    for (size_t i = 0; i < ncenters_; i++) {
+      printf("%ld", i);
+      const float *w = &weights_[0] + i * dimension_;
+      for (size_t k = 0; k < dimension_; k++) {
+        if (w[k] != 0.0) printf("\t%ld\t%.3f", k, scales_[i] * w[k]);
       }
       printf("\n");
     }
   }
 };
 
-int main(int argc, char **argv) {
-  if (argc < 3) {
-    usage(argv[0]);
+/* options of mini-batch k-means */
+struct MiniBatchOption {
+  size_t batch_size;
+  size_t dimension;
+  size_t npasses;
+  bool labels;
+  const char *stats;  // file of statistics (NULL: none)
+};
+
+void execute_minibatch(const char *filename, size_t nclusters, bool smart,
+                       const MiniBatchOption &option) {
+  sparse::JobStats stats("points");
+  if (option.stats != NULL && !stats.open(option.stats)) {
+    fprintf(stderr, "cannot open %s\n", option.stats);
+    exit(1);
+  }
+  VectorReader reader(filename, option.dimension);
+  std::string label;
+  std::vector<Element> elements;
+  double start = stats.start();
+
+  // reservoir sample for seeding
+  size_t nsample = std::max(option.batch_size, nclusters);
+  std::vector<std::pair<std::string, std::vector<Element> > > sample;
+  size_t nread = 0;
+  while (reader.next(label, elements)) {
+    if (sample.size() < nsample) {
+      sample.push_back(std::make_pair(label, elements));
+    } else {
+      size_t idx = rand() % (nread + 1);
+      if (idx < nsample) sample[idx] = std::make_pair(label, elements);
+    }
+    nread++;
+  }
+  stats.phase("load", start, nread);
+  if (sample.size() < nclusters) {
+    fprintf(stderr, "too few vectors: %ld\n", sample.size());
+    exit(1);
+  }
+  MiniBatchKMeans kmeans(nclusters, option.dimension);
+  start = stats.start();
+  {
+    KMeans seeder;
+    seeder.set_smart(smart);
+    for (size_t i = 0; i < sample.size(); i++) {
+      seeder.add_vector(sample[i].first, sample[i].second);
+    }
+    sample.clear();
+    seeder.choose_centers(nclusters);
+    kmeans.set_seeds(seeder);
+  }
+  stats.phase("seed", start, nsample);
+
+  VectorStore batch;
+  std::vector<std::string> labels;
+  std::vector<size_t> assign;
+  for (size_t pass = 0; pass < option.npasses; pass++) {
+    fprintf(stderr, "mini-batch kmeans pass No.%ld ...\n", pass);
+    start = stats.start();
+    reader.rewind();
+    bool more = true;
+    double sse = 0.0;
+    while (more) {
+      batch.clear();
+      while (batch.size() < option.batch_size &&
+             (more = reader.next(label, elements))) {
+        batch.add(elements);
+      }
+      if (batch.size() > 0) sse += kmeans.train(batch, assign);
+    }
+    // sse is of the distances before the updates of each batch
+    stats.iteration(pass + 1, start, nread).value("sse", sse).end();
+  }
+
+  start = stats.start();
+  if (!option.labels) {
+    kmeans.show_centers();
+    fflush(stdout);
+    stats.phase("save", start, nclusters);
+    return;
   }
+  // final assignment while streaming
+  reader.rewind();
+  bool more = true;
+  while (more) {
+    batch.clear();
+    labels.clear();
+    while (batch.size() < option.batch_size &&
+           (more = reader.next(label, elements))) {
+      batch.add(elements);
+      labels.push_back(label);
+    }
+    kmeans.assign_batch(batch, assign);
+    for (size_t i = 0; i < labels.size(); i++) {
+      printf("%s\t%ld\n", labels[i].c_str(), assign[i]);
+    }
+  }
+  fflush(stdout);
+  stats.phase("assign", start, nread);
+}
+
+int main(int argc, char **argv) {
   //srand((unsigned int) time(NULL));
   KMeans kmeans;
-  read_vectors(argv[2], kmeans);
+  MiniBatchOption minibatch;
+  minibatch.batch_size = 0;
+  minibatch.dimension = 1 << 20;
+  minibatch.npasses = 1;
+  minibatch.labels = false;
+  bool smart = false;
+  const char *stats = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "i:e:pb:d:n:lS:")) != -1) {
+    switch (opt) {
+    case 'i':
+      kmeans.set_max_iter(atoi(optarg));
+      break;
+    case 'e':
+      kmeans.set_tolerance(atof(optarg));
+      break;
+    case 'p':
+      smart = true;
+      break;
+    case 'b':
+      minibatch.batch_size = atoi(optarg);
+      break;
+    case 'd':
+      minibatch.dimension = atoi(optarg);
+      if (minibatch.dimension < 2) usage(argv[0]);
+      break;
+    case 'n':
+      minibatch.npasses = atoi(optarg);
+      break;
+    case 'l':
+      minibatch.labels = true;
+      break;
+    case 'S':
+      stats = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (argc - optind < 2) {
+    usage(argv[0]);
+  }
+  if (minibatch.batch_size > 0) {
+    minibatch.stats = stats;
+    execute_minibatch(argv[optind+1], atoi(argv[optind]), smart, minibatch);
+    return 0;
+  }
+  kmeans.set_smart(smart);
+  if (stats != NULL && !kmeans.stats().open(stats)) {
+    fprintf(stderr, "cannot open %s\n", stats);
+    exit(1);
+  }
+  double start = kmeans.stats().start();
+  read_vectors(argv[optind+1], kmeans);
+  kmeans.stats().phase("load", start, kmeans.size());
 //  kmeans.show_vectors();
-  kmeans.execute(atoi(argv[1]));
+  kmeans.execute(atoi(argv[optind]));
   return 0;
 }
 
 void usage(const char *progname) {
-  fprintf(stderr, "%s: ncluster data\n", progname);
+  fprintf(stderr, "%s: [-i max_iter] [-e tolerance] [-p] [-S file] ncluster data\n",
+          progname);
+  fprintf(stderr, "%s: -b batch_size [-d dimension] [-n npasses] [-l] [-p] [-S file] ncluster data\n",
+          progname);
+  fprintf(stderr, "  -i max_iter  : the maximum number of iterations (default: %ld)\n",
+          MAX_ITER);
+  fprintf(stderr, "  -e tolerance : stop when the rate of changed vectors is not\n"
+                  "                 larger than tolerance (default: 0)\n");
+  fprintf(stderr, "  -p           : k-means++ seeding (default: random)\n");
+  fprintf(stderr, "  -b batch_size: mini-batch k-means streaming the data\n");
+  fprintf(stderr, "  -d dimension : features are hashed into dimension (default: 2^20)\n");
+  fprintf(stderr, "  -n npasses   : the number of passes over the data (default: 1)\n");
+  fprintf(stderr, "  -l           : write labels in a final pass (default: centers)\n");
+  fprintf(stderr, "  -S file      : append statistics of phases and iterations to\n"
+                  "                 file (\"-\": stderr)\n");
   exit(1);
 }
 
 void read_vectors(const char *filename, KMeans &kmeans) {
-  std::ifstream ifs(filename);
-  if (!ifs) {
+  sparse::TsvReader reader;
+  if (!reader.open(filename)) {
     fprintf(stderr, "cannot open %s\n", filename);
     exit(1);
   }
-  KeyMap keymap;
-  keymap.set_empty_key("");
-  VecKey curkey = EMPTY_KEY + 1;
-  std::string line;
-  std::vector<std::string> splited;
-  while (getline(ifs, line)) {
-    splitstring(line, DELIMITER, splited);
-    if (splited.size() % 2 != 1) {
-      fprintf(stderr, "format error: %s\n", line.c_str());
+  sparse::FeatureDict features;
+  const char *line;
+  size_t size;
+  std::vector<sparse::Field> fields;
+  std::vector<Element> elements;
+  while (reader.next_line(&line, &size)) {
+    sparse::split(line, line + size, DELIMITER, fields);
+    if (fields.size() % 2 != 1) {
+      fprintf(stderr, "format error: %s\n", line);
       continue;
     }
-    Vector *vec = new Vector;
-    vec->set_empty_key(EMPTY_KEY);
-    for (size_t i = 1; i < splited.size(); i += 2) {
-      KeyMap::iterator kit = keymap.find(splited[i]);
-      VecKey key;
-      if (kit != keymap.end()) {
-        key = kit->second;
-      } else {
-        key = curkey;
-        keymap[splited[i]] = curkey++;
-      }
-      double point = 0.0;
-      point = atof(splited[i+1].c_str());
+    elements.clear();
+    for (size_t i = 1; i < fields.size(); i += 2) {
+      uint32_t key = features.intern(fields[i]);
+      double point = fields[i+1].to_double();
       if (point != 0) {
-        vec->insert(std::pair<VecKey, double>(key, point));
+        elements.push_back(Element(key, point));
       }
     }
-    if (!splited[0].empty() && !vec->empty()) {
-      kmeans.add_vector(splited[0], vec);
+    if (!fields[0].empty() && !elements.empty()) {
+      kmeans.add_vector(fields[0].str(), elements);
     }
-    splited.clear();
   }
 }
-
-size_t splitstring(std::string s, const std::string &delimiter,
-                   std::vector<std::string> &splited) {
-  size_t cnt = 0;
-  for (size_t p = 0; (p = s.find(delimiter)) != s.npos; ) {
-    splited.push_back(s.substr(0, p));
-    ++cnt;
-    s = s.substr(p + delimiter.size());
-  }
-  splited.push_back(s);
-  ++cnt;
-  return cnt;
-}
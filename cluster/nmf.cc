@@ -10,125 +10,201 @@
 //   ...
 //
 // Build:
-//   % g++ -Wall -O3 nmf.cc -o nmf
+//   % g++ -Wall -O3 -fopenmp -I../sparse nmf.cc -o nmf
 //
 
+#include <unistd.h>
 #include <cassert>
+#include <cstdio>
 #include <cstdlib>
-#include <fstream>
+#include <ctime>
 #include <iostream>
-#include <map>
+#include <algorithm>
 #include <string>
+#include <utility>
 #include <vector>
-#include <Eigen/Array>
+#include <Eigen/Core>
 #include <Eigen/Sparse>
+#include "job_stats.h"
+#include "sparse_matrix.h"
+#include "tsv_reader.h"
 
 using namespace Eigen;
 
 /* NMF class */
+// lower bound of elements in HALS
+const double EPSILON = 1e-16;
+
 class Nmf {
  public:
-  typedef std::map<std::string, uint32_t> Str2Column;
   typedef MatrixXf Mat;
   typedef SparseMatrix<double, RowMajor> SMat;
+  enum Solver {
+    SOLVER_MU,   // multiplicative updates
+    SOLVER_HALS  // hierarchical alternating least squares
+  };
+
+  Nmf() : stats_("nonzeros") { }
 
-  Nmf() { }
+  // phases and iterations are recorded by stats() when it is opened
+  sparse::JobStats &stats() { return stats_; }
 
+  // Read documents in one pass.  Feature ids are interned into columns
+  // in order of appearance, and each document is appended to the
+  // docs x features CSR matrix, which is transposed at the end.
   void read_file(const char *filename) {
-    std::ifstream ifs(filename);
-    if (!ifs) {
+    double start = stats_.start();
+    sparse::TsvReader reader;
+    if (!reader.open(filename)) {
       fprintf(stderr, "cannot open %s\n", filename);
       exit(1);
     }
-    Str2Column s2c;
-    uint32_t maxcol = 0;
-    uint32_t maxrow = 0;
-    std::string line;
-    std::vector<std::string> splited;
-    while (getline(ifs, line)) {
-      splitstring(line, "\t", splited);
-      if (splited.size() % 2 != 1) {
-        fprintf(stderr, "format error: %s\n", line.c_str());
+    sparse::Matrix<double> rows;
+    std::vector<sparse::Matrix<double>::Element> elements;
+    std::vector<sparse::Field> fields;
+    const char *line;
+    size_t size;
+    while (reader.next_line(&line, &size)) {
+      sparse::split(line, line + size, '\t', fields);
+      if (fields.size() % 2 != 1) {
+        fprintf(stderr, "format error: %s\n", line);
         continue;
       }
-      document_ids_.push_back(splited[0]);
-      for (size_t i = 1; i < splited.size(); i += 2) {
-        Str2Column::iterator kit = s2c.find(splited[i]);
-        if (kit == s2c.end()) {
-          s2c[splited[i]] = maxcol;
-          feature_ids_.push_back(splited[i]);
-          maxcol++;
-        }
+      document_ids_.push_back(fields[0].str());
+      elements.clear();
+      for (size_t i = 1; i < fields.size(); i += 2) {
+        double point = fields[i+1].to_double();
+        if (point == 0) continue;
+        elements.push_back(std::make_pair(features_.intern(fields[i]), point));
       }
-      splited.clear();
-      maxrow++;
+      // the first of duplicated features is used
+      rows.add(elements);
     }
-    ifs.clear();
-    ifs.seekg(0, std::ios_base::beg);
-    V_.resize(maxrow, maxcol);
-
-    size_t row = 0;
-    std::vector<std::pair<uint32_t, double> > pairs;
-    while (getline(ifs, line)) {
-      splitstring(line, "\t", splited);
-      if (splited.size() % 2 != 1) {
-        fprintf(stderr, "format error: %s\n", line.c_str());
-        continue;
-      }
-      for (size_t i = 1; i < splited.size(); i += 2) {
-        uint32_t col = s2c[splited[i]];
-        double point = atof(splited[i+1].c_str());
-        if (point != 0) {
-          pairs.push_back(std::pair<uint32_t, double>(col, point)); 
-        }
-      }
-      std::sort(pairs.begin(), pairs.end());
-      for (size_t i = 0; i < pairs.size(); i++) {
-        V_.fill(row, pairs[i].first) = pairs[i].second;
+
+    int nrow = static_cast<int>(rows.size());
+    SMat docs(nrow, features_.size());
+    docs.reserve(rows.nonzeros());
+    for (int row = 0; row < nrow; row++) {
+      docs.startVec(row);
+      const uint32_t *ids = rows.ids(row);
+      const double *values = rows.values(row);
+      for (size_t p = 0; p < rows.length(row); p++) {
+        docs.insertBack(row, ids[p]) = values[p];
       }
-      splited.clear();
-      pairs.clear();
-      row++;
     }
-    V_ = V_.transpose();
+    docs.finalize();
+    V_ = docs.transpose();
+    stats_.phase("load", start, V_.nonZeros());
   }
 
-  void factorize(size_t ncluster, size_t niter) {
+  // V = W * H by multiplicative updates (Lee and Seung) or HALS.
+  // V (features x docs) is sparse, and no dense features x docs matrix
+  // is made: W^t V, V H^t, W^t W and H H^t are the only products, and
+  // the cost |V - W H|^2 is computed from them.
+  // tolerance > 0 stops the updates when the cost decreases by less than
+  // tolerance * cost.
+  void factorize(size_t ncluster, size_t niter, double tolerance = 0.0,
+                 Solver solver = SOLVER_MU) {
+    double start = stats_.start();
+    prepare();
+    int r = static_cast<int>(ncluster);
     W_.resize(V_.rows(), ncluster);
     H_.resize(ncluster, V_.cols());
     set_random(W_);
     W_.normalize();
     set_random(H_);
-    for (size_t i = 0; i < niter; i++) {
-      Mat Wt = W_.transpose();
-      Mat hnumer = Wt * V_;
-      Mat hdenom = Wt * W_ * H_;
-      Mat Ht = H_.transpose();
-      Mat wnumer = V_ * Ht;
-      Mat wdenom = W_ * H_ * Ht;
-      for (int j = 0; j < H_.rows(); j++) {
-        for (int k = 0; k < H_.cols(); k++) {
-          if (hdenom(j, k) != 0)
-            H_(j, k) = H_(j, k) * hnumer(j, k) / hdenom(j, k);
-          if (wdenom(k, j) != 0)
-            W_(k, j) = W_(k, j) * wnumer(k, j) / wdenom(k, j);
+    stats_.phase("seed", start, V_.nonZeros());
+    double update_start = stats_.start();
+    Mat WtV, WtW, HHt, VHt, denom;
+    double prev_cost = -1.0;
+    size_t i = 0;
+    for (; i < niter; i++) {
+      multiply_wt_v(W_, WtV);
+      WtW = W_.transpose() * W_;
+      HHt = H_ * H_.transpose();
+      double cost = vnorm_ - 2.0 * inner_product(H_, WtV)
+                    + inner_product(WtW, HHt);
+      // the cost after an iteration is known at the head of the next one
+      if (i > 0) {
+        stats_.iteration(i, start, V_.nonZeros()).value("cost", cost).end();
+      }
+      start = stats_.start();
+      if ((i + 1) % 10 == 0) printf(" loop: %ld\tcost: %.4f\n", i+1, cost);
+      // without a tolerance, all niter iterations are done: the cost has
+      // rounding noise of the float matrices
+      if (tolerance > 0 && prev_cost > 0 &&
+          prev_cost - cost <= tolerance * prev_cost) {
+        printf(" converged: %ld\tcost: %.4f\n", i+1, cost);
+        break;
+      }
+      prev_cost = cost;
+
+      int ndoc = static_cast<int>(H_.cols());
+      if (solver == SOLVER_HALS) {
+        for (int l = 0; l < r; l++) {
+          if (WtW(l, l) <= 0) continue;
+          #pragma omp parallel for
+          for (int j = 0; j < ndoc; j++) {
+            double val = H_(l, j) +
+              (WtV(l, j) - WtW.row(l).dot(H_.col(j))) / WtW(l, l);
+            H_(l, j) = (val > EPSILON) ? val : EPSILON;
+          }
+        }
+      } else {
+        denom = WtW * H_;
+        #pragma omp parallel for
+        for (int j = 0; j < ndoc; j++) {
+          for (int l = 0; l < r; l++) {
+            if (denom(l, j) != 0) H_(l, j) *= WtV(l, j) / denom(l, j);
+          }
+        }
+      }
+
+      multiply_v_ht(H_, VHt);
+      HHt = H_ * H_.transpose();
+      int nfeature = static_cast<int>(W_.rows());
+      if (solver == SOLVER_HALS) {
+        for (int l = 0; l < r; l++) {
+          if (HHt(l, l) <= 0) continue;
+          #pragma omp parallel for
+          for (int k = 0; k < nfeature; k++) {
+            double val = W_(k, l) +
+              (VHt(k, l) - W_.row(k).dot(HHt.col(l))) / HHt(l, l);
+            W_(k, l) = (val > EPSILON) ? val : EPSILON;
+          }
+        }
+      } else {
+        denom = W_ * HHt;
+        #pragma omp parallel for
+        for (int k = 0; k < nfeature; k++) {
+          for (int l = 0; l < r; l++) {
+            if (denom(k, l) != 0) W_(k, l) *= VHt(k, l) / denom(k, l);
+          }
         }
       }
-      H_.normalize();
-//      double cost = difcost(V_, W_*H_);
-//      fprintf(stderr, " loop: %ld\tcost: %4f\n", i, cost);
-//      if (cost == 0) break;
-      if ((i + 1) % 10 == 0) printf(" loop: %ld\n", i+1);
+      // normalize H, keeping W * H
+      double scale = H_.norm();
+      if (scale > 0) {
+        H_ /= scale;
+        W_ *= scale;
+      }
+    }
+    if (stats_.enabled() && i == niter && niter > 0) {
+      multiply_wt_v(W_, WtV);
+      double cost = vnorm_ - 2.0 * inner_product(H_, WtV)
+                    + inner_product(W_.transpose() * W_, H_ * H_.transpose());
+      stats_.iteration(i, start, V_.nonZeros()).value("cost", cost).end();
     }
     W_.normalize();
+    stats_.phase("update", update_start, i * V_.nonZeros());
   }
 
   void show_result() const {
     printf("Input matrix was factorized. ( V = W * H )\n");
     printf("=== W matrix ===\n");
     for (int i = 0; i < W_.rows(); i++) {
-      if (static_cast<int>(feature_ids_.size()) <= i) break;
-      printf("%s", feature_ids_[i].c_str());
+      if (static_cast<int>(features_.size()) <= i) break;
+      printf("%s", features_.name(i).c_str());
       for (int j = 0; j < W_.cols(); j++) {
         printf("\t%.4f", W_(i, j));
       }
@@ -149,19 +225,70 @@ class Nmf {
   SMat V_;
   Mat W_;
   Mat H_;
-  std::vector<std::string> feature_ids_;
+  sparse::FeatureDict features_;
   std::vector<std::string> document_ids_;
+  // V_ in compressed columns (by documents) for W^t V
+  std::vector<int> col_offsets_;
+  std::vector<int> col_rows_;
+  std::vector<double> col_values_;
+  double vnorm_;  // |V|^2
+  sparse::JobStats stats_;
 
-  double difcost(const SMat m1, const Mat m2) const {
+  void prepare() {
+    col_offsets_.assign(V_.cols() + 1, 0);
+    vnorm_ = 0.0;
+    for (int i = 0; i < V_.outerSize(); i++) {
+      for (SMat::InnerIterator it(V_, i); it; ++it) {
+        col_offsets_[it.col() + 1]++;
+        vnorm_ += it.value() * it.value();
+      }
+    }
+    for (int j = 0; j < V_.cols(); j++) col_offsets_[j+1] += col_offsets_[j];
+    col_rows_.resize(col_offsets_[V_.cols()]);
+    col_values_.resize(col_offsets_[V_.cols()]);
+    std::vector<int> fill(col_offsets_.begin(), col_offsets_.end() - 1);
+    for (int i = 0; i < V_.outerSize(); i++) {
+      for (SMat::InnerIterator it(V_, i); it; ++it) {
+        col_rows_[fill[it.col()]] = i;
+        col_values_[fill[it.col()]++] = it.value();
+      }
+    }
+  }
+
+  // WtV = W^t * V (ncluster x docs), in parallel over documents
+  void multiply_wt_v(const Mat &W, Mat &WtV) const {
+    WtV = Mat::Zero(W.cols(), V_.cols());
+    int ndoc = static_cast<int>(V_.cols());
+    #pragma omp parallel for
+    for (int j = 0; j < ndoc; j++) {
+      for (int p = col_offsets_[j]; p < col_offsets_[j+1]; p++) {
+        WtV.col(j) += col_values_[p] * W.row(col_rows_[p]).transpose();
+      }
+    }
+  }
+
+  // VHt = V * H^t (features x ncluster), in parallel over features
+  void multiply_v_ht(const Mat &H, Mat &VHt) const {
+    VHt = Mat::Zero(V_.rows(), H.rows());
+    int nfeature = static_cast<int>(V_.outerSize());
+    #pragma omp parallel for
+    for (int i = 0; i < nfeature; i++) {
+      for (SMat::InnerIterator it(V_, i); it; ++it) {
+        VHt.row(i) += it.value() * H.col(it.col()).transpose();
+      }
+    }
+  }
+
+  // sum of m1(i, j) * m2(i, j)
+  static double inner_product(const Mat &m1, const Mat &m2) {
     assert(m1.cols() == m2.cols() && m1.rows() == m2.rows());
-    double distance = 0.0;
-    for (int i = 0; i < m1.outerSize(); i++) {
-      for (SMat::InnerIterator it(m1, i); it; ++it) {
-        double diff = it.value() - m2(it.row(), it.col());
-        distance += diff * diff;
+    double sum = 0.0;
+    for (int j = 0; j < m1.cols(); j++) {
+      for (int i = 0; i < m1.rows(); i++) {
+        sum += static_cast<double>(m1(i, j)) * m2(i, j);
       }
     }
-    return distance;
+    return sum;
   }
 
   void set_random(Mat &mat) const {
@@ -171,35 +298,57 @@ class Nmf {
       }
     }
   }
-
-  size_t splitstring(std::string s, const std::string &delimiter,
-                     std::vector<std::string> &splited) const {
-    size_t cnt = 0;
-    for (size_t p = 0; (p = s.find(delimiter)) != s.npos; ) {
-      splited.push_back(s.substr(0, p));
-      ++cnt;
-      s = s.substr(p + delimiter.size());
-    }
-    splited.push_back(s);
-    ++cnt;
-    return cnt;
-  }
 };
 
+void usage(const char *progname) {
+  fprintf(stderr, "Usage: %s [-e tolerance] [-a] [-S file] data ncluster [niter]\n",
+          progname);
+  fprintf(stderr, "  -e tolerance : stop when the cost decreases by less than\n"
+                  "                 tolerance * cost (default: 0, all niter\n"
+                  "                 iterations)\n");
+  fprintf(stderr, "  -a           : HALS instead of multiplicative updates\n");
+  fprintf(stderr, "  -S file      : append statistics of phases and iterations to\n"
+                  "                 file (\"-\": stderr)\n");
+  exit(1);
+}
+
 int main(int argc, char **argv) {
-  if (argc < 3) {
-    fprintf(stderr, "Usage: %s data ncluster [niter]\n", argv[0]);
-    exit(1);
+  double tolerance = 0.0;
+  Nmf::Solver solver = Nmf::SOLVER_MU;
+  const char *stats = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "e:aS:")) != -1) {
+    switch (opt) {
+    case 'e':
+      tolerance = atof(optarg);
+      break;
+    case 'a':
+      solver = Nmf::SOLVER_HALS;
+      break;
+    case 'S':
+      stats = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
   }
+  if (argc - optind < 2) usage(argv[0]);
   srand(time(NULL));
   Nmf nmf;
+  if (stats != NULL && !nmf.stats().open(stats)) {
+    fprintf(stderr, "cannot open %s\n", stats);
+    exit(1);
+  }
   printf("Reading input data\n");
-  nmf.read_file(argv[1]);
+  nmf.read_file(argv[optind]);
 
   size_t niter = 50;
-  if (argc == 4) niter = atoi(argv[3]);
+  if (argc - optind >= 3) niter = atoi(argv[optind+2]);
   printf("Factorizing input matrix\n");
-  nmf.factorize(atoi(argv[2]), niter);
+  nmf.factorize(atoi(argv[optind+1]), niter, tolerance, solver);
+  double start = nmf.stats().start();
   nmf.show_result();
+  fflush(stdout);
+  nmf.stats().phase("save", start, 0);
   return 0;
 }
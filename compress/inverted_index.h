@@ -0,0 +1,378 @@
+//
+// Inverted index of compressed posting lists
+//
+// Each term (word id, hash bucket, ...) has a sorted list of document ids
+// encoded by differences in Variable Byte code, in blocks of BLOCK_SIZE
+// ids with skip entries (variable_byte_code.h).  PostingIterator decodes
+// one block at a time and skip_to() jumps over the blocks which cannot
+// contain the target, so that intersection only decodes the blocks it
+// needs.
+//
+// Usage:
+//   vbyte::InvertedIndex index;
+//   index.add(term, doc);  // any order, duplicates are removed
+//   ...
+//   index.build();
+//   index.intersect(terms, docs);
+//   index.save(path);  // and index.load(path)
+//
+
+#ifndef INVERTED_INDEX_H_
+#define INVERTED_INDEX_H_
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <utility>
+#include <vector>
+#include "variable_byte_code.h"
+
+namespace vbyte {
+
+/* iterator of a posting list */
+class PostingIterator {
+ public:
+  PostingIterator()
+      : data_(NULL), skips_(NULL), size_(0), nblocks_(0), pos_(0) { }
+
+  void reset(const uint8_t *data, const Skip *skips, size_t size) {
+    data_ = data;
+    skips_ = skips;
+    size_ = size;
+    nblocks_ = num_blocks(size);
+    pos_ = 0;
+    if (size_ > 0) load(0);
+  }
+
+  // number of documents of the list
+  size_t size() const { return size_; }
+  bool end() const { return pos_ >= size_; }
+  uint64_t doc() const { return buffer_[pos_ % BLOCK_SIZE]; }
+
+  void next() {
+    pos_++;
+    if (!end() && pos_ % BLOCK_SIZE == 0) load(pos_ / BLOCK_SIZE);
+  }
+
+  // move to the first document not less than target
+  void skip_to(uint64_t target) {
+    if (end() || doc() >= target) return;
+    size_t block = pos_ / BLOCK_SIZE;
+    if (skips_[block].last < target) {
+      block += 1 + find_block(skips_ + block + 1, nblocks_ - block - 1, target);
+      if (block >= nblocks_) {
+        pos_ = size_;
+        return;
+      }
+      load(block);
+      pos_ = block * BLOCK_SIZE;
+    }
+    while (!end() && doc() < target) next();
+  }
+
+ private:
+  const uint8_t *data_;
+  const Skip *skips_;
+  size_t size_;
+  size_t nblocks_;
+  size_t pos_;
+  uint64_t buffer_[BLOCK_SIZE];
+
+  void load(size_t block) {
+    decode_block(data_, skips_, size_, block, buffer_);
+  }
+};
+
+/* inverted index */
+class InvertedIndex {
+ public:
+  InvertedIndex() { }
+  ~InvertedIndex() { }
+
+  // Add a posting.  It is searchable after build().
+  void add(uint64_t term, uint64_t doc) {
+    pending_.push_back(std::make_pair(term, doc));
+  }
+
+  // Compress the added postings (merged with the built ones).
+  void build() {
+    for (size_t t = 0; t < terms_.size(); t++) {
+      PostingIterator it;
+      postings_at(t, &it);
+      for (; !it.end(); it.next()) add(terms_[t], it.doc());
+    }
+    std::sort(pending_.begin(), pending_.end());
+    pending_.erase(std::unique(pending_.begin(), pending_.end()),
+                   pending_.end());
+    terms_.clear();
+    sizes_.clear();
+    skip_begins_.clear();
+    data_begins_.clear();
+    skips_.clear();
+    data_.clear();
+    std::vector<uint64_t> docs;
+    for (size_t i = 0; i < pending_.size(); ) {
+      uint64_t term = pending_[i].first;
+      docs.clear();
+      for (; i < pending_.size() && pending_[i].first == term; i++) {
+        docs.push_back(pending_[i].second);
+      }
+      terms_.push_back(term);
+      sizes_.push_back(docs.size());
+      skip_begins_.push_back(skips_.size());
+      data_begins_.push_back(data_.size());
+      size_t data_size = data_.size();
+      data_.resize(data_size + max_encoded_size(docs.size()));
+      skips_.resize(skips_.size() + num_blocks(docs.size()));
+      size_t bytes = encode_blocks(&docs[0], docs.size(), &data_[data_size],
+                                   &skips_[skip_begins_.back()]);
+      data_.resize(data_size + bytes);
+    }
+    std::vector<uint8_t>(data_).swap(data_);
+    std::vector<std::pair<uint64_t, uint64_t> >().swap(pending_);
+  }
+
+  size_t num_terms() const { return terms_.size(); }
+
+  size_t num_postings() const {
+    size_t sum = 0;
+    for (size_t t = 0; t < sizes_.size(); t++) sum += sizes_[t];
+    return sum;
+  }
+
+  // bytes of the built index
+  size_t memory_size() const {
+    return terms_.size() * sizeof(uint64_t) * 4 +
+           skips_.size() * sizeof(Skip) + data_.size();
+  }
+
+  // Set the iterator of the postings of term.  Return false if not found.
+  bool postings(uint64_t term, PostingIterator *it) const {
+    std::vector<uint64_t>::const_iterator pos =
+      std::lower_bound(terms_.begin(), terms_.end(), term);
+    if (pos == terms_.end() || *pos != term) {
+      it->reset(NULL, NULL, 0);
+      return false;
+    }
+    postings_at(pos - terms_.begin(), it);
+    return true;
+  }
+
+  // documents which have all the terms
+  void intersect(const std::vector<uint64_t> &terms,
+                 std::vector<uint64_t> &docs) const {
+    docs.clear();
+    if (terms.empty()) return;
+    std::vector<PostingIterator> its(terms.size());
+    for (size_t i = 0; i < terms.size(); i++) {
+      if (!postings(terms[i], &its[i])) return;
+    }
+    // the shortest list leads and the others skip to it
+    std::sort(its.begin(), its.end(), less_size);
+    PostingIterator &lead = its[0];
+    while (!lead.end()) {
+      uint64_t doc = lead.doc();
+      bool found = true;
+      for (size_t i = 1; i < its.size(); i++) {
+        its[i].skip_to(doc);
+        if (its[i].end()) return;
+        if (its[i].doc() != doc) {
+          found = false;
+          lead.skip_to(its[i].doc());
+          break;
+        }
+      }
+      if (found) {
+        docs.push_back(doc);
+        lead.next();
+      }
+    }
+  }
+
+  // Documents which have any of the terms.  counts (if not NULL) are set
+  // to the number of terms each document has.
+  void unite(const std::vector<uint64_t> &terms, std::vector<uint64_t> &docs,
+             std::vector<size_t> *counts = NULL) const {
+    docs.clear();
+    if (counts) counts->clear();
+    std::vector<PostingIterator> its(terms.size());
+    std::vector<std::pair<uint64_t, size_t> > heap;  // (doc, iterator)
+    for (size_t i = 0; i < terms.size(); i++) {
+      if (postings(terms[i], &its[i])) {
+        heap.push_back(std::make_pair(its[i].doc(), i));
+      }
+    }
+    std::greater<std::pair<uint64_t, size_t> > greater;
+    std::make_heap(heap.begin(), heap.end(), greater);
+    while (!heap.empty()) {
+      std::pop_heap(heap.begin(), heap.end(), greater);
+      uint64_t doc = heap.back().first;
+      PostingIterator &it = its[heap.back().second];
+      if (docs.empty() || docs.back() != doc) {
+        docs.push_back(doc);
+        if (counts) counts->push_back(0);
+      }
+      if (counts) counts->back()++;
+      it.next();
+      if (it.end()) {
+        heap.pop_back();
+      } else {
+        heap.back().first = it.doc();
+        std::push_heap(heap.begin(), heap.end(), greater);
+      }
+    }
+  }
+
+  // Save the built index.  Return false on error.
+  bool save(const char *path) const {
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) return false;
+    uint64_t header[4] = { INDEX_MAGIC, terms_.size(), skips_.size(),
+                           data_.size() };
+    bool ok = write_array(fp, header, 4) &&
+              write_array(fp, vector_ptr(terms_), terms_.size()) &&
+              write_array(fp, vector_ptr(sizes_), sizes_.size()) &&
+              write_array(fp, vector_ptr(skip_begins_), skip_begins_.size()) &&
+              write_array(fp, vector_ptr(data_begins_), data_begins_.size()) &&
+              write_array(fp, vector_ptr(skips_), skips_.size()) &&
+              write_array(fp, vector_ptr(data_), data_.size());
+    return (fclose(fp) == 0) && ok;
+  }
+
+  // Load an index written by save().  Return false on error, or if the
+  // sections do not match the size of the file or each other.
+  bool load(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) return false;
+    uint64_t header[4];
+    struct stat st;
+    bool ok = fstat(fileno(fp), &st) == 0 && read_array(fp, header, 4) &&
+              header[0] == INDEX_MAGIC &&
+              check_sizes(header, static_cast<uint64_t>(st.st_size));
+    if (ok) {
+      terms_.resize(header[1]);
+      sizes_.resize(header[1]);
+      skip_begins_.resize(header[1]);
+      data_begins_.resize(header[1]);
+      skips_.resize(header[2]);
+      data_.resize(header[3]);
+      ok = read_array(fp, vector_ptr(terms_), terms_.size()) &&
+           read_array(fp, vector_ptr(sizes_), sizes_.size()) &&
+           read_array(fp, vector_ptr(skip_begins_), skip_begins_.size()) &&
+           read_array(fp, vector_ptr(data_begins_), data_begins_.size()) &&
+           read_array(fp, vector_ptr(skips_), skips_.size()) &&
+           read_array(fp, vector_ptr(data_), data_.size()) &&
+           check_lists();
+    }
+    fclose(fp);
+    pending_.clear();
+    if (!ok) clear();
+    return ok;
+  }
+
+ private:
+  static const uint64_t INDEX_MAGIC = 0x5642494931ULL;  // magic number of files
+
+  std::vector<uint64_t> terms_;        // sorted terms
+  std::vector<uint64_t> sizes_;        // number of documents of each term
+  std::vector<uint64_t> skip_begins_;  // first skip entry of each term
+  std::vector<uint64_t> data_begins_;  // first byte of each term
+  std::vector<Skip> skips_;
+  std::vector<uint8_t> data_;
+  std::vector<std::pair<uint64_t, uint64_t> > pending_;  // (term, doc)
+
+  void clear() {
+    terms_.clear();
+    sizes_.clear();
+    skip_begins_.clear();
+    data_begins_.clear();
+    skips_.clear();
+    data_.clear();
+  }
+
+  // Check that the sections of a header fill the file exactly, bounding
+  // the counts first so that the sum cannot overflow.
+  static bool check_sizes(const uint64_t *header, uint64_t file_size) {
+    uint64_t nterms = header[1], nskips = header[2], nbytes = header[3];
+    if (file_size < sizeof(uint64_t) * 4) return false;
+    uint64_t rest = file_size - sizeof(uint64_t) * 4;
+    if (nterms > rest / (sizeof(uint64_t) * 4)) return false;
+    rest -= nterms * sizeof(uint64_t) * 4;
+    if (nskips > rest / sizeof(Skip)) return false;
+    rest -= nskips * sizeof(Skip);
+    return nbytes == rest;
+  }
+
+  // Check that the terms are sorted, that each list has its skip entries
+  // and its bytes in order, and that each block has exactly as many
+  // encoded numbers as it holds, so that no decoder reads out of the list.
+  bool check_lists() const {
+    uint64_t nskips = 0;
+    for (size_t t = 0; t < terms_.size(); t++) {
+      if ((t > 0 && terms_[t-1] >= terms_[t]) || sizes_[t] == 0 ||
+          skip_begins_[t] != nskips ||
+          num_blocks(sizes_[t]) > skips_.size() - nskips) {
+        return false;
+      }
+      uint64_t begin = data_begins_[t];
+      uint64_t end = (t + 1 < terms_.size()) ? data_begins_[t+1]
+                                             : data_.size();
+      if (begin > end || end > data_.size()) return false;
+      if (t == 0 && begin != 0) return false;
+      size_t nblocks = num_blocks(sizes_[t]);
+      const Skip *skips = &skips_[nskips];
+      for (size_t b = 0; b < nblocks; b++) {
+        uint64_t block_begin = begin + skips[b].offset;
+        uint64_t block_end = (b + 1 < nblocks) ? begin + skips[b+1].offset
+                                               : end;
+        if (skips[b].offset > end - begin || block_begin > block_end ||
+            block_end > end || (b > 0 && skips[b-1].last >= skips[b].last)) {
+          return false;
+        }
+        size_t count = (b + 1 < nblocks) ? BLOCK_SIZE
+                                         : sizes_[t] - b * BLOCK_SIZE;
+        size_t stops = 0;
+        for (uint64_t p = block_begin; p < block_end; p++) {
+          if (data_[p] & 0x80) stops++;
+        }
+        if (stops != count) return false;
+      }
+      nskips += nblocks;
+    }
+    return nskips == skips_.size();
+  }
+
+  void postings_at(size_t t, PostingIterator *it) const {
+    it->reset(vector_ptr(data_) + data_begins_[t],
+              vector_ptr(skips_) + skip_begins_[t], sizes_[t]);
+  }
+
+  static bool less_size(const PostingIterator &lhs,
+                        const PostingIterator &rhs) {
+    return lhs.size() < rhs.size();
+  }
+
+  template <typename T>
+  static const T *vector_ptr(const std::vector<T> &v) {
+    return v.empty() ? NULL : &v[0];
+  }
+  template <typename T>
+  static T *vector_ptr(std::vector<T> &v) {
+    return v.empty() ? NULL : &v[0];
+  }
+  template <typename T>
+  static bool write_array(FILE *fp, const T *array, size_t size) {
+    return size == 0 || fwrite(array, sizeof(T), size, fp) == size;
+  }
+  template <typename T>
+  static bool read_array(FILE *fp, T *array, size_t size) {
+    return size == 0 || fread(array, sizeof(T), size, fp) == size;
+  }
+};
+
+} /* namespace vbyte */
+
+#endif  // INVERTED_INDEX_H_
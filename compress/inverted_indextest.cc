@@ -0,0 +1,318 @@
+//
+// Tests for the inverted index of compressed posting lists
+//
+
+#include <stdint.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <gtest/gtest.h>
+#include "inverted_index.h"
+
+namespace {
+
+const size_t B = vbyte::BLOCK_SIZE;
+
+// every step-th document from first, n documents
+std::vector<uint64_t> docs_of(uint64_t first, uint64_t step, size_t n) {
+  std::vector<uint64_t> docs;
+  for (size_t i = 0; i < n; i++) docs.push_back(first + i * step);
+  return docs;
+}
+
+void add_docs(vbyte::InvertedIndex &index, uint64_t term,
+              const std::vector<uint64_t> &docs) {
+  for (size_t i = 0; i < docs.size(); i++) index.add(term, docs[i]);
+}
+
+// lists of lengths around the block size: term n has n documents
+void build_index(vbyte::InvertedIndex &index) {
+  const size_t lengths[] = { 1, B - 1, B, B + 1, 3 * B };
+  for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+    add_docs(index, lengths[l], docs_of(lengths[l] % 7, 3, lengths[l]));
+  }
+  index.build();
+}
+
+std::vector<uint64_t> terms_of(uint64_t t1, uint64_t t2) {
+  std::vector<uint64_t> terms;
+  terms.push_back(t1);
+  terms.push_back(t2);
+  return terms;
+}
+
+void write_bytes(const char *filename, const std::vector<uint8_t> &bytes) {
+  FILE *fp = fopen(filename, "wb");
+  ASSERT_TRUE(fp != NULL);
+  fwrite(&bytes[0], 1, bytes.size(), fp);
+  fclose(fp);
+}
+
+std::vector<uint8_t> read_bytes(const char *filename) {
+  std::vector<uint8_t> bytes;
+  FILE *fp = fopen(filename, "rb");
+  if (fp == NULL) return bytes;
+  int c;
+  while ((c = fgetc(fp)) != EOF) bytes.push_back(static_cast<uint8_t>(c));
+  fclose(fp);
+  return bytes;
+}
+
+}  // namespace
+
+/* add, build, postings */
+TEST(InvertedIndexTest, PostingsTest) {
+  vbyte::InvertedIndex index;
+  index.add(5, 10);
+  index.add(5, 3);
+  index.add(5, 10);
+  index.add(2, 7);
+  index.build();
+  EXPECT_EQ(2U, index.num_terms());
+  EXPECT_EQ(3U, index.num_postings());
+  vbyte::PostingIterator it;
+  EXPECT_FALSE(index.postings(4, &it));
+  EXPECT_TRUE(it.end());
+  ASSERT_TRUE(index.postings(5, &it));
+  EXPECT_EQ(2U, it.size());
+  EXPECT_EQ(3U, it.doc());
+  it.next();
+  EXPECT_EQ(10U, it.doc());
+  it.next();
+  EXPECT_TRUE(it.end());
+  // adding after build merges with the built lists
+  index.add(2, 1);
+  index.build();
+  ASSERT_TRUE(index.postings(2, &it));
+  EXPECT_EQ(2U, it.size());
+  EXPECT_EQ(1U, it.doc());
+
+  vbyte::InvertedIndex empty;
+  empty.build();
+  EXPECT_EQ(0U, empty.num_terms());
+  EXPECT_FALSE(empty.postings(0, &it));
+}
+
+/* PostingIterator::next */
+TEST(InvertedIndexTest, NextTest) {
+  vbyte::InvertedIndex index;
+  build_index(index);
+  const size_t lengths[] = { 1, B - 1, B, B + 1, 3 * B };
+  for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+    std::vector<uint64_t> docs = docs_of(lengths[l] % 7, 3, lengths[l]);
+    vbyte::PostingIterator it;
+    ASSERT_TRUE(index.postings(lengths[l], &it));
+    EXPECT_EQ(docs.size(), it.size());
+    for (size_t i = 0; i < docs.size(); i++, it.next()) {
+      ASSERT_FALSE(it.end());
+      EXPECT_EQ(docs[i], it.doc());
+    }
+    EXPECT_TRUE(it.end());
+  }
+}
+
+/* PostingIterator::skip_to */
+TEST(InvertedIndexTest, SkipToTest) {
+  vbyte::InvertedIndex index;
+  build_index(index);
+  // term 3B has the documents 3 * i + 3B % 7
+  uint64_t first = (3 * B) % 7;
+  std::vector<uint64_t> docs = docs_of(first, 3, 3 * B);
+  vbyte::PostingIterator it;
+  ASSERT_TRUE(index.postings(3 * B, &it));
+  // the last document of the first block, the first of the next, and a
+  // target between documents
+  it.skip_to(docs[B - 1]);
+  EXPECT_EQ(docs[B - 1], it.doc());
+  it.skip_to(docs[B]);
+  EXPECT_EQ(docs[B], it.doc());
+  it.skip_to(docs[B] + 1);
+  EXPECT_EQ(docs[B + 1], it.doc());
+  // skipping backward does not move
+  it.skip_to(first);
+  EXPECT_EQ(docs[B + 1], it.doc());
+  // over a whole block to the first document of the last block
+  it.skip_to(docs[2 * B] - 1);
+  EXPECT_EQ(docs[2 * B], it.doc());
+  it.skip_to(docs[3 * B - 1]);
+  EXPECT_EQ(docs[3 * B - 1], it.doc());
+  it.skip_to(docs[3 * B - 1] + 1);
+  EXPECT_TRUE(it.end());
+  it.skip_to(0);
+  EXPECT_TRUE(it.end());
+
+  // from the start past the end
+  ASSERT_TRUE(index.postings(B + 1, &it));
+  it.skip_to(1000000);
+  EXPECT_TRUE(it.end());
+  // a single document
+  ASSERT_TRUE(index.postings(1, &it));
+  it.skip_to(1);
+  EXPECT_EQ(1U, it.doc());
+  it.skip_to(2);
+  EXPECT_TRUE(it.end());
+}
+
+/* intersect */
+TEST(InvertedIndexTest, IntersectTest) {
+  vbyte::InvertedIndex index;
+  // multiples of 2 and of 3 across blocks
+  add_docs(index, 2, docs_of(0, 2, 3 * B));
+  add_docs(index, 3, docs_of(0, 3, 2 * B + 1));
+  add_docs(index, 9, docs_of(5, 1000, 2));
+  add_docs(index, 10, docs_of(0, 1, 1));
+  index.build();
+  std::vector<uint64_t> docs;
+  index.intersect(terms_of(2, 3), docs);
+  std::vector<uint64_t> expected;
+  for (uint64_t d = 0; d < 6 * B; d += 6) {
+    if (d <= 3 * 2 * B) expected.push_back(d);
+  }
+  EXPECT_EQ(expected, docs);
+  index.intersect(terms_of(3, 2), docs);
+  EXPECT_EQ(expected, docs);
+  index.intersect(terms_of(2, 10), docs);
+  EXPECT_EQ(std::vector<uint64_t>(1, 0), docs);
+  index.intersect(terms_of(2, 9), docs);
+  EXPECT_TRUE(docs.empty());
+  // a missing term, no terms, and one term
+  index.intersect(terms_of(2, 4), docs);
+  EXPECT_TRUE(docs.empty());
+  index.intersect(std::vector<uint64_t>(), docs);
+  EXPECT_TRUE(docs.empty());
+  index.intersect(std::vector<uint64_t>(1, 3), docs);
+  EXPECT_EQ(docs_of(0, 3, 2 * B + 1), docs);
+}
+
+/* unite */
+TEST(InvertedIndexTest, UniteTest) {
+  vbyte::InvertedIndex index;
+  add_docs(index, 2, docs_of(0, 2, B + 1));
+  add_docs(index, 3, docs_of(0, 3, B));
+  index.build();
+  std::vector<uint64_t> docs;
+  std::vector<size_t> counts;
+  std::vector<uint64_t> terms = terms_of(2, 3);
+  terms.push_back(4);  // missing
+  index.unite(terms, docs, &counts);
+  std::vector<uint64_t> expected;
+  std::vector<size_t> expected_counts;
+  for (uint64_t d = 0; d <= 3 * (B - 1); d++) {
+    size_t count = (d % 2 == 0 && d <= 2 * B) + (d % 3 == 0);
+    if (count > 0) {
+      expected.push_back(d);
+      expected_counts.push_back(count);
+    }
+  }
+  EXPECT_EQ(expected, docs);
+  EXPECT_EQ(expected_counts, counts);
+  index.unite(terms, docs);
+  EXPECT_EQ(expected, docs);
+  index.unite(std::vector<uint64_t>(1, 4), docs, &counts);
+  EXPECT_TRUE(docs.empty());
+  EXPECT_TRUE(counts.empty());
+}
+
+/* save, load */
+TEST(InvertedIndexTest, SaveLoadTest) {
+  const char *filename = "inverted_indextest.tmp";
+  vbyte::InvertedIndex index;
+  build_index(index);
+  ASSERT_TRUE(index.save(filename));
+  vbyte::InvertedIndex loaded;
+  ASSERT_TRUE(loaded.load(filename));
+  EXPECT_EQ(index.num_terms(), loaded.num_terms());
+  EXPECT_EQ(index.num_postings(), loaded.num_postings());
+  EXPECT_EQ(index.memory_size(), loaded.memory_size());
+  std::vector<uint64_t> docs, loaded_docs;
+  index.intersect(terms_of(B, 3 * B), docs);
+  loaded.intersect(terms_of(B, 3 * B), loaded_docs);
+  EXPECT_EQ(docs, loaded_docs);
+
+  vbyte::InvertedIndex empty;
+  empty.build();
+  ASSERT_TRUE(empty.save(filename));
+  EXPECT_TRUE(loaded.load(filename));
+  EXPECT_EQ(0U, loaded.num_terms());
+  EXPECT_FALSE(loaded.load("inverted_indextest_missing.tmp"));
+  remove(filename);
+}
+
+/* load of broken files */
+TEST(InvertedIndexTest, LoadBrokenTest) {
+  const char *filename = "inverted_indextest.tmp";
+  vbyte::InvertedIndex index;
+  build_index(index);
+  ASSERT_TRUE(index.save(filename));
+  const std::vector<uint8_t> bytes = read_bytes(filename);
+  ASSERT_FALSE(bytes.empty());
+  const size_t nterms = index.num_terms();
+  const size_t header = 4 * sizeof(uint64_t);
+  vbyte::InvertedIndex loaded;
+
+  // truncated and extended files
+  std::vector<uint8_t> broken(bytes.begin(), bytes.end() - 1);
+  write_bytes(filename, broken);
+  EXPECT_FALSE(loaded.load(filename));
+  EXPECT_EQ(0U, loaded.num_terms());
+  broken = bytes;
+  broken.push_back(0);
+  write_bytes(filename, broken);
+  EXPECT_FALSE(loaded.load(filename));
+  broken.assign(bytes.begin(), bytes.begin() + header - 1);
+  write_bytes(filename, broken);
+  EXPECT_FALSE(loaded.load(filename));
+
+  // a huge number of terms
+  broken = bytes;
+  uint64_t huge = ~0ULL / 2;
+  memcpy(&broken[sizeof(uint64_t)], &huge, sizeof(huge));
+  write_bytes(filename, broken);
+  EXPECT_FALSE(loaded.load(filename));
+
+  // unsorted terms
+  broken = bytes;
+  std::swap_ranges(&broken[header], &broken[header + 8], &broken[header + 8]);
+  write_bytes(filename, broken);
+  EXPECT_FALSE(loaded.load(filename));
+
+  // sizes, skip entries and data offsets out of range
+  const size_t sections[] = { 1, 2, 3 };  // sizes, skip_begins, data_begins
+  for (size_t s = 0; s < 3; s++) {
+    broken = bytes;
+    size_t pos = header + (sections[s] * nterms + 1) * sizeof(uint64_t);
+    uint64_t value;
+    memcpy(&value, &broken[pos], sizeof(value));
+    value += 1000000;
+    memcpy(&broken[pos], &value, sizeof(value));
+    write_bytes(filename, broken);
+    EXPECT_FALSE(loaded.load(filename)) << "section " << sections[s];
+  }
+
+  // the offset of a block beyond its list
+  broken = bytes;
+  size_t skips = header + 4 * nterms * sizeof(uint64_t);
+  uint64_t offset = 1000000;
+  memcpy(&broken[skips + sizeof(vbyte::Skip) + sizeof(uint64_t)], &offset,
+         sizeof(offset));
+  write_bytes(filename, broken);
+  EXPECT_FALSE(loaded.load(filename));
+
+  // a stop bit cleared in the data
+  broken = bytes;
+  broken[broken.size() - 1] &= 0x7f;
+  write_bytes(filename, broken);
+  EXPECT_FALSE(loaded.load(filename));
+
+  // the original still loads
+  write_bytes(filename, bytes);
+  EXPECT_TRUE(loaded.load(filename));
+  EXPECT_EQ(nterms, loaded.num_terms());
+  remove(filename);
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -1,120 +1,221 @@
 //
-// Variable Byte code
+// Benchmark of Variable Byte code and Group Varint code
 // http://nlp.stanford.edu/IR-book/html/htmledition/variable-byte-codes-1.html
 //
+// Usage:
+//   % variable_byte_code [-g average_gap] [-s min_seconds] [-j]
+//
+// Sorted random lists (posting lists) of several lengths are encoded and
+// decoded repeatedly, and the throughput of each codec is printed in
+// GB/s of uncompressed numbers, with the compressed bytes per number.
+// With -j, the results are printed in JSON (the format of Google
+// Benchmark).
+//
+// Build:
+//   % g++ -Wall -O3 -mssse3 variable_byte_code.cc -o variable_byte_code
+//   (or "./waf build" in matrix/mf: build/default/variable_byte_code)
+//
 
 #include <stdint.h>
-#include <algorithm>
-#include <iostream>
-#include <map>
-#include <vector>
+#include <sys/time.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
 #include <ctime>
+#include <string>
+#include <vector>
+#include "variable_byte_code.h"
 
-void variable_byte_encode_number(uint64_t num, std::vector<uint64_t> &encoded) {
-  for (;;) {
-    encoded.push_back(num % 128);
-    if (num < 128) break;
-    num /= 128;
-  }
-  encoded[0] += 128;
+/* lengths of lists */
+const size_t LIST_LENGTHS[] = { 128, 1024, 16384, 262144, 1048576 };
+
+/* result of a codec on a list */
+struct Result {
+  std::string codec;
+  size_t size;
+  double bytes_per_number;
+  double input_bytes;
+  double encode_time;  // seconds per list
+  double decode_time;
+};
+
+std::vector<Result> results;
+
+double get_time() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
 }
 
-char *variable_byte_encode(const std::vector<uint64_t> &numbers) {
-  if (numbers.size() == 0) return NULL;
-  // size of numbers
-  std::vector<uint64_t> bytes, numenc;
-  variable_byte_encode_number(numbers.size(), numenc);
-  copy(numenc.rbegin(), numenc.rend(), std::back_inserter(bytes));
-  numenc.clear();
-
-  for (size_t i = 0; i < numbers.size(); i++) {
-    variable_byte_encode_number(numbers[i], numenc);
-    copy(numenc.rbegin(), numenc.rend(), std::back_inserter(bytes));
-    numenc.clear();
+// sorted distinct numbers with random gaps in [1, 2 * gap - 1]
+void random_numbers(size_t size, uint64_t gap, std::vector<uint64_t> &numbers) {
+  numbers.clear();
+  uint64_t num = 0;
+  for (size_t i = 0; i < size; i++) {
+    num += 1 + static_cast<uint64_t>(rand()) % (2 * gap - 1);
+    numbers.push_back(num);
   }
-  char *buf = new char[bytes.size()];
-  copy(bytes.begin(), bytes.end(), buf);
-  std::cout << "Size(encoded): " << sizeof(char) * bytes.size() << std::endl;
-  return buf;
 }
 
-void variable_byte_decode(const char *ptr, std::vector<uint64_t> &numbers) {
-  // size of numbers
-  uint64_t size = 0;
-  uint64_t c;
-  do {
-    c = *(unsigned char *)ptr++;
-    size = (c < 128) ? 128 * size + c : 128 * size + (c - 128);
-  } while (c < 128);
-
-  uint64_t cnt = 0;
-  while (cnt < size) {
-    uint64_t n = 0;
-    do {
-      c = *(unsigned char *)ptr++;
-      n = (c < 128) ? 128 * n + c : 128 * n + (c - 128);
-    } while (c < 128);
-    numbers.push_back(n);
-    cnt++;
+void check(bool ok, const char *name, size_t size) {
+  if (!ok) {
+    fprintf(stderr, "[Error] %s: decoded numbers differ (size: %ld)\n",
+            name, size);
+    exit(1);
   }
 }
 
-char *compress_diff(const std::vector<uint64_t> &numbers) {
-  std::vector<uint64_t> diff;
-  uint64_t prev = 0;
-  for (size_t i = 0; i < numbers.size(); i++) {
-    diff.push_back(numbers[i] - prev);
-    prev = numbers[i];
+// encode_time and decode_time are seconds per list
+void add_result(const char *name, size_t size, size_t bytes,
+                double input_bytes, double encode_time, double decode_time) {
+  Result result;
+  result.codec = name;
+  result.size = size;
+  result.bytes_per_number = static_cast<double>(bytes) / size;
+  result.input_bytes = input_bytes;
+  result.encode_time = encode_time;
+  result.decode_time = decode_time;
+  results.push_back(result);
+}
+
+void print_tsv() {
+  printf("codec\tlength\tbytes/num\tencode(GB/s)\tdecode(GB/s)\n");
+  for (size_t i = 0; i < results.size(); i++) {
+    const Result &r = results[i];
+    printf("%s\t%ld\t%.3f\t%.3f\t%.3f\n", r.codec.c_str(), r.size,
+           r.bytes_per_number, r.input_bytes / r.encode_time / 1e9,
+           r.input_bytes / r.decode_time / 1e9);
   }
-  return variable_byte_encode(diff);
 }
 
-void decompress_diff(const char *ptr, std::vector<uint64_t> &numbers) {
-  variable_byte_decode(ptr, numbers);
-  for (size_t i = 1; i < numbers.size(); i++) numbers[i] += numbers[i-1];
+void print_json_entry(const Result &r, const char *op, double seconds,
+                      bool last) {
+  printf("    {\n");
+  printf("      \"name\": \"%s/%s/%ld\",\n", r.codec.c_str(), op, r.size);
+  printf("      \"real_time\": %.3f,\n", seconds * 1e9);
+  printf("      \"cpu_time\": %.3f,\n", seconds * 1e9);
+  printf("      \"time_unit\": \"ns\",\n");
+  printf("      \"bytes_per_number\": %.4f,\n", r.bytes_per_number);
+  printf("      \"bytes_per_second\": %.6g,\n", r.input_bytes / seconds);
+  printf("      \"items_per_second\": %.6g\n", r.size / seconds);
+  printf("    }%s\n", last ? "" : ",");
 }
 
-void random_numbers(size_t size, uint64_t max, std::vector<uint64_t> &numbers) {
-  std::map<uint64_t, bool> check;
-  size_t cnt = 0;
-  while (cnt < size) {
-    uint64_t num = static_cast<uint64_t>(rand()) % max;
-    if (check.find(num) == check.end()) {
-      numbers.push_back(num);
-      check[num] = true;
-      cnt++;
-    }
+void print_json(const char *progname, uint64_t gap) {
+  char date[64];
+  time_t now = time(NULL);
+  strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&now));
+  printf("{\n");
+  printf("  \"context\": {\n");
+  printf("    \"date\": \"%s\",\n", date);
+  printf("    \"executable\": \"%s\",\n", progname);
+  printf("    \"average_gap\": %ld\n", gap);
+  printf("  },\n");
+  printf("  \"benchmarks\": [\n");
+  for (size_t i = 0; i < results.size(); i++) {
+    print_json_entry(results[i], "encode", results[i].encode_time, false);
+    print_json_entry(results[i], "decode", results[i].decode_time,
+                     i + 1 == results.size());
   }
-  std::sort(numbers.begin(), numbers.end());
+  printf("  ]\n");
+  printf("}\n");
 }
 
-int main(int argc, char **argv) {
-  srand(static_cast<unsigned int>(time(NULL)));
-  std::vector<uint64_t> numbers;
-  size_t size = 10;
-  random_numbers(size, size * 100, numbers);
-
-  std::cout << "Size(input):   " << sizeof(uint64_t) * size << std::endl;
-  std::cout << "Input:   ";
-  for (size_t i = 0; i < numbers.size(); i++) {
-    if (i != 0) std::cout << " ";
-    std::cout << numbers[i];
-  }
-  std::cout << std::endl;
+// run stmt repeatedly for min_seconds at least, and set the number of
+// loops and the elapsed seconds
+#define TIME_LOOP(loops, seconds, stmt) do {      \
+    double start_ = get_time();                   \
+    (loops) = 0;                                  \
+    do {                                          \
+      stmt;                                       \
+      (loops)++;                                  \
+    } while (get_time() - start_ < min_seconds);  \
+    (seconds) = get_time() - start_;              \
+  } while (0)
+
+void bench(size_t size, uint64_t gap, double min_seconds) {
+  std::vector<uint64_t> numbers, decoded(size);
+  random_numbers(size, gap, numbers);
+  std::vector<uint32_t> numbers32(numbers.begin(), numbers.end());
+  std::vector<uint32_t> decoded32(size);
+  std::vector<uint8_t> buf(vbyte::max_encoded_size(size));
+  std::vector<vbyte::Skip> skips(vbyte::num_blocks(size));
+  double input64 = static_cast<double>(size) * sizeof(uint64_t);
+  double input32 = static_cast<double>(size) * sizeof(uint32_t);
+  size_t bytes = 0, loops, nblocks = skips.size();
+  double encode_time, decode_time;
+
+  // vbyte (no delta)
+  TIME_LOOP(loops, encode_time, bytes = vbyte::encode(&numbers[0], size, &buf[0]));
+  size_t eloops = loops;
+  TIME_LOOP(loops, decode_time, vbyte::decode(&buf[0], size, &decoded[0]));
+  check(numbers == decoded, "vbyte", size);
+  add_result("vbyte", size, bytes, input64,
+             encode_time / eloops, decode_time / loops);
+
+  // vbyte of differences
+  TIME_LOOP(loops, encode_time,
+            bytes = vbyte::encode_delta(&numbers[0], size, &buf[0]));
+  eloops = loops;
+  TIME_LOOP(loops, decode_time, vbyte::decode_delta(&buf[0], size, &decoded[0]));
+  check(numbers == decoded, "vbyte-delta", size);
+  add_result("vbyte-delta", size, bytes, input64,
+             encode_time / eloops, decode_time / loops);
 
-  char *encoded = compress_diff(numbers);
-  //char *encoded = variable_byte_encode(numbers);
+  // vbyte of differences in blocks with skips
+  TIME_LOOP(loops, encode_time,
+            bytes = vbyte::encode_blocks(&numbers[0], size, &buf[0], &skips[0]));
+  eloops = loops;
+  TIME_LOOP(loops, decode_time,
+            for (size_t b = 0; b < nblocks; b++)
+              vbyte::decode_block(&buf[0], &skips[0], size, b,
+                                  &decoded[b * vbyte::BLOCK_SIZE]));
+  check(numbers == decoded, "vbyte-block", size);
+  add_result("vbyte-block", size, bytes + nblocks * sizeof(vbyte::Skip),
+             input64, encode_time / eloops, decode_time / loops);
 
-  std::vector<uint64_t> decoded;
-  decompress_diff(encoded, decoded);
-  //variable_byte_decode(encoded, decoded);
-  delete [] encoded;
+  // group varint of differences
+  TIME_LOOP(loops, encode_time,
+            bytes = vbyte::group_encode_delta(&numbers32[0], size, &buf[0]));
+  eloops = loops;
+  TIME_LOOP(loops, decode_time,
+            vbyte::group_decode_delta(&buf[0], size, &decoded32[0]));
+  check(numbers32 == decoded32, "group-delta", size);
+  add_result("group-delta", size, bytes, input32,
+             encode_time / eloops, decode_time / loops);
+}
 
-  std::cout << "Decoded: ";
-  for (size_t i = 0; i < decoded.size(); i++) {
-    if (i != 0) std::cout << " ";
-    std::cout << decoded[i];
+int main(int argc, char **argv) {
+  uint64_t gap = 100;
+  double min_seconds = 0.2;
+  bool json = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "g:s:j")) != -1) {
+    switch (opt) {
+    case 'g':
+      gap = atoi(optarg);
+      break;
+    case 's':
+      min_seconds = atof(optarg);
+      break;
+    case 'j':
+      json = true;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-g average_gap] [-s min_seconds] [-j]\n",
+              argv[0]);
+      exit(1);
+    }
+  }
+  if (gap < 1) gap = 1;
+  srand(static_cast<unsigned int>(time(NULL)));
+  for (size_t i = 0; i < sizeof(LIST_LENGTHS) / sizeof(LIST_LENGTHS[0]); i++) {
+    bench(LIST_LENGTHS[i], gap, min_seconds);
+  }
+  if (json) {
+    print_json(argv[0], gap);
+  } else {
+    print_tsv();
   }
-  std::cout << std::endl;
   return 0;
 }
@@ -0,0 +1,308 @@
+//
+// Variable Byte code and Group Varint code
+// http://nlp.stanford.edu/IR-book/html/htmledition/variable-byte-codes-1.html
+//
+// Variable Byte code writes 7 bits per byte from the most significant
+// group, and the last byte of a number has the high bit set.
+// Group Varint code writes 4 numbers (uint32_t) behind one tag byte which
+// has the byte length (1-4) of each number in 2 bits, little endian.
+//
+// All encoders write into a buffer given by caller and return the
+// number of bytes written; max_encoded_size() and group_max_encoded_size()
+// give the size to allocate.  Decoders return the number of bytes read.
+//
+// Sorted lists (posting lists) are encoded by their differences
+// (encode_delta), optionally in blocks of BLOCK_SIZE numbers with a skip
+// entry per block (encode_blocks), so that a block containing a number
+// can be found without decoding the blocks before it.
+//
+// The decoders use SSE2/SSSE3 when available (-msse2, -mssse3).
+//
+
+#ifndef VARIABLE_BYTE_CODE_H_
+#define VARIABLE_BYTE_CODE_H_
+
+#include <stdint.h>
+#include <cstddef>
+#include <cstring>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+namespace vbyte {
+
+/* number of numbers in a block of encode_blocks */
+const size_t BLOCK_SIZE = 128;
+
+/* skip entry of a block */
+struct Skip {
+  uint64_t last;    // last number of the block
+  uint64_t offset;  // byte offset of the block
+};
+
+/* Variable Byte code */
+
+// maximum bytes of n encoded numbers
+inline size_t max_encoded_size(size_t n) {
+  return n * 10;
+}
+
+inline uint8_t *encode_number(uint64_t num, uint8_t *out) {
+  if (num < (1ULL << 7)) {
+    *out++ = static_cast<uint8_t>(num | 0x80);
+    return out;
+  }
+  if (num < (1ULL << 14)) {
+    *out++ = static_cast<uint8_t>(num >> 7);
+    *out++ = static_cast<uint8_t>((num & 0x7f) | 0x80);
+    return out;
+  }
+  uint8_t bytes[10];
+  int size = 0;
+  do {
+    bytes[size++] = static_cast<uint8_t>(num & 0x7f);
+    num >>= 7;
+  } while (num != 0);
+  bytes[0] |= 0x80;
+  while (size > 0) *out++ = bytes[--size];
+  return out;
+}
+
+inline const uint8_t *decode_number(const uint8_t *in, uint64_t *num) {
+  uint64_t n = 0;
+  uint8_t c;
+  while (((c = *in++) & 0x80) == 0) n = (n << 7) | c;
+  *num = (n << 7) | (c & 0x7f);
+  return in;
+}
+
+inline size_t encode(const uint64_t *numbers, size_t n, uint8_t *out) {
+  uint8_t *p = out;
+  for (size_t i = 0; i < n; i++) p = encode_number(numbers[i], p);
+  return p - out;
+}
+
+// Decode n numbers.  Runs of one byte numbers are found by the stop bits
+// of 16 (SSE2) or 8 bytes at once and copied without the loop of
+// decode_number.
+inline size_t decode(const uint8_t *in, size_t n, uint64_t *numbers) {
+  const uint8_t *p = in;
+  size_t i = 0;
+#ifdef __SSE2__
+  // 16 numbers or more remain, so 16 bytes can be read
+  while (i + 16 <= n) {
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    unsigned int stops = _mm_movemask_epi8(bytes);
+    int run = (stops == 0xffff) ? 16 : __builtin_ctz(~stops);
+    for (int k = 0; k < run; k++) numbers[i + k] = p[k] & 0x7f;
+    i += run;
+    p += run;
+    if (run < 16) p = decode_number(p, numbers + i++);
+  }
+#else
+  while (i + 8 <= n) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    if ((word & 0x8080808080808080ULL) == 0x8080808080808080ULL) {
+      for (int k = 0; k < 8; k++) numbers[i + k] = p[k] & 0x7f;
+      i += 8;
+      p += 8;
+    } else {
+      p = decode_number(p, numbers + i++);
+      p = decode_number(p, numbers + i++);
+    }
+  }
+#endif
+  for (; i < n; i++) p = decode_number(p, numbers + i);
+  return p - in;
+}
+
+/* differences of sorted numbers */
+
+inline size_t encode_delta(const uint64_t *numbers, size_t n, uint8_t *out,
+                           uint64_t prev = 0) {
+  uint8_t *p = out;
+  for (size_t i = 0; i < n; i++) {
+    p = encode_number(numbers[i] - prev, p);
+    prev = numbers[i];
+  }
+  return p - out;
+}
+
+inline size_t decode_delta(const uint8_t *in, size_t n, uint64_t *numbers,
+                           uint64_t prev = 0) {
+  size_t size = decode(in, n, numbers);
+  for (size_t i = 0; i < n; i++) {
+    prev += numbers[i];
+    numbers[i] = prev;
+  }
+  return size;
+}
+
+// number of blocks (and skip entries) of n numbers
+inline size_t num_blocks(size_t n) {
+  return (n + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+// Encode sorted numbers in blocks.  skips must have num_blocks(n) entries.
+inline size_t encode_blocks(const uint64_t *numbers, size_t n, uint8_t *out,
+                            Skip *skips) {
+  size_t size = 0;
+  uint64_t prev = 0;
+  for (size_t b = 0; b * BLOCK_SIZE < n; b++) {
+    size_t begin = b * BLOCK_SIZE;
+    size_t count = (n - begin < BLOCK_SIZE) ? n - begin : BLOCK_SIZE;
+    skips[b].offset = size;
+    skips[b].last = numbers[begin + count - 1];
+    size += encode_delta(numbers + begin, count, out + size, prev);
+    prev = skips[b].last;
+  }
+  return size;
+}
+
+// Decode the block b of n numbers and return the number of decoded numbers.
+inline size_t decode_block(const uint8_t *in, const Skip *skips, size_t n,
+                           size_t b, uint64_t *numbers) {
+  size_t begin = b * BLOCK_SIZE;
+  size_t count = (n - begin < BLOCK_SIZE) ? n - begin : BLOCK_SIZE;
+  decode_delta(in + skips[b].offset, count, numbers,
+               (b == 0) ? 0 : skips[b-1].last);
+  return count;
+}
+
+// Return the first block which may contain target (or nblocks).
+inline size_t find_block(const Skip *skips, size_t nblocks, uint64_t target) {
+  size_t low = 0;
+  size_t high = nblocks;
+  while (low < high) {
+    size_t mid = (low + high) / 2;
+    if (skips[mid].last < target) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+/* Group Varint code */
+
+// maximum bytes of n encoded numbers
+inline size_t group_max_encoded_size(size_t n) {
+  return (n + 3) / 4 + n * 4;
+}
+
+inline int group_length(uint32_t num) {
+  return (num < (1U << 8)) ? 1 : (num < (1U << 16)) ? 2 :
+         (num < (1U << 24)) ? 3 : 4;
+}
+
+// encode a group of count (<= 4) numbers
+inline uint8_t *group_encode_group(const uint32_t *numbers, size_t count,
+                                   uint8_t *out) {
+  uint8_t *tag = out++;
+  *tag = 0;
+  for (size_t k = 0; k < count; k++) {
+    uint32_t num = numbers[k];
+    int length = group_length(num);
+    *tag |= static_cast<uint8_t>((length - 1) << (2 * k));
+    for (int j = 0; j < length; j++) {
+      *out++ = static_cast<uint8_t>(num >> (8 * j));
+    }
+  }
+  return out;
+}
+
+inline size_t group_encode(const uint32_t *numbers, size_t n, uint8_t *out) {
+  uint8_t *p = out;
+  for (size_t i = 0; i < n; i += 4) {
+    p = group_encode_group(numbers + i, (n - i < 4) ? n - i : 4, p);
+  }
+  return p - out;
+}
+
+#ifdef __SSSE3__
+/* shuffle masks of pshufb for each tag */
+struct GroupShuffle {
+  uint8_t masks[256][16];
+  uint8_t lengths[256];
+  GroupShuffle() {
+    for (int tag = 0; tag < 256; tag++) {
+      int offset = 0;
+      for (int k = 0; k < 4; k++) {
+        int length = ((tag >> (2 * k)) & 3) + 1;
+        for (int j = 0; j < 4; j++) {
+          masks[tag][4 * k + j] = (j < length) ? offset + j : 0x80;
+        }
+        offset += length;
+      }
+      lengths[tag] = offset;
+    }
+  }
+};
+
+inline const GroupShuffle &group_shuffle() {
+  static GroupShuffle shuffle;
+  return shuffle;
+}
+#endif
+
+inline size_t group_decode(const uint8_t *in, size_t n, uint32_t *numbers) {
+  const uint8_t *p = in;
+  size_t i = 0;
+#ifdef __SSSE3__
+  // a group takes 5 bytes at least, so 16 bytes can be read if 3 more full
+  // groups follow
+  const GroupShuffle &shuffle = group_shuffle();
+  for (; i + 16 <= n; i += 4) {
+    uint8_t tag = *p++;
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    __m128i mask = _mm_loadu_si128(
+        reinterpret_cast<const __m128i *>(shuffle.masks[tag]));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(numbers + i),
+                     _mm_shuffle_epi8(bytes, mask));
+    p += shuffle.lengths[tag];
+  }
+#endif
+  for (; i < n; i += 4) {
+    uint8_t tag = *p++;
+    for (size_t k = 0; k < 4 && i + k < n; k++) {
+      int length = ((tag >> (2 * k)) & 3) + 1;
+      uint32_t num = 0;
+      for (int j = 0; j < length; j++) num |= static_cast<uint32_t>(p[j]) << (8 * j);
+      numbers[i + k] = num;
+      p += length;
+    }
+  }
+  return p - in;
+}
+
+inline size_t group_encode_delta(const uint32_t *numbers, size_t n,
+                                 uint8_t *out) {
+  uint8_t *p = out;
+  uint32_t prev = 0;
+  uint32_t gaps[4];
+  for (size_t i = 0; i < n; i += 4) {
+    size_t count = (n - i < 4) ? n - i : 4;
+    for (size_t k = 0; k < count; k++) {
+      gaps[k] = numbers[i + k] - prev;
+      prev = numbers[i + k];
+    }
+    p = group_encode_group(gaps, count, p);
+  }
+  return p - out;
+}
+
+inline size_t group_decode_delta(const uint8_t *in, size_t n,
+                                 uint32_t *numbers) {
+  size_t size = group_decode(in, n, numbers);
+  for (size_t i = 1; i < n; i++) numbers[i] += numbers[i-1];
+  return size;
+}
+
+} /* namespace vbyte */
+
+#endif  // VARIABLE_BYTE_CODE_H_
@@ -0,0 +1,178 @@
+//
+// Tests for Variable Byte code and Group Varint code
+//
+
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+#include <gtest/gtest.h>
+#include "variable_byte_code.h"
+
+namespace {
+
+// numbers around the boundaries of the byte lengths (7, 14, 21, 28 bits)
+std::vector<uint64_t> boundary_numbers() {
+  std::vector<uint64_t> numbers;
+  numbers.push_back(0);
+  numbers.push_back(1);
+  for (int bits = 7; bits <= 63; bits += 7) {
+    numbers.push_back((1ULL << bits) - 1);
+    numbers.push_back(1ULL << bits);
+  }
+  numbers.push_back(~0ULL);
+  return numbers;
+}
+
+// sorted numbers whose gaps are at the boundaries of the byte lengths
+std::vector<uint64_t> boundary_deltas(size_t n) {
+  const uint64_t gaps[] = { 1, 127, 128, 16383, 16384, 2097151, 2097152,
+                            268435455, 268435456 };
+  const size_t ngaps = sizeof(gaps) / sizeof(gaps[0]);
+  std::vector<uint64_t> numbers;
+  uint64_t prev = 0;
+  for (size_t i = 0; i < n; i++) {
+    prev += gaps[i % ngaps];
+    numbers.push_back(prev);
+  }
+  return numbers;
+}
+
+void check_round_trip(const std::vector<uint64_t> &numbers) {
+  size_t n = numbers.size();
+  // padded so that an over-read of the decoder is not hidden
+  std::vector<uint8_t> buffer(vbyte::max_encoded_size(n) + 16, 0xff);
+  size_t size = vbyte::encode(n ? &numbers[0] : NULL, n, &buffer[0]);
+  EXPECT_LE(size, vbyte::max_encoded_size(n));
+  std::vector<uint64_t> decoded(n + 1, 12345);
+  EXPECT_EQ(size, vbyte::decode(&buffer[0], n, &decoded[0]));
+  for (size_t i = 0; i < n; i++) EXPECT_EQ(numbers[i], decoded[i]);
+  EXPECT_EQ(12345ULL, decoded[n]);
+}
+
+void check_group_round_trip(const std::vector<uint32_t> &numbers) {
+  size_t n = numbers.size();
+  std::vector<uint8_t> buffer(vbyte::group_max_encoded_size(n) + 16, 0xff);
+  size_t size = vbyte::group_encode(n ? &numbers[0] : NULL, n, &buffer[0]);
+  EXPECT_LE(size, vbyte::group_max_encoded_size(n));
+  std::vector<uint32_t> decoded(n + 4, 12345);
+  EXPECT_EQ(size, vbyte::group_decode(&buffer[0], n, &decoded[0]));
+  for (size_t i = 0; i < n; i++) EXPECT_EQ(numbers[i], decoded[i]);
+}
+
+}  // namespace
+
+/* encode_number, decode_number */
+TEST(VariableByteCodeTest, NumberTest) {
+  std::vector<uint64_t> numbers = boundary_numbers();
+  for (size_t i = 0; i < numbers.size(); i++) {
+    uint8_t buffer[16];
+    uint8_t *end = vbyte::encode_number(numbers[i], buffer);
+    int bits = 64;
+    while (bits > 1 && !(numbers[i] >> (bits - 1))) bits--;
+    EXPECT_EQ((bits + 6) / 7, end - buffer) << numbers[i];
+    // only the last byte has the high bit
+    for (uint8_t *p = buffer; p < end - 1; p++) EXPECT_EQ(0, *p & 0x80);
+    EXPECT_EQ(0x80, *(end - 1) & 0x80);
+    uint64_t num = 0;
+    EXPECT_EQ(end, vbyte::decode_number(buffer, &num));
+    EXPECT_EQ(numbers[i], num);
+  }
+}
+
+/* encode, decode */
+TEST(VariableByteCodeTest, EncodeDecodeTest) {
+  check_round_trip(std::vector<uint64_t>());
+  check_round_trip(std::vector<uint64_t>(1, 0));
+  check_round_trip(std::vector<uint64_t>(1, 128));
+  check_round_trip(boundary_numbers());
+  // runs of 16 one-byte numbers (the SIMD path) and the rest
+  std::vector<uint64_t> numbers;
+  for (size_t i = 0; i < 100; i++) {
+    numbers.push_back((i % 40 < 20) ? i % 128 : (1ULL << (i % 30)));
+  }
+  for (size_t n = 0; n <= numbers.size(); n++) {
+    check_round_trip(std::vector<uint64_t>(numbers.begin(),
+                                           numbers.begin() + n));
+  }
+}
+
+/* encode_delta, decode_delta */
+TEST(VariableByteCodeTest, DeltaTest) {
+  std::vector<uint64_t> numbers = boundary_deltas(40);
+  for (size_t n = 0; n <= numbers.size(); n++) {
+    std::vector<uint8_t> buffer(vbyte::max_encoded_size(n) + 1);
+    size_t size = vbyte::encode_delta(&numbers[0], n, &buffer[0]);
+    std::vector<uint64_t> decoded(n + 1);
+    EXPECT_EQ(size, vbyte::decode_delta(&buffer[0], n, &decoded[0]));
+    for (size_t i = 0; i < n; i++) EXPECT_EQ(numbers[i], decoded[i]);
+  }
+}
+
+/* encode_blocks, decode_block, find_block */
+TEST(VariableByteCodeTest, BlocksTest) {
+  const size_t lengths[] = { 1, vbyte::BLOCK_SIZE - 1, vbyte::BLOCK_SIZE,
+                             vbyte::BLOCK_SIZE + 1, 3 * vbyte::BLOCK_SIZE };
+  for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+    size_t n = lengths[l];
+    std::vector<uint64_t> numbers = boundary_deltas(n);
+    size_t nblocks = vbyte::num_blocks(n);
+    EXPECT_EQ((n + vbyte::BLOCK_SIZE - 1) / vbyte::BLOCK_SIZE, nblocks);
+    std::vector<uint8_t> buffer(vbyte::max_encoded_size(n));
+    std::vector<vbyte::Skip> skips(nblocks);
+    vbyte::encode_blocks(&numbers[0], n, &buffer[0], &skips[0]);
+    uint64_t block[vbyte::BLOCK_SIZE];
+    for (size_t b = 0; b < nblocks; b++) {
+      size_t count = vbyte::decode_block(&buffer[0], &skips[0], n, b, block);
+      size_t begin = b * vbyte::BLOCK_SIZE;
+      EXPECT_EQ(std::min(n - begin, vbyte::BLOCK_SIZE), count);
+      for (size_t i = 0; i < count; i++) EXPECT_EQ(numbers[begin + i], block[i]);
+      EXPECT_EQ(numbers[begin + count - 1], skips[b].last);
+      EXPECT_EQ(b, vbyte::find_block(&skips[0], nblocks, numbers[begin]));
+      EXPECT_EQ(b, vbyte::find_block(&skips[0], nblocks, skips[b].last));
+    }
+    EXPECT_EQ(0U, vbyte::find_block(&skips[0], nblocks, 0));
+    EXPECT_EQ(nblocks, vbyte::find_block(&skips[0], nblocks, numbers[n-1] + 1));
+  }
+}
+
+/* group_encode, group_decode */
+TEST(GroupVarintTest, EncodeDecodeTest) {
+  check_group_round_trip(std::vector<uint32_t>());
+  check_group_round_trip(std::vector<uint32_t>(1, 0));
+  check_group_round_trip(std::vector<uint32_t>(1, 0xffffffffU));
+  // all lengths at every position of a group, and partial last groups
+  const uint32_t values[] = { 0, 0xff, 0x100, 0xffff, 0x10000, 0xffffff,
+                              0x1000000, 0xffffffffU };
+  const size_t nvalues = sizeof(values) / sizeof(values[0]);
+  std::vector<uint32_t> numbers;
+  for (size_t i = 0; i < 4 * nvalues + 3; i++) {
+    numbers.push_back(values[(i * 3) % nvalues]);
+  }
+  for (size_t n = 0; n <= numbers.size(); n++) {
+    check_group_round_trip(std::vector<uint32_t>(numbers.begin(),
+                                                 numbers.begin() + n));
+  }
+}
+
+/* group_encode_delta, group_decode_delta */
+TEST(GroupVarintTest, DeltaTest) {
+  std::vector<uint32_t> numbers;
+  uint32_t prev = 0;
+  const uint32_t gaps[] = { 1, 255, 256, 65535, 65536, 16777215, 16777216 };
+  for (size_t i = 0; i < 35; i++) {
+    prev += gaps[i % (sizeof(gaps) / sizeof(gaps[0]))];
+    numbers.push_back(prev);
+  }
+  for (size_t n = 0; n <= numbers.size(); n++) {
+    std::vector<uint8_t> buffer(vbyte::group_max_encoded_size(n) + 1);
+    size_t size = vbyte::group_encode_delta(&numbers[0], n, &buffer[0]);
+    std::vector<uint32_t> decoded(n + 4);
+    EXPECT_EQ(size, vbyte::group_decode_delta(&buffer[0], n, &decoded[0]));
+    for (size_t i = 0; i < n; i++) EXPECT_EQ(numbers[i], decoded[i]);
+  }
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -9,26 +9,106 @@
 
 #include <cassert>
 #include <cstdio>
+#include <cstring>
+#include <istream>
+#include <string>
+#include <vector>
 #include <cv.h>
 #include <highgui.h>
 
 namespace bof {
 
+/**
+ * Local features of an image in one contiguous buffer
+ */
+class Descriptors {
+ private:
+  size_t dim_;              ///< dimension of a descriptor
+  std::vector<float> data_; ///< descriptors (size() * dim())
+
+ public:
+  /**
+   * Constructor.
+   * @param dim dimension of a descriptor
+   */
+  explicit Descriptors(size_t dim = 0) : dim_(dim) { }
+
+  /**
+   * Remove all descriptors and set the dimension.
+   * @param dim dimension of a descriptor
+   */
+  void reset(size_t dim) {
+    dim_ = dim;
+    data_.clear();
+  }
+
+  /**
+   * Append a descriptor.
+   * @param descriptor dim() values
+   */
+  void add(const float *descriptor) {
+    data_.insert(data_.end(), descriptor, descriptor + dim_);
+  }
+
+  size_t dim() const { return dim_; }
+  size_t size() const { return dim_ ? data_.size() / dim_ : 0; }
+  bool empty() const { return data_.empty(); }
+  const float *operator[](size_t i) const { return &data_[i * dim_]; }
+  const float *data() const { return data_.empty() ? NULL : &data_[0]; }
+};
+
 /**
  * This class extracts local features from input images
  * (virtual class)
  */
 class FeatureDetector {
  public:
+  virtual ~FeatureDetector() { }
+
   /**
    * Extract local features.
+   * It is called from several threads at once by extract_batch().
    * @param path path of an image file
-   * @param feature local features
+   * @param features local features
    */
-  virtual void extract(const char *path,
-                       std::vector<std::vector<float> >&features) = 0;
+  virtual void extract(const char *path, Descriptors &features) = 0;
 };
 
+/**
+ * Extract local features of images in parallel (OpenMP).
+ * Each thread decodes an image and extracts its features.
+ * @param detector feature detector
+ * @param paths paths of image files
+ * @param features local features of each image (in order of paths)
+ */
+inline void extract_batch(FeatureDetector &detector,
+                          const std::vector<std::string> &paths,
+                          std::vector<Descriptors> &features) {
+  features.resize(paths.size());
+  int size = static_cast<int>(paths.size());
+  #pragma omp parallel for schedule(dynamic, 1)
+  for (int i = 0; i < size; i++) {
+    detector.extract(paths[i].c_str(), features[i]);
+  }
+}
+
+/**
+ * Read paths of image files.
+ * @param is input stream (a path in each line)
+ * @param limit maximum number of paths
+ * @param paths paths of image files
+ * @return false if no path is read
+ */
+inline bool read_paths(std::istream &is, size_t limit,
+                       std::vector<std::string> &paths) {
+  paths.clear();
+  std::string line;
+  while (paths.size() < limit && std::getline(is, line)) {
+    paths.push_back(line);
+  }
+  return !paths.empty();
+}
+
 /**
  * This class extract SURF features from input images
  */
@@ -50,10 +130,11 @@ class SurfDetector : public FeatureDetector {
   /**
    * Extract local features.
    * @param path path of an image file
-   * @param feature local features
+   * @param features local features
    */
-  void extract(const char *path, std::vector<std::vector<float> > &features) {
+  void extract(const char *path, Descriptors &features) {
     assert(path);
+    features.reset(DIM_DESCRIPTOR);
     CvMemStorage *storage = cvCreateMemStorage(0);
     CvSeq* keypoints;
     CvSeq *descriptors;
@@ -61,17 +142,14 @@ class SurfDetector : public FeatureDetector {
     IplImage *img = cvLoadImage(path, CV_LOAD_IMAGE_GRAYSCALE);
     if (img == NULL) {
       fprintf(stderr, "[Error] cannot open %s\n", path);
+      cvReleaseMemStorage(&storage);
       return;
     }
     cvExtractSURF(img, 0, &keypoints, &descriptors, storage, params);
     cvReleaseImage(&img);
     if (keypoints->total > 0) {
       for (int i = 0; i < keypoints->total; i++) {
-        std::vector<float> feature;
-        float *descriptor = (float *)cvGetSeqElem(descriptors, i);
-        std::copy(descriptor, descriptor + DIM_DESCRIPTOR,
-                  std::back_inserter(feature));
-        features.push_back(feature);
+        features.add((float *)cvGetSeqElem(descriptors, i));
       }
     }
     cvClearSeq(keypoints);
@@ -87,9 +165,9 @@ class SiftDetector : public FeatureDetector {
   /**
    * Extract local features.
    * @param path path of an image file
-   * @param feature local features
+   * @param features local features
    */
-  void extract(const char *path, std::vector<std::vector<float> > &features) { }
+  void extract(const char *path, Descriptors &features) { }
 };
 
 } /* namespace bof */
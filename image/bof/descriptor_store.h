@@ -0,0 +1,264 @@
+//
+// Binary store of local features
+//
+// Copyright(C) 2010  Mizuki Fujisawa <fujisawa@bayon.cc>
+//
+
+#ifndef BOF_DESCRIPTOR_STORE_H_
+#define BOF_DESCRIPTOR_STORE_H_
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "descriptor.h"
+
+namespace bof {
+
+/**
+ * This class stores local features of images, in memory or in a binary
+ * file which is read by mmap.
+ *
+ * File format (native byte order):
+ *   header:  magic, dim, number of images, number of descriptors,
+ *            offset of the table (uint64_t each, padded to 64 bytes)
+ *   data:    descriptors of all images (float, dim values each),
+ *            padded to a multiple of 8 bytes
+ *   table:   first descriptor of each image and the end (uint64_t),
+ *            first byte of each name and the end (uint64_t),
+ *            names (terminated by '\0')
+ *
+ * Usage:
+ *   bof::DescriptorStore store;
+ *   store.create(path, dim);  // or create(NULL, dim) to keep in memory
+ *   store.add(name, features);
+ *   ...
+ *   store.finish();           // then readable (same as open(path))
+ */
+class DescriptorStore {
+ private:
+  static const uint64_t STORE_MAGIC = 0x42444553ULL;  ///< magic number
+  static const size_t HEADER_SIZE   = 64;             ///< bytes of header
+
+  size_t dim_;                     ///< dimension of a descriptor
+  std::string path_;               ///< path of the file (empty: in memory)
+  FILE *fp_;                       ///< file being written
+  bool ok_;                        ///< true unless writing failed
+  std::vector<float> buffer_;      ///< descriptors kept in memory
+  std::vector<uint64_t> offsets_;  ///< first descriptor of each image
+  std::vector<uint64_t> name_offsets_;  ///< first byte of each name
+  std::string names_;              ///< names of images
+  const float *data_;              ///< descriptors (mmap or buffer_)
+  void *map_;                      ///< mapped file
+  size_t map_size_;                ///< bytes of the mapped file
+
+ public:
+  /**
+   * Constructor.
+   */
+  DescriptorStore()
+    : dim_(0), fp_(NULL), ok_(true), data_(NULL), map_(NULL), map_size_(0) {
+    clear_table();
+  }
+
+  /**
+   * Destructor.
+   */
+  ~DescriptorStore() { close(); }
+
+  /**
+   * Start writing.
+   * @param path path of the file (NULL: in memory)
+   * @param dim dimension of a descriptor
+   * @return false if the file cannot be opened
+   */
+  bool create(const char *path, size_t dim) {
+    close();
+    dim_ = dim;
+    ok_ = true;
+    if (path == NULL) return true;
+    path_ = path;
+    fp_ = fopen(path, "wb");
+    if (fp_ == NULL) return false;
+    char header[HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+    ok_ = fwrite(header, 1, sizeof(header), fp_) == sizeof(header);
+    return ok_;
+  }
+
+  /**
+   * Append local features of an image.
+   * @param name name of the image
+   * @param features local features (dimension dim())
+   * @return false if the dimension of the features is not dim()
+   */
+  bool add(const std::string &name, const Descriptors &features) {
+    if (!features.empty() && features.dim() != dim_) return false;
+    size_t size = features.size() * dim_;
+    if (fp_) {
+      if (size > 0 && fwrite(features.data(), sizeof(float), size, fp_) != size) {
+        ok_ = false;
+      }
+    } else if (size > 0) {
+      buffer_.insert(buffer_.end(), features.data(), features.data() + size);
+    }
+    offsets_.push_back(offsets_.back() + features.size());
+    names_.append(name.c_str(), name.size() + 1);
+    name_offsets_.push_back(names_.size());
+    return true;
+  }
+
+  /**
+   * Finish writing and make the store readable.
+   * @return false if writing or reading the file failed
+   */
+  bool finish() {
+    if (fp_ == NULL) {
+      data_ = buffer_.empty() ? NULL : &buffer_[0];
+      return ok_;
+    }
+    // the table starts at a multiple of 8 bytes
+    uint64_t data_end = HEADER_SIZE + offsets_.back() * dim_ * sizeof(float);
+    uint64_t table = (data_end + 7) / 8 * 8;
+    char padding[8] = { 0 };
+    uint64_t header[5] = { STORE_MAGIC, dim_, num_images(), offsets_.back(),
+                           table };
+    ok_ = ok_ &&
+          write_array(padding, table - data_end) &&
+          write_array(&offsets_[0], offsets_.size()) &&
+          write_array(&name_offsets_[0], name_offsets_.size()) &&
+          write_array(names_.data(), names_.size()) &&
+          fseek(fp_, 0, SEEK_SET) == 0 &&
+          write_array(header, 5);
+    ok_ = (fclose(fp_) == 0) && ok_;
+    fp_ = NULL;
+    std::string path(path_);  // open() clears path_
+    return ok_ && open(path.c_str());
+  }
+
+  /**
+   * Open a file written by finish().
+   * @param path path of the file
+   * @return false if the file is not a store, or its sections do not
+   *         match the size of the file or each other
+   */
+  bool open(const char *path) {
+    close();
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(HEADER_SIZE)) {
+      ::close(fd);
+      return false;
+    }
+    map_size_ = st.st_size;
+    map_ = mmap(NULL, map_size_, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map_ == MAP_FAILED) {
+      map_ = NULL;
+      return false;
+    }
+    const char *bytes = static_cast<const char *>(map_);
+    const uint64_t *header = reinterpret_cast<const uint64_t *>(bytes);
+    uint64_t dim = header[1];
+    uint64_t nimages = header[2];
+    uint64_t ndescriptors = header[3];
+    uint64_t table = header[4];
+    // the counts are bounded by the file size first, so that the sizes
+    // of the sections cannot overflow
+    if (header[0] != STORE_MAGIC || dim == 0 ||
+        dim > map_size_ / sizeof(float) ||
+        nimages >= map_size_ / (2 * sizeof(uint64_t)) ||
+        ndescriptors > map_size_ / (dim * sizeof(float)) ||
+        table % 8 != 0 || table > map_size_) {
+      close();
+      return false;
+    }
+    // descriptors fill the data section up to the padding of the table
+    uint64_t data_end = HEADER_SIZE + ndescriptors * dim * sizeof(float);
+    uint64_t table_size = 2 * (nimages + 1) * sizeof(uint64_t);
+    if (data_end > table || table - data_end >= 8 ||
+        table_size > map_size_ - table) {
+      close();
+      return false;
+    }
+    const uint64_t *offsets = reinterpret_cast<const uint64_t *>(bytes + table);
+    const uint64_t *name_offsets = offsets + nimages + 1;
+    const char *names = reinterpret_cast<const char *>(offsets + 2 * (nimages + 1));
+    uint64_t names_size = map_size_ - table - table_size;
+    bool ok = offsets[0] == 0 && offsets[nimages] == ndescriptors &&
+              name_offsets[0] == 0 && name_offsets[nimages] == names_size;
+    for (uint64_t i = 0; ok && i < nimages; i++) {
+      // each name has at least its '\0'
+      ok = offsets[i] <= offsets[i+1] &&
+           name_offsets[i] < name_offsets[i+1] &&
+           name_offsets[i+1] <= names_size &&
+           names[name_offsets[i+1] - 1] == '\0';
+    }
+    if (!ok) {
+      close();
+      return false;
+    }
+    path_ = path;
+    dim_ = dim;
+    data_ = reinterpret_cast<const float *>(bytes + HEADER_SIZE);
+    offsets_.assign(offsets, offsets + nimages + 1);
+    name_offsets_.assign(name_offsets, name_offsets + nimages + 1);
+    names_.assign(names, names_size);
+    return true;
+  }
+
+  /**
+   * Release the descriptors (the file is not removed).
+   */
+  void close() {
+    if (fp_) fclose(fp_);
+    fp_ = NULL;
+    if (map_) munmap(map_, map_size_);
+    map_ = NULL;
+    map_size_ = 0;
+    data_ = NULL;
+    path_.clear();
+    std::vector<float>().swap(buffer_);
+    clear_table();
+  }
+
+  size_t dim() const { return dim_; }
+  size_t num_images() const { return offsets_.size() - 1; }
+  size_t num_descriptors() const { return offsets_.back(); }
+
+  /** name of image i */
+  const char *name(size_t i) const { return names_.data() + name_offsets_[i]; }
+
+  /** number of descriptors of image i */
+  size_t size(size_t i) const { return offsets_[i+1] - offsets_[i]; }
+
+  /** descriptors of image i (size(i) * dim() values) */
+  const float *descriptors(size_t i) const {
+    return data_ + offsets_[i] * dim_;
+  }
+
+  /** descriptor j of all images */
+  const float *descriptor(size_t j) const { return data_ + j * dim_; }
+
+ private:
+  void clear_table() {
+    offsets_.assign(1, 0);
+    name_offsets_.assign(1, 0);
+    names_.clear();
+  }
+
+  template <typename T>
+  bool write_array(const T *array, size_t size) {
+    return size == 0 || fwrite(array, sizeof(T), size, fp_) == size;
+  }
+};
+
+} /* namespace bof */
+
+#endif  // BOF_DESCRIPTOR_STORE_H_
@@ -9,25 +9,36 @@
 #include <ctime>
 #include <fstream>
 #include <string>
+#include <unistd.h>
 #include "descriptor.h"
 #include "lsh.h"
 
+/* number of images extracted at once */
+const size_t BATCH_SIZE = 64;
+
 /* function prototypes */
 int main(int argc, char **argv);
 static void usage(const char *progname);
-static void lsh_base(std::istream &is);
+static void lsh_base(std::istream &is, unsigned int seed);
 
 
 int main(int argc, char **argv) {
-  if (argc == 1) {
-    lsh_base(std::cin);
-  } else if (argc == 2) {
-    std::ifstream ifs(argv[1]);
+  unsigned int seed = bof::Lsh::DEFAULT_SEED;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:")) != -1) {
+    if (opt != 's') usage(argv[0]);
+    seed = strtoul(optarg, NULL, 10);
+  }
+  char **args = argv + optind;
+  if (argc - optind == 0) {
+    lsh_base(std::cin, seed);
+  } else if (argc - optind == 1) {
+    std::ifstream ifs(args[0]);
     if (!ifs) {
-      fprintf(stderr, "[Error] cannot open file: %s\n", argv[1]);
+      fprintf(stderr, "[Error] cannot open file: %s\n", args[0]);
       return 1;
     }
-    lsh_base(ifs);
+    lsh_base(ifs, seed);
   } else {
     usage(argv[0]);
   }
@@ -37,36 +48,39 @@ int main(int argc, char **argv) {
 static void usage(const char *progname) {
   fprintf(stderr, "%s: Image Feature Extractor using LSH\n", progname);
   fprintf(stderr, "Usage:\n");
-  fprintf(stderr, " %% %s [file]\n", progname);
+  fprintf(stderr, " %% %s [-s seed] [file]\n", progname);
+  fprintf(stderr, "  -s seed ... seed of random projections\n");
   exit(EXIT_FAILURE);
 }
 
-static void lsh_base(std::istream &is) {
+static void lsh_base(std::istream &is, unsigned int seed) {
   bof::SurfDetector detector;
-  std::string line;
-  std::vector<std::vector<float> > features;
-  std::vector<size_t> values;
-  bof::Lsh lsh(10, 128, -1.0, 1.0);
+  std::vector<std::string> paths;
+  std::vector<bof::Descriptors> batch;
+  std::vector<bof::Lsh::Bins> bins;
+  bof::Lsh lsh(10, 128, -1.0, 1.0, seed);
   size_t count = 0;
-  while (std::getline(is, line)) {
-    fprintf(stderr, "(%zd) %s\n", ++count, line.c_str());
-    features.clear();
-    detector.extract(line.c_str(), features);
-    if (features.empty()) {
-      fprintf(stderr, "[Warning] cannot detect descriptors: %s\n",
-              line.c_str());
-      continue;
-    }
-    values.clear();
-    lsh.hash(features, values);
-    if (values.empty()) {
-      fprintf(stderr, "[Warning] lsh error: %s\n", line.c_str());
-      continue;
-    } else {
-      printf("%s", line.c_str());
-      for (size_t i = 0; i < values.size(); i++)
-        if (values[i]) printf("\t%zd\t%zd", i, values[i]);
-      printf("\n");
+  while (bof::read_paths(is, BATCH_SIZE, paths)) {
+    bof::extract_batch(detector, paths, batch);
+    lsh.hash(batch, bins);
+    for (size_t k = 0; k < paths.size(); k++) {
+      const std::string &line = paths[k];
+      fprintf(stderr, "(%zd) %s\n", ++count, line.c_str());
+      if (batch[k].empty()) {
+        fprintf(stderr, "[Warning] cannot detect descriptors: %s\n",
+                line.c_str());
+        continue;
+      }
+      const bof::Lsh::Bins &values = bins[k];
+      if (values.empty()) {
+        fprintf(stderr, "[Warning] lsh error: %s\n", line.c_str());
+        continue;
+      } else {
+        printf("%s", line.c_str());
+        for (size_t i = 0; i < values.size(); i++)
+          printf("\t%zd\t%zd", values[i].first, values[i].second);
+        printf("\n");
+      }
     }
   }
 }
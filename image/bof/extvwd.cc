@@ -9,28 +9,51 @@
 #include <ctime>
 #include <fstream>
 #include <string>
+#include <unistd.h>
 #include "descriptor.h"
+#include "descriptor_store.h"
 #include "visual_words.h"
 
 /* function prototypes */
 int main(int argc, char **argv);
 static void usage(const char *progname);
-static void vwd_base(double rate, std::istream &is);
+static void vwd_base(double rate, std::istream &is, const char *index_path,
+                     size_t max_checks, bool in_memory);
 
 
 int main(int argc, char **argv) {
   srand(time(NULL));
-  if (argc == 2) {
-    double rate = atof(argv[1]);
-    vwd_base(rate, std::cin);
-  } else if (argc == 3) {
-    double rate = atof(argv[1]);
-    std::ifstream ifs(argv[2]);
+  const char *index_path = NULL;
+  size_t max_checks = 0;
+  bool in_memory = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "i:a:m")) != -1) {
+    switch (opt) {
+    case 'i':
+      index_path = optarg;
+      break;
+    case 'a':
+      max_checks = atoi(optarg);
+      break;
+    case 'm':
+      in_memory = true;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  char **args = argv + optind;
+  if (argc - optind == 1) {
+    double rate = atof(args[0]);
+    vwd_base(rate, std::cin, index_path, max_checks, in_memory);
+  } else if (argc - optind == 2) {
+    double rate = atof(args[0]);
+    std::ifstream ifs(args[1]);
     if (!ifs) {
-      fprintf(stderr, "cannot open file: %s\n", argv[2]);
+      fprintf(stderr, "cannot open file: %s\n", args[1]);
       exit(1);
     }
-    vwd_base(rate, ifs);
+    vwd_base(rate, ifs, index_path, max_checks, in_memory);
   } else {
     usage(argv[0]);
   }
@@ -40,18 +63,52 @@ int main(int argc, char **argv) {
 static void usage(const char *progname) {
   fprintf(stderr, "%s: Image Feature Extractor using Visual Words\n", progname);
   fprintf(stderr, "Usage:\n");
-  fprintf(stderr, " %% %s rate [file]\n", progname);
+  fprintf(stderr, " %% %s [-i index] [-a checks] [-m] rate [file]\n", progname);
+  fprintf(stderr, "  -i index ... save inverted index from visual words to images"
+                  " (numbered by output lines)\n");
+  fprintf(stderr, "  -a checks ... assign visual words approximately, comparing"
+                  " checks words per descriptor\n");
+  fprintf(stderr, "  -m ... keep descriptors in memory instead of a temporary"
+                  " file\n");
   exit(EXIT_FAILURE);
 }
 
-static void vwd_base(double rate, std::istream &is) {
+static void vwd_base(double rate, std::istream &is, const char *index_path,
+                     size_t max_checks, bool in_memory) {
   bof::VisualWords vwd;
+  vwd.set_approximate(max_checks);
   bof::SurfDetector detector;
-  char desc_path[] = "vwd_desc.tmp";
+  bof::DescriptorStore store;
   fprintf(stderr, "Saving descriptros..\n");
-  vwd.save_descriptors(desc_path, is, detector);
+  if (in_memory) {
+    vwd.save_descriptors(store, NULL, is, detector);
+  } else {
+    // a unique temporary file, removed once it is mapped
+    const char *tmpdir = getenv("TMPDIR");
+    std::string desc_path = std::string(tmpdir ? tmpdir : "/tmp") +
+                            "/vwd_desc.XXXXXX";
+    int fd = mkstemp(&desc_path[0]);
+    if (fd < 0) {
+      fprintf(stderr, "cannot create temporary file: %s\n", desc_path.c_str());
+      exit(1);
+    }
+    close(fd);
+    vwd.save_descriptors(store, desc_path.c_str(), is, detector);
+    unlink(desc_path.c_str());
+  }
   fprintf(stderr, "Clustering descriptros..\n");
-  vwd.do_clustering(desc_path, rate);
+  vwd.do_clustering(store, rate);
   fprintf(stderr, "Print bag-of-features..\n");
-  vwd.get_bof(desc_path);
+  if (index_path == NULL) {
+    vwd.get_bof(store);
+    return;
+  }
+  vbyte::InvertedIndex index;
+  vwd.get_bof(store, &index);
+  if (!index.save(index_path)) {
+    fprintf(stderr, "[Error] cannot save index: %s\n", index_path);
+    exit(1);
+  }
+  fprintf(stderr, "Saved index: %zu words, %zu postings, %zu bytes\n",
+          index.num_terms(), index.num_postings(), index.memory_size());
 }
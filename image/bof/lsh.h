@@ -8,8 +8,10 @@
 #ifndef BOF_LSH_H_
 #define BOF_LSH_H_
 
+#include <utility>
 #include <vector>
 #include <lshkit.h>
+#include "descriptor.h"
 
 namespace bof {
 
@@ -17,6 +19,13 @@ namespace bof {
  * Locality sensitive hashing using lshkit
  */
 class Lsh {
+ public:
+  /** sparse histogram: (index, count) pairs in order of index */
+  typedef std::vector<std::pair<size_t, size_t> > Bins;
+
+  /** seed of the default random number generator of lshkit */
+  static const unsigned int DEFAULT_SEED = 5489;
+
  private:
   typedef lshkit::Repeat<lshkit::ThresholdingLsh> MyLsh;
   typedef lshkit::Histogram<MyLsh> MyHistogram;
@@ -24,32 +33,99 @@ class Lsh {
   static const size_t M = 10;  ///< number repeated to take average
   static const size_t N = 10;  ///< number of concatenated histograms
 
-  MyLsh::Parameter param_;  ///< parameter for LSH
+  MyLsh::Parameter param_;     ///< parameter for LSH
+  MyHistogram hist_;           ///< random projections (made once)
+  std::vector<float> output_;  ///< buffer of hash()
 
  public:
-  Lsh(size_t repeat, size_t dim, double min, double max) {
+  /**
+   * Constructor.  The random projections are made here.
+   * @param repeat number of repeated hash functions
+   * @param dim dimension of descriptors
+   * @param min minimum value of descriptors
+   * @param max maximum value of descriptors
+   * @param seed seed of random numbers
+   */
+  Lsh(size_t repeat, size_t dim, double min, double max,
+      unsigned int seed = DEFAULT_SEED) {
     param_.repeat = repeat;
     param_.dim = dim;
     param_.min = min;
     param_.max = max;
+    lshkit::DefaultRng rng(seed);  // random number generator
+    hist_.reset(M, N, param_, rng);
+    output_.resize(hist_.dim());
   }
   ~Lsh() { }
 
-  void hash(const std::vector<std::vector<float> > &features,
-            std::vector<size_t> &values) {
-    MyHistogram hist;
-    lshkit::DefaultRng rng;  // random number generator
-    hist.reset(M, N, param_, rng);
-    float *output = new float[hist.dim()];
-    hist.zero(output);
-    for (size_t i = 0; i < features.size(); i++) {
-      hist.add(output, &features[i][0]);
+  /**
+   * Dimension of histograms.
+   */
+  size_t dim() const { return hist_.dim(); }
+
+  /**
+   * Hash local features of an image.
+   * @param features local features
+   * @param values (index, count) of non-empty bins
+   */
+  void hash(const Descriptors &features, Bins &values) {
+    hash(features.data(), features.size(), &output_[0], values);
+  }
+
+  /**
+   * Hash local features of images in parallel (OpenMP).
+   * @param descriptors local features of all images in one buffer
+   * @param offsets first descriptor of each image and the end
+   *                (size + 1 values)
+   * @param size number of images
+   * @param values (index, count) of non-empty bins of each image
+   */
+  void hash(const float *descriptors, const size_t *offsets, size_t size,
+            std::vector<Bins> &values) const {
+    values.resize(size);
+    int n = static_cast<int>(size);
+    #pragma omp parallel
+    {
+      std::vector<float> output(hist_.dim());  // buffer of each thread
+      #pragma omp for schedule(dynamic, 1)
+      for (int i = 0; i < n; i++) {
+        hash(descriptors + offsets[i] * param_.dim, offsets[i+1] - offsets[i],
+             &output[0], values[i]);
+      }
+    }
+  }
+
+  /**
+   * Hash local features of images in parallel (OpenMP).
+   * @param batch local features of each image
+   * @param values (index, count) of non-empty bins of each image
+   */
+  void hash(const std::vector<Descriptors> &batch,
+            std::vector<Bins> &values) const {
+    values.resize(batch.size());
+    int n = static_cast<int>(batch.size());
+    #pragma omp parallel
+    {
+      std::vector<float> output(hist_.dim());  // buffer of each thread
+      #pragma omp for schedule(dynamic, 1)
+      for (int i = 0; i < n; i++) {
+        hash(batch[i].data(), batch[i].size(), &output[0], values[i]);
+      }
+    }
+  }
+
+ private:
+  void hash(const float *descriptors, size_t size, float *output,
+            Bins &values) const {
+    values.clear();
+    hist_.zero(output);
+    for (size_t i = 0; i < size; i++) {
+      hist_.add(output, descriptors + i * param_.dim);
     }
-    values.resize(hist.dim());
-    for (size_t i = 0; i < hist.dim(); i++) {
-      if (output[i]) values[i] = static_cast<size_t>(output[i]);
+    for (size_t i = 0; i < hist_.dim(); i++) {
+      size_t count = static_cast<size_t>(output[i]);
+      if (count) values.push_back(std::make_pair(i, count));
     }
-    delete [] output;
   }
 };
 
@@ -0,0 +1,301 @@
+//
+// Nearest centroid quantizer of local features
+//
+// Copyright(C) 2010  Mizuki Fujisawa <fujisawa@bayon.cc>
+//
+
+#ifndef BOF_QUANTIZER_H_
+#define BOF_QUANTIZER_H_
+
+#include <algorithm>
+#include <cfloat>
+#include <cstdlib>
+#include <functional>
+#include <utility>
+#include <vector>
+
+namespace bof {
+
+/**
+ * This class assigns descriptors to their nearest centroids (visual
+ * words) by squared euclidean distance.
+ *
+ * Exact mode computes |c|^2 - 2 x.c for blocks of descriptors and
+ * centroids at once, with the centroids stored dimension-major in
+ * blocks so that the inner loop runs over contiguous centroids.
+ * Approximate mode searches a hierarchical k-means tree of the centroids
+ * best-bin-first, and checks a limited number of centroids.
+ *
+ * The quantize methods are const and can be called from several threads.
+ */
+class Quantizer {
+ private:
+  static const size_t CENTROID_BLOCK   = 64;  ///< centroids of a block
+  static const size_t DESCRIPTOR_BLOCK = 4;   ///< descriptors of a block
+
+  /* node of the tree */
+  struct Node {
+    size_t begin;  ///< first child (internal) or first item (leaf)
+    size_t end;
+    bool leaf;
+  };
+
+  size_t dim_;                  ///< dimension of a centroid
+  size_t size_;                 ///< number of centroids
+  std::vector<float> codebook_; ///< centroids (size_ * dim_)
+  std::vector<float> blocks_;   ///< blocks of centroids (dimension-major)
+  std::vector<float> norms_;    ///< |c|^2 of blocks_ (FLT_MAX for padding)
+
+  std::vector<Node> nodes_;     ///< nodes of the tree (root: 0)
+  std::vector<float> centers_;  ///< centers of nodes
+  std::vector<size_t> items_;   ///< centroid ids of leaves
+
+ public:
+  /**
+   * Constructor.
+   */
+  Quantizer() : dim_(0), size_(0) { }
+
+  /**
+   * Destructor.
+   */
+  ~Quantizer() { }
+
+  /**
+   * Set centroids.  The tree is cleared.
+   * @param centroids size * dim values
+   * @param size number of centroids
+   * @param dim dimension of a centroid
+   */
+  void set_codebook(const float *centroids, size_t size, size_t dim) {
+    dim_ = dim;
+    size_ = size;
+    codebook_.assign(centroids, centroids + size * dim);
+    size_t nblocks = (size + CENTROID_BLOCK - 1) / CENTROID_BLOCK;
+    blocks_.assign(nblocks * CENTROID_BLOCK * dim, 0.0f);
+    norms_.assign(nblocks * CENTROID_BLOCK, FLT_MAX);
+    for (size_t i = 0; i < size; i++) {
+      float *block = &blocks_[i / CENTROID_BLOCK * CENTROID_BLOCK * dim];
+      const float *c = &codebook_[i * dim];
+      float norm = 0.0f;
+      for (size_t d = 0; d < dim; d++) {
+        block[d * CENTROID_BLOCK + i % CENTROID_BLOCK] = c[d];
+        norm += c[d] * c[d];
+      }
+      norms_[i] = norm;
+    }
+    nodes_.clear();
+    centers_.clear();
+    items_.clear();
+  }
+
+  size_t size() const { return size_; }
+  size_t dim() const { return dim_; }
+  const float *centroid(size_t i) const { return &codebook_[i * dim_]; }
+
+  /**
+   * Find the nearest centroids exactly.
+   * @param descriptors n * dim() values
+   * @param n number of descriptors
+   * @param words ids of the nearest centroids (n values)
+   */
+  void quantize(const float *descriptors, size_t n, size_t *words) const {
+    float dots[DESCRIPTOR_BLOCK][CENTROID_BLOCK];
+    float best[DESCRIPTOR_BLOCK];
+    for (size_t q0 = 0; q0 < n; q0 += DESCRIPTOR_BLOCK) {
+      size_t nq = (n - q0 < DESCRIPTOR_BLOCK) ? n - q0 : DESCRIPTOR_BLOCK;
+      for (size_t q = 0; q < nq; q++) {
+        best[q] = FLT_MAX;
+        words[q0 + q] = 0;
+      }
+      for (size_t c0 = 0; c0 < norms_.size(); c0 += CENTROID_BLOCK) {
+        const float *block = &blocks_[c0 * dim_];
+        for (size_t q = 0; q < nq; q++) {
+          for (size_t c = 0; c < CENTROID_BLOCK; c++) dots[q][c] = 0.0f;
+        }
+        for (size_t d = 0; d < dim_; d++) {
+          const float *column = block + d * CENTROID_BLOCK;
+          for (size_t q = 0; q < nq; q++) {
+            float x = descriptors[(q0 + q) * dim_ + d];
+            float *dot = dots[q];
+            for (size_t c = 0; c < CENTROID_BLOCK; c++) dot[c] += x * column[c];
+          }
+        }
+        for (size_t q = 0; q < nq; q++) {
+          for (size_t c = 0; c < CENTROID_BLOCK; c++) {
+            float dist = norms_[c0 + c] - 2.0f * dots[q][c];
+            if (dist < best[q]) {
+              best[q] = dist;
+              words[q0 + q] = c0 + c;
+            }
+          }
+        }
+      }
+    }
+  }
+
+  /**
+   * Build the tree for approximate search.
+   * @param branching number of children of a node
+   * @param leaf_size maximum number of centroids in a leaf
+   * @param niter number of k-means iterations at each node
+   * @param seed seed of random numbers
+   */
+  void build_tree(size_t branching = 16, size_t leaf_size = 64,
+                  size_t niter = 5, unsigned int seed = 0) {
+    nodes_.clear();
+    centers_.clear();
+    items_.clear();
+    if (branching < 2) branching = 2;
+    if (leaf_size < 1) leaf_size = 1;
+    std::vector<size_t> ids(size_);
+    for (size_t i = 0; i < size_; i++) ids[i] = i;
+    Node root = { 0, 0, true };
+    nodes_.push_back(root);
+    centers_.assign(dim_, 0.0f);
+    build_node(0, ids, branching, leaf_size, niter, &seed);
+  }
+
+  /**
+   * Whether the tree is built.
+   * @return true if built
+   */
+  bool has_tree() const { return !nodes_.empty(); }
+
+  /**
+   * Find the nearest centroids approximately using the tree
+   * (exactly if the tree is not built).
+   * @param descriptors n * dim() values
+   * @param n number of descriptors
+   * @param max_checks number of centroids compared for a descriptor
+   * @param words ids of the found centroids (n values)
+   */
+  void quantize_approx(const float *descriptors, size_t n, size_t max_checks,
+                       size_t *words) const {
+    if (!has_tree()) {
+      quantize(descriptors, n, words);
+      return;
+    }
+    typedef std::pair<float, size_t> Entry;  // (distance, node)
+    std::vector<Entry> heap;
+    std::greater<Entry> greater;
+    for (size_t q = 0; q < n; q++) {
+      const float *x = descriptors + q * dim_;
+      float best = FLT_MAX;
+      size_t best_id = 0;
+      size_t checks = 0;
+      heap.clear();
+      heap.push_back(Entry(0.0f, 0));
+      while (!heap.empty() && (checks < max_checks || checks == 0)) {
+        std::pop_heap(heap.begin(), heap.end(), greater);
+        const Node &node = nodes_[heap.back().second];
+        heap.pop_back();
+        if (node.leaf) {
+          for (size_t i = node.begin; i < node.end; i++) {
+            float dist = distance(x, centroid(items_[i]));
+            if (dist < best) {
+              best = dist;
+              best_id = items_[i];
+            }
+          }
+          checks += node.end - node.begin;
+        } else {
+          for (size_t child = node.begin; child < node.end; child++) {
+            heap.push_back(Entry(distance(x, &centers_[child * dim_]), child));
+            std::push_heap(heap.begin(), heap.end(), greater);
+          }
+        }
+      }
+      words[q] = best_id;
+    }
+  }
+
+ private:
+  float distance(const float *x, const float *y) const {
+    float dist = 0.0f;
+    for (size_t d = 0; d < dim_; d++) dist += (x[d] - y[d]) * (x[d] - y[d]);
+    return dist;
+  }
+
+  void build_node(size_t node, const std::vector<size_t> &ids,
+                  size_t branching, size_t leaf_size, size_t niter,
+                  unsigned int *seed) {
+    if (ids.size() <= leaf_size || ids.size() <= branching) {
+      make_leaf(node, ids);
+      return;
+    }
+    // k-means of the centroids under the node
+    size_t k = branching;
+    std::vector<float> centers(k * dim_);
+    for (size_t j = 0; j < k; j++) {
+      size_t pick = ids[j * ids.size() / k + rand_r(seed) % (ids.size() / k)];
+      std::copy(centroid(pick), centroid(pick) + dim_, &centers[j * dim_]);
+    }
+    std::vector<size_t> assign(ids.size(), 0);
+    std::vector<size_t> counts(k);
+    for (size_t iter = 0; iter <= niter; iter++) {
+      for (size_t i = 0; i < ids.size(); i++) {
+        float best = FLT_MAX;
+        for (size_t j = 0; j < k; j++) {
+          float dist = distance(centroid(ids[i]), &centers[j * dim_]);
+          if (dist < best) {
+            best = dist;
+            assign[i] = j;
+          }
+        }
+      }
+      if (iter == niter) break;
+      std::vector<float> sums(k * dim_, 0.0f);
+      counts.assign(k, 0);
+      for (size_t i = 0; i < ids.size(); i++) {
+        const float *c = centroid(ids[i]);
+        float *sum = &sums[assign[i] * dim_];
+        for (size_t d = 0; d < dim_; d++) sum[d] += c[d];
+        counts[assign[i]]++;
+      }
+      for (size_t j = 0; j < k; j++) {
+        if (counts[j] == 0) continue;  // keep the old center
+        for (size_t d = 0; d < dim_; d++) {
+          centers[j * dim_ + d] = sums[j * dim_ + d] / counts[j];
+        }
+      }
+    }
+    std::vector<std::vector<size_t> > parts(k);
+    for (size_t i = 0; i < ids.size(); i++) parts[assign[i]].push_back(ids[i]);
+    size_t nonempty = 0;
+    for (size_t j = 0; j < k; j++) {
+      if (!parts[j].empty()) nonempty++;
+    }
+    if (nonempty < 2) {  // cannot be divided
+      make_leaf(node, ids);
+      return;
+    }
+    size_t first = nodes_.size();
+    for (size_t j = 0; j < k; j++) {
+      if (parts[j].empty()) continue;
+      Node child = { 0, 0, true };
+      nodes_.push_back(child);
+      centers_.insert(centers_.end(), &centers[j * dim_],
+                      &centers[j * dim_] + dim_);
+    }
+    nodes_[node].leaf = false;
+    nodes_[node].begin = first;
+    nodes_[node].end = nodes_.size();
+    size_t child = first;
+    for (size_t j = 0; j < k; j++) {
+      if (parts[j].empty()) continue;
+      build_node(child++, parts[j], branching, leaf_size, niter, seed);
+    }
+  }
+
+  void make_leaf(size_t node, const std::vector<size_t> &ids) {
+    nodes_[node].leaf = true;
+    nodes_[node].begin = items_.size();
+    items_.insert(items_.end(), ids.begin(), ids.end());
+    nodes_[node].end = items_.size();
+  }
+};
+
+} /* namespace bof */
+
+#endif  // BOF_QUANTIZER_H_
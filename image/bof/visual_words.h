@@ -4,11 +4,15 @@
 // Copyright(C) 2010  Mizuki Fujisawa <fujisawa@bayon.cc>
 //
 
+#include <algorithm>
+#include <cmath>
 #include <cstdio>
-#include <fstream>
+#include <map>
 #include <bayon.h>  // bayon library
 #include "descriptor.h"
-#include "util.h"
+#include "descriptor_store.h"
+#include "inverted_index.h"
+#include "quantizer.h"
 
 #ifndef BOF_VISUAL_WORDS_H_
 #define BOF_VISUAL_WORDS_H_
@@ -21,144 +25,202 @@ namespace bof {
 class VisualWords {
  private:
   static const double CLUSTER_LIMIT = 1.5;
-  static const size_t MAX_INDEX     = 100;
-  static const size_t MAX_INDEX_KEY = 20;
+  static const size_t BATCH_SIZE    = 64;  ///< images processed at once
 
   bayon::Analyzer analyzer_;
-  bayon::Classifier classifier_;
+  Quantizer quantizer_;  ///< centroids of clusters
+  size_t max_checks_;    ///< checks of approximate search (0: exact)
 
  public:
-  VisualWords() { }
+  VisualWords() : max_checks_(0) { }
   ~VisualWords() { }
 
-  void save_descriptors(const char *path, std::istream &is,
-                        FeatureDetector &detector) {
-    FILE *fp = fopen(path, "w");
-    if (!fp) {
-      fprintf(stderr, "cannot open file: %s\n", path);
-      exit(1);
-    }
-    std::string line;
-    std::vector<std::vector<float> > features;
-    bof::VisualWords vwd;
-    while (std::getline(is, line)) {
-      features.clear();
-      detector.extract(line.c_str(), features);
-      if (features.empty()) {
-        fprintf(stderr, "[Warning] cannot detect descriptors: %s\n",
-                line.c_str());
-        continue;
-      }
-      for (size_t i = 0; i < features.size(); i++) {
-        fprintf(fp, "%s %zd", line.c_str(), i);
-        for (size_t j = 0; j < features[i].size(); j++) {
-          fprintf(fp, "\t%f", features[i][j]);
+  /**
+   * Assign descriptors to visual words approximately by a tree.
+   * @param max_checks number of centroids compared for a descriptor
+   *                   (0: exact)
+   */
+  void set_approximate(size_t max_checks) {
+    max_checks_ = max_checks;
+  }
+
+  /**
+   * Extract local features of images and store them.
+   * Images without local features are skipped.
+   * @param store descriptor store (create() is called)
+   * @param path path of the store (NULL: in memory)
+   * @param is input stream (a path of an image in each line)
+   * @param detector feature detector
+   */
+  void save_descriptors(DescriptorStore &store, const char *path,
+                        std::istream &is, FeatureDetector &detector) {
+    std::vector<std::string> paths;
+    std::vector<Descriptors> batch;
+    bool created = false;
+    while (read_paths(is, BATCH_SIZE, paths)) {
+      extract_batch(detector, paths, batch);
+      for (size_t k = 0; k < paths.size(); k++) {
+        const Descriptors &features = batch[k];
+        if (features.empty()) {
+          fprintf(stderr, "[Warning] cannot detect descriptors: %s\n",
+                  paths[k].c_str());
+          continue;
+        }
+        if (!created) {
+          if (!store.create(path, features.dim())) {
+            fprintf(stderr, "cannot open file: %s\n", path);
+            exit(1);
+          }
+          created = true;
+        }
+        if (!store.add(paths[k], features)) {
+          fprintf(stderr, "[Error] dimension %ld of descriptors differs from "
+                  "%ld: %s\n", static_cast<long>(features.dim()),
+                  static_cast<long>(store.dim()), paths[k].c_str());
+          exit(1);
         }
-        fprintf(fp, "\n");
       }
     }
-    fclose(fp);
-  }
-
-  void do_clustering(const char *path, double rate) {
-    std::ifstream ifs(path);
-    if (!ifs) {
-      fprintf(stderr, "cannot open file: %s\n", path);
+    if (!created) {
+      fprintf(stderr, "[Error] no descriptors\n");
       exit(1);
     }
-    std::string line;
-    std::vector<std::string> splited;
+    if (!store.finish()) {
+      fprintf(stderr, "[Error] cannot write descriptors: %s\n", path);
+      exit(1);
+    }
+  }
+
+  /**
+   * Cluster descriptors sampled from the store.
+   * @param store descriptor store
+   * @param rate sampling rate of descriptors
+   */
+  void do_clustering(const DescriptorStore &store, double rate) {
     bayon::DocumentId id = 0;
-    while (std::getline(ifs, line)) {
-      if (line.empty() ||  // random skip
-          static_cast<double>(rand()) / RAND_MAX > rate) continue;
-      splited.clear();
-      bof::split_string(line, "\t", splited);
+    for (size_t j = 0; j < store.num_descriptors(); j++) {
+      if (static_cast<double>(rand()) / RAND_MAX > rate) continue;  // random skip
+      const float *descriptor = store.descriptor(j);
       bayon::Document doc(id++);
-      for (size_t i = 1; i < splited.size(); i++) {
-        doc.add_feature(i-1, atof(splited[i].c_str()));
+      for (size_t i = 0; i < store.dim(); i++) {
+        doc.add_feature(i, descriptor[i]);
       }
       analyzer_.add_document(doc);
     }
-    /*  // for debug
-    for (size_t i = 0; i < analyzer_.documents().size(); i++) {
-      bayon::VecHashMap *hmap = analyzer_.documents()[i]->feature()->hash_map();
-      printf("%zd", i);
-      for (bayon::VecHashMap::iterator it = hmap->begin(); it != hmap->end(); ++it) {
-        printf("\t%ld\t%f", it->first, it->second);
-      }
-      printf("\n");
-    }
-    printf("documents: %zd\n", analyzer_.documents().size());
-    printf("Cluster limit: %f\n", CLUSTER_LIMIT);
-    */
     //analyzer_.idf();
     analyzer_.set_eval_limit(CLUSTER_LIMIT);
     analyzer_.do_clustering(bayon::Analyzer::RB);
   }
 
-  void get_bof(const char *path) {
-    std::vector<bayon::Cluster *> clusters = analyzer_.clusters();
-    for (size_t i = 0; i < clusters.size(); i++) {
-      classifier_.add_vector(i, *clusters[i]->centroid_vector());
+  /**
+   * Print bag-of-features of the images in the store.
+   * @param store descriptor store
+   * @param index inverted index from visual words to images (numbered in
+   *              order of output lines) if not NULL
+   */
+  void get_bof(const DescriptorStore &store,
+               vbyte::InvertedIndex *index = NULL) {
+    if (quantizer_.size() == 0) make_codebook(store.dim());
+    for (size_t begin = 0; begin < store.num_images(); begin += BATCH_SIZE) {
+      size_t end = std::min(begin + BATCH_SIZE, store.num_images());
+      print_batch(store, begin, end, index);
     }
-    classifier_.resize_inverted_index(MAX_INDEX);
+    if (index) index->build();
+  }
 
-    std::ifstream ifs(path);
-    if (!ifs) {
-      fprintf(stderr, "cannot open file: %s\n", path);
-      exit(1);
-    }
-    std::string line;
-    std::vector<std::string> splited;
-    std::vector<std::string> splfile;
-    std::string prevfile("");
-    std::map<size_t, size_t> feature;
-    bayon::DocumentId id = 0;
-    while (std::getline(ifs, line)) {
-      if (line.empty()) continue;
-      splited.clear();
-      splfile.clear();
-      bof::split_string(line, "\t", splited);
-      bof::split_string(splited[0], " ", splfile);
-      if (!prevfile.empty() && prevfile != splfile[0]) {
-        printf("%s", prevfile.c_str());
-        for (std::map<size_t, size_t>::iterator it = feature.begin();
-             it != feature.end(); ++it) {
-          printf("\t%zd\t%zd", it->first, it->second);
-        }
-        printf("\n");
-        feature.clear();
+  /**
+   * Assign descriptors of images to visual words in parallel, and print
+   * the bag-of-features in order.
+   * @param store descriptor store
+   * @param begin first image
+   * @param end end of images
+   * @param index inverted index (or NULL)
+   */
+  void print_batch(const DescriptorStore &store, size_t begin, size_t end,
+                   vbyte::InvertedIndex *index) {
+    std::vector<std::map<size_t, size_t> > features(end - begin);
+    int size = static_cast<int>(end - begin);
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int i = 0; i < size; i++) {
+      size_t n = store.size(begin + i);
+      if (n == 0) continue;
+      const float *descriptors = store.descriptors(begin + i);
+      std::vector<float> normalized(descriptors, descriptors + n * store.dim());
+      for (size_t j = 0; j < n; j++) {
+        normalize(&normalized[j * store.dim()], store.dim());
       }
-      prevfile = splfile[0];
-      bayon::Document doc(id++);
-      for (size_t i = 1; i < splited.size(); i++) {
-        doc.add_feature(i-1, atof(splited[i].c_str()));
-      }
-      doc.feature()->normalize();
-      bayon::Classifier::VectorId clid = get_most_similar_cluster(doc);
-      if (feature.find(clid) != feature.end()) {
-        feature[clid]++;
+      std::vector<size_t> words(n);
+      if (max_checks_ > 0) {
+        quantizer_.quantize_approx(&normalized[0], n, max_checks_, &words[0]);
       } else {
-        feature[clid] = 1;
+        quantizer_.quantize(&normalized[0], n, &words[0]);
       }
+      for (size_t j = 0; j < n; j++) features[i][words[j]]++;
+    }
+    for (size_t i = begin; i < end; i++) {
+      print_bof(store.name(i), features[i - begin], i, index);
     }
-    if (!feature.empty()) {
-      printf("%s", prevfile.c_str());
-      for (std::map<size_t, size_t>::iterator it = feature.begin();
-           it != feature.end(); ++it) {
-        printf("\t%zd\t%zd", it->first, it->second);
+  }
+
+  /**
+   * Make the codebook of normalized centroids of clusters, so that the
+   * nearest centroid is the most similar one by cosine.
+   * @param dim dimension of descriptors
+   */
+  void make_codebook(size_t dim) {
+    std::vector<bayon::Cluster *> clusters = analyzer_.clusters();
+    std::vector<float> codebook(clusters.size() * dim, 0.0f);
+    std::vector<float> centroid(dim);
+    for (size_t i = 0; i < clusters.size(); i++) {
+      centroid.assign(dim, 0.0f);
+      bayon::VecHashMap *hmap = clusters[i]->centroid_vector()->hash_map();
+      for (bayon::VecHashMap::iterator it = hmap->begin();
+           it != hmap->end(); ++it) {
+        if (it->first >= 0 && static_cast<size_t>(it->first) < dim) {
+          centroid[it->first] = it->second;
+        }
       }
-      printf("\n");
-      feature.clear();
+      normalize(&centroid[0], dim);
+      std::copy(centroid.begin(), centroid.end(), &codebook[i * dim]);
+    }
+    if (codebook.empty()) {
+      fprintf(stderr, "[Error] no visual words\n");
+      exit(1);
     }
+    quantizer_.set_codebook(&codebook[0], clusters.size(), dim);
+    if (max_checks_ > 0) quantizer_.build_tree();
+  }
+
+  /**
+   * Normalize a vector to unit length.
+   * @param v vector
+   * @param size size of the vector
+   */
+  static void normalize(float *v, size_t size) {
+    double norm = 0.0;
+    for (size_t i = 0; i < size; i++) norm += v[i] * v[i];
+    norm = sqrt(norm);
+    if (norm == 0) return;
+    for (size_t i = 0; i < size; i++) v[i] /= norm;
   }
 
-  bayon::Classifier::VectorId get_most_similar_cluster(
-    const bayon::Document &doc) {
-    std::vector<std::pair<bayon::Classifier::VectorId, double> > pairs;
-    classifier_.similar_vectors(MAX_INDEX_KEY, *doc.feature(), pairs);
-    return pairs[0].first;
+  /**
+   * Print bag-of-features of an image, and add it to the index.
+   * @param name name of the image
+   * @param feature counts of visual words
+   * @param image_id id of the image in the index
+   * @param index inverted index (or NULL)
+   */
+  void print_bof(const std::string &name,
+                 const std::map<size_t, size_t> &feature, size_t image_id,
+                 vbyte::InvertedIndex *index) {
+    printf("%s", name.c_str());
+    for (std::map<size_t, size_t>::const_iterator it = feature.begin();
+         it != feature.end(); ++it) {
+      printf("\t%zd\t%zd", it->first, it->second);
+      if (index) index->add(it->first, image_id);
+    }
+    printf("\n");
   }
 };
 
@@ -1,20 +1,47 @@
 //
 // Calculate the distance between images using Earth Mover's Distance(EMD)
 //
+// Usage:
+//   % compare_emd imgfile txtfile
+//   % compare_emd imgfile imgfile1 imgfile2 ..
+//   % compare_emd index txtfile indexfile [features]
+//   % compare_emd query indexfile imgfile [k]
+//
+// "index" computes the signatures (Luv histograms) of the images listed in
+// txtfile once and saves them in a feature store (../feature_store.h).
+// features ("emd,hist,hog") adds other features for compare_hist and
+// calc_hog_distance.  "query" prints the k (default 10) images
+// in the index nearest to imgfile.  The distance between the centroids of
+// two signatures is a lower bound of their EMD, so candidates are tried in
+// order of it and the full EMD is skipped once the bound exceeds the k-th
+// distance.
+//
 // Build:
-// % g++ -I /usr/local/include/opencv -lcv -lhighgui -Wall -O2 -fopenmp compare_emd.cc -o compare_emd
+// % g++ -I.. -I /usr/local/include/opencv -lcv -lcvaux -lhighgui -Wall -O2 -fopenmp compare_emd.cc -o compare_emd
 //
 // Requirement:
 //  - OpenCV
 //  - OpenMP
 //
 
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <utility>
+#include <vector>
 #include <cv.h>
 #include <highgui.h>
 #include <omp.h>
+#include "feature_store.h"
+
+// candidates tried at once by rank()
+const size_t CHUNK_SIZE = 256;
 
 std::string get_extension(const std::string filename) {
   size_t index = filename.rfind('.', filename.size());
@@ -24,158 +51,146 @@ std::string get_extension(const std::string filename) {
   return "";
 }
 
-class EmdCalc {
- private:
-  virtual CvMat *get_signature(const cv::MatND &hist) = 0;
-  virtual void get_histogram(const cv::Mat &img, cv::MatND &hist) = 0;
-
- public:
-  void print_emd(const cv::Mat &target, const std::vector<std::string> &filenames) {
-    cv::MatND hist_target;
-    get_histogram(target, hist_target);
-    CvMat *sig_target = get_signature(hist_target);
-
-    int size = static_cast<int>(filenames.size());
-    #pragma omp parallel for
-    for (int i = 0; i < size; i++) {
-      cv::Mat img = cv::imread(filenames[i]);
-      if (!img.data) {
-        fprintf(stderr, "file open error: %s\n", filenames[i].c_str());
-        continue;
-      }
-      cv::MatND hist;
-      get_histogram(img, hist);
-      CvMat *sig = get_signature(hist);
-      if (!sig) {
-        fprintf(stderr, "cannot get signature: %s", filenames[i].c_str());
-        continue;
-      }
+// The k images (0: all) nearest to target by EMD, in order of distance.
+void rank(const imgfeat::ImageFeatures &target,
+          const imgfeat::FeatureStore &store, size_t k,
+          std::vector<imgfeat::Score> &results) {
+  results.clear();
+  CvMat sig_target = target.signature();
+
+  // lower bounds: distances of centroids
+  std::vector<imgfeat::Score> bounds(store.size());
+  for (size_t i = 0; i < store.size(); i++) {
+    const float *centroid = store.centroid(i);
+    float dist = 0.0f;
+    for (int c = 0; c < imgfeat::EMD_COLS - 1; c++) {
+      dist += (target.centroid[c] - centroid[c]) *
+              (target.centroid[c] - centroid[c]);
+    }
+    bounds[i] = imgfeat::Score(i, sqrt(dist));
+  }
+  std::sort(bounds.begin(), bounds.end(), imgfeat::less_score);
+
+  // results are kept as a max heap of k distances
+  std::vector<float> emds;
+  for (size_t begin = 0; begin < bounds.size(); begin += CHUNK_SIZE) {
+    float threshold = (k > 0 && results.size() == k) ?
+                      results.front().second : FLT_MAX;
+    if (bounds[begin].second >= threshold) break;
+    size_t end = std::min(begin + CHUNK_SIZE, bounds.size());
+    emds.assign(end - begin, -1.0f);
+    int size = static_cast<int>(end - begin);
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int j = 0; j < size; j++) {
+      if (bounds[begin + j].second >= threshold) continue;
+      size_t i = bounds[begin + j].first;
+      CvMat sig = store.signature(i);
       try {
-        float emd = cvCalcEMD2(sig_target, sig, CV_DIST_L2);
-        printf("%s\t%f\n", filenames[i].c_str(), emd);
+        emds[j] = cvCalcEMD2(&sig_target, &sig, CV_DIST_L2);
       } catch (cv::Exception e) {
-        fprintf(stderr, "error: %s : %s:\n", e.err.c_str(), filenames[i].c_str());
-        continue;
+        fprintf(stderr, "error: %s : %s:\n", e.err.c_str(), store.name(i));
       }
-      cvReleaseMat(&sig);
-      fprintf(stderr, "%d\t%s\n", i+1, filenames[i].c_str());
     }
-    cvReleaseMat(&sig_target);
-  }
-};
-
-class EmdCalcHsv : public EmdCalc{
- private:
-  int h_bins;
-  int s_bins;
-
-  CvMat *get_signature(const cv::MatND &hist) {
-    CvMat *sig = cvCreateMat(h_bins * s_bins, 3, CV_32FC1);
-    for (int h = 0; h < h_bins; h++) {
-      for (int s = 0; s < s_bins; s++) {
-        float bin_val = hist.at<float>(h, s);
-        cvSet2D(sig, h * s_bins + s, 0, cvScalar(bin_val));
-        cvSet2D(sig, h * s_bins + s, 1, cvScalar(h));
-        cvSet2D(sig, h * s_bins + s, 2, cvScalar(s));
+    for (size_t j = 0; j < emds.size(); j++) {
+      if (emds[j] < 0) continue;
+      imgfeat::Score result(bounds[begin + j].first, emds[j]);
+      if (k == 0 || results.size() < k) {
+        results.push_back(result);
+        std::push_heap(results.begin(), results.end(), imgfeat::less_score);
+      } else if (imgfeat::less_score(result, results.front())) {
+        std::pop_heap(results.begin(), results.end(), imgfeat::less_score);
+        results.back() = result;
+        std::push_heap(results.begin(), results.end(), imgfeat::less_score);
       }
     }
-    return sig;
   }
+  std::sort_heap(results.begin(), results.end(), imgfeat::less_score);
+}
 
-  void get_histogram(const cv::Mat &img, cv::MatND &hist) {
-    cv::Mat hsv;
-    cvtColor(img, hsv, CV_BGR2HSV);
-    int histSize[] = {h_bins, s_bins};
-    float hranges[] = {0, 180};
-    float sranges[] = {0, 255};
-    const float *ranges[] = {hranges, sranges};
-    int channels[] = {0, 1};
-
-    cv::calcHist(&img, 1, channels, cv::Mat(),
-                 hist, 2, histSize, ranges, true, false);
-    cv::normalize(hist, hist, 1, 0, cv::NORM_L1);
+// Print the k images (0: all) nearest to target.
+void print_emd(const char *target_path, const imgfeat::FeatureStore &store,
+               size_t k) {
+  imgfeat::ImageFeatures target;
+  if (!store.extract(target_path, imgfeat::EMD, target)) {
+    fprintf(stderr, "file open error: %s\n", target_path);
+    exit(1);
   }
-
- public:
-  EmdCalcHsv(int h_bins, int s_bins) : h_bins(h_bins), s_bins(s_bins) { }
-  ~EmdCalcHsv() { }
-};
-
-class EmdCalcLuv : public EmdCalc {
- private:
-  int l_bins;
-  int u_bins;
-  int v_bins;
-
-  void get_histogram(const cv::Mat &img, cv::MatND &hist) {
-    cv::Mat luv;
-    cvtColor(img, luv, CV_BGR2Luv);
-    int histSize[] = {l_bins, u_bins, v_bins};
-    float l_ranges[] = {0, 255};
-    float u_ranges[] = {0, 255};
-    float v_ranges[] = {0, 255};
-    const float *ranges[] = {l_ranges, u_ranges, v_ranges};
-    int channels[] = {0, 1, 2};
-
-    cv::calcHist(&img, 1, channels, cv::Mat(),
-                 hist, 3, histSize, ranges, true, false);
-    cv::normalize(hist, hist, 1, 0, cv::NORM_L1);
+  std::vector<imgfeat::Score> results;
+  rank(target, store, k, results);
+  for (size_t i = 0; i < results.size(); i++) {
+    printf("%s\t%f\n", store.name(results[i].first), results[i].second);
   }
+}
 
-  CvMat *get_signature(const cv::MatND &hist) {
-    CvMat *sig = cvCreateMat(l_bins * u_bins * v_bins, 4, CV_32FC1);
-    for (int l = 0; l < l_bins; l++) {
-      for (int u = 0; u < u_bins; u++) {
-        for (int v = 0; v < v_bins; v++) {
-          float bin_val = hist.at<float>(l, u, v);
-          cvSet2D(sig, l * u_bins * v_bins + u * v_bins + v, 0, cvScalar(bin_val));
-          cvSet2D(sig, l * u_bins * v_bins + u * v_bins + v, 1, cvScalar(l));
-          cvSet2D(sig, l * u_bins * v_bins + u * v_bins + v, 2, cvScalar(u));
-          cvSet2D(sig, l * u_bins * v_bins + u * v_bins + v, 3, cvScalar(v));
-        }
-      }
-    }
-    return sig;
+static void read_filenames(const char *path,
+                           std::vector<std::string> &filenames) {
+  std::ifstream ifs(path);
+  if (!ifs) {
+    fprintf(stderr, "cannot open %s\n", path);
+    exit(1);
+  }
+  std::string line;
+  while (std::getline(ifs, line)) {
+    filenames.push_back(line);
   }
+}
 
- public:
-  EmdCalcLuv(int l_bins, int u_bins, int v_bins)
-    : l_bins(l_bins), u_bins(u_bins), v_bins(v_bins) {}
-  ~EmdCalcLuv() { }
-};
+static void usage(const char *progname) {
+  fprintf(stderr, "Usage: %s imgfile txtfile\n", progname);
+  fprintf(stderr, "Usage: %s imgfile imgfile1 imgfile2 ..\n", progname);
+  fprintf(stderr, "Usage: %s index txtfile indexfile [features]\n", progname);
+  fprintf(stderr, "Usage: %s query indexfile imgfile [k]\n", progname);
+  exit(1);
+}
 
 int main(int argc, char **argv) {
-  if (argc < 3) {
-    fprintf(stderr, "Usage: %s imgfile txtfile\n", argv[0]);
-    fprintf(stderr, "Usage: %s imgfile imgfile1 imgfile2 ..\n", argv[0]);
-    exit(1);
+  if (argc < 3) usage(argv[0]);
+
+  imgfeat::FeatureStore store;
+  if (!strcmp(argv[1], "index")) {
+    if (argc != 4 && argc != 5) usage(argv[0]);
+    int features = (argc == 5) ? imgfeat::parse_features(argv[4]) : imgfeat::EMD;
+    if (!(features & imgfeat::EMD)) {
+      fprintf(stderr, "invalid features: %s\n", argv[4]);
+      exit(1);
+    }
+    std::vector<std::string> filenames;
+    read_filenames(argv[2], filenames);
+    if (!store.create(argv[3], features)) {
+      fprintf(stderr, "cannot open %s\n", argv[3]);
+      exit(1);
+    }
+    store.add_images(filenames);
+    if (!store.finish()) {
+      fprintf(stderr, "cannot write %s\n", argv[3]);
+      exit(1);
+    }
+    fprintf(stderr, "%zu images\n", store.size());
+    return 0;
   }
-  cv::Mat target = cv::imread(argv[1]);
-  if (!target.data) {
-    fprintf(stderr, "file open error: %s\n", argv[1]);
-    exit(1);
+
+  if (!strcmp(argv[1], "query")) {
+    if (argc != 4 && argc != 5) usage(argv[0]);
+    if (!store.open(argv[2]) || !store.has(imgfeat::EMD)) {
+      fprintf(stderr, "invalid index: %s\n", argv[2]);
+      exit(1);
+    }
+    print_emd(argv[3], store, (argc == 5) ? atoi(argv[4]) : 10);
+    return 0;
   }
+
   std::vector<std::string> filenames;
   if (get_extension(argv[2]) == "txt") {
-    std::ifstream ifs(argv[2]);
-    if (!ifs) {
-      fprintf(stderr, "cannot open %s\n", argv[2]);
-      exit(1);
-    }
-    std::string line;
-    while (std::getline(ifs, line)) {
-      filenames.push_back(line);
-    }
+    read_filenames(argv[2], filenames);
   } else {
     for (int i = 2; i < argc; i++) {
       filenames.push_back(argv[i]);
     }
   }
-
-  //EmdCalcHsv calc(6, 6);
-  //EmdCalcHsv calc(30, 32);
-  EmdCalcLuv calc(6, 6, 6);
-  calc.print_emd(target, filenames);
+  store.create(NULL, imgfeat::EMD);
+  store.add_images(filenames);
+  store.finish();
+  print_emd(argv[1], store, 0);
 
   return 0;
 }
@@ -0,0 +1,495 @@
+//
+// Feature store of images shared by compare_hist, calc_hog_distance and
+// compare_emd
+//
+// Each image is decoded once and all the configured features are extracted
+// from it in one pass (images of a batch in parallel):
+//   HIST: HSV histogram (30 x 32 bins), stored as the square roots of the
+//         L1-normalized bins, so that the Bhattacharyya coefficient of two
+//         histograms is an inner product
+//   HOG:  HOG descriptor (default cv::HOGDescriptor), L2-normalized, so that
+//         the cosine of two descriptors is an inner product
+//   EMD:  signature of the Luv histogram (6 x 6 x 6 bins) for cvCalcEMD2,
+//         the rows (weight, l, u, v) of non-empty bins, and their centroid
+//
+// The store is kept in memory or in a file read by mmap:
+//   header:  magic, features, number of images, dimension of HIST and HOG,
+//            columns and rows of EMD signatures, bytes of names (uint64_t)
+//   records: HIST, HOG and EMD centroid of each image (float)
+//   offsets: first EMD row of each image and the end (uint64_t)
+//   rows:    EMD rows of all images (float)
+//   names:   names of images (terminated by '\0')
+// Each section starts at a multiple of 8 bytes.
+//
+// Usage:
+//   imgfeat::FeatureStore store;
+//   store.create(path, imgfeat::HIST | imgfeat::HOG);  // path NULL: memory
+//   store.add_images(paths);
+//   store.finish();  // then readable (same as open(path))
+//
+
+#ifndef IMGFEAT_FEATURE_STORE_H_
+#define IMGFEAT_FEATURE_STORE_H_
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+#include <cv.h>
+#include <cvaux.h>
+#include <highgui.h>
+
+namespace imgfeat {
+
+// features of images
+enum Feature {
+  HIST = 1,
+  HOG  = 2,
+  EMD  = 4
+};
+
+const uint64_t STORE_MAGIC = 0x3154414546474d49ULL;  // magic number of files
+const int HIST_H_BINS = 30;     // bins of hue
+const int HIST_S_BINS = 32;     // bins of saturation
+const int EMD_BINS    = 6;      // bins of each channel of Luv
+const int EMD_COLS    = 4;      // weight, l, u, v
+const size_t BATCH_SIZE = 256;  // images decoded at once
+
+// Parse features separated by commas ("hist,hog,emd").  Return 0 on error.
+inline int parse_features(const std::string &s) {
+  int features = 0;
+  size_t begin = 0;
+  while (begin <= s.size()) {
+    size_t end = s.find(',', begin);
+    if (end == std::string::npos) end = s.size();
+    std::string name = s.substr(begin, end - begin);
+    if (name == "hist") {
+      features |= HIST;
+    } else if (name == "hog") {
+      features |= HOG;
+    } else if (name == "emd") {
+      features |= EMD;
+    } else {
+      return 0;
+    }
+    begin = end + 1;
+  }
+  return features;
+}
+
+// inner product with independent partial sums, so that the compiler can
+// vectorize it
+inline float dot(const float *vec1, const float *vec2, size_t size) {
+  float sums[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    for (size_t k = 0; k < 8; k++) sums[k] += vec1[i + k] * vec2[i + k];
+  }
+  float sum = 0;
+  for (; i < size; i++) sum += vec1[i] * vec2[i];
+  for (size_t k = 0; k < 8; k++) sum += sums[k];
+  return sum;
+}
+
+// Bhattacharyya distance (as cv::compareHist) of square roots of
+// L1-normalized histograms
+inline float bhattacharyya(const float *hist1, const float *hist2,
+                           size_t size) {
+  float coef = dot(hist1, hist2, size);
+  return (coef < 1.0f) ? sqrt(1.0f - coef) : 0.0f;
+}
+
+inline void normalize(std::vector<float> &vec) {
+  double nrm = 0.0;
+  for (size_t i = 0; i < vec.size(); i++) nrm += vec[i] * vec[i];
+  nrm = sqrt(nrm);
+  if (!nrm) return;
+  for (size_t i = 0; i < vec.size(); i++) vec[i] /= nrm;
+}
+
+// (image, score)
+typedef std::pair<size_t, float> Score;
+
+inline bool greater_score(const Score &left, const Score &right) {
+  if (left.second != right.second) return left.second > right.second;
+  return left.first < right.first;
+}
+
+inline bool less_score(const Score &left, const Score &right) {
+  if (left.second != right.second) return left.second < right.second;
+  return left.first < right.first;
+}
+
+// Keep the k best scores (0: all) in order, higher or lower first.
+inline void select_top(std::vector<Score> &scores, size_t k,
+                       bool higher_first) {
+  if (k == 0 || k > scores.size()) k = scores.size();
+  std::partial_sort(scores.begin(), scores.begin() + k, scores.end(),
+                    higher_first ? greater_score : less_score);
+  scores.resize(k);
+}
+
+inline void get_histogram_hsv(const cv::Mat &img, cv::MatND &hist) {
+  cv::Mat hsv;
+  cvtColor(img, hsv, CV_BGR2HSV);
+  int histSize[] = {HIST_H_BINS, HIST_S_BINS};
+  float hranges[] = {0, 180};
+  float sranges[] = {0, 256};
+  const float *ranges[] = {hranges, sranges};
+  int channels[] = {0, 1};
+
+  cv::calcHist(&img, 1, channels, cv::Mat(),
+               hist, 2, histSize, ranges, true, false);
+  cv::normalize(hist, hist, 1, 0, cv::NORM_L1);
+}
+
+inline void get_histogram_luv(const cv::Mat &img, cv::MatND &hist) {
+  cv::Mat luv;
+  cvtColor(img, luv, CV_BGR2Luv);
+  int histSize[] = {EMD_BINS, EMD_BINS, EMD_BINS};
+  float l_ranges[] = {0, 255};
+  float u_ranges[] = {0, 255};
+  float v_ranges[] = {0, 255};
+  const float *ranges[] = {l_ranges, u_ranges, v_ranges};
+  int channels[] = {0, 1, 2};
+
+  cv::calcHist(&img, 1, channels, cv::Mat(),
+               hist, 3, histSize, ranges, true, false);
+  cv::normalize(hist, hist, 1, 0, cv::NORM_L1);
+}
+
+inline void calc_hog(const cv::HOGDescriptor &hog, const cv::Mat &img,
+                     std::vector<float> &descriptors) {
+  cv::Mat resized;
+  cv::resize(img, resized, hog.winSize);
+  hog.compute(resized, descriptors);
+}
+
+// features of an image
+struct ImageFeatures {
+  std::vector<float> hist;      // square roots of the histogram
+  std::vector<float> hog;       // normalized HOG descriptor
+  std::vector<float> rows;      // EMD signature (EMD_COLS values each)
+  std::vector<float> centroid;  // centroid of the EMD signature
+
+  int num_rows() const { return static_cast<int>(rows.size() / EMD_COLS); }
+
+  // matrix header of the EMD signature
+  CvMat signature() const {
+    return cvMat(num_rows(), EMD_COLS, CV_32FC1,
+                 const_cast<float *>(rows.empty() ? NULL : &rows[0]));
+  }
+};
+
+class FeatureStore {
+ private:
+  cv::HOGDescriptor hog_;
+  int features_;
+  size_t hist_dim_;
+  size_t hog_dim_;
+  size_t stride_;                      // values of a record
+  std::string path_;                   // path of the file (empty: memory)
+  FILE *fp_;                           // file being written
+  bool ok_;                            // true unless writing failed
+  std::vector<float> record_buffer_;   // records kept in memory
+  std::vector<float> row_buffer_;      // EMD rows kept in memory
+  std::vector<uint64_t> offsets_;      // first EMD row of each image
+  std::vector<uint64_t> name_offsets_; // first byte of each name
+  std::string names_;
+  const float *records_;               // records (mmap or record_buffer_)
+  const float *rows_;                  // EMD rows (mmap or row_buffer_)
+  void *map_;
+  size_t map_size_;
+
+  template <typename T>
+  bool write_array(const T *array, size_t size) {
+    return size == 0 || fwrite(array, sizeof(T), size, fp_) == size;
+  }
+
+  bool write_padding() {
+    long pos = ftell(fp_);
+    char padding[8] = { 0 };
+    return pos >= 0 && write_array(padding, (8 - pos % 8) % 8);
+  }
+
+  static size_t align(size_t offset) { return (offset + 7) / 8 * 8; }
+
+  void set_features(int features, size_t hist_dim, size_t hog_dim) {
+    features_ = features;
+    hist_dim_ = (features & HIST) ? hist_dim : 0;
+    hog_dim_ = (features & HOG) ? hog_dim : 0;
+    stride_ = hist_dim_ + hog_dim_ + ((features & EMD) ? EMD_COLS - 1 : 0);
+  }
+
+  void clear_table() {
+    offsets_.assign(1, 0);
+    name_offsets_.assign(1, 0);
+    names_.clear();
+  }
+
+  void add(const std::string &name, const ImageFeatures &image) {
+    std::vector<float> record;
+    record.reserve(stride_);
+    if (features_ & HIST) {
+      record.insert(record.end(), image.hist.begin(), image.hist.end());
+    }
+    if (features_ & HOG) {
+      record.insert(record.end(), image.hog.begin(), image.hog.end());
+    }
+    if (features_ & EMD) {
+      record.insert(record.end(), image.centroid.begin(), image.centroid.end());
+      row_buffer_.insert(row_buffer_.end(), image.rows.begin(), image.rows.end());
+    }
+    if (fp_) {
+      ok_ = ok_ && write_array(&record[0], record.size());
+    } else {
+      record_buffer_.insert(record_buffer_.end(), record.begin(), record.end());
+    }
+    offsets_.push_back(row_buffer_.size() / EMD_COLS);
+    names_.append(name.c_str(), name.size() + 1);
+    name_offsets_.push_back(names_.size());
+  }
+
+ public:
+  FeatureStore()
+    : features_(0), hist_dim_(0), hog_dim_(0), stride_(0), fp_(NULL),
+      ok_(true), records_(NULL), rows_(NULL), map_(NULL), map_size_(0) {
+    clear_table();
+  }
+  ~FeatureStore() { close(); }
+
+  // Start adding images.  Return false if the file cannot be opened.
+  bool create(const char *path, int features) {
+    close();
+    set_features(features, HIST_H_BINS * HIST_S_BINS,
+                 hog_.getDescriptorSize());
+    ok_ = true;
+    if (path == NULL) return true;
+    path_ = path;
+    fp_ = fopen(path, "wb");
+    if (fp_ == NULL) return false;
+    uint64_t header[8] = { 0 };
+    ok_ = write_array(header, 8);
+    return ok_;
+  }
+
+  // Extract features of an image.  Return false on error.
+  bool extract(const cv::Mat &img, int features, ImageFeatures &image) const {
+    if (!img.data) return false;
+    if (features & HIST) {
+      cv::MatND hist;
+      get_histogram_hsv(img, hist);
+      image.hist.resize(HIST_H_BINS * HIST_S_BINS);
+      for (int h = 0; h < HIST_H_BINS; h++) {
+        for (int s = 0; s < HIST_S_BINS; s++) {
+          image.hist[h * HIST_S_BINS + s] = sqrt(hist.at<float>(h, s));
+        }
+      }
+    }
+    if (features & HOG) {
+      calc_hog(hog_, img, image.hog);
+      if (image.hog.size() != hog_.getDescriptorSize()) return false;
+      normalize(image.hog);
+    }
+    if (features & EMD) {
+      cv::MatND hist;
+      get_histogram_luv(img, hist);
+      image.rows.clear();
+      image.centroid.assign(EMD_COLS - 1, 0.0f);
+      double total = 0.0;
+      for (int l = 0; l < EMD_BINS; l++) {
+        for (int u = 0; u < EMD_BINS; u++) {
+          for (int v = 0; v < EMD_BINS; v++) {
+            float bin_val = hist.at<float>(l, u, v);
+            if (bin_val <= 0) continue;
+            image.rows.push_back(bin_val);
+            image.rows.push_back(l);
+            image.rows.push_back(u);
+            image.rows.push_back(v);
+            image.centroid[0] += bin_val * l;
+            image.centroid[1] += bin_val * u;
+            image.centroid[2] += bin_val * v;
+            total += bin_val;
+          }
+        }
+      }
+      if (image.rows.empty()) return false;
+      for (int c = 0; c < EMD_COLS - 1; c++) image.centroid[c] /= total;
+    }
+    return true;
+  }
+
+  bool extract(const std::string &path, int features,
+               ImageFeatures &image) const {
+    cv::Mat img = cv::imread(path);
+    return extract(img, features, image);
+  }
+
+  // Decode images in parallel and add their features in order.
+  void add_images(const std::vector<std::string> &paths) {
+    std::vector<ImageFeatures> batch;
+    std::vector<char> ok;
+    for (size_t begin = 0; begin < paths.size(); begin += BATCH_SIZE) {
+      size_t end = std::min(begin + BATCH_SIZE, paths.size());
+      batch.assign(end - begin, ImageFeatures());
+      ok.assign(end - begin, 0);
+      int size = static_cast<int>(end - begin);
+      #pragma omp parallel for schedule(dynamic, 1)
+      for (int i = 0; i < size; i++) {
+        ok[i] = extract(paths[begin + i], features_, batch[i]);
+      }
+      for (size_t i = 0; i < batch.size(); i++) {
+        if (!ok[i]) {
+          fprintf(stderr, "file open error: %s\n", paths[begin + i].c_str());
+          continue;
+        }
+        add(paths[begin + i], batch[i]);
+      }
+    }
+  }
+
+  // Finish adding images and make the store readable.
+  // Return false if writing or reading the file failed.
+  bool finish() {
+    if (fp_ == NULL) {
+      records_ = record_buffer_.empty() ? NULL : &record_buffer_[0];
+      rows_ = row_buffer_.empty() ? NULL : &row_buffer_[0];
+      return ok_;
+    }
+    uint64_t header[8] = { STORE_MAGIC, static_cast<uint64_t>(features_),
+                           size(), hist_dim_, hog_dim_, EMD_COLS,
+                           offsets_.back(), names_.size() };
+    ok_ = ok_ && write_padding() &&
+          write_array(&offsets_[0], offsets_.size()) &&
+          write_array(row_buffer_.empty() ? NULL : &row_buffer_[0],
+                      row_buffer_.size()) &&
+          write_padding() &&
+          write_array(names_.data(), names_.size()) &&
+          fseek(fp_, 0, SEEK_SET) == 0 &&
+          write_array(header, 8);
+    ok_ = (fclose(fp_) == 0) && ok_;
+    fp_ = NULL;
+    std::string path(path_);  // open() clears path_
+    return ok_ && open(path.c_str());
+  }
+
+  // Open a file written by finish().  Return false if it is not a store.
+  bool open(const char *path) {
+    close();
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 8 * 8) {
+      ::close(fd);
+      return false;
+    }
+    map_size_ = st.st_size;
+    map_ = mmap(NULL, map_size_, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map_ == MAP_FAILED) {
+      map_ = NULL;
+      return false;
+    }
+    const char *bytes = static_cast<const char *>(map_);
+    const uint64_t *header = reinterpret_cast<const uint64_t *>(bytes);
+    uint64_t size = header[2];
+    int features = static_cast<int>(header[1]);
+    // bound the counts by the file size first, so that the sections below
+    // cannot overflow
+    uint64_t max_count = map_size_ / sizeof(float);
+    if (header[0] != STORE_MAGIC || header[5] != EMD_COLS ||
+        (features & ~(HIST | HOG | EMD)) != 0 ||
+        ((features & HIST) &&
+         header[3] != static_cast<uint64_t>(HIST_H_BINS * HIST_S_BINS)) ||
+        ((features & HOG) && header[4] != hog_.getDescriptorSize()) ||
+        size > max_count || header[6] > max_count || header[7] > map_size_) {
+      close();
+      return false;
+    }
+    set_features(features, header[3], header[4]);
+    size_t records = 8 * 8;
+    size_t offsets = align(records + size * stride_ * sizeof(float));
+    size_t rows = offsets + (size + 1) * sizeof(uint64_t);
+    size_t names = align(rows + header[6] * EMD_COLS * sizeof(float));
+    if (names + header[7] > map_size_) {
+      close();
+      return false;
+    }
+    records_ = reinterpret_cast<const float *>(bytes + records);
+    const uint64_t *offset_table =
+      reinterpret_cast<const uint64_t *>(bytes + offsets);
+    offsets_.assign(offset_table, offset_table + size + 1);
+    // EMD offsets are monotonic from 0 to the number of rows
+    if (offsets_[0] != 0 || offsets_[size] != header[6]) {
+      close();
+      return false;
+    }
+    rows_ = reinterpret_cast<const float *>(bytes + rows);
+    names_.assign(bytes + names, header[7]);
+    name_offsets_.assign(1, 0);
+    for (size_t i = 0; i < size; i++) {
+      size_t end = names_.find('\0', name_offsets_.back());
+      if (end == std::string::npos || offsets_[i+1] < offsets_[i] ||
+          offsets_[i+1] > header[6]) {
+        close();
+        return false;
+      }
+      name_offsets_.push_back(end + 1);
+    }
+    path_ = path;
+    return true;
+  }
+
+  // Release the store (the file is not removed).
+  void close() {
+    if (fp_) fclose(fp_);
+    fp_ = NULL;
+    if (map_) munmap(map_, map_size_);
+    map_ = NULL;
+    map_size_ = 0;
+    records_ = NULL;
+    rows_ = NULL;
+    path_.clear();
+    std::vector<float>().swap(record_buffer_);
+    std::vector<float>().swap(row_buffer_);
+    clear_table();
+  }
+
+  int features() const { return features_; }
+  bool has(int features) const { return (features_ & features) == features; }
+  size_t size() const { return offsets_.size() - 1; }
+  const char *name(size_t i) const { return names_.data() + name_offsets_[i]; }
+  size_t hist_dim() const { return hist_dim_; }
+  size_t hog_dim() const { return hog_dim_; }
+
+  // square roots of the histogram of image i
+  const float *hist(size_t i) const { return records_ + i * stride_; }
+
+  // normalized HOG descriptor of image i
+  const float *hog(size_t i) const {
+    return records_ + i * stride_ + hist_dim_;
+  }
+
+  // centroid of the EMD signature of image i
+  const float *centroid(size_t i) const {
+    return records_ + i * stride_ + hist_dim_ + hog_dim_;
+  }
+
+  // matrix header of the EMD signature of image i
+  CvMat signature(size_t i) const {
+    return cvMat(static_cast<int>(offsets_[i+1] - offsets_[i]), EMD_COLS,
+                 CV_32FC1, const_cast<float *>(rows_ + offsets_[i] * EMD_COLS));
+  }
+};
+
+} /* namespace imgfeat */
+
+#endif  // IMGFEAT_FEATURE_STORE_H_
@@ -1,76 +1,41 @@
+//
+// Similarity of images by color histograms and HOG descriptors
+//
+// Usage:
+//   % compare_hist imgfile txtfile
+//   % compare_hist index txtfile indexfile [features]
+//   % compare_hist query indexfile imgfile [k [survivors]]
+//
+// The similarity is 0.3 * (1 - Bhattacharyya distance of HSV histograms)
+// + 1.5 * (cosine of HOG descriptors).  The first form prints the
+// similarity of each image of txtfile to imgfile in order of txtfile,
+// decoding a batch of images at once without a store.  "index" extracts the features of
+// the images listed in txtfile once into a feature store
+// (../feature_store.h); features ("hist,hog,emd") adds the EMD signatures
+// for compare_emd.  "query" ranks all images by the histogram first, and
+// re-ranks the survivors (default max(100, 10 * k)) by the similarity.
+//
+// Build:
+//   % g++ -Wall -O3 -fopenmp -I.. -I/usr/include/opencv compare_hist.cc -o compare_hist -lcv -lcvaux -lhighgui
+//
+
+#include <algorithm>
 #include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <string>
+#include <vector>
 #include <cv.h>
 #include <cvaux.h>
 #include <highgui.h>
+#include "feature_store.h"
 
-double euclid_distance(const std::vector<float> &vec1,
-                       const std::vector<float> &vec2) {
-  assert(vec1.size() == vec2.size());
-  double dist = 0.0;
-  for (size_t i = 0; i < vec1.size(); i++) {
-    dist += (vec1[i] - vec2[i]) * (vec1[i] - vec2[i]);
-  }
-  return sqrt(dist);
-}
-
-double norm(const std::vector<float> &vec) {
-  double nrm = 0.0;
-  for (size_t i = 0; i < vec.size(); i++) {
-    nrm += vec[i] * vec[i];
-  }
-  return sqrt(nrm);
-}
-
-double inner_product(const std::vector<float> &vec1,
-                     const std::vector<float> &vec2) {
-  assert(vec1.size() == vec2.size());
-  double prod = 0.0;
-  for (size_t i = 0; i < vec1.size(); i++) {
-    prod += vec1[i] * vec2[i];
-  }
-  return prod;
-}
-
-double cosine(const std::vector<float> &vec1,
-              const std::vector<float> &vec2) {
-  assert(vec1.size() == vec2.size());
-  double nrm1 = norm(vec1);
-  double nrm2 = norm(vec2);
-  if (!nrm1 || !nrm2) return 0;
-  double prod = inner_product(vec1, vec2);
-  return prod / (nrm1 * nrm2);
-}
-
-double cosine_distance(const std::vector<float> &vec1,
-                       const std::vector<float> &vec2) {
-  return 1.0 - cosine(vec1, vec2);
-}
-
-void calc_hog(const cv::HOGDescriptor &hog, const cv::Mat &img,
-                std::vector<float> &descriptors) {
-  cv::Mat resized;
-//  printf("%d\t%d\n", hog.winSize.width, hog.winSize.height);
-  cv::resize(img, resized, hog.winSize);
-  hog.compute(resized, descriptors);
-}
-
-void get_histogram_hsv(const cv::Mat &img, cv::MatND &hist) {
-  cv::Mat hsv;
-  cvtColor(img, hsv, CV_BGR2HSV);
-  int hbins = 30;
-  int sbins = 32;
-  int histSize[] = {hbins, sbins};
-  float hranges[] = {0, 180};
-  float sranges[] = {0, 256};
-  const float *ranges[] = {hranges, sranges};
-  int channels[] = {0, 1};
-
-  cv::calcHist(&img, 1, channels, cv::Mat(),
-               hist, 2, histSize, ranges, true, false);
-  cv::normalize(hist, hist, 1, 0, cv::NORM_L1);
-}
+// weights of the similarity
+const double HIST_WEIGHT = 0.3;
+const double HOG_WEIGHT  = 1.5;
 
 void get_histogram_rgb(const cv::Mat &img, cv::MatND &hist) {
   int n = 16;
@@ -94,7 +59,7 @@ void compare_hist_hsv(int argc, char **argv) {
     exit(1);
   }
   cv::MatND hist_target;
-  get_histogram_hsv(target, hist_target);
+  imgfeat::get_histogram_hsv(target, hist_target);
 
   std::ifstream ifs(argv[2]);
   if (!ifs) {
@@ -110,57 +75,172 @@ void compare_hist_hsv(int argc, char **argv) {
     }
     cv::MatND hist;
     //get_histogram_rgb(img, hist);
-    get_histogram_hsv(img, hist);
+    imgfeat::get_histogram_hsv(img, hist);
     double similarity = cv::compareHist(hist_target, hist, CV_COMP_BHATTACHARYYA);
     //double similarity = cv::compareHist(hist_target, hist, CV_COMP_INTERSECT);
     printf("%s\t%f\n", line.c_str(), similarity);
   }
 }
 
-void compare_hist_hog(int argc, char **argv) {
-  if (argc != 3) {
-    fprintf(stderr, "Usage: %s imgfile txtfile\n", argv[0]);
+// Print the similarity of each image listed in a file to the target, in
+// order of the list.  Images of a batch are decoded in parallel, and only
+// the features of the batch are kept.
+void compare_hist_hog(const char *target_path, const char *list_path) {
+  imgfeat::FeatureStore extractor;
+  int features = imgfeat::HIST | imgfeat::HOG;
+  imgfeat::ImageFeatures target;
+  if (!extractor.extract(target_path, features, target)) {
+    fprintf(stderr, "file open error: %s\n", target_path);
     exit(1);
   }
-  cv::Mat target = cv::imread(argv[1]);
-  if (!target.data) {
-    fprintf(stderr, "file open error: %s\n", argv[1]);
+  std::ifstream ifs(list_path);
+  if (!ifs) {
+    fprintf(stderr, "cannot open %s\n", list_path);
     exit(1);
   }
+  std::vector<std::string> lines;
+  std::vector<imgfeat::ImageFeatures> batch;
+  std::vector<char> ok;
+  std::string line;
+  bool eof = false;
+  while (!eof) {
+    lines.clear();
+    while (lines.size() < imgfeat::BATCH_SIZE) {
+      if (!std::getline(ifs, line)) {
+        eof = true;
+        break;
+      }
+      lines.push_back(line);
+    }
+    batch.assign(lines.size(), imgfeat::ImageFeatures());
+    ok.assign(lines.size(), 0);
+    int size = static_cast<int>(lines.size());
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int i = 0; i < size; i++) {
+      ok[i] = extractor.extract(lines[i], features, batch[i]);
+    }
+    for (size_t i = 0; i < lines.size(); i++) {
+      if (!ok[i]) {
+        fprintf(stderr, "file open error: %s\n", lines[i].c_str());
+        continue;
+      }
+      double sim_hist = 1.0 - imgfeat::bhattacharyya(&target.hist[0],
+                                                     &batch[i].hist[0],
+                                                     target.hist.size());
+      double sim_hog = imgfeat::dot(&target.hog[0], &batch[i].hog[0],
+                                    target.hog.size());
+      double similarity = HIST_WEIGHT * sim_hist + HOG_WEIGHT * sim_hog;
+      printf("%s\t%f\t%f\t%f\n", lines[i].c_str(), similarity, sim_hist,
+             sim_hog);
+    }
+  }
+}
 
-  cv::MatND hist_target;
-  get_histogram_hsv(target, hist_target);
-
-  cv::HOGDescriptor hog;
-  std::vector<float> desc_target;
-  calc_hog(hog, target, desc_target);
-
-  std::ifstream ifs(argv[2]);
+void read_filenames(const char *path, std::vector<std::string> &filenames) {
+  std::ifstream ifs(path);
   if (!ifs) {
-    fprintf(stderr, "cannot open %s\n", argv[2]);
+    fprintf(stderr, "cannot open %s\n", path);
     exit(1);
   }
   std::string line;
   while (std::getline(ifs, line)) {
-    cv::Mat img = cv::imread(line);
-    if (!img.data) {
-      fprintf(stderr, "file open error: %s\n", line.c_str());
-      continue;
-    }
-    cv::MatND hist;
-    get_histogram_hsv(img, hist);
-    double sim_hist = 1.0 - cv::compareHist(hist_target, hist, CV_COMP_BHATTACHARYYA);
-    std::vector<float> desc;
-    calc_hog(hog, img, desc);
-    double sim_hog = cosine(desc_target, desc);
-    double similarity = 0.3 * sim_hist + 1.5 * sim_hog;
+    filenames.push_back(line);
+  }
+}
+
+// Print the k images (0: all) most similar to the target.  All images are
+// ranked by the histogram, and the survivors (0: all) by the similarity.
+void print_similarities(const char *target_path,
+                        const imgfeat::FeatureStore &store,
+                        size_t k, size_t survivors) {
+  imgfeat::ImageFeatures target;
+  if (!store.extract(target_path, imgfeat::HIST | imgfeat::HOG, target) ||
+      target.hog.size() != store.hog_dim()) {
+    fprintf(stderr, "file open error: %s\n", target_path);
+    exit(1);
+  }
 
-    printf("%s\t%f\t%f\t%f\n", line.c_str(), similarity, sim_hist, sim_hog);
+  std::vector<imgfeat::Score> scores(store.size());
+  int size = static_cast<int>(store.size());
+  #pragma omp parallel for
+  for (int i = 0; i < size; i++) {
+    scores[i].first = i;
+    scores[i].second = 1.0 - imgfeat::bhattacharyya(&target.hist[0],
+                                                    store.hist(i),
+                                                    store.hist_dim());
+  }
+  imgfeat::select_top(scores, survivors, true);
+
+  // re-rank the survivors; scores are indexed by the survivors from here
+  std::vector<imgfeat::Score> survived(scores);
+  std::vector<float> sim_hogs(survived.size());
+  size = static_cast<int>(survived.size());
+  #pragma omp parallel for
+  for (int j = 0; j < size; j++) {
+    sim_hogs[j] = imgfeat::dot(&target.hog[0], store.hog(survived[j].first),
+                               store.hog_dim());
+    scores[j].first = j;
+    scores[j].second = HIST_WEIGHT * survived[j].second +
+                       HOG_WEIGHT * sim_hogs[j];
+  }
+  imgfeat::select_top(scores, k, true);
+  for (size_t r = 0; r < scores.size(); r++) {
+    size_t j = scores[r].first;
+    printf("%s\t%f\t%f\t%f\n", store.name(survived[j].first),
+           scores[r].second, survived[j].second, sim_hogs[j]);
   }
 }
 
+static void usage(const char *progname) {
+  fprintf(stderr, "Usage: %s imgfile txtfile\n", progname);
+  fprintf(stderr, "Usage: %s index txtfile indexfile [features]\n", progname);
+  fprintf(stderr, "Usage: %s query indexfile imgfile [k [survivors]]\n",
+          progname);
+  exit(1);
+}
+
 int main(int argc, char **argv) {
+  if (argc < 3) usage(argv[0]);
   //compare_hist_hsv(argc, argv);
-  compare_hist_hog(argc, argv);
+
+  imgfeat::FeatureStore store;
+  int required = imgfeat::HIST | imgfeat::HOG;
+  if (!strcmp(argv[1], "index")) {
+    if (argc != 4 && argc != 5) usage(argv[0]);
+    int features = (argc == 5) ? imgfeat::parse_features(argv[4]) : required;
+    if ((features & required) != required) {
+      fprintf(stderr, "invalid features: %s\n", argv[4]);
+      exit(1);
+    }
+    std::vector<std::string> filenames;
+    read_filenames(argv[2], filenames);
+    if (!store.create(argv[3], features)) {
+      fprintf(stderr, "cannot open %s\n", argv[3]);
+      exit(1);
+    }
+    store.add_images(filenames);
+    if (!store.finish()) {
+      fprintf(stderr, "cannot write %s\n", argv[3]);
+      exit(1);
+    }
+    fprintf(stderr, "%zu images\n", store.size());
+    return 0;
+  }
+
+  if (!strcmp(argv[1], "query")) {
+    if (argc < 4 || argc > 6) usage(argv[0]);
+    if (!store.open(argv[2]) || !store.has(required)) {
+      fprintf(stderr, "invalid index: %s\n", argv[2]);
+      exit(1);
+    }
+    size_t k = (argc >= 5) ? atoi(argv[4]) : 10;
+    size_t survivors = (argc == 6) ? atoi(argv[5])
+                                   : std::max<size_t>(100, 10 * k);
+    print_similarities(argv[3], store, k, survivors);
+    return 0;
+  }
+
+  if (argc != 3) usage(argv[0]);
+  compare_hist_hog(argv[1], argv[2]);
   return 0;
 }
@@ -1,4 +1,26 @@
+//
+// Distances of HOG descriptors between a target image and other images
+//
+// Usage:
+//   % calc_hog_distance targetimg txtfile
+//   % calc_hog_distance index txtfile indexfile [features]
+//   % calc_hog_distance query indexfile targetimg [k]
+//
+// "index" computes HOG descriptors of the images listed in txtfile (an image
+// in each line) in parallel, and saves them L2-normalized in a feature store
+// (../feature_store.h).  features ("hog,hist,emd") adds other features for
+// compare_hist and compare_emd.  "query" prints the k (default 10) images
+// in the index most similar to the target by cosine.
+//
+// Build:
+//   % g++ -Wall -O3 -fopenmp -I.. -I/usr/include/opencv calc_hog_distance.cc -o calc_hog_distance -lcv -lcvaux -lhighgui
+//
+
 #include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <algorithm>
 #include <fstream>
 #include <iostream>
@@ -8,6 +30,7 @@
 #include <cv.h>
 #include <cvaux.h>
 #include <highgui.h>
+#include "feature_store.h"
 
 double euclid_distance(const std::vector<float> &vec1,
                        const std::vector<float> &vec2) {
@@ -205,7 +228,79 @@ void calc_distances_text(int argc, char **argv) {
   }
 }
 
+void make_index(int argc, char **argv) {
+  if (argc != 4 && argc != 5) {
+    fprintf(stderr, "Usage: %s index txtfile indexfile [features]\n", argv[0]);
+    exit(1);
+  }
+  int features = (argc == 5) ? imgfeat::parse_features(argv[4]) : imgfeat::HOG;
+  if (!(features & imgfeat::HOG)) {
+    fprintf(stderr, "invalid features: %s\n", argv[4]);
+    exit(1);
+  }
+  std::vector<std::string> paths;
+  std::ifstream ifs(argv[2]);
+  if (!ifs) {
+    fprintf(stderr, "cannot open %s\n", argv[2]);
+    exit(1);
+  }
+  std::string line;
+  while (std::getline(ifs, line)) paths.push_back(line);
+  imgfeat::FeatureStore store;
+  if (!store.create(argv[3], features)) {
+    fprintf(stderr, "cannot open %s\n", argv[3]);
+    exit(1);
+  }
+  store.add_images(paths);
+  if (!store.finish()) {
+    fprintf(stderr, "cannot write %s\n", argv[3]);
+    exit(1);
+  }
+  fprintf(stderr, "%ld images, %ld dimensions\n",
+          static_cast<long>(store.size()), static_cast<long>(store.hog_dim()));
+}
+
+void query_index(int argc, char **argv) {
+  if (argc != 4 && argc != 5) {
+    fprintf(stderr, "Usage: %s query indexfile targetimg [k]\n", argv[0]);
+    exit(1);
+  }
+  size_t max = (argc == 5) ? atoi(argv[4]) : 10;
+  imgfeat::FeatureStore store;
+  if (!store.open(argv[2]) || !store.has(imgfeat::HOG)) {
+    fprintf(stderr, "invalid index: %s\n", argv[2]);
+    exit(1);
+  }
+  imgfeat::ImageFeatures target;
+  if (!store.extract(argv[3], imgfeat::HOG, target) ||
+      target.hog.size() != store.hog_dim()) {
+    fprintf(stderr, "file open error: %s\n", argv[3]);
+    exit(1);
+  }
+
+  // cosine of the target and every image
+  std::vector<imgfeat::Score> scores(store.size());
+  int n = static_cast<int>(store.size());
+  #pragma omp parallel for
+  for (int i = 0; i < n; i++) {
+    scores[i].first = i;
+    scores[i].second = imgfeat::dot(&target.hog[0], store.hog(i),
+                                    store.hog_dim());
+  }
+  imgfeat::select_top(scores, max, true);
+  for (size_t i = 0; i < scores.size(); i++) {
+    printf("%s\t%f\n", store.name(scores[i].first), scores[i].second);
+  }
+}
+
 int main(int argc, char **argv) {
+  if (argc > 1 && !strcmp(argv[1], "index")) {
+    make_index(argc, argv);
+    return 0;
+  } else if (argc > 1 && !strcmp(argv[1], "query")) {
+    query_index(argc, argv);
+    return 0;
+  }
   print_distances(argc, argv);
 //  calc_distances(argc, argv);
 //  calc_distances_text(argc, argv);
@@ -1,70 +1,294 @@
+//
+// Compare SURF features of a target image with other images
+//
+// Usage:
+//   % compare_surf [-n] [-l list] target [imgname1 ...]
+//
+// Keypoints and descriptors of each image are cached in a sidecar file
+// (imgname.surf) with the mtime and size of the image, and extracted again
+// only when the image is changed (-n: no cache).  Images are matched with
+// the target in parallel.
+//
+// Build:
+//   % g++ -Wall -O3 -fopenmp -I/usr/include/opencv compare_surf.cc -o compare_surf -lcv -lhighgui
+//
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cfloat>
 #include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <string>
 #include <vector>
 #include <cv.h>
 #include <highgui.h>
 
+// magic number of cache files
+const uint64_t CACHE_MAGIC = 0x3146525553ULL;
+// groups of descriptors by the sign of laplacian (-, 0, +)
+const int NUM_GROUPS = 3;
+// the maximum dimension of descriptors (extended SURF)
+const uint64_t MAX_DIM = 128;
+// descriptors of a block in the matcher
+const int BLOCK = 16;
+// images matched before printing
+const size_t BATCH_SIZE = 1024;
+
+// SURF features of an image.  Descriptors are grouped by the sign of
+// laplacian since only the same sign can match, and stored contiguously;
+// blocks have BLOCK descriptors each in dimension-major order.
+struct SurfFeatures {
+  int dim;
+  std::vector<CvSURFPoint> keypoints[NUM_GROUPS];
+  std::vector<float> descriptors[NUM_GROUPS];
+  std::vector<float> blocks[NUM_GROUPS];
+
+  SurfFeatures() : dim(0) { }
+
+  static int group(int laplacian) {
+    return (laplacian < 0) ? 0 : (laplacian == 0) ? 1 : 2;
+  }
+
+  void reset(int d) {
+    dim = d;
+    for (int g = 0; g < NUM_GROUPS; g++) {
+      keypoints[g].clear();
+      descriptors[g].clear();
+      blocks[g].clear();
+    }
+  }
+
+  void add(const CvSURFPoint &point, const float *descriptor) {
+    int g = group(point.laplacian);
+    keypoints[g].push_back(point);
+    descriptors[g].insert(descriptors[g].end(), descriptor, descriptor + dim);
+  }
+
+  int size(int g) const { return static_cast<int>(keypoints[g].size()); }
+
+  int total() const {
+    int sum = 0;
+    for (int g = 0; g < NUM_GROUPS; g++) sum += size(g);
+    return sum;
+  }
+
+  // index of the first descriptor of group g in order of groups
+  int offset(int g) const {
+    int sum = 0;
+    for (int h = 0; h < g; h++) sum += size(h);
+    return sum;
+  }
+
+  void make_blocks() {
+    for (int g = 0; g < NUM_GROUPS; g++) {
+      int nblocks = (size(g) + BLOCK - 1) / BLOCK;
+      blocks[g].assign(nblocks * BLOCK * dim, 0.0f);
+      for (int i = 0; i < size(g); i++) {
+        float *block = &blocks[g][i / BLOCK * BLOCK * dim];
+        for (int d = 0; d < dim; d++) {
+          block[d * BLOCK + i % BLOCK] = descriptors[g][i * dim + d];
+        }
+      }
+    }
+  }
+};
+
 class Surf {
  private:
-  double euclid_distance(const float *vec1, const float *vec2, int length) {
-    double sum = 0.0;
-    for (int i = 0; i < length; i++) {
-      sum += (vec1[i] - vec2[i]) * (vec1[i] - vec2[i]);
+  CvSURFParams params_;
+  bool use_cache_;
+
+  template <typename T>
+  static T *vector_ptr(std::vector<T> &v) { return v.empty() ? NULL : &v[0]; }
+  template <typename T>
+  static const T *vector_ptr(const std::vector<T> &v) {
+    return v.empty() ? NULL : &v[0];
+  }
+  template <typename T>
+  static bool write_array(FILE *fp, const T *array, size_t size) {
+    return size == 0 || fwrite(array, sizeof(T), size, fp) == size;
+  }
+  template <typename T>
+  static bool read_array(FILE *fp, T *array, size_t size) {
+    return size == 0 || fread(array, sizeof(T), size, fp) == size;
+  }
+
+  // header: magic, mtime and size of the image, dimension, sizes of groups
+  static void make_header(const struct stat &st, const SurfFeatures &features,
+                          uint64_t *header) {
+    header[0] = CACHE_MAGIC;
+    header[1] = st.st_mtime;
+    header[2] = st.st_size;
+    header[3] = features.dim;
+    for (int g = 0; g < NUM_GROUPS; g++) header[4 + g] = features.size(g);
+  }
+
+  // Check that the dimension and the sizes of groups in a header match
+  // the size of the file, so that a broken cache is a miss instead of a
+  // huge allocation.
+  static bool check_sizes(FILE *fp, const uint64_t *header) {
+    struct stat st;
+    if (fstat(fileno(fp), &st) != 0) return false;
+    uint64_t dim = header[3];
+    if (dim == 0 || dim > MAX_DIM) return false;
+    uint64_t rest = static_cast<uint64_t>(st.st_size);
+    uint64_t header_size = sizeof(uint64_t) * (4 + NUM_GROUPS);
+    if (rest < header_size) return false;
+    rest -= header_size;
+    uint64_t item_size = sizeof(CvSURFPoint) + sizeof(float) * dim;
+    for (int g = 0; g < NUM_GROUPS; g++) {
+      if (header[4 + g] > rest / item_size) return false;
+      rest -= header[4 + g] * item_size;
+    }
+    return rest == 0;
+  }
+
+  bool read_cache(const std::string &path, const struct stat &st,
+                  SurfFeatures &features) {
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp) return false;
+    uint64_t header[4 + NUM_GROUPS];
+    bool ok = read_array(fp, header, 4 + NUM_GROUPS) &&
+              header[0] == CACHE_MAGIC &&
+              header[1] == static_cast<uint64_t>(st.st_mtime) &&
+              header[2] == static_cast<uint64_t>(st.st_size);
+    if (ok) ok = check_sizes(fp, header);
+    if (ok) {
+      features.reset(static_cast<int>(header[3]));
+      for (int g = 0; g < NUM_GROUPS && ok; g++) {
+        features.keypoints[g].resize(header[4 + g]);
+        features.descriptors[g].resize(header[4 + g] * features.dim);
+        ok = read_array(fp, vector_ptr(features.keypoints[g]), header[4 + g]) &&
+             read_array(fp, vector_ptr(features.descriptors[g]),
+                        header[4 + g] * features.dim);
+      }
+    }
+    fclose(fp);
+    return ok;
+  }
+
+  // write to a temporary file and rename it, so that readers never see a
+  // partial file
+  void write_cache(const std::string &path, const struct stat &st,
+                   const SurfFeatures &features) {
+    std::string tmp_path = path + ".XXXXXX";
+    int fd = mkstemp(&tmp_path[0]);
+    if (fd < 0) return;
+    FILE *fp = fdopen(fd, "wb");
+    if (!fp) {
+      close(fd);
+      unlink(tmp_path.c_str());
+      return;
+    }
+    uint64_t header[4 + NUM_GROUPS];
+    make_header(st, features, header);
+    bool ok = write_array(fp, header, 4 + NUM_GROUPS);
+    for (int g = 0; g < NUM_GROUPS && ok; g++) {
+      ok = write_array(fp, vector_ptr(features.keypoints[g]), features.size(g)) &&
+           write_array(fp, vector_ptr(features.descriptors[g]),
+                       features.descriptors[g].size());
+    }
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+      unlink(tmp_path.c_str());
+    }
+  }
+
+  bool extract(const char *filename, SurfFeatures &features) {
+    IplImage *img = cvLoadImage(filename, CV_LOAD_IMAGE_GRAYSCALE);
+    if (!img) return false;
+    CvMemStorage *storage = cvCreateMemStorage(0);
+    CvSeq *keypoints, *descriptors;
+    cvExtractSURF(img, 0, &keypoints, &descriptors, storage, params_);
+    cvReleaseImage(&img);
+    features.reset(static_cast<int>(descriptors->elem_size / sizeof(float)));
+    for (int i = 0; i < descriptors->total; i++) {
+      features.add(*(const CvSURFPoint *)cvGetSeqElem(keypoints, i),
+                   (const float *)cvGetSeqElem(descriptors, i));
     }
-    return sqrt(sum);
+    cvReleaseMemStorage(&storage);
+    return true;
   }
- 
+
  public:
-  Surf() { }
+  explicit Surf(bool use_cache = true)
+    : params_(cvSURFParams(500, 1)), use_cache_(use_cache) { }
   ~Surf() { }
 
-  void get_surf(const char *filename, CvSeq *&keypoints, CvSeq *&descriptors) {
-    CvMemStorage *storage = cvCreateMemStorage(0);
-    CvSURFParams params = cvSURFParams(500, 1);
-    IplImage *img = cvLoadImage(filename, CV_LOAD_IMAGE_GRAYSCALE);
-    cvExtractSURF(img, 0, &keypoints, &descriptors, storage, params);
+  // Extract (or read the cache of) SURF features of an image.
+  // Return false if the image cannot be read.
+  bool get_surf(const char *filename, SurfFeatures &features) {
+    struct stat st;
+    if (stat(filename, &st) != 0) return false;
+    std::string cache_path = std::string(filename) + ".surf";
+    if (!use_cache_ || !read_cache(cache_path, st, features)) {
+      if (!extract(filename, features)) return false;
+      if (use_cache_) write_cache(cache_path, st, features);
+    }
+    features.make_blocks();
+    return true;
   }
 
-  int nearest_neighbor(const float *vec, int laplacian,
-                       const CvSeq *keypoints, const CvSeq* descriptors) {
-    int length = (int) (descriptors->elem_size / sizeof(float));
+  // Find the nearest neighbor in group g of features of vec, and return
+  // the index if it passes the ratio test (or -1).
+  int nearest_neighbor(const float *vec, int g,
+                       const SurfFeatures &features) const {
+    int dim = features.dim;
+    int size = features.size(g);
     int neighbor = -1;
-    double min_dist = 1e6;
-    double secmin_dist = 1e6;
-    for (int i = 0; i < descriptors->total; i++) {
-      const CvSURFPoint *point = (const CvSURFPoint *)cvGetSeqElem(keypoints, i);
-      if (laplacian != point->laplacian) continue;
-      const float *v = (const float *)cvGetSeqElem(descriptors, i);
-      double dist = euclid_distance(vec, v, length);
-      if (dist < min_dist) {
-        secmin_dist = min_dist;
-        min_dist = dist;
-        neighbor = i;
-      } else if (dist < secmin_dist) {
-        secmin_dist = dist;
+    float min_dist = FLT_MAX;  // squared distances
+    float secmin_dist = FLT_MAX;
+    float dists[BLOCK];
+    for (int b = 0; b < size; b += BLOCK) {
+      const float *block = &features.blocks[g][b * dim];
+      for (int k = 0; k < BLOCK; k++) dists[k] = 0.0f;
+      for (int d = 0; d < dim; d++) {
+        float x = vec[d];
+        const float *column = block + d * BLOCK;
+        for (int k = 0; k < BLOCK; k++) {
+          float diff = x - column[k];
+          dists[k] += diff * diff;
+        }
+      }
+      int count = (size - b < BLOCK) ? size - b : BLOCK;
+      for (int k = 0; k < count; k++) {
+        if (dists[k] < min_dist) {
+          secmin_dist = min_dist;
+          min_dist = dists[k];
+          neighbor = b + k;
+        } else if (dists[k] < secmin_dist) {
+          secmin_dist = dists[k];
+        }
       }
     }
-    if (min_dist < 0.6 * secmin_dist) {
-      return neighbor;
-    }
+    // distance < 0.6 * second distance
+    if (neighbor >= 0 && min_dist < 0.36f * secmin_dist) return neighbor;
     return -1;
   }
 
-  void find_pairs(const CvSeq *keypoints1, const CvSeq *descriptors1,
-                  const CvSeq *keypoints2, const CvSeq *descriptors2,
-                  std::vector<int> &pairs) {
-    for (int i = 0; i < descriptors1->total; i++) {
-      const CvSURFPoint *point = (const CvSURFPoint *)cvGetSeqElem(keypoints1, i);
-      const float *descriptor = (const float *)cvGetSeqElem(descriptors1, i);
-      int neighbor = nearest_neighbor(descriptor, point->laplacian,
-                                      keypoints2, descriptors2);
-      if (neighbor >= 0) {
-        pairs.push_back(i);
-        pairs.push_back(neighbor);
+  // Pairs of indices (in order of groups) of features1 and their nearest
+  // neighbors in features2.
+  void find_pairs(const SurfFeatures &features1, const SurfFeatures &features2,
+                  std::vector<int> &pairs) const {
+    if (features1.dim != features2.dim) return;
+    for (int g = 0; g < NUM_GROUPS; g++) {
+      int offset1 = features1.offset(g);
+      int offset2 = features2.offset(g);
+      for (int i = 0; i < features1.size(g); i++) {
+        const float *descriptor = &features1.descriptors[g][i * features1.dim];
+        int neighbor = nearest_neighbor(descriptor, g, features2);
+        if (neighbor >= 0) {
+          pairs.push_back(offset1 + i);
+          pairs.push_back(offset2 + neighbor);
+        }
       }
     }
   }
-
 };
 
 static int run_pair(int argc, char **argv);
@@ -80,43 +304,97 @@ static int run_pair(int argc, char **argv) {
     fprintf(stderr, "Usage: %s imgname1 imgname2\n", argv[0]);
     exit(1);
   }
-  CvSeq *keypoints1, *keypoints2;
-  CvSeq *descriptors1, *descriptors2;
+  SurfFeatures features1, features2;
   Surf surf;
-
-  surf.get_surf(argv[1], keypoints1, descriptors1);
-  surf.get_surf(argv[2], keypoints2, descriptors2);
+  for (int i = 1; i <= 2; i++) {
+    if (!surf.get_surf(argv[i], (i == 1) ? features1 : features2)) {
+      fprintf(stderr, "cannot open %s\n", argv[i]);
+      exit(1);
+    }
+  }
 
   std::vector<int> pairs;
-  surf.find_pairs(keypoints1, descriptors1, keypoints2, descriptors2, pairs);
+  surf.find_pairs(features1, features2, pairs);
   printf("descriptors:\n");
-  printf(" %s : %d\n", argv[1], descriptors1->total);
-  printf(" %s : %d\n", argv[2], descriptors2->total);
+  printf(" %s : %d\n", argv[1], features1.total());
+  printf(" %s : %d\n", argv[2], features2.total());
   printf("match: %d / %d\n",
-         static_cast<int>(pairs.size() / 2), descriptors1->total);
+         static_cast<int>(pairs.size() / 2), features1.total());
   return 0;
 }
 
+static void usage_multi(const char *progname) {
+  fprintf(stderr, "Usage: %s [-n] [-l list] target imgname1 ...\n", progname);
+  fprintf(stderr, "  -n      ... do not use cache files (imgname.surf)\n");
+  fprintf(stderr, "  -l list ... compare with images in list"
+                  " (an image in each line)\n");
+  exit(1);
+}
+
 static int run_multi(int argc, char **argv) {
-  if (argc < 3) {
-    fprintf(stderr, "Usage: %s target imgname1 ...\n", argv[0]);
+  bool use_cache = true;
+  const char *list_path = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "nl:")) != -1) {
+    switch (opt) {
+    case 'n':
+      use_cache = false;
+      break;
+    case 'l':
+      list_path = optarg;
+      break;
+    default:
+      usage_multi(argv[0]);
+    }
+  }
+  if (argc - optind < 1 || (argc - optind < 2 && list_path == NULL)) {
+    usage_multi(argv[0]);
+  }
+  const char *target = argv[optind];
+  std::vector<std::string> names(argv + optind + 1, argv + argc);
+  if (list_path) {
+    std::ifstream ifs(list_path);
+    if (!ifs) {
+      fprintf(stderr, "cannot open %s\n", list_path);
+      exit(1);
+    }
+    std::string line;
+    while (std::getline(ifs, line)) {
+      if (!line.empty()) names.push_back(line);
+    }
+  }
+
+  Surf surf(use_cache);
+  SurfFeatures features1;
+  if (!surf.get_surf(target, features1)) {
+    fprintf(stderr, "cannot open %s\n", target);
     exit(1);
   }
-  CvSeq *keypoints1, *keypoints2;
-  CvSeq *descriptors1, *descriptors2;
-  Surf surf;
-  surf.get_surf(argv[1], keypoints1, descriptors1);
-
-  for (int i = 2; i < argc; i++) {
-    surf.get_surf(argv[i], keypoints2, descriptors2);
-
-    std::vector<int> pairs;
-    surf.find_pairs(keypoints1, descriptors1, keypoints2, descriptors2, pairs);
-    printf("descriptors:\n");
-    printf(" %s : %d\n", argv[1], descriptors1->total);
-    printf(" %s : %d\n", argv[i], descriptors2->total);
-    printf("match: %d / %d\n\n",
-           static_cast<int>(pairs.size() / 2), descriptors1->total);
+
+  std::vector<int> matches, totals;
+  for (size_t begin = 0; begin < names.size(); begin += BATCH_SIZE) {
+    int size = static_cast<int>(std::min(BATCH_SIZE, names.size() - begin));
+    matches.assign(size, -1);
+    totals.assign(size, 0);
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int i = 0; i < size; i++) {
+      SurfFeatures features2;
+      if (!surf.get_surf(names[begin + i].c_str(), features2)) continue;
+      std::vector<int> pairs;
+      surf.find_pairs(features1, features2, pairs);
+      matches[i] = static_cast<int>(pairs.size() / 2);
+      totals[i] = features2.total();
+    }
+    for (int i = 0; i < size; i++) {
+      if (matches[i] < 0) {
+        fprintf(stderr, "cannot open %s\n", names[begin + i].c_str());
+        continue;
+      }
+      printf("descriptors:\n");
+      printf(" %s : %d\n", target, features1.total());
+      printf(" %s : %d\n", names[begin + i].c_str(), totals[i]);
+      printf("match: %d / %d\n\n", matches[i], features1.total());
+    }
   }
   return 0;
 }
@@ -1,15 +1,25 @@
+//
+// Assign SIFT descriptors of *.sift files in a directory to their nearest
+// centroids (visual words), and print a histogram per file.
+//
+// Build:
+//   % g++ -Wall -O3 -fopenmp -I../../bof nearest_neighbor.cc -o nearest_neighbor
+//
+
 #include <sys/types.h>
 #include <dirent.h>
-#include <cassert>
-#include <cmath>
-#include <algorithm>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
 #include <map>
 #include <string>
 #include <vector>
+#include "quantizer.h"
 
 const static size_t SIZE = 128;
+const static size_t BATCH_SIZE = 64;  // files read and assigned at once
 
 std::vector<std::string> splitAll(std::string s, std::string t) {
   std::vector<std::string> v;
@@ -21,16 +31,6 @@ std::vector<std::string> splitAll(std::string s, std::string t) {
   return v;
 }
 
-double euclid_distance_squared(const std::vector<double> &vec1,
-                               const std::vector<double> &vec2) {
-  assert(vec1.size() == vec2.size());
-  double dist = 0.0;
-  for (size_t i = 0; i < vec1.size(); i++) {
-    dist += (vec1[i] - vec2[i]) * (vec1[i] - vec2[i]);
-  }
-  return dist;
-}
-
 std::string get_extension(const std::string filename) {
   size_t index = filename.rfind('.', filename.size());
   if (index != std::string::npos) {
@@ -39,36 +39,41 @@ std::string get_extension(const std::string filename) {
   return "";
 }
 
-void read_centroids(const char *filename,
-                    std::vector<std::vector<double> *> &centroids) {
+// read "id\tindex\tvalue\t..." lines into codebook
+size_t read_centroids(const char *filename, std::vector<float> &codebook) {
   std::ifstream ifs(filename);
   if (!ifs) {
     fprintf(stderr, "cannot open %s\n", filename);
     exit(1);
   }
   std::string line;
+  size_t size = 0;
   while (std::getline(ifs, line)) {
-    std::vector<double> *centroid = new std::vector<double>;
-    centroid->resize(SIZE);
+    codebook.resize((size + 1) * SIZE, 0.0f);
+    float *centroid = &codebook[size * SIZE];
     std::vector<std::string> splited = splitAll(line, "\t");
-    for (size_t i = 1; i < splited.size(); i += 2) {
-      (*centroid)[atoi(splited[i].c_str())] = atof(splited[i+1].c_str());
+    for (size_t i = 1; i + 1 < splited.size(); i += 2) {
+      size_t index = atoi(splited[i].c_str());
+      if (index < SIZE) centroid[index] = atof(splited[i+1].c_str());
     }
-    centroids.push_back(centroid);
+    size++;
   }
+  return size;
 }
 
-void read_sift(const char *filename,
-               std::vector<std::vector<double> *> &features) {
+// read descriptors (SIZE values each) into features
+void read_sift(const char *filename, std::vector<float> &features) {
   std::ifstream ifs(filename);
   if (!ifs) {
     fprintf(stderr, "cannot open %s\n", filename);
     exit(1);
   }
   std::string line;
-  std::vector<double> vec;
-  while (std::getline(ifs, line)) {
-    if (line[0] == ' ') {
+  std::vector<float> vec;
+  bool eof = false;
+  while (!eof) {
+    eof = !std::getline(ifs, line);
+    if (!eof && line[0] == ' ') {
       std::vector<std::string> splited = splitAll(line, " ");
       for (size_t i = 0; i < splited.size(); i++) {
         if (!splited[i].empty()) {
@@ -76,75 +81,101 @@ void read_sift(const char *filename,
         }
       }
     } else if (!vec.empty()) {
-      std::vector<double> *vec_copy = new std::vector<double>;
-      std::copy(vec.begin(), vec.end(), std::back_inserter(*vec_copy));
-      features.push_back(vec_copy);
+      vec.resize(SIZE, 0.0f);
+      features.insert(features.end(), vec.begin(), vec.end());
       vec.clear();
     }
   }
 }
 
-size_t search_nearest_centroid(
-  const std::vector<double> &feature,
-  const std::vector<std::vector<double> *> &centroids) {
-  size_t min_id = 0;
-  double min_dist = 1000000;
-  for (size_t i = 0; i < centroids.size(); i++) {
-    double dist = euclid_distance_squared(feature, *centroids[i]);
-    if (dist < min_dist) {
-      min_id = i;
-      min_dist = dist;
+// read the files of paths and count their visual words in parallel
+void assign_batch(const bof::Quantizer &quantizer, size_t max_checks,
+                  const std::vector<std::string> &paths,
+                  std::vector<std::map<size_t, size_t> > &histograms) {
+  histograms.assign(paths.size(), std::map<size_t, size_t>());
+  int size = static_cast<int>(paths.size());
+  #pragma omp parallel for schedule(dynamic, 1)
+  for (int i = 0; i < size; i++) {
+    std::vector<float> features;
+    read_sift(paths[i].c_str(), features);
+    std::vector<size_t> words(features.size() / SIZE);
+    if (words.empty()) continue;
+    if (max_checks > 0) {
+      quantizer.quantize_approx(&features[0], words.size(), max_checks,
+                                &words[0]);
+    } else {
+      quantizer.quantize(&features[0], words.size(), &words[0]);
     }
+    for (size_t j = 0; j < words.size(); j++) histograms[i][words[j]]++;
   }
-  return min_id;
 }
 
-void delete_features(std::vector<std::vector<double> *> &features) {
-  for (size_t i = 0; i < features.size(); i++) {
-    if (features[i]) delete features[i];
+void print_batch(const std::vector<std::string> &names,
+                 const std::vector<std::string> &paths,
+                 const std::vector<std::map<size_t, size_t> > &histograms,
+                 size_t &count) {
+  for (size_t i = 0; i < names.size(); i++) {
+    printf("%s", names[i].c_str());
+    for (std::map<size_t, size_t>::const_iterator it = histograms[i].begin();
+         it != histograms[i].end(); ++it) {
+      printf("\t%ld\t%ld", it->first, it->second);
+    }
+    printf("\n");
+    fprintf(stderr, "%ld\t%s\n", ++count, paths[i].c_str());
   }
 }
 
+void usage(const char *progname) {
+  fprintf(stderr, "Usage: %s [-a checks] centroid dirname\n", progname);
+  fprintf(stderr, "  -a checks ... assign approximately, comparing checks"
+                  " centroids per descriptor\n");
+  exit(1);
+}
+
 int main(int argc, char **argv) {
-  if (argc != 3) {
-    fprintf(stderr, "Usage: %s centroid dirname\n", argv[0]);
+  size_t max_checks = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "a:")) != -1) {
+    if (opt != 'a') usage(argv[0]);
+    max_checks = atoi(optarg);
+  }
+  if (argc - optind != 2) usage(argv[0]);
+  const char *centroid_path = argv[optind];
+  const char *dirname = argv[optind + 1];
+
+  std::vector<float> codebook;
+  size_t ncentroids = read_centroids(centroid_path, codebook);
+  if (ncentroids == 0) {
+    fprintf(stderr, "no centroids: %s\n", centroid_path);
     exit(1);
   }
-  std::vector<std::vector<double> *> centroids;
-  read_centroids(argv[1], centroids);
+  bof::Quantizer quantizer;
+  quantizer.set_codebook(&codebook[0], ncentroids, SIZE);
+  if (max_checks > 0) quantizer.build_tree();
 
-  DIR *dp = opendir(argv[2]);
+  DIR *dp = opendir(dirname);
   if (!dp) {
-    fprintf(stderr, "cannot open directory: %s\n", argv[2]);
+    fprintf(stderr, "cannot open directory: %s\n", dirname);
     exit(1);
   }
   struct dirent *dent;
   size_t count = 0;
-  while ((dent = readdir(dp)) != NULL) {
+  std::vector<std::string> names, paths;
+  std::vector<std::map<size_t, size_t> > histograms;
+  while (true) {
+    dent = readdir(dp);
+    if (dent == NULL || names.size() == BATCH_SIZE) {
+      assign_batch(quantizer, max_checks, paths, histograms);
+      print_batch(names, paths, histograms, count);
+      names.clear();
+      paths.clear();
+      if (dent == NULL) break;
+    }
     std::string ext = get_extension(dent->d_name);
     if (ext != "sift") continue;
-    char path[256];
-    sprintf(path, "%s/%s", argv[2], dent->d_name);
-    std::vector<std::vector<double> *> features;
-    read_sift(path, features);
-
-    std::map<size_t, size_t> histogram;
-    for (size_t i = 0; i < features.size(); i++) {
-      size_t id = search_nearest_centroid(*features[i], centroids);
-      histogram[id]++;
-    }
-    printf("%s", dent->d_name);
-    for (std::map<size_t, size_t>::iterator it = histogram.begin();
-         it != histogram.end(); ++it) {
-      printf("\t%ld\t%ld", it->first, it->second);
-    }
-    printf("\n");
-    fprintf(stderr, "%ld\t%s\n", ++count, path);
-    delete_features(features);
+    names.push_back(dent->d_name);
+    paths.push_back(std::string(dirname) + "/" + dent->d_name);
   }
   closedir(dp);
-
-
-  delete_features(centroids);
   return 0;
 }
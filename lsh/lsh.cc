@@ -2,283 +2,507 @@
  * Locality Sensitive Hash
  *
  * Usage:
- *   % lsh input_dbm output_txt
+ *   % lsh [options] input_dbm output_txt
+ *     -b nbits     ... number of random vectors (bits of a signature)
+ *     -s nshuffle  ... number of bit permutations
+ *     -n nneighbor ... window size in sorted signatures
+ *     -c cosine    ... minimum cosine of output pairs
+ *     -d distance  ... maximum hamming distance of verified pairs
+ *                      (default: no limit)
+ *     -w width     ... find candidates in buckets of bands of the given
+ *                      bits instead of windows in sorted signatures
+ *                      (at most 256 bands: nbits / width <= 256)
+ *
+ * Signatures are packed into 64 bit words.  For each permutation of
+ * bits, the permuted signatures are sorted and the vectors within the
+ * window of each vector are compared (Charikar's method).  The input
+ * dbm is read once into memory, and the candidate pairs are verified
+ * in parallel (OpenMP) on the sparse rows of sparse/sparse_matrix.h.
+ *
+ * With -w, signatures are cut into bands, and the vectors which share
+ * the value of a band are candidates.  The buckets (band and value) are
+ * kept in a compressed inverted index (compress/inverted_index.h), and
+ * each vector looks up the union of its buckets.
  *
  * Build:
- *   % g++ `tcucodec conf -l` -Wall -O3 lsh.c -o lsh
+ *   % g++ `tcucodec conf -l` -Wall -O3 -fopenmp -I../compress -I../sparse lsh.cc -o lsh
  *
  * Requirement:
  *   - Tokyo Cabinet
  *
  */
+#include <stdint.h>
+#include <unistd.h>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <ctime>
-#include <fstream>
+#include <algorithm>
 #include <iostream>
-#include <map>
-#include <sstream>
+#include <set>
 #include <string>
 #include <vector>
 #include <tchdb.h>
-#include <ext/hash_map>
+#include "inverted_index.h"
+#include "sparse_matrix.h"
+#include "tsv_reader.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 using namespace std;
 
-/* Constants */
+/* Constants (default values of options) */
 const int    NUM_RANDOM_KEY = 100;
 const int    NUM_SHUFFLE    = 15;
 const int    NUM_NEIGHBOR   = 10;
 const int    MAX_VECTOR_KEY = 50;
 const double MIN_COSINE     = 0.7;
+const int    MAX_BAND_BITS  = 56;    // band value bits in a bucket id
+const int    MAX_BANDS      = 1 << (64 - MAX_BAND_BITS);  // band numbers
+const int    QUERY_BATCH    = 4096;  // vectors looked up at once
+
+/* all vectors of the input dbm in memory (sparse rows of interned ids) */
+struct Matrix {
+  vector<string> keys;          // record keys
+  sparse::FeatureDict features;
+  sparse::Matrix<double> rows;
+};
+
+/* candidate pair to be verified */
+struct Candidate {
+  int id1;  // printed first
+  int id2;
+};
+
+/* options */
+struct Option {
+  int num_random_key;
+  int num_shuffle;
+  int num_neighbor;
+  double min_cosine;
+  int max_hamming;  // negative: no limit
+  int band_bits;    // 0: sorted windows
+};
+
+/* bit-packed signatures of all vectors */
+class Signatures {
+ public:
+  explicit Signatures(int nbits) : nbits_(nbits), nwords_((nbits + 63) / 64) { }
+
+  // add a signature cleared and return a pointer to it
+  uint64_t *add() {
+    words_.resize(words_.size() + nwords_, 0);
+    return &words_[words_.size() - nwords_];
+  }
+  uint64_t *get(size_t id) { return &words_[id * nwords_]; }
+  const uint64_t *get(size_t id) const { return &words_[id * nwords_]; }
+  size_t size() const { return words_.size() / nwords_; }
+  int nbits() const { return nbits_; }
+  int nwords() const { return nwords_; }
+
+  // bit i is stored from the most significant bit of the words, so that
+  // comparing words compares bit strings
+  static void set_bit(uint64_t *sig, int i) {
+    sig[i / 64] |= 1ULL << (63 - i % 64);
+  }
+  static bool get_bit(const uint64_t *sig, int i) {
+    return (sig[i / 64] >> (63 - i % 64)) & 1;
+  }
+
+  // dst[i] = src[indexes[i]] for all bits
+  void permute(const Signatures &src, const vector<int> &indexes) {
+    words_.assign(src.words_.size(), 0);
+    for (size_t id = 0; id < src.size(); id++) {
+      const uint64_t *s = src.get(id);
+      uint64_t *d = get(id);
+      for (int i = 0; i < nbits_; i++) {
+        if (get_bit(s, indexes[i])) set_bit(d, i);
+      }
+    }
+  }
+
+  int hamming(size_t id1, size_t id2) const {
+    const uint64_t *s1 = get(id1);
+    const uint64_t *s2 = get(id2);
+    int dist = 0;
+    for (int i = 0; i < nwords_; i++) dist += __builtin_popcountll(s1[i] ^ s2[i]);
+    return dist;
+  }
 
-/* type */
-typedef map<string, double> Vector;
-typedef map<string, double>::iterator VecIt;
-typedef map<string, vector<int> > Bits;
-typedef map<string, vector<int> >::iterator BitsIt;
-
-/*
-struct stringhash { // hash function for string
-  size_t operator()(const string& str) const {
-    const char *ptr = str.data();
-    int size = str.size();
-    size_t idx = 19780211;
-    while(size--){
-      idx = idx * 37 + *(uint8_t *)ptr++;
+  bool less(size_t id1, size_t id2) const {
+    const uint64_t *s1 = get(id1);
+    const uint64_t *s2 = get(id2);
+    for (int i = 0; i < nwords_; i++) {
+      if (s1[i] != s2[i]) return s1[i] < s2[i];
     }
-    return idx;
+    return id1 < id2;
   }
+
+ private:
+  int nbits_;
+  int nwords_;
+  vector<uint64_t> words_;
+};
+
+/* comparator of ids by their signatures */
+struct SignatureLess {
+  const Signatures *sigs;
+  explicit SignatureLess(const Signatures *s) : sigs(s) { }
+  bool operator()(int id1, int id2) const { return sigs->less(id1, id2); }
 };
 
-typedef __gnu_cxx::hash_map<string, double, stringhash> Vector;
-typedef __gnu_cxx::hash_map<string, double, stringhash>::iterator VecIt;
-typedef __gnu_cxx::hash_map<string, vector<int>, stringhash> Bits;
-typedef __gnu_cxx::hash_map<string, vector<int>, stringhash>::iterator BitsIt;
-*/
+/* open addressing hash set of id pairs */
+class PairSet {
+ public:
+  PairSet() : table_(1024, EMPTY), size_(0) { }
+
+  // return false if the pair is already in the set
+  bool insert(uint32_t id1, uint32_t id2) {
+    if (id1 > id2) swap(id1, id2);
+    if ((size_ + 1) * 2 > table_.size()) rehash(table_.size() * 2);
+    uint64_t key = (static_cast<uint64_t>(id1) << 32) | id2;
+    size_t pos = position(key);
+    if (table_[pos] == key) return false;
+    table_[pos] = key;
+    size_++;
+    return true;
+  }
+
+ private:
+  static const uint64_t EMPTY = ~0ULL;
+  vector<uint64_t> table_;
+  size_t size_;
+
+  size_t position(uint64_t key) const {
+    size_t mask = table_.size() - 1;
+    size_t pos = (key * 0x9E3779B97F4A7C15ULL) >> 20 & mask;
+    while (table_[pos] != EMPTY && table_[pos] != key) pos = (pos + 1) & mask;
+    return pos;
+  }
+
+  void rehash(size_t size) {
+    vector<uint64_t> old(size, EMPTY);
+    old.swap(table_);
+    for (size_t i = 0; i < old.size(); i++) {
+      if (old[i] != EMPTY) table_[position(old[i])] = old[i];
+    }
+  }
+};
+
+const uint64_t PairSet::EMPTY;
 
 /* function prototypes */
 int main(int, char **);
-void read_vector(TCHDB *, const char *, int, Vector &);
-void select_keys_randomly(TCHDB *, int, vector<string> &);
-void lsh(TCHDB *, const char *);
-double cosine(Vector &, Vector &);
-double inner_product(Vector &, Vector &);
-double norm(Vector &);
-void print_vector(Vector &);
+void usage_exit(const char *);
+void load_matrix(TCHDB *, int, Matrix &);
+void parse_dbmdata(const char *, int, int, Matrix &);
+void select_rows_randomly(const Matrix &, int, vector<size_t> &);
+void lsh(const Matrix &, const char *, const Option &);
+void lsh_banded(const Matrix &, const Signatures &, const Option &, FILE *);
+void band_buckets(const Signatures &, size_t, int, vector<uint64_t> &);
+void verify(const Matrix &, const vector<Candidate> &, double, FILE *);
 
 
 int main(int argc, char **argv) {
-  if (argc != 3) {
-    fprintf(stderr, "Usage %s input_dbm output_txt\n", argv[0]);
+  Option option;
+  option.num_random_key = NUM_RANDOM_KEY;
+  option.num_shuffle    = NUM_SHUFFLE;
+  option.num_neighbor   = NUM_NEIGHBOR;
+  option.min_cosine     = MIN_COSINE;
+  option.max_hamming    = -1;
+  option.band_bits      = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "b:s:n:c:d:w:")) != -1) {
+    switch (opt) {
+    case 'b':
+      option.num_random_key = atoi(optarg);
+      break;
+    case 's':
+      option.num_shuffle = atoi(optarg);
+      break;
+    case 'n':
+      option.num_neighbor = atoi(optarg);
+      break;
+    case 'c':
+      option.min_cosine = atof(optarg);
+      break;
+    case 'd':
+      option.max_hamming = atoi(optarg);
+      break;
+    case 'w':
+      option.band_bits = atoi(optarg);
+      break;
+    default:
+      usage_exit(argv[0]);
+    }
+  }
+  if (argc - optind != 2 || option.num_random_key <= 0 ||
+      option.band_bits < 0 || option.band_bits > MAX_BAND_BITS) {
+    usage_exit(argv[0]);
+  }
+  if (option.band_bits > 0 &&
+      option.num_random_key / option.band_bits > MAX_BANDS) {
+    fprintf(stderr, "[error] too many bands (max %d): -b %d -w %d\n",
+            MAX_BANDS, option.num_random_key, option.band_bits);
     exit(1);
   }
-  
+
   TCHDB *vecdb = tchdbnew();
-  if (!tchdbopen(vecdb, argv[1], HDBOREADER)) {
+  if (!tchdbopen(vecdb, argv[optind], HDBOREADER)) {
     int ecode = tchdbecode(vecdb);
     fprintf(stderr, "[error] open error:%s\n", tchdberrmsg(ecode));
     exit(1);
   }
 
-  lsh(vecdb, argv[2]);
-
+  cout << "Load vectors" << endl;
+  Matrix matrix;
+  load_matrix(vecdb, MAX_VECTOR_KEY, matrix);
   tchdbdel(vecdb);
+  cout << " " << matrix.keys.size() << " vectors, "
+       << matrix.features.size() << " features" << endl;
+
+  lsh(matrix, argv[optind+1], option);
   return 0;
 }
 
-void read_vector(TCHDB *vecdb, const char *key, int knum, Vector &v) {
-  if (key == NULL) return;
-
-  char *value = tchdbget2(vecdb, key);
-  if (value != NULL) {
-    string vecstr(value);
-    string key(""), delimiter("\t");
-    int cnt = 0;
-    int kwcnt = 0;
-
-    int p = vecstr.find(delimiter);
-    while (p != (int)vecstr.npos && kwcnt < knum) {
-      string s = vecstr.substr(0, p);
-      if (cnt % 2 == 0) {
-        key = s;
-      } else {
-        double point = 0;
-        point = atof(s.c_str());
-        if (!key.empty() && point != 0) {
-          v[key] = point;
-          kwcnt++;
-        }
-      }
-      cnt++;
-      vecstr = vecstr.substr(p + delimiter.size());
-      p = vecstr.find(delimiter);
-    }
-    free(value);
+void usage_exit(const char *progname) {
+  fprintf(stderr, "Usage %s [-b nbits] [-s nshuffle] [-n nneighbor] "
+          "[-c cosine] [-d distance] [-w width] input_dbm output_txt\n",
+          progname);
+  exit(1);
+}
+
+void load_matrix(TCHDB *vecdb, int knum, Matrix &matrix) {
+  TCXSTR *key = tcxstrnew();
+  TCXSTR *value = tcxstrnew();
+  tchdbiterinit(vecdb);
+  while (tchdbiternext3(vecdb, key, value)) {
+    size_t nrows = matrix.rows.size();
+    parse_dbmdata(static_cast<const char *>(tcxstrptr(value)),
+                  tcxstrsize(value), knum, matrix);
+    if (matrix.rows.size() == nrows) continue;  // empty vector
+    matrix.keys.push_back(string(static_cast<const char *>(tcxstrptr(key)),
+                                 tcxstrsize(key)));
   }
+  tcxstrdel(key);
+  tcxstrdel(value);
 }
 
+// "key \t value \t key \t value ..." (at most knum non-zero elements)
+void parse_dbmdata(const char *data, int size, int knum, Matrix &matrix) {
+  vector<sparse::Field> fields;
+  sparse::split(data, data + size, '\t', fields);
+  vector<sparse::Matrix<double>::Element> row;
+  for (size_t i = 0; i + 1 < fields.size() &&
+       static_cast<int>(row.size()) < knum; i += 2) {
+    double point = fields[i+1].to_double();
+    if (fields[i].empty() || point == 0) continue;
+    row.push_back(make_pair(matrix.features.intern(fields[i]), point));
+  }
+  // the last value of a duplicated word is used
+  if (!row.empty()) {
+    matrix.rows.add(row, sparse::Matrix<double>::DUPLICATE_LAST);
+  }
+}
 
-void select_keys_randomly(TCHDB *vecdb, int limit, vector<string> &keys) {
-  int rnum = tchdbrnum(vecdb);
+void select_rows_randomly(const Matrix &matrix, int limit,
+                          vector<size_t> &rows) {
+  int rnum = static_cast<int>(matrix.keys.size());
   if (limit > rnum) limit = rnum;
 
-  map<int, bool> idxmap;
-  int cnt = 0;
+  set<int> idxset;
   srand((unsigned) time(NULL));
-  while (cnt < limit) {
-    int idx = rand() % rnum;
-    if (idxmap.find(idx) == idxmap.end()) {
-      idxmap[idx] = true;
-      ++cnt;
-    }
-  }
-
-  int idx = 0;
-  char *key;
-  tchdbiterinit(vecdb);
-  while ((key = tchdbiternext2(vecdb)) != NULL) {
-    if (idxmap[idx]) {
-      keys.push_back(key);
-    }
-    free(key);
-    idx++;
+  while (static_cast<int>(idxset.size()) < limit) {
+    idxset.insert(rand() % rnum);
   }
+  rows.assign(idxset.begin(), idxset.end());
 }
 
-void lsh(TCHDB *vecdb, const char *filename) {
-  ofstream ofs(filename);
+void lsh(const Matrix &matrix, const char *filename, const Option &option) {
+  FILE *fp = fopen(filename, "w");
+  if (fp == NULL) {
+    fprintf(stderr, "[error] cannot open %s\n", filename);
+    exit(1);
+  }
 
   cout << "Select vectors randomly" << endl;
-  vector<string> keys;
-  select_keys_randomly(vecdb, NUM_RANDOM_KEY, keys);
-  vector<Vector> randvecs;
-  for (unsigned int i = 0; i < keys.size(); i++) {
-    Vector v;
-    read_vector(vecdb, keys[i].c_str(), MAX_VECTOR_KEY, v);
-    randvecs.push_back(v);
-  }
+  vector<size_t> randrows;
+  select_rows_randomly(matrix, option.num_random_key, randrows);
+  int nbits = static_cast<int>(randrows.size());
 
   cout << "Calculate bits" << endl;
-  Bits bits;
-  char *key;
-  tchdbiterinit(vecdb);
-  while ((key = tchdbiternext2(vecdb)) != NULL) {
-    Vector v;
-    read_vector(vecdb, key, MAX_VECTOR_KEY, v);
-    if (!v.empty()) {
-      vector<int> bit;
-      for (unsigned int i = 0; i < randvecs.size(); i++) {
-        double cos = cosine(v, randvecs[i]);
-        if (cos > 0) {
-          bit.push_back(1); 
-        } else {
-          bit.push_back(0); 
-        }
+  int size = static_cast<int>(matrix.keys.size());
+  Signatures bits(nbits);
+  for (int j = 0; j < size; j++) bits.add();
+  #pragma omp parallel for schedule(dynamic, 64)
+  for (int j = 0; j < size; j++) {
+    uint64_t *sig = bits.get(j);
+    for (int i = 0; i < nbits; i++) {
+      if (matrix.rows.dot(j, randrows[i]) > 0) {
+        Signatures::set_bit(sig, i);
       }
-      bits[key] = bit;
     }
-    free(key);
   }
 
-  map<string, bool> check;
-  for (int i = 0; i < NUM_SHUFFLE; i++) {
+  if (option.band_bits > 0) {
+    lsh_banded(matrix, bits, option, fp);
+    fclose(fp);
+    return;
+  }
+
+  PairSet check;
+  Signatures bits_shuffled(nbits);
+  vector<int> indexes;
+  for (int j = 0; j < nbits; j++) {
+    indexes.push_back(j);
+  }
+  vector<int> order(size);
+  vector<Candidate> candidates;
+  for (int i = 0; i < option.num_shuffle; i++) {
     cout << "Loop No." << i << endl;
 
     cout << " Shuffle bits" << endl;
-    vector<int> indexes;
-    for (int j = 0; j < NUM_RANDOM_KEY; j++) {
-      indexes.push_back(j);
-    }
     random_shuffle(indexes.begin(), indexes.end());
-
-    vector<pair<string, string> > bits_shuffled;
-    BitsIt it = bits.begin();
-    while (it != bits.end()) {
-      string key = (*it).first;
-      stringstream ss;
-      for (unsigned int j = 0; j < indexes.size(); j++) {
-        ss << bits[key][j];
-      }
-      pair<string, string> p;
-      p.first = ss.str();
-      p.second = key;
-      bits_shuffled.push_back(p);
-      ++it;
-    }
-    sort(bits_shuffled.begin(), bits_shuffled.end());
+    bits_shuffled.permute(bits, indexes);
+    for (int j = 0; j < size; j++) order[j] = j;
+    sort(order.begin(), order.end(), SignatureLess(&bits_shuffled));
 
     cout << " Get similar keys" << endl;
-    int size = bits_shuffled.size();
+    candidates.clear();
     for (int j = 0; j < size; j++) {
-      string key = bits_shuffled[j].second;
-      Vector v;
-      read_vector(vecdb, key.c_str(), MAX_VECTOR_KEY, v);
-      int start = ((j - NUM_NEIGHBOR) > 0) ? (j - NUM_NEIGHBOR) : 0;
-      int end = (j + NUM_NEIGHBOR < size) ? (j + NUM_NEIGHBOR) : (size-1);
+      int id = order[j];
+      int start = ((j - option.num_neighbor) > 0) ? (j - option.num_neighbor) : 0;
+      int end = (j + option.num_neighbor < size) ?
+                (j + option.num_neighbor) : (size-1);
       for (int k = start; k <= end; k++) {
         if (j == k) continue;
-        string key_neigh = bits_shuffled[k].second;
-        stringstream ss;
-        if (j < k) {
-          ss << key << "\t" << key_neigh;
-        } else {
-          ss << key_neigh << "\t" << key;
-        }
-        string chkkey = ss.str();
-        if (check.find(chkkey) == check.end()) {
-          check[chkkey] = true;
-          Vector v_neigh;
-          read_vector(vecdb, key_neigh.c_str(), MAX_VECTOR_KEY, v_neigh);
-          double cos = cosine(v, v_neigh);
-          if (cos > MIN_COSINE) ofs << chkkey << "\t" << cos << endl;
-        }
+        int id_neigh = order[k];
+        if (option.max_hamming >= 0 &&
+            bits.hamming(id, id_neigh) > option.max_hamming) continue;
+        if (!check.insert(id, id_neigh)) continue;
+        Candidate c;
+        c.id1 = (j < k) ? id : id_neigh;
+        c.id2 = (j < k) ? id_neigh : id;
+        candidates.push_back(c);
       }
     }
+    verify(matrix, candidates, option.min_cosine, fp);
   }
+  fclose(fp);
 }
 
-double cosine(Vector &v1, Vector &v2) {
-  double len1 = norm(v1);
-  double len2 = norm(v2);
-  if (len1 == 0 || len2 == 0) return 0;
-  
-  double prod = inner_product(v1, v2);
-  return prod / (len1 * len2);
-}
+// Find candidates in the buckets of bands.  A pair is a candidate of the
+// smaller id only, so that no pair is verified twice.
+void lsh_banded(const Matrix &matrix, const Signatures &bits,
+                const Option &option, FILE *fp) {
+  cout << "Make buckets" << endl;
+  int size = static_cast<int>(bits.size());
+  vbyte::InvertedIndex index;
+  vector<uint64_t> buckets;
+  for (int j = 0; j < size; j++) {
+    band_buckets(bits, j, option.band_bits, buckets);
+    for (size_t b = 0; b < buckets.size(); b++) index.add(buckets[b], j);
+  }
+  index.build();
+  cout << " " << index.num_terms() << " buckets, " << index.memory_size()
+       << " bytes" << endl;
 
-double inner_product(Vector &v1, Vector &v2) {
-  double result = 0;
-  VecIt it = v1.begin();
-  while (it != v1.end()) {
-    string key = (*it).first;
-    if (v2.find(key) != v2.end()) {
-      double p1 = v1[key];
-      double p2 = v2[key];
-      result += p1 * p2;
+  cout << "Get similar keys" << endl;
+  int nthreads = 1;
+#ifdef _OPENMP
+  nthreads = omp_get_max_threads();
+#endif
+  vector<vector<Candidate> > thread_candidates(nthreads);
+  vector<Candidate> candidates;
+  for (int begin = 0; begin < size; begin += QUERY_BATCH) {
+    int end = (begin + QUERY_BATCH < size) ? begin + QUERY_BATCH : size;
+    // clear all slots here, as a team may have fewer threads than
+    // nthreads and leave some slots untouched
+    for (int i = 0; i < nthreads; i++) thread_candidates[i].clear();
+    #pragma omp parallel
+    {
+      int thread = 0;
+#ifdef _OPENMP
+      thread = omp_get_thread_num();
+#endif
+      vector<Candidate> &found = thread_candidates[thread];
+      vector<uint64_t> terms, docs;
+      #pragma omp for schedule(static)
+      for (int j = begin; j < end; j++) {
+        band_buckets(bits, j, option.band_bits, terms);
+        index.unite(terms, docs);
+        for (size_t k = 0; k < docs.size(); k++) {
+          int id_neigh = static_cast<int>(docs[k]);
+          if (id_neigh <= j) continue;
+          if (option.max_hamming >= 0 &&
+              bits.hamming(j, id_neigh) > option.max_hamming) continue;
+          Candidate c;
+          c.id1 = j;
+          c.id2 = id_neigh;
+          found.push_back(c);
+        }
+      }
     }
-    ++it;
+    candidates.clear();
+    for (int i = 0; i < nthreads; i++) {
+      candidates.insert(candidates.end(), thread_candidates[i].begin(),
+                        thread_candidates[i].end());
+    }
+    verify(matrix, candidates, option.min_cosine, fp);
   }
-  return result;
 }
 
-double norm(Vector &v) {
-  if (v.size() == 0) return 0;
-
-  double result = 0;
-  VecIt it = v.begin();
-  while (it != v.end()) {
-    double point = (*it).second;
-    result += point * point;
-    ++it;
+// Bucket ids of the bands of a signature: the band number in the upper
+// bits and the value of the band in the lower bits.
+void band_buckets(const Signatures &bits, size_t id, int width,
+                  vector<uint64_t> &buckets) {
+  buckets.clear();
+  const uint64_t *sig = bits.get(id);
+  for (int begin = 0; begin + width <= bits.nbits(); begin += width) {
+    uint64_t value = 0;
+    for (int i = begin; i < begin + width; i++) {
+      value = (value << 1) | Signatures::get_bit(sig, i);
+    }
+    uint64_t band = begin / width;
+    buckets.push_back((band << MAX_BAND_BITS) | value);
   }
-  return sqrt(result);
 }
 
-void print_vector(Vector &v) {
-  VecIt it = v.begin();
-  cout << "( ";
-  while (it != v.end()) {
-    cout << (*it).first << ":" << (*it).second << " ";
-    ++it;
+// Compute cosines of candidates in parallel, and write the similar pairs
+// in order of candidates.  Each thread writes to its own buffer over a
+// contiguous range of candidates, and the buffers are merged at the end.
+void verify(const Matrix &matrix, const vector<Candidate> &candidates,
+            double min_cosine, FILE *fp) {
+  int nthreads = 1;
+#ifdef _OPENMP
+  nthreads = omp_get_max_threads();
+#endif
+  vector<string> buffers(nthreads);
+  int size = static_cast<int>(candidates.size());
+  #pragma omp parallel
+  {
+    int thread = 0;
+#ifdef _OPENMP
+    thread = omp_get_thread_num();
+#endif
+    string &buffer = buffers[thread];
+    char line[32];
+    #pragma omp for schedule(static)
+    for (int i = 0; i < size; i++) {
+      const Candidate &c = candidates[i];
+      double cos = matrix.rows.cosine(c.id1, c.id2);
+      if (cos > min_cosine) {
+        buffer += matrix.keys[c.id1];
+        buffer += '\t';
+        buffer += matrix.keys[c.id2];
+        snprintf(line, sizeof(line), "\t%g\n", cos);
+        buffer += line;
+      }
+    }
+  }
+  for (int i = 0; i < nthreads; i++) {
+    fwrite(buffers[i].data(), 1, buffers[i].size(), fp);
   }
-  cout << " )" << endl;
 }
@@ -23,47 +23,241 @@
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <algorithm>
 #include <fstream>
 #include <iostream>
-#include <queue>
-#include <tr1/unordered_map>
+#include <new>
+#include <string>
 #include <vector>
+#include <Eigen/Cholesky>
 #include <Eigen/Core>
 #include <Eigen/Sparse>
+#include "rating.h"
 #include "util.h"
 
 namespace mf {
 
 /* typedef */
-typedef Eigen::MatrixXf Mat;
-typedef Eigen::SparseMatrix<int, Eigen::RowMajor> SMat;
+typedef Eigen::Map<Mat> MatMap;
+
+/**
+ * Header of a model snapshot file.
+ * The header is followed by float32 sections of the model (column-major
+ * matrices): U (users x factors), V (factors x items), and
+ * - with biases: average rate (1), user biases (users), item biases (items)
+ * - SVD++: Y (factors x items), Z (factors x users),
+ *          implicit offsets (int32, users + 1), implicit items (int32)
+ */
+struct ModelFileHeader {
+  char magic[4];     ///< "MFMS"
+  uint32_t version;  ///< format version
+  uint32_t type;     ///< model type
+  int32_t users;     ///< the number of users
+  int32_t items;     ///< the number of items
+  int32_t factors;   ///< the number of factors (clusters)
+};
+
+const char MODEL_FILE_MAGIC[] = "MFMS";  ///< magic of model snapshots
+const uint32_t MODEL_FILE_VERSION = 1;   ///< version of model snapshots
 
 /**
  * Matrix factorizer interfaces
  * (virtual class)
  */
 class MatrixFactorizer {
+ public:
+  enum ModelType {
+    MODEL_SGD = 1,
+    MODEL_SGD_BIAS = 2,
+    MODEL_SVDPP = 3,
+    MODEL_ALS = 4,
+    MODEL_ALS_IMPLICIT = 5
+  };
+
+  enum TrainMode {
+    TRAIN_SERIAL,
+    TRAIN_HOGWILD,
+    TRAIN_BLOCK
+  };
+
  private:
-  template<typename KeyType, typename ValueType>
-  struct GreaterPair {
-    bool operator() (const std::pair<KeyType, ValueType> a,
-                     const std::pair<KeyType, ValueType> b) {
-      return a.second < b.second;
+  typedef std::pair<int, float> ItemRate;
+
+  Mat user_storage_;     ///< storage of U_ (unless mapped from a snapshot)
+  Mat item_storage_;     ///< storage of V_ (unless mapped from a snapshot)
+  MappedFile snapshot_;  ///< mapped snapshot
+  IdMap user_ids_;       ///< original ids of user indexes
+  IdMap item_ids_;       ///< original ids of item indexes
+  bool mapped_ids_;      ///< ids are mapped to compact indexes
+
+  static const int USER_BLOCK = 256;             ///< users scored at once
+  static const int MAX_BLOCK_RATES = 1 << 24;    ///< rates scored at once
+
+  /**
+   * Order of top items. (higher rates, then smaller item indexes first)
+   */
+  struct HigherRate {
+    bool operator() (const ItemRate &a, const ItemRate &b) const {
+      return a.second > b.second || (a.second == b.second && a.first < b.first);
     }
   };
 
   /**
-   * Save a matrix to a file.
+   * Push an item into a heap holding top num items.
+   * @param heap heap of items (the lowest rate on the top)
+   * @param num the number of items to be kept
+   * @param item item index
+   * @param rate predicted rate
+   */
+  static void push_top(std::vector<ItemRate> &heap, size_t num,
+                       int item, float rate) {
+    ItemRate p(item, rate);
+    if (heap.size() < num) {
+      heap.push_back(p);
+      std::push_heap(heap.begin(), heap.end(), HigherRate());
+    } else if (HigherRate()(p, heap.front())) {
+      std::pop_heap(heap.begin(), heap.end(), HigherRate());
+      heap.back() = p;
+      std::push_heap(heap.begin(), heap.end(), HigherRate());
+    }
+  }
+
+  /**
+   * Get the id of a user index in input files.
+   * @param user user index
+   * @return user id
+   */
+  int user_id(int user) const {
+    return mapped_ids_ ? user_ids_.id(user) : user;
+  }
+
+  /**
+   * Get the id of an item index in input files.
+   * @param item item index
+   * @return item id
+   */
+  int item_id(int item) const {
+    return mapped_ids_ ? item_ids_.id(item) : item;
+  }
+
+  /**
+   * Append top items of the users in [begin, end) to a buffer.
+   * @param begin first user index
+   * @param end last user index + 1
+   * @param num the number of items for each user
+   * @param exclude_rated skip items rated in the training matrix
+   * @param clusters cluster of each user (NULL: all items are candidates)
+   * @param candidates sorted candidate items of each cluster
+   * @param list_format "user \t item1 \t item2 .." instead of
+   *                    "user \t item \t rate" lines
+   * @param buffer output buffer
+   */
+  void recommend_block(int begin, int end, size_t num, bool exclude_rated,
+                       const std::vector<int> *clusters,
+                       const std::vector<std::vector<int> > *candidates,
+                       bool list_format, std::string &buffer) const {
+    Mat rates;
+    predict_rates(begin, end, rates);
+    std::vector<ItemRate> heap;
+    char str[64];
+    for (int user = begin; user < end; user++) {
+      const float *rate = rates.col(user - begin).data();
+      const int *rated = NULL;
+      const int *rated_end = NULL;
+      if (exclude_rated && user < mtrain_->outerSize()) {
+        rated = mtrain_->innerIndexPtr() + mtrain_->outerIndexPtr()[user];
+        rated_end = mtrain_->innerIndexPtr() + mtrain_->outerIndexPtr()[user+1];
+      }
+      heap.clear();
+      if (clusters) {
+        const std::vector<int> &items = (*candidates)[(*clusters)[user]];
+        for (size_t i = 0; i < items.size(); i++) {
+          while (rated != rated_end && *rated < items[i]) rated++;
+          if (rated != rated_end && *rated == items[i]) continue;
+          push_top(heap, num, items[i], rate[items[i]]);
+        }
+      } else {
+        for (int item = 1; item < rates.rows(); item++) {
+          while (rated != rated_end && *rated < item) rated++;
+          if (rated != rated_end && *rated == item) continue;
+          push_top(heap, num, item, rate[item]);
+        }
+      }
+      std::sort_heap(heap.begin(), heap.end(), HigherRate());
+      if (list_format) {
+        snprintf(str, sizeof(str), "%d", user_id(user));
+        buffer += str;
+      }
+      for (size_t i = 0; i < heap.size(); i++) {
+        if (list_format) {
+          snprintf(str, sizeof(str), "\t%d", item_id(heap[i].first));
+        } else {
+          snprintf(str, sizeof(str), "%d\t%d\t%.2f\n", user_id(user),
+                   item_id(heap[i].first), heap[i].second);
+        }
+        buffer += str;
+      }
+      if (list_format) buffer += "\n";
+    }
+  }
+
+  /**
+   * Write top items of all users. Blocks of users are scored by one
+   * matrix product and processed in parallel, and the output of each
+   * block is written at once in order of users.
+   * @param fp output file
+   * @param num the number of items for each user
+   * @param exclude_rated skip items rated in the training matrix
+   * @param clusters cluster of each user (NULL: all items are candidates)
+   * @param candidates sorted candidate items of each cluster
+   * @param list_format output format (see recommend_block)
+   */
+  void write_recommend(FILE *fp, size_t num, bool exclude_rated,
+                       const std::vector<int> *clusters,
+                       const std::vector<std::vector<int> > *candidates,
+                       bool list_format) const {
+    int nuser = static_cast<int>(U_.rows());
+    int nitem = static_cast<int>(V_.cols());
+    if (nuser <= 1 || nitem == 0) return;
+    int block = USER_BLOCK;
+    if (block > MAX_BLOCK_RATES / nitem) block = MAX_BLOCK_RATES / nitem;
+    if (block < 1) block = 1;
+    int nblock = (nuser - 2) / block + 1;  // users from 1
+    int nround = static_cast<int>(nthread_) * 4;
+    std::vector<std::string> buffers(nround);
+    for (int r = 0; r < nblock; r += nround) {
+      int last = (r + nround < nblock) ? r + nround : nblock;
+      #pragma omp parallel for num_threads(nthread_) schedule(dynamic, 1)
+      for (int b = r; b < last; b++) {
+        int begin = 1 + b * block;
+        int end = (begin + block < nuser) ? begin + block : nuser;
+        buffers[b - r].clear();
+        recommend_block(begin, end, num, exclude_rated, clusters, candidates,
+                        list_format, buffers[b - r]);
+      }
+      for (int b = r; b < last; b++) {
+        fwrite(buffers[b - r].data(), 1, buffers[b - r].size(), fp);
+      }
+    }
+  }
+
+  /**
+   * Save a matrix to a file. If ids are mapped, each row but the unused
+   * row 0 is written after the original id of its index and a tab.
    * @param filename output file name
-   * @return return true if succeeded
+   * @param mat matrix
+   * @param ids map of the row indexes (user_ids_ or item_ids_)
    */
-  void save_matrix(const char *filename, const Mat &mat) const {
+  void save_matrix(const char *filename, const Mat &mat,
+                   const IdMap &ids) const {
     FILE *fp = fopen(filename, "w");
     if (fp == NULL) {
       fprintf(stderr, "[Error] cannot open %s\n", filename);
       exit(1);
     }
-    for (int i = 0; i < mat.rows(); i++) {
+    for (int i = mapped_ids_ ? 1 : 0; i < mat.rows(); i++) {
+      if (mapped_ids_) fprintf(fp, "%d\t", ids.id(i));
       for (int j = 0; j < mat.cols(); j++) {
         if (j != 0) fprintf(fp, "\t");
         fprintf(fp, "%.2f", mat(i, j));
@@ -74,72 +268,122 @@ class MatrixFactorizer {
   }
 
  protected:
-  SMat mtrain_;  ///< training matrix
-  Mat U_;        ///< user matrix
-  Mat V_;        ///< item matrix
+  SMat train_storage_;  ///< storage of the training matrix (unless shared)
+  const SMat *mtrain_;  ///< training matrix
+  int nfold_;           ///< rates at positions p % nfold_ == fold_ of the
+  int fold_;            ///< training matrix are held out (nfold_ = 0: none)
+  MatMap U_;           ///< user matrix
+  MatMap V_;           ///< item matrix
+  size_t nthread_;     ///< the number of threads
+  unsigned int seed_;  ///< seed of random number generator
+  TrainMode mode_;     ///< how ratings are walked (by SGD factorizers)
+  Stats stats_;        ///< statistics of phases and iterations
+
+  /**
+   * Point a matrix to external data.
+   * @param mat matrix to be pointed
+   * @param data data of the matrix (column-major)
+   * @param rows the number of rows
+   * @param cols the number of columns
+   */
+  static void map_matrix(MatMap &mat, float *data, int rows, int cols) {
+    new (&mat) MatMap(data, rows, cols);
+  }
+
+  /**
+   * Resize a matrix held in a storage.
+   * @param storage storage of the matrix
+   * @param mat matrix to be pointed to the storage
+   * @param rows the number of rows
+   * @param cols the number of columns
+   */
+  static void resize_matrix(Mat &storage, MatMap &mat, int rows, int cols) {
+    storage.resize(rows, cols);
+    map_matrix(mat, storage.data(), rows, cols);
+  }
+
+  /**
+   * Resize the user matrix and the item matrix.
+   * @param ncluster the number of clusters
+   */
+  void resize_matrices(size_t ncluster) {
+    resize_matrix(user_storage_, U_, mtrain_->rows(), ncluster);
+    resize_matrix(item_storage_, V_, ncluster, mtrain_->cols());
+  }
 
   /**
-   * Read matrix data from a text file.
-   * @param filename a text file
+   * Read matrix data from a text file or a binary rating file.
+   * If ids are mapped, rates of unknown users or items are skipped.
+   * @param filename a text file or a binary rating file
    * @param mat output matrix
    */
   void read_file(const char *filename, SMat &mat) const {
-    std::ifstream ifs(filename);
-    if (!ifs) {
-      fprintf(stderr, "cannot open %s\n", filename);
-      exit(1);
+    if (!mapped_ids_) {
+      read_rating_file(filename, mat);
+      return;
     }
-    size_t max_userid = 0;
-    size_t max_itemid = 0;
-    std::string line;
-    std::vector<std::string> splited;
-    while (getline(ifs, line)) {
-      split_string(line, "\t", splited);
-      size_t userid = atoi(splited[0].c_str());
-      size_t itemid = atoi(splited[1].c_str());
-      if (max_userid < userid) max_userid = userid;
-      if (max_itemid < itemid) max_itemid = itemid;
-      splited.clear();
+    std::vector<Rating> ratings;
+    read_ratings(filename, ratings);
+    size_t skipped = remap_ratings(ratings, user_ids_, item_ids_);
+    if (skipped > 0) {
+      fprintf(stderr, "%ld rates of unknown users or items are skipped: %s\n",
+              static_cast<long>(skipped), filename);
     }
-    mat.resize(max_userid+1, max_itemid+1);
+    build_rating_matrix(ratings, user_ids_.size(), item_ids_.size(), mat);
+  }
 
-    ifs.clear();
-    ifs.seekg(0, std::ios_base::beg);
-    while (getline(ifs, line)) {
-      split_string(line, "\t", splited);
-      size_t userid = atoi(splited[0].c_str());
-      size_t itemid = atoi(splited[1].c_str());
-      double rate = atof(splited[2].c_str());
-      mat.insert(userid, itemid) = rate;
-      splited.clear();
-    }
+  /**
+   * Train the own matrix (train_storage_) instead of a shared one.
+   */
+  void use_own_matrix() {
+    mtrain_ = &train_storage_;
+    nfold_ = 0;
+    fold_ = 0;
   }
 
   /**
    * Set random values to a matrix.
    * @param mat matrix to be set values
    */
-  void set_matrix_random(Mat &mat) const {
+  void set_matrix_random(MatMap &mat) {
     for (int i = 0; i < mat.rows(); i++) {
       for (int j = 0; j < mat.cols(); j++) {
-        mat(i, j) = static_cast<double>(rand()) / RAND_MAX;
+        mat(i, j) = static_cast<double>(myrand(&seed_)) / RAND_MAX;
       }
     }
   }
 
   /**
-   * Get the average value of a matrix.
-   * @param mat matrix
+   * Check whether a rate of the training matrix is held out.
+   * @param p position of the rate in the training matrix
+   * @return return true if the rate is not trained
+   */
+  bool held_out(int p) const {
+    return nfold_ > 0 && p % nfold_ == fold_;
+  }
+
+  /**
+   * Get the number of trained rates.
+   * @return the number of rates not held out
+   */
+  size_t train_size() const {
+    size_t nnz = mtrain_->nonZeros();
+    if (nfold_ == 0) return nnz;
+    return nnz - (nnz / nfold_ + ((static_cast<size_t>(fold_) < nnz % nfold_)
+                                  ? 1 : 0));
+  }
+
+  /**
+   * Get the average of the trained rates.
    * @return average value
    */
-  double matrix_average(const SMat &mat) const {
-    size_t N = mat.nonZeros();
+  double train_average() const {
+    size_t N = train_size();
     if (N == 0) return 0.0;
+    const int *values = mtrain_->valuePtr();
     double sum = 0.0;
-    for (int j = 0; j < mat.outerSize(); j++) {
-      for (SMat::InnerIterator it(mat, j); it; ++it) {
-        sum += it.value();
-      }
+    for (int p = 0; p < mtrain_->nonZeros(); p++) {
+      if (!held_out(p)) sum += values[p];
     }
     return sum / N;
   }
@@ -152,17 +396,168 @@ class MatrixFactorizer {
    */
   virtual double predict_rate(int user, int item) const = 0;
 
+  /**
+   * Get RMSE of the training matrix (without rounding predicted rates).
+   * @return RMSE
+   */
+  double train_rmse() const {
+    size_t N = train_size();
+    if (N == 0) return 0.0;
+    const int *outer = mtrain_->outerIndexPtr();
+    const int *inner = mtrain_->innerIndexPtr();
+    const int *values = mtrain_->valuePtr();
+    double sum = 0.0;
+    int nrow = static_cast<int>(mtrain_->outerSize());
+    #pragma omp parallel for num_threads(nthread_) reduction(+:sum)
+    for (int j = 0; j < nrow; j++) {
+      for (int p = outer[j]; p < outer[j+1]; p++) {
+        if (held_out(p)) continue;
+        double val = values[p] - predict_rate(j, inner[p]);
+        sum += val * val;
+      }
+    }
+    return sqrt(sum / N);
+  }
+
+  /**
+   * Predict rates of users in a range for all items at once.
+   * @param begin first user index
+   * @param end last user index + 1
+   * @param rates output matrix (items x users)
+   */
+  virtual void predict_rates(int begin, int end, Mat &rates) const {
+    rates.noalias() =
+      V_.transpose() * U_.middleRows(begin, end - begin).transpose();
+  }
+
+  /**
+   * Called after a training matrix is set. (do nothing by default)
+   */
+  virtual void prepare_train() { }
+
+  /**
+   * Get the type of a model. (virtual function)
+   * @return model type
+   */
+  virtual ModelType model_type() const = 0;
+
+  /**
+   * Write a section of a snapshot.
+   * @param fp output file
+   * @param data data of the section
+   * @param size size of the section
+   */
+  static void write_section(FILE *fp, const void *data, size_t size) {
+    if (size > 0 && fwrite(data, 1, size, fp) != size) {
+      fprintf(stderr, "[Error] cannot write a snapshot\n");
+      exit(1);
+    }
+  }
+
+  /**
+   * Get a section of a mapped snapshot.
+   * @param cursor current position (moved to the next section)
+   * @param end end of the snapshot
+   * @param size size of the section
+   * @return address of the section
+   */
+  static char *read_section(char *&cursor, const char *end, size_t size) {
+    if (static_cast<size_t>(end - cursor) < size) {
+      fprintf(stderr, "[Error] broken snapshot\n");
+      exit(1);
+    }
+    char *section = cursor;
+    cursor += size;
+    return section;
+  }
+
+  /**
+   * Write the sections of a model.
+   * @param fp output file
+   */
+  virtual void write_sections(FILE *fp) const {
+    write_section(fp, U_.data(), sizeof(float) * U_.size());
+    write_section(fp, V_.data(), sizeof(float) * V_.size());
+  }
+
+  /**
+   * Read the sections of a model from a mapped snapshot.
+   * The matrices point to the mapped pages, which are copy-on-write.
+   * @param header header of the snapshot
+   * @param cursor current position (moved to the end of the model)
+   * @param end end of the snapshot
+   */
+  virtual void read_sections(const ModelFileHeader &header,
+                             char *&cursor, const char *end) {
+    size_t users = header.users;
+    size_t items = header.items;
+    size_t factors = header.factors;
+    map_matrix(U_, reinterpret_cast<float *>(
+      read_section(cursor, end, sizeof(float) * users * factors)),
+      header.users, header.factors);
+    map_matrix(V_, reinterpret_cast<float *>(
+      read_section(cursor, end, sizeof(float) * factors * items)),
+      header.factors, header.items);
+  }
+
  public:
   /**
    * Constructor.
    */
-  MatrixFactorizer() { }
+  MatrixFactorizer()
+    : mapped_ids_(false), mtrain_(&train_storage_), nfold_(0), fold_(0),
+      U_(NULL, 0, 0), V_(NULL, 0, 0), nthread_(1), seed_(DEFAULT_SEED),
+      mode_(TRAIN_SERIAL), stats_("ratings") { }
 
   /**
    * Destructor.
    */
   ~MatrixFactorizer() { }
 
+  /**
+   * Set the number of threads used in factorization.
+   * @param nthread the number of threads
+   */
+  void set_threads(size_t nthread) {
+    nthread_ = (nthread > 0) ? nthread : 1;
+  }
+
+  /**
+   * Set a seed of random number generator.
+   * The same seed gives the same initial matrices.
+   * @param seed seed
+   */
+  void set_seed(unsigned int seed) {
+    seed_ = seed;
+  }
+
+  /**
+   * Set how ratings are walked in factorization.
+   * (ignored by factorizers not using SGD)
+   * @param mode training mode
+   */
+  void set_train_mode(TrainMode mode) {
+    mode_ = mode;
+  }
+
+  /**
+   * Record statistics of loading, factorization and saving into a file.
+   * (see Stats for the format)
+   * @param filename output file name ("-": standard error)
+   * @return return true if succeeded
+   */
+  bool open_stats(const char *filename) {
+    return stats_.open(filename);
+  }
+
+  /**
+   * Record statistics into an open file. (not closed by the factorizer)
+   * @param fp output file
+   */
+  void open_stats(FILE *fp) {
+    stats_.open(fp);
+  }
+
   /**
    * Factorize a training matrix. (virtual function)
    * @param ncluster the number of clusters
@@ -177,8 +572,80 @@ class MatrixFactorizer {
    * Read a training file.
    * @param filename training file
    */
-  virtual void train(const char *filename) {
-    read_file(filename, mtrain_);
+  void train(const char *filename) {
+    double start = stats_.start();
+    use_own_matrix();
+    read_file(filename, train_storage_);
+    prepare_train();
+    stats_.phase("load", start, mtrain_->nonZeros());
+  }
+
+  /**
+   * Read a training file mapping user ids and item ids to compact
+   * indexes, so that the matrices have no rows for unused ids.
+   * Test files and rated files are mapped by the same maps, and
+   * recommended items are written with the original ids.
+   * @param filename training file
+   */
+  void train_compact(const char *filename) {
+    double start = stats_.start();
+    std::vector<Rating> ratings;
+    read_ratings(filename, ratings);
+    compact_ratings(ratings, user_ids_, item_ids_);
+    mapped_ids_ = true;
+    use_own_matrix();
+    build_rating_matrix(ratings, user_ids_.size(), item_ids_.size(),
+                        train_storage_);
+    prepare_train();
+    stats_.phase("load", start, mtrain_->nonZeros());
+  }
+
+  /**
+   * Set a training matrix.
+   * @param mat training matrix (copied)
+   */
+  void train(const SMat &mat) {
+    use_own_matrix();
+    train_storage_ = mat;
+    prepare_train();
+  }
+
+  /**
+   * Share a matrix for cross validation without copying it. The rates
+   * at positions p % nfold == fold are held out of training, and tested
+   * by test_fold(). (recommend() still skips them as rated)
+   * @param mat compressed training matrix (not copied, and must be kept
+   *            until the factorizer is destroyed or trained again)
+   * @param nfold the number of folds
+   * @param fold fold held out
+   */
+  void train(const SMat &mat, int nfold, int fold) {
+    train_storage_.resize(0, 0);
+    mtrain_ = &mat;
+    nfold_ = nfold;
+    fold_ = fold;
+    prepare_train();
+  }
+
+  /**
+   * Do test on the rates held out by train(mat, nfold, fold).
+   * @return RMSE(root mean square error)
+   */
+  double test_fold() const {
+    size_t ntest = mtrain_->nonZeros() - train_size();
+    if (nfold_ == 0 || ntest == 0) return -1;
+    const int *outer = mtrain_->outerIndexPtr();
+    const int *inner = mtrain_->innerIndexPtr();
+    const int *values = mtrain_->valuePtr();
+    double rmse = 0.0;
+    for (int j = 0; j < mtrain_->outerSize(); j++) {
+      for (int p = outer[j]; p < outer[j+1]; p++) {
+        if (!held_out(p)) continue;
+        int rate = round(predict_rate(j, inner[p]));
+        rmse += (rate - values[p]) * (rate - values[p]);
+      }
+    }
+    return sqrt(rmse / ntest);
   }
 
   /**
@@ -189,6 +656,15 @@ class MatrixFactorizer {
   double test(const char *filename) const {
     SMat mtest;
     read_file(filename, mtest);
+    return test(mtest);
+  }
+
+  /**
+   * Do test.
+   * @param mtest test matrix
+   * @return RMSE(root mean square error)
+   */
+  double test(const SMat &mtest) const {
     if (mtest.nonZeros() == 0) return -1;
     double rmse = 0.0;
     for (int j = 0; j < mtest.outerSize(); j++) {
@@ -208,8 +684,8 @@ class MatrixFactorizer {
    * Print all predicted rates.
    */
   void print_all_rate() const {
-    for (int i = 1; i < mtrain_.rows(); i++) {
-      for (int j = 1; j < mtrain_.cols(); j++) {
+    for (int i = 1; i < mtrain_->rows(); i++) {
+      for (int j = 1; j < mtrain_->cols(); j++) {
         printf("%d\t%d\t%.2f\n", i, j, predict_rate(i, j));
       }
     }
@@ -220,46 +696,149 @@ class MatrixFactorizer {
    * @param num the number of output rates
    */
   void print_top_rate(size_t num) const {
-    for (int i = 1; i < mtrain_.rows(); i++) {
-      std::priority_queue<std::pair<int, double>,
-                          std::vector<std::pair<int, double> >,
-                          GreaterPair<int, double> > pq;
-      for (int j = 1; j < mtrain_.cols(); j++) {
-        pq.push(std::pair<int, double>(j,predict_rate(i, j)));
-      }
-      for (size_t k = 0; k < num && !pq.empty(); k++) {
-        std::pair<int, double> p = pq.top();
-        printf("%d\t%d\t%.2f\n", i, p.first, p.second);
-        pq.pop();
-      }
+    recommend(stdout, num, false);
+  }
+
+  /**
+   * Write top n predicted rates of each user as
+   * "user \t item \t rate" lines.
+   * @param fp output file
+   * @param num the number of items for each user
+   * @param exclude_rated skip items rated in the training matrix
+   */
+  void recommend(FILE *fp, size_t num, bool exclude_rated) const {
+    write_recommend(fp, num, exclude_rated, NULL, NULL, false);
+  }
+
+  /**
+   * Save a model snapshot.
+   * @param filename output file name
+   */
+  void save_snapshot(const char *filename) const {
+    double start = stats_.start();
+    FILE *fp = fopen(filename, "wb");
+    if (fp == NULL) {
+      fprintf(stderr, "[Error] cannot open %s\n", filename);
+      exit(1);
+    }
+    ModelFileHeader header;
+    memcpy(header.magic, MODEL_FILE_MAGIC, sizeof(header.magic));
+    header.version = MODEL_FILE_VERSION;
+    header.type = model_type();
+    header.users = static_cast<int32_t>(U_.rows());
+    header.items = static_cast<int32_t>(V_.cols());
+    header.factors = static_cast<int32_t>(U_.cols());
+    write_section(fp, &header, sizeof(header));
+    write_sections(fp);
+    fclose(fp);
+    stats_.phase("save", start, 0);
+  }
+
+  /**
+   * Load a model snapshot saved by save_snapshot().
+   * The snapshot is mapped into memory instead of being read.
+   * @param filename snapshot file name
+   */
+  void load_snapshot(const char *filename) {
+    if (!snapshot_.open(filename, true)) {
+      fprintf(stderr, "[Error] cannot open %s\n", filename);
+      exit(1);
+    }
+    ModelFileHeader header;
+    if (snapshot_.size() < sizeof(header)) {
+      fprintf(stderr, "[Error] broken snapshot: %s\n", filename);
+      exit(1);
+    }
+    memcpy(&header, snapshot_.data(), sizeof(header));
+    if (memcmp(header.magic, MODEL_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != MODEL_FILE_VERSION) {
+      fprintf(stderr, "[Error] broken snapshot: %s\n", filename);
+      exit(1);
+    }
+    if (header.type != static_cast<uint32_t>(model_type())) {
+      fprintf(stderr, "[Error] model type mismatch: %s\n", filename);
+      exit(1);
+    }
+    // copy-on-write pages, so that the mapped model can be modified
+    char *cursor = const_cast<char *>(snapshot_.data()) + sizeof(header);
+    const char *end = snapshot_.data() + snapshot_.size();
+    read_sections(header, cursor, end);
+    if (cursor != end) {
+      fprintf(stderr, "[Error] broken snapshot: %s\n", filename);
+      exit(1);
+    }
+  }
+
+  /**
+   * Save the maps of ids made by train_compact().
+   * @param filename output file name
+   */
+  void save_id_maps(const char *filename) const {
+    write_id_maps(filename, user_ids_, item_ids_);
+  }
+
+  /**
+   * Load maps of ids of a model saved by save_id_maps().
+   * Call it after load_snapshot() and before read_rated().
+   * @param filename id map file
+   */
+  void load_id_maps(const char *filename) {
+    read_id_maps(filename, user_ids_, item_ids_);
+    if (user_ids_.size() != U_.rows() || item_ids_.size() != V_.cols()) {
+      fprintf(stderr, "[Error] id maps do not match the model: %s\n",
+              filename);
+      exit(1);
     }
+    mapped_ids_ = true;
+  }
+
+  /**
+   * Read rates used to skip rated items in recommend().
+   * (the model is not changed)
+   * @param filename a text file or a binary rating file
+   */
+  void read_rated(const char *filename) {
+    use_own_matrix();
+    read_file(filename, train_storage_);
   }
 
   /**
-   * Save a user matrix.
+   * Save a user matrix, a row per user (with the user id if ids are
+   * mapped).
    * @param filename output file name
    */
   void save_user_matrix(const char *filename) const {
-    save_matrix(filename, U_);
+    save_matrix(filename, U_, user_ids_);
   }
 
   /**
-   * Save a item matrix.
+   * Save a item matrix, a row per item (with the item id if ids are
+   * mapped).
    * @param filename output file name
    */
   void save_item_matrix(const char *filename) const {
-    save_matrix(filename, V_.transpose());
+    save_matrix(filename, V_.transpose(), item_ids_);
   }
 
-  void save_recommend(const char *filename, size_t max) const {
+  /**
+   * Save recommend items for each user. Candidates are items rated by
+   * users of the same cluster (the largest element of the user vector).
+   * @param filename output file name
+   * @param max the number of items for each user
+   * @param exclude_rated skip items rated by the user
+   */
+  void save_recommend(const char *filename, size_t max,
+                      bool exclude_rated = false) const {
     FILE *fp = fopen(filename, "w");
     if (fp == NULL) {
       fprintf(stderr, "[Error] cannot open %s\n", filename);
       exit(1);
     }
     // user cluster
-    std::vector<int> user_clusters(U_.rows());
-    for (int i = 0; i < U_.rows(); i++) {
+    int nuser = static_cast<int>(U_.rows());
+    std::vector<int> user_clusters(nuser);
+    #pragma omp parallel for num_threads(nthread_)
+    for (int i = 0; i < nuser; i++) {
       int max_idx = 0;
       double max_val = -1.0;
       for (int j = 0; j < U_.cols(); j++) {
@@ -271,118 +850,287 @@ class MatrixFactorizer {
       user_clusters[i] = max_idx;
     }
     // cluster items
-    std::vector<std::tr1::unordered_map<int, size_t> *>
-      cluster_item_maps(V_.rows());
-    std::tr1::unordered_map<int, size_t>::iterator cit;
-    for (int i = 0; i < mtrain_.outerSize(); i++) {
-      for (SMat::InnerIterator it(mtrain_, i); it; ++it) {
-//        if (it.value() < 3.0) continue;
-        int cluster_id = user_clusters[it.row()];
-        if (cluster_item_maps[cluster_id] == NULL) {
-          cluster_item_maps[cluster_id] =
-            new std::tr1::unordered_map<int, size_t>;
-        }
-        cit = cluster_item_maps[cluster_id]->find(it.col());
-        if (cit == cluster_item_maps[cluster_id]->end()) {
-          cluster_item_maps[cluster_id]->insert(
-            std::pair<int, size_t>(it.col(), 1));
-        } else {
-          cit->second += 1;
+    std::vector<std::vector<int> > cluster_items(U_.cols());
+    const int *outer = mtrain_->outerIndexPtr();
+    const int *inner = mtrain_->innerIndexPtr();
+    for (int i = 0; i < mtrain_->outerSize() && i < nuser; i++) {
+      for (int p = outer[i]; p < outer[i+1]; p++) {
+        if (!held_out(p) && inner[p] < V_.cols()) {
+          cluster_items[user_clusters[i]].push_back(inner[p]);
         }
       }
     }
-    // sort cluster items
-    std::vector<std::pair<int, double> > pairs;
-    std::vector<std::vector<int> > cluster_items(V_.rows());
-    for (size_t i = 0; i < cluster_item_maps.size(); i++) {
-      if (cluster_item_maps[i] == NULL) continue;
-      for (cit = cluster_item_maps[i]->begin();
-           cit != cluster_item_maps[i]->end(); ++cit) {
-        pairs.push_back(std::pair<int, size_t>(cit->first, cit->second));
-      }
-      sort(pairs.begin(), pairs.end(), greater_pair<int, size_t>);
-      for (size_t j = 0; j < pairs.size(); j++) {
-        cluster_items[i].push_back(pairs[j].first);
-      }
-      pairs.clear();
-    }
-    cluster_item_maps.clear();
-
-    for (int i = 1; i < U_.rows(); i++) {
-      fprintf(fp, "%d", i);
-      int cluster_id = user_clusters[i];
-      for (size_t j = 0; j < cluster_items[cluster_id].size(); j++) {
-        pairs.push_back(std::pair<int, double>(
-          cluster_items[cluster_id][j],
-          predict_rate(i, cluster_items[cluster_id][j])));
-      }
-      sort(pairs.begin(), pairs.end(), greater_pair<int, double>);
-      for (size_t j = 0; j < pairs.size() && j < max; j++) {
-        fprintf(fp, "\t%d", pairs[j].first);
-      }
-      fprintf(fp, "\n");
-      pairs.clear();
-    }
-    fclose(fp);
-    for (size_t i = 0; i < cluster_item_maps.size(); i++) {
-      if (cluster_item_maps[i]) delete cluster_item_maps[i];
-    }
-
-    /*
-    std::vector<std::pair<int, size_t> > pairs;
-    std::vector<std::vector<int> > cluster_items(V_.rows());
-    for (size_t i = 0; i < cluster_item_maps.size(); i++) {
-      if (cluster_item_maps[i] == NULL) continue;
-      for (cit = cluster_item_maps[i]->begin();
-           cit != cluster_item_maps[i]->end(); ++cit) {
-        pairs.push_back(std::pair<int, size_t>(cit->first, cit->second));
-      }
-      sort(pairs.begin(), pairs.end(), greater_pair<int, size_t>);
-      for (size_t j = 0; j < pairs.size() && j < max; j++) {
-        cluster_items[i].push_back(pairs[j].first);
-      }
-      pairs.clear();
-    }
-    cluster_item_maps.clear();
-
-    for (int i = 1; i < U_.rows(); i++) {
-      fprintf(fp, "%d", i);
-      int cluster_id = user_clusters[i];
-      for (size_t j = 0; j < cluster_items[cluster_id].size(); j++) {
-        fprintf(fp, "\t%d", cluster_items[cluster_id][j]);
-      }
-      fprintf(fp, "\n");
+    for (size_t i = 0; i < cluster_items.size(); i++) {
+      std::sort(cluster_items[i].begin(), cluster_items[i].end());
+      cluster_items[i].erase(
+        std::unique(cluster_items[i].begin(), cluster_items[i].end()),
+        cluster_items[i].end());
     }
+    write_recommend(fp, max, exclude_rated, &user_clusters, &cluster_items,
+                    true);
     fclose(fp);
-    for (size_t i = 0; i < cluster_item_maps.size(); i++) {
-      if (cluster_item_maps[i]) delete cluster_item_maps[i];
-    }
-    */
   }
 };
 
 
 /**
  * Matrix factorization using stochastic gradient descent.
+ *
+ * Ratings can be walked by one thread (TRAIN_SERIAL), by several threads
+ * updating the shared matrices without locks (TRAIN_HOGWILD), or by
+ * several threads each owning one block of a stratum whose blocks share
+ * no users and no items (TRAIN_BLOCK). TRAIN_BLOCK gives the same result
+ * for the same seed and the same number of threads, but not the result
+ * of TRAIN_SERIAL: the ratings are walked in another order, and the
+ * average of rates, shared by all ratings, is updated only in
+ * TRAIN_SERIAL.
  */
 class MatrixFactorizerSgd : public MatrixFactorizer {
- protected:
+ private:
+  typedef std::pair<int, int> Entry;  ///< (user, position in mtrain_)
+
   /**
-   * Predict a rate using user matrix and item matrix.
-   * @param user user index
-   * @param item item index
-   * @return a rate
+   * Get a learning rate decayed by the number of updated ratings.
+   * @param eta a tuning parameter
+   * @param count the number of updated ratings
+   * @param N the number of ratings in a training matrix
+   * @return learning rate
    */
-  double predict_rate(int user, int item) const {
-    assert(user < U_.rows() && item < V_.cols());
-    return U_.row(user).dot(V_.col(item));
+  static double decayed_eta(double eta, size_t count, size_t N) {
+    return eta / (1 + static_cast<double>(count) / N);
   }
 
- public:
   /**
-   * Constructor.
+   * Walk ratings in storage order with one thread.
    */
-  MatrixFactorizerSgd() { }
+  void loop_serial(size_t niter, double eta, double lambda) {
+    size_t count = 0;
+    size_t N = train_size();
+    const int *outer = mtrain_->outerIndexPtr();
+    const int *inner = mtrain_->innerIndexPtr();
+    const int *values = mtrain_->valuePtr();
+    for (size_t i = 0; i < niter; i++) {
+      double start = stats_.start();
+      double sse = 0.0;
+      begin_epoch();
+      for (int j = 0; j < mtrain_->outerSize(); j++) {
+        begin_user(j);
+        for (int p = outer[j]; p < outer[j+1]; p++) {
+          if (held_out(p)) continue;
+          count++;
+          double eta_2 = decayed_eta(eta, count, N);
+          double val = update(j, inner[p], values[p], eta_2, lambda);
+          update_average(eta_2 * val);
+          sse += val * val;
+        }
+        end_user(j, decayed_eta(eta, count, N), lambda);
+      }
+      end_epoch(decayed_eta(eta, count, N), lambda);
+      stats_.iteration(i + 1, start, N).value("train_rmse", sqrt(sse / N))
+            .end();
+    }
+  }
+
+  /**
+   * Walk users in parallel without locking the item matrix.
+   */
+  void loop_hogwild(size_t niter, double eta, double lambda) {
+    size_t N = train_size();
+    const int *outer = mtrain_->outerIndexPtr();
+    const int *inner = mtrain_->innerIndexPtr();
+    const int *values = mtrain_->valuePtr();
+    int nrow = static_cast<int>(mtrain_->outerSize());
+    for (size_t i = 0; i < niter; i++) {
+      double start = stats_.start();
+      double sse = 0.0;
+      begin_epoch();
+      #pragma omp parallel for num_threads(nthread_) schedule(dynamic, 64) \
+        reduction(+:sse)
+      for (int j = 0; j < nrow; j++) {
+        for (int p = outer[j]; p < outer[j+1]; p++) {
+          if (held_out(p)) continue;
+          double eta_2 = decayed_eta(eta, i * N + p + 1, N);
+          double val = update(j, inner[p], values[p], eta_2, lambda);
+          sse += val * val;
+        }
+      }
+      end_epoch(decayed_eta(eta, (i + 1) * N, N), lambda);
+      stats_.iteration(i + 1, start, N).value("train_rmse", sqrt(sse / N))
+            .end();
+    }
+  }
+
+  /**
+   * Walk nthread x nthread blocks of ratings, one stratum after another.
+   * Users are split into contiguous ranges holding almost the same number
+   * of ratings, items are split by their index modulo nthread.
+   */
+  void loop_block(size_t niter, double eta, double lambda) {
+    size_t N = train_size();
+    const int *outer = mtrain_->outerIndexPtr();
+    const int *inner = mtrain_->innerIndexPtr();
+    const int *values = mtrain_->valuePtr();
+    int nrow = static_cast<int>(mtrain_->outerSize());
+    int nblock = static_cast<int>(nthread_);
+
+    // split users into row blocks
+    std::vector<int> row_blocks(nrow);
+    for (int j = 0; j < nrow; j++) {
+      int b = static_cast<int>(
+        static_cast<double>(outer[j]) * nblock / (mtrain_->nonZeros() + 1));
+      row_blocks[j] = (b < nblock) ? b : nblock - 1;
+    }
+    // group ratings by blocks
+    std::vector<size_t> offsets(nblock * nblock + 1, 0);
+    for (int j = 0; j < nrow; j++) {
+      for (int p = outer[j]; p < outer[j+1]; p++) {
+        if (held_out(p)) continue;
+        offsets[row_blocks[j] * nblock + inner[p] % nblock + 1]++;
+      }
+    }
+    for (size_t b = 1; b < offsets.size(); b++) offsets[b] += offsets[b-1];
+    std::vector<Entry> entries(N);
+    std::vector<size_t> fill(offsets.begin(), offsets.end() - 1);
+    for (int j = 0; j < nrow; j++) {
+      for (int p = outer[j]; p < outer[j+1]; p++) {
+        if (held_out(p)) continue;
+        entries[fill[row_blocks[j] * nblock + inner[p] % nblock]++] =
+          Entry(j, p);
+      }
+    }
+
+    std::vector<int> strata(nblock);
+    for (int s = 0; s < nblock; s++) strata[s] = s;
+    for (size_t i = 0; i < niter; i++) {
+      double start = stats_.start();
+      double sse = 0.0;
+      begin_epoch();
+      for (int s = nblock - 1; s > 0; s--) {
+        std::swap(strata[s], strata[myrand(&seed_) % (s + 1)]);
+      }
+      for (int s = 0; s < nblock; s++) {
+        #pragma omp parallel for num_threads(nthread_) schedule(dynamic, 1) \
+          reduction(+:sse)
+        for (int b = 0; b < nblock; b++) {
+          size_t block = b * nblock + (b + strata[s]) % nblock;
+          for (size_t k = offsets[block]; k < offsets[block+1]; k++) {
+            int p = entries[k].second;
+            double eta_2 = decayed_eta(eta, i * N + p + 1, N);
+            double val = update(entries[k].first, inner[p], values[p],
+                                eta_2, lambda);
+            sse += val * val;
+          }
+        }
+      }
+      end_epoch(decayed_eta(eta, (i + 1) * N, N), lambda);
+      stats_.iteration(i + 1, start, N).value("train_rmse", sqrt(sse / N))
+            .end();
+    }
+  }
+
+ protected:
+  /**
+   * Predict a rate using user matrix and item matrix.
+   * @param user user index
+   * @param item item index
+   * @return a rate
+   */
+  double predict_rate(int user, int item) const {
+    assert(user < U_.rows() && item < V_.cols());
+    return U_.row(user).dot(V_.col(item));
+  }
+
+  /**
+   * Update the matrices by one rating.
+   * @param user user index
+   * @param item item index
+   * @param rate rate given by the user to the item
+   * @param eta learning rate
+   * @param lambda a tuning parameter
+   * @return prediction error of the rate before updating
+   */
+  virtual double update(int user, int item, double rate,
+                        double eta, double lambda) {
+    double val = rate - predict_rate(user, item);
+    U_.row(user) += eta * (val * V_.col(item).transpose()
+                           - lambda * U_.row(user));
+    V_.col(item) += eta * (val * U_.row(user).transpose()
+                           - lambda * V_.col(item));
+    return val;
+  }
+
+  /**
+   * Update the average of rates. (do nothing without biases)
+   * @param delta learning rate * prediction error
+   */
+  virtual void update_average(double delta) { }
+
+  /**
+   * Called at the beginning of each iteration. (do nothing by default)
+   */
+  virtual void begin_epoch() { }
+
+  /**
+   * Called at the end of each iteration. (do nothing by default)
+   * @param eta learning rate at the end of the iteration
+   * @param lambda a tuning parameter
+   */
+  virtual void end_epoch(double eta, double lambda) { }
+
+  /**
+   * Called before the ratings of a user in TRAIN_SERIAL.
+   * (do nothing by default)
+   * @param user user index
+   */
+  virtual void begin_user(int user) { }
+
+  /**
+   * Called after the ratings of a user in TRAIN_SERIAL.
+   * (do nothing by default)
+   * @param user user index
+   * @param eta learning rate after the ratings of the user
+   * @param lambda a tuning parameter
+   */
+  virtual void end_user(int user, double eta, double lambda) { }
+
+  /**
+   * Update the matrices by all ratings niter times.
+   * train_rmse of an iteration in the statistics is of the prediction
+   * errors before the updates.
+   * @param niter the number of iterations
+   * @param eta a tuning parameter
+   * @param lambda a tuning parameter
+   */
+  void sgd_loop(size_t niter, double eta, double lambda) {
+    if (train_size() == 0) return;
+    double start = stats_.start();
+    switch (mode_) {
+    case TRAIN_HOGWILD:
+      loop_hogwild(niter, eta, lambda);
+      break;
+    case TRAIN_BLOCK:
+      loop_block(niter, eta, lambda);
+      break;
+    default:
+      loop_serial(niter, eta, lambda);
+      break;
+    }
+    stats_.phase("update", start, niter * train_size());
+  }
+
+  /**
+   * Get the type of a model.
+   * @return model type
+   */
+  ModelType model_type() const {
+    return MODEL_SGD;
+  }
+
+ public:
+  /**
+   * Constructor.
+   */
+  MatrixFactorizerSgd() { }
 
   /**
    * Destructor.
@@ -397,25 +1145,12 @@ class MatrixFactorizerSgd : public MatrixFactorizer {
    * @param lambda a tuning parameter
    */
   void factorize(size_t ncluster, size_t niter, double eta, double lambda) {
-    size_t count = 0;
-    size_t N = mtrain_.nonZeros();
-    U_.resize(mtrain_.rows(), ncluster);
-    V_.resize(ncluster, mtrain_.cols());
+    double start = stats_.start();
+    resize_matrices(ncluster);
     set_matrix_random(U_);
     set_matrix_random(V_);
-    for (size_t i = 0; i < niter; i++) {
-      for (int j = 0; j < mtrain_.outerSize(); j++) {
-        for (SMat::InnerIterator it(mtrain_, j); it; ++it) {
-          count++;
-          double eta_2 = eta / (1 + static_cast<double>(count) / N);
-          double val = it.value() - predict_rate(it.row(), it.col());
-          U_.row(it.row()) += eta_2 * (val * V_.col(it.col()).transpose()
-                                       - lambda * U_.row(it.row()));
-          V_.col(it.col()) += eta_2 * (val * U_.row(it.row()).transpose()
-                                       - lambda * V_.col(it.col()));
-        }
-      }
-    }
+    stats_.phase("seed", start, 0);
+    sgd_loop(niter, eta, lambda);
   }
 };
 
@@ -453,17 +1188,113 @@ class MatrixFactorizerSgdBias : public MatrixFactorizerSgd {
     return bias(user, item) + U_.row(user).dot(V_.col(item));
   }
 
+  /**
+   * Add the biases to predicted rates of users in a range.
+   * @param begin first user index
+   * @param end last user index + 1
+   * @param rates predicted rates (items x users)
+   */
+  void add_biases(int begin, int end, Mat &rates) const {
+    Eigen::VectorXf item_biases(rates.rows());
+    for (int i = 0; i < rates.rows(); i++) item_biases(i) = item_biases_[i];
+    for (int k = 0; k < end - begin; k++) {
+      rates.col(k).array() += item_biases.array() +
+        static_cast<float>(average_rate_ + user_biases_[begin + k]);
+    }
+  }
+
+  /**
+   * Predict rates of users in a range for all items at once.
+   * @param begin first user index
+   * @param end last user index + 1
+   * @param rates output matrix (items x users)
+   */
+  void predict_rates(int begin, int end, Mat &rates) const {
+    MatrixFactorizerSgd::predict_rates(begin, end, rates);
+    add_biases(begin, end, rates);
+  }
+
+  /**
+   * Update the matrices and the biases by one rating.
+   * @param user user index
+   * @param item item index
+   * @param rate rate given by the user to the item
+   * @param eta learning rate
+   * @param lambda a tuning parameter
+   * @return prediction error of the rate before updating
+   */
+  double update(int user, int item, double rate, double eta, double lambda) {
+    double val = MatrixFactorizerSgd::update(user, item, rate, eta, lambda);
+    user_biases_[user] += eta * (val - lambda * user_biases_[user]);
+    item_biases_[item] += eta * (val - lambda * item_biases_[item]);
+    return val;
+  }
+
+  /**
+   * Update the average of rates.
+   * @param delta learning rate * prediction error
+   */
+  void update_average(double delta) {
+    average_rate_ += delta;
+  }
+
+  /**
+   * Set the average of rates in a training matrix.
+   */
+  void prepare_train() {
+    average_rate_ = train_average();
+  }
+
+  /**
+   * Get the type of a model.
+   * @return model type
+   */
+  ModelType model_type() const {
+    return MODEL_SGD_BIAS;
+  }
+
+  /**
+   * Write the sections of a model with the biases (as float32).
+   * @param fp output file
+   */
+  void write_sections(FILE *fp) const {
+    MatrixFactorizerSgd::write_sections(fp);
+    std::vector<float> values;
+    values.reserve(1 + user_biases_.size() + item_biases_.size());
+    values.push_back(static_cast<float>(average_rate_));
+    values.insert(values.end(), user_biases_.begin(), user_biases_.end());
+    values.insert(values.end(), item_biases_.begin(), item_biases_.end());
+    write_section(fp, &values[0], sizeof(float) * values.size());
+  }
+
+  /**
+   * Read the sections of a model with the biases.
+   * @param header header of the snapshot
+   * @param cursor current position (moved to the end of the model)
+   * @param end end of the snapshot
+   */
+  void read_sections(const ModelFileHeader &header,
+                     char *&cursor, const char *end) {
+    MatrixFactorizerSgd::read_sections(header, cursor, end);
+    const float *values = reinterpret_cast<const float *>(read_section(
+      cursor, end, sizeof(float) * (1 + header.users + header.items)));
+    average_rate_ = values[0];
+    user_biases_.assign(values + 1, values + 1 + header.users);
+    item_biases_.assign(values + 1 + header.users,
+                        values + 1 + header.users + header.items);
+  }
+
   /**
    * Set random values to the biases of users and items
    */
   void set_biases_random() {
-    user_biases_.resize(mtrain_.rows());
-    item_biases_.resize(mtrain_.cols());
-    for (int i = 0; i < mtrain_.rows(); i++) {
-      user_biases_[i] = static_cast<double>(rand()) / RAND_MAX;
+    user_biases_.resize(mtrain_->rows());
+    item_biases_.resize(mtrain_->cols());
+    for (int i = 0; i < mtrain_->rows(); i++) {
+      user_biases_[i] = static_cast<double>(myrand(&seed_)) / RAND_MAX;
     }
-    for (int i = 0; i < mtrain_.cols(); i++) {
-      item_biases_[i] = static_cast<double>(rand()) / RAND_MAX;
+    for (int i = 0; i < mtrain_->cols(); i++) {
+      item_biases_[i] = static_cast<double>(myrand(&seed_)) / RAND_MAX;
     }
   }
 
@@ -478,15 +1309,6 @@ class MatrixFactorizerSgdBias : public MatrixFactorizerSgd {
    */
   ~MatrixFactorizerSgdBias() { }
 
-  /**
-   * Read a training file.
-   * @param filename training file
-   */
-  void train(const char *filename) {
-    read_file(filename, mtrain_);
-    average_rate_ = matrix_average(mtrain_);
-  }
-
   /**
    * Factorize a training matrix.
    * @param ncluster the number of clusters
@@ -495,31 +1317,13 @@ class MatrixFactorizerSgdBias : public MatrixFactorizerSgd {
    * @param lambda a tuning parameter
    */
   void factorize(size_t ncluster, size_t niter, double eta, double lambda) {
-    size_t count = 0;
-    size_t N = mtrain_.nonZeros();
-    U_.resize(mtrain_.rows(), ncluster);
-    V_.resize(ncluster, mtrain_.cols());
+    double start = stats_.start();
+    resize_matrices(ncluster);
     set_matrix_random(U_);
     set_matrix_random(V_);
     set_biases_random();
-    for (size_t i = 0; i < niter; i++) {
-      for (int j = 0; j < mtrain_.outerSize(); j++) {
-        for (SMat::InnerIterator it(mtrain_, j); it; ++it) {
-          count++;
-          double eta_2 = eta / (1 + static_cast<double>(count) / N);
-          double val = it.value() - predict_rate(it.row(), it.col());
-          U_.row(it.row()) += eta_2 * (val * V_.col(it.col()).transpose()
-                                       - lambda * U_.row(it.row()));
-          V_.col(it.col()) += eta_2 * (val * U_.row(it.row()).transpose()
-                                       - lambda * V_.col(it.col()));
-          average_rate_ += eta_2 * val;
-          user_biases_[it.row()] +=
-            eta_2 * (val - lambda * user_biases_[it.row()]);
-          item_biases_[it.col()] +=
-            eta_2 * (val - lambda * item_biases_[it.col()]);
-        }
-      }
-    }
+    stats_.phase("seed", start, 0);
+    sgd_loop(niter, eta, lambda);
   }
 };
 
@@ -527,38 +1331,76 @@ class MatrixFactorizerSgdBias : public MatrixFactorizerSgd {
  * SVD++
  * Matrix factorization using stochastic gradient descent with biases
  * and implicit information (rental hisotry, ..)
+ *
+ * The implicit value of a user is kept in Z_ while the ratings of the
+ * user are updated, and the gradient of Y_ is applied once per user
+ * (TRAIN_SERIAL) or once per iteration (parallel modes).
  */
 class MatrixFactorizerSvdpp : public MatrixFactorizerSgdBias {
  private:
   typedef std::vector<std::vector<int> > Implicit;
-  Implicit implicit_;  ///< impclit information
-  Mat Y_;              ///< bias of impclit information
+  Implicit implicit_;            ///< impclit information
+  Mat implicit_storage_;         ///< storage of Y_
+  Mat implicit_value_storage_;   ///< storage of Z_
+  MatMap Y_;                     ///< bias of impclit information
+  MatMap Z_;                     ///< implicit value of each user (cached)
+  Mat Ygrad_;                    ///< gradient of Y_ accumulated for each user
 
   /**
    * Set implicit information
    */
   void set_implicit_information() {
-    implicit_.resize(mtrain_.rows());
-    for (int j = 0; j < mtrain_.outerSize(); j++) {
-      for (SMat::InnerIterator it(mtrain_, j); it; ++it) {
-        implicit_[it.row()].push_back(it.col());
+    implicit_.clear();
+    implicit_.resize(mtrain_->rows());
+    const int *outer = mtrain_->outerIndexPtr();
+    const int *inner = mtrain_->innerIndexPtr();
+    for (int j = 0; j < mtrain_->outerSize(); j++) {
+      for (int p = outer[j]; p < outer[j+1]; p++) {
+        if (!held_out(p)) implicit_[j].push_back(inner[p]);
       }
     }
   }
 
   /**
-   * Get the bias values of implicit information
+   * Update the cached implicit value of a user.
    * @param user user index
-   * @return the vector of implicit bias
    */
-  Eigen::VectorXf implicit_value(int user) const {
-    Eigen::VectorXf vec = Eigen::VectorXf::Zero(Y_.rows());
-    if (implicit_[user].size() == 0) return vec;
+  void update_implicit_value(int user) {
+    Z_.col(user).setZero();
+    if (implicit_[user].size() == 0) return;
     for (size_t i = 0; i < implicit_[user].size(); i++) {
-      vec += Y_.col(implicit_[user][i]);
+      Z_.col(user) += Y_.col(implicit_[user][i]);
+    }
+    Z_.col(user) *= pow(static_cast<double>(implicit_[user].size()), -0.5);
+  }
+
+  /**
+   * Update the cached implicit values of all users.
+   */
+  void update_implicit_values() {
+    int nuser = static_cast<int>(implicit_.size());
+    #pragma omp parallel for num_threads(nthread_) schedule(dynamic, 64)
+    for (int i = 0; i < nuser; i++) {
+      update_implicit_value(i);
+    }
+  }
+
+  /**
+   * Apply the accumulated gradient of a user to Y_.
+   * @param user user index
+   * @param eta learning rate
+   * @param lambda a tuning parameter
+   */
+  void apply_implicit_gradient(int user, double eta, double lambda) {
+    if (implicit_[user].empty()) return;
+    // each Y_ column was regularized once per rating of the user
+    double decay = pow(1.0 - eta * lambda / 2.0,
+                       static_cast<double>(implicit_[user].size()));
+    for (size_t k = 0; k < implicit_[user].size(); k++) {
+      Y_.col(implicit_[user][k]) =
+        decay * Y_.col(implicit_[user][k]) + Ygrad_.col(user);
     }
-    vec *= pow(static_cast<double>(implicit_[user].size()), -0.5);
-    return vec;
+    Ygrad_.col(user).setZero();
   }
 
  protected:
@@ -570,13 +1412,155 @@ class MatrixFactorizerSvdpp : public MatrixFactorizerSgdBias {
    */ 
   double predict_rate(int user, int item) const {
     return bias(user, item) + V_.col(item).transpose().dot(
-      U_.row(user).transpose() + implicit_value(user));
+      U_.row(user).transpose() + Z_.col(user));
 //    double rate = bias(user, item) + V_.col(item).transpose().dot(
-//      U_.row(user).transpose() + implicit_value(user));
+//      U_.row(user).transpose() + Z_.col(user));
 //    return (rate > 5.0) ? 5.0 : (rate < 3.0) ? 3.0 : rate;
   }
 
+  /**
+   * Predict rates of users in a range for all items at once.
+   * @param begin first user index
+   * @param end last user index + 1
+   * @param rates output matrix (items x users)
+   */
+  void predict_rates(int begin, int end, Mat &rates) const {
+    rates.noalias() = V_.transpose() *
+      (U_.middleRows(begin, end - begin).transpose() +
+       Z_.middleCols(begin, end - begin));
+    add_biases(begin, end, rates);
+  }
+
+  /**
+   * Update the matrices and the biases by one rating, and accumulate
+   * the gradient of Y_ for the user.
+   * @param user user index
+   * @param item item index
+   * @param rate rate given by the user to the item
+   * @param eta learning rate
+   * @param lambda a tuning parameter
+   * @return prediction error of the rate before updating
+   */
+  double update(int user, int item, double rate, double eta, double lambda) {
+    double val = rate - predict_rate(user, item);
+
+    U_.row(user) += eta * (val * V_.col(item).transpose()
+                           - lambda * U_.row(user));
+    V_.col(item) += eta * (val * (U_.row(user).transpose() + Z_.col(user))
+                           - lambda * V_.col(item));
+    user_biases_[user] += eta * (val - lambda * user_biases_[user]);
+    item_biases_[item] += eta * (val - lambda * item_biases_[item]);
+    double coeff = pow(implicit_[user].size(), -0.5);
+    Ygrad_.col(user) += eta * val * coeff * V_.col(item);
+    return val;
+  }
+
+  /**
+   * Update the implicit values before parallel iteration,
+   * where Y_ is modified only at the end of the iteration.
+   */
+  void begin_epoch() {
+    if (mode_ != TRAIN_SERIAL) update_implicit_values();
+  }
+
+  /**
+   * Apply the gradients of Y_ accumulated in parallel iteration.
+   * @param eta learning rate at the end of the iteration
+   * @param lambda a tuning parameter
+   */
+  void end_epoch(double eta, double lambda) {
+    if (mode_ == TRAIN_SERIAL) return;
+    for (size_t i = 0; i < implicit_.size(); i++) {
+      apply_implicit_gradient(i, eta, lambda);
+    }
+  }
+
+  /**
+   * Update the implicit value of a user before the ratings of the user.
+   * @param user user index
+   */
+  void begin_user(int user) {
+    update_implicit_value(user);
+  }
+
+  /**
+   * Apply the gradient of Y_ after the ratings of a user.
+   * @param user user index
+   * @param eta learning rate after the ratings of the user
+   * @param lambda a tuning parameter
+   */
+  void end_user(int user, double eta, double lambda) {
+    apply_implicit_gradient(user, eta, lambda);
+  }
+
+  /**
+   * Get the type of a model.
+   * @return model type
+   */
+  ModelType model_type() const {
+    return MODEL_SVDPP;
+  }
+
+  /**
+   * Write the sections of a model with the implicit information.
+   * @param fp output file
+   */
+  void write_sections(FILE *fp) const {
+    MatrixFactorizerSgdBias::write_sections(fp);
+    write_section(fp, Y_.data(), sizeof(float) * Y_.size());
+    write_section(fp, Z_.data(), sizeof(float) * Z_.size());
+    std::vector<int32_t> offsets(1, 0);
+    for (size_t i = 0; i < implicit_.size(); i++) {
+      offsets.push_back(offsets.back() + implicit_[i].size());
+    }
+    write_section(fp, &offsets[0], sizeof(int32_t) * offsets.size());
+    for (size_t i = 0; i < implicit_.size(); i++) {
+      if (implicit_[i].empty()) continue;
+      write_section(fp, &implicit_[i][0], sizeof(int) * implicit_[i].size());
+    }
+  }
+
+  /**
+   * Read the sections of a model with the implicit information.
+   * @param header header of the snapshot
+   * @param cursor current position (moved to the end of the model)
+   * @param end end of the snapshot
+   */
+  void read_sections(const ModelFileHeader &header,
+                     char *&cursor, const char *end) {
+    MatrixFactorizerSgdBias::read_sections(header, cursor, end);
+    size_t users = header.users;
+    size_t items = header.items;
+    size_t factors = header.factors;
+    map_matrix(Y_, reinterpret_cast<float *>(
+      read_section(cursor, end, sizeof(float) * factors * items)),
+      header.factors, header.items);
+    map_matrix(Z_, reinterpret_cast<float *>(
+      read_section(cursor, end, sizeof(float) * factors * users)),
+      header.factors, header.users);
+    const int32_t *offsets = reinterpret_cast<const int32_t *>(
+      read_section(cursor, end, sizeof(int32_t) * (users + 1)));
+    const int32_t *items_rated = reinterpret_cast<const int32_t *>(
+      read_section(cursor, end, sizeof(int32_t) * offsets[users]));
+    implicit_.clear();
+    implicit_.resize(users);
+    for (size_t i = 0; i < users; i++) {
+      implicit_[i].assign(items_rated + offsets[i],
+                          items_rated + offsets[i + 1]);
+    }
+  }
+
  public:
+  /**
+   * Constructor.
+   */
+  MatrixFactorizerSvdpp() : Y_(NULL, 0, 0), Z_(NULL, 0, 0) { }
+
+  /**
+   * Destructor.
+   */
+  ~MatrixFactorizerSvdpp() { }
+
   /**
    * Factorize a training matrix.
    * @param ncluster the number of clusters
@@ -585,43 +1569,333 @@ class MatrixFactorizerSvdpp : public MatrixFactorizerSgdBias {
    * @param lambda a tuning parameter
    */
   void factorize(size_t ncluster, size_t niter, double eta, double lambda) {
-    size_t count = 0;
-    size_t N = mtrain_.nonZeros();
-    U_.resize(mtrain_.rows(), ncluster);
-    V_.resize(ncluster, mtrain_.cols());
-    Y_.resize(ncluster, mtrain_.cols());
+    double start = stats_.start();
+    resize_matrices(ncluster);
+    resize_matrix(implicit_storage_, Y_, ncluster, mtrain_->cols());
+    resize_matrix(implicit_value_storage_, Z_, ncluster, mtrain_->rows());
     set_matrix_random(U_);
     set_matrix_random(V_);
     set_matrix_random(Y_);
     set_biases_random();
     set_implicit_information();
+    Z_.setZero();
+    Ygrad_ = Mat::Zero(ncluster, mtrain_->rows());
+    stats_.phase("seed", start, 0);
+    sgd_loop(niter, eta, lambda);
+    update_implicit_values();
+  }
+};
+
+
+/**
+ * Matrix factorization using alternating least squares.
+ * Each half-step solves the k x k normal equations of all users with
+ * the item matrix fixed, and then of all items with the user matrix
+ * fixed. The rows are independent, so they are solved in parallel
+ * (set_threads()) without write conflicts. lambda is weighted by the
+ * number of ratings of each row (ALS-WR), and eta is not used.
+ */
+class MatrixFactorizerAls : public MatrixFactorizer {
+ private:
+  SMat mitem_;  ///< transposed training matrix (items x users)
+
+  /**
+   * Make the transposed matrix of the trained rates.
+   * @param mat output matrix (items x users)
+   */
+  void transpose_train(SMat &mat) const {
+    const int *outer = mtrain_->outerIndexPtr();
+    const int *inner = mtrain_->innerIndexPtr();
+    const int *values = mtrain_->valuePtr();
+    int nrow = static_cast<int>(mtrain_->outerSize());
+    int ncol = static_cast<int>(mtrain_->cols());
+    mat.resize(ncol, nrow);
+    mat.resizeNonZeros(train_size());
+    int *offsets = mat.outerIndexPtr();
+    std::fill(offsets, offsets + ncol + 1, 0);
+    for (int j = 0; j < nrow; j++) {
+      for (int p = outer[j]; p < outer[j+1]; p++) {
+        if (!held_out(p)) offsets[inner[p] + 1]++;
+      }
+    }
+    for (int i = 0; i < ncol; i++) offsets[i+1] += offsets[i];
+    std::vector<int> fill(offsets, offsets + ncol);
+    for (int j = 0; j < nrow; j++) {
+      for (int p = outer[j]; p < outer[j+1]; p++) {
+        if (held_out(p)) continue;
+        int q = fill[inner[p]]++;
+        mat.innerIndexPtr()[q] = j;
+        mat.valuePtr()[q] = values[p];
+      }
+    }
+  }
+
+  /**
+   * Solve the factors of all rows of a matrix.
+   * @param mat ratings (users x items, or items x users)
+   * @param masked skip the rates held out (mat is the training matrix)
+   * @param F fixed factors of the columns of mat (k x cols)
+   * @param lambda a tuning parameter
+   * @param X output factors of the rows of mat (k x rows)
+   */
+  void solve_rows(const SMat &mat, bool masked, const Mat &F, double lambda,
+                  Mat &X) const {
+    Mat FtF;
+    prepare_solve(F, FtF);
+    X.resize(F.rows(), mat.rows());
+    int nrow = static_cast<int>(mat.rows());
+    #pragma omp parallel for num_threads(nthread_) schedule(dynamic, 64)
+    for (int i = 0; i < nrow; i++) {
+      Mat A(F.rows(), F.rows());
+      Eigen::VectorXf b(F.rows());
+      X.col(i) = solve_row(mat, masked, i, F, FtF, lambda, A, b);
+    }
+  }
+
+ protected:
+  /**
+   * Predict a rate using user matrix and item matrix.
+   * @param user user index
+   * @param item item index
+   * @return a rate
+   */
+  double predict_rate(int user, int item) const {
+    assert(user < U_.rows() && item < V_.cols());
+    return U_.row(user).dot(V_.col(item));
+  }
+
+  /**
+   * Prepare to solve the rows of a half-step. (do nothing by default)
+   * @param F fixed factors (k x cols)
+   * @param FtF output data shared by the rows
+   */
+  virtual void prepare_solve(const Mat &F, Mat &FtF) const { }
+
+  /**
+   * Solve the factors of a row minimizing
+   * sum_j (r_ij - x . f_j)^2 + lambda * n_i * |x|^2.
+   * @param mat ratings
+   * @param masked skip the rates held out
+   * @param row row index
+   * @param F fixed factors (k x cols)
+   * @param FtF data given by prepare_solve()
+   * @param lambda a tuning parameter
+   * @param A work matrix (k x k)
+   * @param b work vector (k)
+   * @return factors of the row
+   */
+  virtual Eigen::VectorXf solve_row(const SMat &mat, bool masked, int row,
+                                    const Mat &F, const Mat &FtF,
+                                    double lambda, Mat &A,
+                                    Eigen::VectorXf &b) const {
+    int begin = mat.outerIndexPtr()[row];
+    int end = mat.outerIndexPtr()[row+1];
+    const int *inner = mat.innerIndexPtr();
+    const int *values = mat.valuePtr();
+    A.setZero();
+    b.setZero();
+    int n = 0;
+    for (int j = begin; j < end; j++) {
+      if (masked && held_out(j)) continue;
+      A.selfadjointView<Eigen::Lower>().rankUpdate(F.col(inner[j]));
+      b += values[j] * F.col(inner[j]);
+      n++;
+    }
+    if (n == 0) return Eigen::VectorXf::Zero(F.rows());
+    A.diagonal().array() += lambda * n;
+    return A.selfadjointView<Eigen::Lower>().ldlt().solve(b);
+  }
+
+  /**
+   * Get the type of a model.
+   * @return model type
+   */
+  ModelType model_type() const {
+    return MODEL_ALS;
+  }
+
+  /**
+   * Get the name of the objective in the statistics.
+   * @return name of the objective
+   */
+  virtual const char *objective_name() const {
+    return "train_rmse";
+  }
+
+  /**
+   * Compute the objective of the current factors (RMSE of the training
+   * matrix).
+   * @param lambda a tuning parameter
+   * @return objective
+   */
+  virtual double objective(double lambda) const {
+    return train_rmse();
+  }
+
+ public:
+  /**
+   * Constructor.
+   */
+  MatrixFactorizerAls() { }
+
+  /**
+   * Destructor.
+   */
+  ~MatrixFactorizerAls() { }
+
+  /**
+   * Factorize a training matrix.
+   * @param ncluster the number of clusters
+   * @param niter the number of iterations
+   * @param eta not used
+   * @param lambda a tuning parameter
+   */
+  void factorize(size_t ncluster, size_t niter, double eta, double lambda) {
+    double start = stats_.start();
+    resize_matrices(ncluster);
+    set_matrix_random(U_);
+    set_matrix_random(V_);
+    transpose_train(mitem_);
+    stats_.phase("seed", start, 0);
+    double update_start = stats_.start();
+    size_t N = train_size();
+    Mat F, X;
     for (size_t i = 0; i < niter; i++) {
-      for (int j = 0; j < mtrain_.outerSize(); j++) {
-        for (SMat::InnerIterator it(mtrain_, j); it; ++it) {
-          Eigen::VectorXf vec = implicit_value(it.row());
-          count++;
-          double eta_2 = eta / (1 + static_cast<double>(count) / N);
-          double val = it.value() - predict_rate(it.row(), it.col());
-
-          U_.row(it.row()) += eta_2 * (val * V_.col(it.col()).transpose()
-                                       - lambda * U_.row(it.row()));
-          V_.col(it.col()) +=
-            eta_2 * (val * (U_.row(it.row()).transpose() + vec)
-                     - lambda * V_.col(it.col()));
-          average_rate_ += eta_2 * val;
-          user_biases_[it.row()] +=
-            eta_2 * (val - lambda * user_biases_[it.row()]);
-          item_biases_[it.col()] +=
-            eta_2 * (val - lambda * item_biases_[it.col()]);
-          double coeff = pow(implicit_[it.row()].size(), -0.5);
-          for (size_t k = 0; k < implicit_[it.row()].size(); k++) {
-            Y_.col(implicit_[it.row()][k]) +=
-              eta_2 * (val * coeff * V_.col(it.col())
-                - lambda / 2.0 * Y_.col(implicit_[it.row()][k]));
-          }
-        }
+      start = stats_.start();
+      F = V_;
+      solve_rows(*mtrain_, true, F, lambda, X);
+      U_ = X.transpose();
+      F = U_.transpose();
+      solve_rows(mitem_, false, F, lambda, X);
+      V_ = X;
+      if (stats_.enabled()) {
+        stats_.iteration(i + 1, start, N)
+              .value(objective_name(), objective(lambda)).end();
       }
     }
+    stats_.phase("update", update_start, niter * N);
+    mitem_.resize(0, 0);
+  }
+};
+
+/**
+ * Matrix factorization of implicit feedback using weighted alternating
+ * least squares. (Hu, Koren and Volinsky, 2008)
+ * A rate r is taken as preference 1 with confidence 1 + alpha * r, and
+ * unrated items as preference 0 with confidence 1. Predicted values are
+ * preferences, so they are used for ranking (recommend()).
+ */
+class MatrixFactorizerAlsImplicit : public MatrixFactorizerAls {
+ private:
+  double alpha_;  ///< weight of confidence
+
+ protected:
+  /**
+   * Compute F F^T shared by the rows.
+   * @param F fixed factors (k x cols)
+   * @param FtF output F F^T
+   */
+  void prepare_solve(const Mat &F, Mat &FtF) const {
+    FtF.noalias() = F * F.transpose();
+  }
+
+  /**
+   * Solve the factors of a row minimizing
+   * sum_j c_ij (p_ij - x . f_j)^2 + lambda * |x|^2, where only rated
+   * columns are visited using F F^T.
+   * @param mat ratings
+   * @param masked skip the rates held out
+   * @param row row index
+   * @param F fixed factors (k x cols)
+   * @param FtF F F^T
+   * @param lambda a tuning parameter
+   * @param A work matrix (k x k)
+   * @param b work vector (k)
+   * @return factors of the row
+   */
+  Eigen::VectorXf solve_row(const SMat &mat, bool masked, int row,
+                            const Mat &F, const Mat &FtF, double lambda,
+                            Mat &A, Eigen::VectorXf &b) const {
+    int begin = mat.outerIndexPtr()[row];
+    int end = mat.outerIndexPtr()[row+1];
+    const int *inner = mat.innerIndexPtr();
+    const int *values = mat.valuePtr();
+    A = FtF;
+    A.diagonal().array() += lambda;
+    b.setZero();
+    int n = 0;
+    for (int j = begin; j < end; j++) {
+      if (masked && held_out(j)) continue;
+      n++;
+      double confidence = 1.0 + alpha_ * values[j];
+      A.selfadjointView<Eigen::Lower>().rankUpdate(F.col(inner[j]),
+                                                   confidence - 1.0);
+      b += confidence * F.col(inner[j]);
+    }
+    if (n == 0) return Eigen::VectorXf::Zero(F.rows());
+    return A.selfadjointView<Eigen::Lower>().ldlt().solve(b);
+  }
+
+  /**
+   * Get the type of a model.
+   * @return model type
+   */
+  ModelType model_type() const {
+    return MODEL_ALS_IMPLICIT;
+  }
+
+  /**
+   * Get the name of the objective in the statistics.
+   * @return name of the objective
+   */
+  const char *objective_name() const {
+    return "cost";
+  }
+
+  /**
+   * Compute the minimized cost
+   * sum_ij c_ij (p_ij - x_ij)^2 + lambda * (|U|^2 + |V|^2),
+   * where the unrated part sum_ij x_ij^2 is trace(U^T U V V^T).
+   * @param lambda a tuning parameter
+   * @return cost
+   */
+  double objective(double lambda) const {
+    Mat UtU = U_.transpose() * U_;
+    Mat VVt = V_ * V_.transpose();
+    double cost = UtU.cwiseProduct(VVt).sum();
+    const int *outer = mtrain_->outerIndexPtr();
+    const int *inner = mtrain_->innerIndexPtr();
+    const int *values = mtrain_->valuePtr();
+    int nrow = static_cast<int>(mtrain_->outerSize());
+    #pragma omp parallel for num_threads(nthread_) reduction(+:cost)
+    for (int j = 0; j < nrow; j++) {
+      for (int p = outer[j]; p < outer[j+1]; p++) {
+        if (held_out(p)) continue;
+        double x = predict_rate(j, inner[p]);
+        double confidence = 1.0 + alpha_ * values[p];
+        cost += confidence * (1.0 - x) * (1.0 - x) - x * x;
+      }
+    }
+    return cost + lambda * (U_.squaredNorm() + V_.squaredNorm());
+  }
+
+ public:
+  /**
+   * Constructor.
+   */
+  MatrixFactorizerAlsImplicit() : alpha_(40.0) { }
+
+  /**
+   * Destructor.
+   */
+  ~MatrixFactorizerAlsImplicit() { }
+
+  /**
+   * Set the weight of confidence.
+   * @param alpha weight of confidence (default: 40)
+   */
+  void set_alpha(double alpha) {
+    alpha_ = alpha;
   }
 };
 
@@ -0,0 +1,333 @@
+//
+// Benchmark of the mf library
+//
+// Copyright(C) 2010  Mizuki Fujisawa <fujisawa@bayon.cc>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 2 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <set>
+#include <string>
+#include <vector>
+#include "factorizer.h"
+
+/* constants of the synthetic data set (MovieLens 100K sized) */
+const int NUM_USERS = 943;
+const int NUM_ITEMS = 1682;
+const int NUM_RATES = 100000;
+const int NUM_TRUE_FACTORS = 5;
+const unsigned int DATA_SEED = 20100101;
+
+/* options of benchmark */
+struct BenchOption {
+  size_t nthread;
+  size_t ncluster;
+  size_t niter;
+  bool json;
+};
+
+/* result of a stage */
+struct BenchResult {
+  std::string stage;
+  std::string name;
+  double seconds;
+  double rmse;   ///< negative if not measured
+  double rates;  ///< rates processed in the stage (0 if not counted)
+};
+
+/* function prototypes */
+int main(int argc, char **argv);
+static void usage(const char *progname);
+static void make_data(const char *filename);
+static void add_result(const char *stage, const char *name, double seconds,
+                       double rmse, double rates,
+                       std::vector<BenchResult> &results);
+static void print_tsv(const std::vector<BenchResult> &results);
+static void print_json(const char *progname, const BenchOption &option,
+                       const std::vector<BenchResult> &results);
+template <typename MF>
+static void bench_factorizer(const char *name, const BenchOption &option,
+                             MF &mf, const mf::SMat &mtrain,
+                             const mf::SMat &mtest, double eta, double lambda,
+                             std::vector<BenchResult> &results);
+
+int main(int argc, char **argv) {
+  BenchOption option;
+  option.nthread = 1;
+  option.ncluster = 10;
+  option.niter = 10;
+  option.json = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "t:k:n:j")) != -1) {
+    switch (opt) {
+    case 't':
+      option.nthread = atoi(optarg);
+      break;
+    case 'k':
+      option.ncluster = atoi(optarg);
+      break;
+    case 'n':
+      option.niter = atoi(optarg);
+      break;
+    case 'j':
+      option.json = true;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (argc - optind != 1) usage(argv[0]);
+  std::string dirname(argv[optind]);
+  std::string textname = dirname + "/mfbench.tsv";
+  std::string binname = dirname + "/mfbench.bin";
+
+  make_data(textname.c_str());
+  std::vector<BenchResult> results;
+
+  // load
+  mf::SMat mat;
+  double start = mf::Stats::now();
+  mf::read_rating_text(textname.c_str(), mat);
+  add_result("load", "text", mf::Stats::now() - start, -1, mat.nonZeros(),
+             results);
+  mf::write_rating_binary(binname.c_str(), mat);
+  start = mf::Stats::now();
+  mf::read_rating_binary(binname.c_str(), mat);
+  add_result("load", "binary", mf::Stats::now() - start, -1, mat.nonZeros(),
+             results);
+
+  mf::SMat mtrain, mtest;
+  mf::split_rating_fold(mat, 5, 0, mtrain, mtest);
+
+  // factorize and test
+  {
+    mf::MatrixFactorizerSgd mf;
+    bench_factorizer("sgd-serial", option, mf, mtrain, mtest, 0.01, 0.02,
+                     results);
+  }
+  {
+    mf::MatrixFactorizerSgdBias mf;
+    mf.set_train_mode(mf::MatrixFactorizer::TRAIN_SERIAL);
+    bench_factorizer("sgdbias-serial", option, mf, mtrain, mtest, 0.01, 0.02,
+                     results);
+  }
+  {
+    mf::MatrixFactorizerSgdBias mf;
+    mf.set_train_mode(mf::MatrixFactorizer::TRAIN_HOGWILD);
+    bench_factorizer("sgdbias-hogwild", option, mf, mtrain, mtest, 0.01, 0.02,
+                     results);
+  }
+  {
+    mf::MatrixFactorizerSgdBias mf;
+    mf.set_train_mode(mf::MatrixFactorizer::TRAIN_BLOCK);
+    bench_factorizer("sgdbias-block", option, mf, mtrain, mtest, 0.01, 0.02,
+                     results);
+  }
+  {
+    mf::MatrixFactorizerSvdpp mf;
+    bench_factorizer("svdpp-serial", option, mf, mtrain, mtest, 0.002, 0.02,
+                     results);
+  }
+  {
+    mf::MatrixFactorizerAls mf;
+    bench_factorizer("als", option, mf, mtrain, mtest, 0.0, 0.05, results);
+  }
+  {
+    mf::MatrixFactorizerAlsImplicit mf;
+    bench_factorizer("als-implicit", option, mf, mtrain, mtest, 0.0, 0.05,
+                     results);
+  }
+  if (option.json) {
+    print_json(argv[0], option, results);
+  } else {
+    print_tsv(results);
+  }
+
+  unlink(textname.c_str());
+  unlink(binname.c_str());
+  return 0;
+}
+
+/**
+ * Show usage.
+ * @param progname the name of this program
+ */
+static void usage(const char *progname) {
+  fprintf(stderr, "%s: benchmark of the mf library\n", progname);
+  fprintf(stderr, "Usage:\n");
+  fprintf(stderr, " %% %s [-t nthread] [-k ncluster] [-n niter] [-j] workdir\n", progname);
+  fprintf(stderr, "  (temporary data files are written in workdir)\n");
+  fprintf(stderr, "  -j : print the results in JSON\n");
+  std::exit(EXIT_FAILURE);
+}
+
+/**
+ * Write a synthetic rating file.
+ * Rates are given by random low rank factors with noise, so the same
+ * file is written in every run.
+ * @param filename output file name
+ */
+static void make_data(const char *filename) {
+  FILE *fp = fopen(filename, "w");
+  if (fp == NULL) {
+    fprintf(stderr, "[Error] cannot open %s\n", filename);
+    exit(1);
+  }
+  unsigned int seed = DATA_SEED;
+  std::vector<double> users(NUM_USERS * NUM_TRUE_FACTORS);
+  std::vector<double> items(NUM_ITEMS * NUM_TRUE_FACTORS);
+  for (size_t i = 0; i < users.size(); i++) {
+    users[i] = static_cast<double>(mf::myrand(&seed)) / RAND_MAX;
+  }
+  for (size_t i = 0; i < items.size(); i++) {
+    items[i] = static_cast<double>(mf::myrand(&seed)) / RAND_MAX;
+  }
+  std::set<std::pair<int, int> > rated;
+  while (static_cast<int>(rated.size()) < NUM_RATES) {
+    int user = mf::myrand(&seed) % NUM_USERS;
+    int item = mf::myrand(&seed) % NUM_ITEMS;
+    if (!rated.insert(std::make_pair(user, item)).second) continue;
+    double value = static_cast<double>(mf::myrand(&seed)) / RAND_MAX - 0.5;
+    for (int k = 0; k < NUM_TRUE_FACTORS; k++) {
+      value += users[user * NUM_TRUE_FACTORS + k] *
+               items[item * NUM_TRUE_FACTORS + k];
+    }
+    int rate = static_cast<int>(value + 1.5);
+    rate = (rate < 1) ? 1 : (rate > 5) ? 5 : rate;
+    fprintf(fp, "%d\t%d\t%d\n", user + 1, item + 1, rate);
+  }
+  fclose(fp);
+}
+
+/**
+ * Add a result of a stage.
+ * @param stage stage of the benchmark
+ * @param name name of the data or the factorizer
+ * @param seconds elapsed seconds
+ * @param rmse RMSE (negative if not measured)
+ * @param rates rates processed in the stage
+ * @param results results
+ */
+static void add_result(const char *stage, const char *name, double seconds,
+                       double rmse, double rates,
+                       std::vector<BenchResult> &results) {
+  BenchResult result;
+  result.stage = stage;
+  result.name = name;
+  result.seconds = seconds;
+  result.rmse = rmse;
+  result.rates = rates;
+  results.push_back(result);
+}
+
+/**
+ * Print results as TSV.
+ * @param results results
+ */
+static void print_tsv(const std::vector<BenchResult> &results) {
+  printf("stage\tname\tseconds\tRMSE\trates/s\n");
+  for (size_t i = 0; i < results.size(); i++) {
+    const BenchResult &r = results[i];
+    printf("%s\t%s\t%.3f\t", r.stage.c_str(), r.name.c_str(), r.seconds);
+    if (r.rmse >= 0) {
+      printf("%.4f\t", r.rmse);
+    } else {
+      printf("-\t");
+    }
+    if (r.rates > 0 && r.seconds > 0) {
+      printf("%.0f\n", r.rates / r.seconds);
+    } else {
+      printf("-\n");
+    }
+  }
+}
+
+/**
+ * Print results as JSON in the format of Google Benchmark.
+ * @param progname the name of this program
+ * @param option options of benchmark
+ * @param results results
+ */
+static void print_json(const char *progname, const BenchOption &option,
+                       const std::vector<BenchResult> &results) {
+  char date[64];
+  time_t now = time(NULL);
+  strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&now));
+  printf("{\n");
+  printf("  \"context\": {\n");
+  printf("    \"date\": \"%s\",\n", date);
+  printf("    \"executable\": \"%s\",\n", progname);
+  printf("    \"num_cpus\": %ld,\n", sysconf(_SC_NPROCESSORS_ONLN));
+  printf("    \"threads\": %ld,\n", option.nthread);
+  printf("    \"factors\": %ld,\n", option.ncluster);
+  printf("    \"iterations\": %ld\n", option.niter);
+  printf("  },\n");
+  printf("  \"benchmarks\": [\n");
+  for (size_t i = 0; i < results.size(); i++) {
+    const BenchResult &r = results[i];
+    printf("    {\n");
+    printf("      \"name\": \"%s/%s\",\n", r.stage.c_str(), r.name.c_str());
+    printf("      \"iterations\": 1,\n");
+    printf("      \"real_time\": %.6f,\n", r.seconds);
+    printf("      \"cpu_time\": %.6f,\n", r.seconds);
+    printf("      \"time_unit\": \"s\"");
+    if (r.rmse >= 0) printf(",\n      \"rmse\": %.6f", r.rmse);
+    if (r.rates > 0 && r.seconds > 0) {
+      printf(",\n      \"items_per_second\": %.6g", r.rates / r.seconds);
+    }
+    printf("\n    }%s\n", (i + 1 < results.size()) ? "," : "");
+  }
+  printf("  ]\n");
+  printf("}\n");
+}
+
+/**
+ * Time factorization, test and recommendation of a factorizer.
+ * @param name name of the factorizer
+ * @param option options of benchmark
+ * @param mf factorizer
+ * @param mtrain training matrix
+ * @param mtest test matrix
+ * @param eta a tuning parameter
+ * @param lambda a tuning parameter
+ * @param results results
+ */
+template <typename MF>
+static void bench_factorizer(const char *name, const BenchOption &option,
+                             MF &mf, const mf::SMat &mtrain,
+                             const mf::SMat &mtest, double eta, double lambda,
+                             std::vector<BenchResult> &results) {
+  mf.set_threads(option.nthread);
+  mf.train(mtrain);
+  double start = mf::Stats::now();
+  mf.factorize(option.ncluster, option.niter, eta, lambda);
+  double factorize_time = mf::Stats::now() - start;
+  start = mf::Stats::now();
+  double rmse = mf.test(mtest);
+  double test_time = mf::Stats::now() - start;
+  FILE *fp = fopen("/dev/null", "w");
+  start = mf::Stats::now();
+  mf.recommend(fp, 10, true);
+  double recommend_time = mf::Stats::now() - start;
+  fclose(fp);
+  // rates/s of factorize is the throughput of the epochs
+  add_result("factorize", name, factorize_time, rmse,
+             static_cast<double>(mtrain.nonZeros()) * option.niter, results);
+  add_result("test", name, test_time, -1, mtest.nonZeros(), results);
+  add_result("recommend", name, recommend_time, -1, 0, results);
+}
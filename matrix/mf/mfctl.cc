@@ -19,23 +19,57 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <unistd.h>
 #include <cstdio>
 #include <string>
+#include <vector>
 #include "factorizer.h"
+#include "shard.h"
 
 /* typedef */
 //typedef mf::MatrixFactorizerSvdpp MF;
+//typedef mf::MatrixFactorizerAls MF;
+//typedef mf::MatrixFactorizerAlsImplicit MF;
 typedef mf::MatrixFactorizerSgdBias MF;
 
 /* constants */
 size_t MAX_RECOMMEND = 30;
 
+/* options of factorization */
+struct TrainOption {
+  size_t nthread;
+  MF::TrainMode mode;
+  unsigned int seed;
+  size_t nfold;
+  const char *stats;
+  bool compact;
+  int worker;
+  int nworker;
+};
+
+/* parameters of factorization in grid search */
+struct GridParam {
+  size_t ncluster;
+  size_t niter;
+  double eta;
+  double lambda;
+};
+
 /* function prototypes */
 int main(int argc, char **argv);
 static void usage(const char *progname);
+static int parse_train_option(int argc, char **argv, TrainOption &option);
+static void set_train_option(const TrainOption &option, MF &mf);
 static int run_factorize(int argc, char **argv);
 static int run_test(int argc, char **argv);
+static int run_cv(int argc, char **argv);
 static int run_mktest(int argc, char **argv);
+static int run_convert(int argc, char **argv);
+static int run_recommend(int argc, char **argv);
+static int run_shard(int argc, char **argv);
+static int run_shard_train(int argc, char **argv);
+static int run_shard_average(int argc, char **argv);
+static int run_shard_model(int argc, char **argv);
 void cross_validation(const char *dir, size_t ncluster,
                       size_t niter, double eta, double lambda);
 
@@ -46,8 +80,22 @@ int main(int argc, char **argv) {
     return run_factorize(argc, argv);
   } else if (command == "test") {
     return run_test(argc, argv);
+  } else if (command == "cv") {
+    return run_cv(argc, argv);
   } else if (command == "mktest") {
     return run_mktest(argc, argv);
+  } else if (command == "convert") {
+    return run_convert(argc, argv);
+  } else if (command == "recommend") {
+    return run_recommend(argc, argv);
+  } else if (command == "shard") {
+    return run_shard(argc, argv);
+  } else if (command == "shard-train") {
+    return run_shard_train(argc, argv);
+  } else if (command == "shard-average") {
+    return run_shard_average(argc, argv);
+  } else if (command == "shard-model") {
+    return run_shard_model(argc, argv);
   } else {
     usage(argv[0]);
   }
@@ -60,25 +108,134 @@ int main(int argc, char **argv) {
 static void usage(const char *progname) {
   fprintf(stderr, "%s: matrix factorization utility tool\n", progname);
   fprintf(stderr, "Usage:\n");
-  fprintf(stderr, " %% %s factorize file dir ncluster niter eta lambda\n", progname);
+  fprintf(stderr, " %% %s factorize [options] file dir ncluster niter eta lambda\n", progname);
   fprintf(stderr, " %% %s mktest file dir ntest\n", progname);
-  fprintf(stderr, " %% %s test dir ncluster niter eta lambda\n", progname);
+  fprintf(stderr, " %% %s test [options] dir ncluster niter eta lambda\n", progname);
+  fprintf(stderr, " %% %s cv [options] file nclusters niters etas lambdas\n", progname);
+  fprintf(stderr, " %% %s convert file binfile\n", progname);
+  fprintf(stderr, " %% %s recommend [-t nthread] [-n num] [-r ratefile] [-i idfile] model\n", progname);
+  fprintf(stderr, " %% %s shard [-s seed] [-S file] file dir nblock ncluster\n", progname);
+  fprintf(stderr, " %% %s shard-train [options] dir niter eta lambda\n", progname);
+  fprintf(stderr, " %% %s shard-average dir nworker\n", progname);
+  fprintf(stderr, " %% %s shard-model dir model\n", progname);
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  -t nthread : the number of threads (default: 1)\n");
+  fprintf(stderr, "  -m mode    : serial, hogwild or block (default: serial)\n");
+  fprintf(stderr, "  -s seed    : seed of random number generator\n");
+  fprintf(stderr, "  -S file    : append statistics of phases and iterations to\n");
+  fprintf(stderr, "               file (\"-\": stderr, factorize, test and cv)\n");
+  fprintf(stderr, "  -c         : map ids to compact indexes, saved to dir/ids.bin\n");
+  fprintf(stderr, "               (factorize, test and cv; rows of dir/*mat.tsv\n");
+  fprintf(stderr, "               start with the original ids)\n");
+  fprintf(stderr, "  (block gives the same result for the same seed and the same\n");
+  fprintf(stderr, "   number of threads, which differs from the result of serial)\n");
+  fprintf(stderr, "  -k nfold   : the number of folds (cv, default: 5)\n");
+  fprintf(stderr, "  (cv takes comma separated values of nclusters, niters, etas\n");
+  fprintf(stderr, "   and lambdas, and trains the folds in nthread threads)\n");
+  fprintf(stderr, "  -n num     : the number of recommended items (recommend)\n");
+  fprintf(stderr, "  -r file    : skip items rated in the file (recommend)\n");
+  fprintf(stderr, "  -i file    : id maps of the model (recommend)\n");
+  fprintf(stderr, "  -w w/n     : train user blocks of the worker w of n workers,\n");
+  fprintf(stderr, "               averaged by shard-average (shard-train)\n");
   std::exit(EXIT_FAILURE);
 }
 
+/**
+ * Parse options of factorization.
+ * @param argc the number of arguments (from the command name)
+ * @param argv arguments (from the command name)
+ * @param option parsed options
+ * @return index of the first non-option argument in argv
+ */
+static int parse_train_option(int argc, char **argv, TrainOption &option) {
+  option.nthread = 1;
+  option.mode = MF::TRAIN_SERIAL;
+  option.seed = mf::DEFAULT_SEED;
+  option.nfold = 5;
+  option.stats = NULL;
+  option.compact = false;
+  option.worker = 0;
+  option.nworker = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, "t:m:s:k:S:cw:")) != -1) {
+    std::string mode;
+    switch (opt) {
+    case 't':
+      option.nthread = atoi(optarg);
+      break;
+    case 'm':
+      mode = optarg;
+      if (mode == "serial") {
+        option.mode = MF::TRAIN_SERIAL;
+      } else if (mode == "hogwild") {
+        option.mode = MF::TRAIN_HOGWILD;
+      } else if (mode == "block") {
+        option.mode = MF::TRAIN_BLOCK;
+      } else {
+        return -1;
+      }
+      break;
+    case 's':
+      option.seed = atoi(optarg);
+      break;
+    case 'k':
+      option.nfold = atoi(optarg);
+      if (option.nfold < 2) return -1;
+      break;
+    case 'S':
+      option.stats = optarg;
+      break;
+    case 'c':
+      option.compact = true;
+      break;
+    case 'w':
+      if (sscanf(optarg, "%d/%d", &option.worker, &option.nworker) != 2 ||
+          option.nworker < 1 || option.worker < 0 ||
+          option.worker >= option.nworker) {
+        return -1;
+      }
+      break;
+    default:
+      return -1;
+    }
+  }
+  return optind;
+}
+
+/**
+ * Set options of factorization to a factorizer.
+ */
+static void set_train_option(const TrainOption &option, MF &mf) {
+  mf.set_threads(option.nthread);
+  mf.set_train_mode(option.mode);
+  mf.set_seed(option.seed);
+  if (option.stats != NULL && !mf.open_stats(option.stats)) {
+    fprintf(stderr, "[Error] cannot open %s\n", option.stats);
+    exit(1);
+  }
+}
+
 
 static int run_factorize(int argc, char **argv) {
   const char *progname = argv[0];
-  if (argc != 8) usage(progname);
-  char *filename  = argv[2];
-  char *dirname   = argv[3];
-  size_t ncluster = atoi(argv[4]);
-  size_t niter    = atoi(argv[5]);
-  double eta      = atof(argv[6]);
-  double lambda   = atof(argv[7]);
+  TrainOption option;
+  int index = parse_train_option(argc - 1, argv + 1, option);
+  if (index < 0 || argc - 1 - index != 6) usage(progname);
+  char **args = argv + 1 + index;
+  char *filename  = args[0];
+  char *dirname   = args[1];
+  size_t ncluster = atoi(args[2]);
+  size_t niter    = atoi(args[3]);
+  double eta      = atof(args[4]);
+  double lambda   = atof(args[5]);
 
   MF mf;
-  mf.train(filename);
+  set_train_option(option, mf);
+  if (option.compact) {
+    mf.train_compact(filename);
+  } else {
+    mf.train(filename);
+  }
   fprintf(stderr, "Factorizing input matrix ...\n");
   mf.factorize(ncluster, niter, eta, lambda);
   fprintf(stderr, "Saving a user matirx and a item matrix ...\n");
@@ -90,6 +247,15 @@ static int run_factorize(int argc, char **argv) {
   fprintf(stderr, "Saving recommend items for each user ...\n");
   sprintf(rpath, "%s/recom.tsv", dirname);
   mf.save_recommend(rpath, MAX_RECOMMEND);
+  fprintf(stderr, "Saving a model snapshot ...\n");
+  char mpath[256];
+  sprintf(mpath, "%s/model.bin", dirname);
+  mf.save_snapshot(mpath);
+  if (option.compact) {
+    char idpath[256];
+    sprintf(idpath, "%s/ids.bin", dirname);
+    mf.save_id_maps(idpath);
+  }
   return 0;
 }
 
@@ -98,12 +264,15 @@ static int run_factorize(int argc, char **argv) {
  */
 static int run_test(int argc, char **argv) {
   const char *progname = argv[0];
-  if (argc != 7) usage(progname);
-  char *dirname   = argv[2];
-  size_t ncluster = atoi(argv[3]);
-  size_t niter    = atoi(argv[4]);
-  double eta      = atof(argv[5]);
-  double lambda   = atof(argv[6]);
+  TrainOption option;
+  int index = parse_train_option(argc - 1, argv + 1, option);
+  if (index < 0 || argc - 1 - index != 5) usage(progname);
+  char **args = argv + 1 + index;
+  char *dirname   = args[0];
+  size_t ncluster = atoi(args[1]);
+  size_t niter    = atoi(args[2]);
+  double eta      = atof(args[3]);
+  double lambda   = atof(args[4]);
 
   size_t ntest = 0;
   double sum = 0.0;
@@ -117,7 +286,12 @@ static int run_test(int argc, char **argv) {
     printf("Training data: %s\n", train_path);
     printf("Test data:     %s\n", test_path);
     MF mf;
-    mf.train(train_path);
+    set_train_option(option, mf);
+    if (option.compact) {
+      mf.train_compact(train_path);
+    } else {
+      mf.train(train_path);
+    }
     printf("Factorizing input matrix ...\n");
     mf.factorize(ncluster, niter, eta, lambda);
     double rmse = mf.test(test_path);
@@ -129,6 +303,180 @@ static int run_test(int argc, char **argv) {
   return 0;
 }
 
+/**
+ * Parse comma separated values.
+ * @param str string of values
+ * @param values output values
+ */
+static void parse_list(const char *str, std::vector<double> &values) {
+  values.clear();
+  std::string s(str);
+  size_t begin = 0;
+  while (begin <= s.size()) {
+    size_t end = s.find(',', begin);
+    if (end == std::string::npos) end = s.size();
+    if (end > begin) values.push_back(atof(s.substr(begin, end - begin).c_str()));
+    begin = end + 1;
+  }
+}
+
+/**
+ * Read the whole of a temporary file, and close it.
+ * @param fp file (may be NULL)
+ * @param contents output contents
+ */
+static void read_tmpfile(FILE *fp, std::string &contents) {
+  contents.clear();
+  if (fp == NULL) return;
+  rewind(fp);
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) contents.append(buf, n);
+  fclose(fp);
+}
+
+/**
+ * Write statistics of a cv job to a file, tagging each line.
+ * @param stats lines of statistics of the job
+ * @param param parameters of the job
+ * @param fold fold held out by the job
+ * @param fp output file
+ */
+static void write_cv_stats(const std::string &stats, const GridParam &param,
+                           int fold, FILE *fp) {
+  char tag[256];
+  snprintf(tag, sizeof(tag), "ncluster=%ld\tniter=%ld\teta=%g\tlambda=%g\t"
+           "fold=%d\t", static_cast<long>(param.ncluster),
+           static_cast<long>(param.niter), param.eta, param.lambda, fold);
+  size_t begin = 0;
+  while (begin < stats.size()) {
+    size_t end = stats.find('\n', begin);
+    end = (end == std::string::npos) ? stats.size() : end + 1;
+    fputs(tag, fp);
+    fwrite(stats.data() + begin, 1, end - begin, fp);
+    begin = end;
+  }
+}
+
+/**
+ * Run k-fold cross validation test on a grid of parameters.
+ * The rating file is read once, and all jobs share the matrix holding
+ * out the rates of their folds. The folds are those of
+ * split_rating_fold(), but masked instead of copied, so that the
+ * concurrent jobs do not hold a copy of the matrix each.
+ * With -S, each job records its statistics into a temporary file, and
+ * the lines are appended with the parameters and the fold of the job
+ * after all jobs.
+ */
+static int run_cv(int argc, char **argv) {
+  const char *progname = argv[0];
+  TrainOption option;
+  int index = parse_train_option(argc - 1, argv + 1, option);
+  if (index < 0 || argc - 1 - index != 5) usage(progname);
+  char **args = argv + 1 + index;
+  char *filename = args[0];
+  std::vector<double> nclusters, niters, etas, lambdas;
+  parse_list(args[1], nclusters);
+  parse_list(args[2], niters);
+  parse_list(args[3], etas);
+  parse_list(args[4], lambdas);
+  if (nclusters.empty() || niters.empty() || etas.empty() || lambdas.empty()) {
+    usage(progname);
+  }
+
+  mf::SMat mat;
+  if (option.compact) {
+    std::vector<mf::Rating> ratings;
+    mf::IdMap users, items;
+    mf::read_ratings(filename, ratings);
+    mf::compact_ratings(ratings, users, items);
+    mf::build_rating_matrix(ratings, users.size(), items.size(), mat);
+  } else {
+    mf::read_rating_file(filename, mat);
+  }
+  int nfold = static_cast<int>(option.nfold);
+  if (mat.nonZeros() < nfold) {
+    fprintf(stderr, "[Error] too few rates: %s\n", filename);
+    exit(1);
+  }
+  fprintf(stderr, "%ld rates, %d folds, %ld parameter sets\n",
+          static_cast<long>(mat.nonZeros()), nfold,
+          static_cast<long>(nclusters.size() * niters.size() *
+                            etas.size() * lambdas.size()));
+
+  // grid points x folds, trained concurrently on the shared matrix
+  std::vector<GridParam> params;
+  for (size_t a = 0; a < nclusters.size(); a++) {
+    for (size_t b = 0; b < niters.size(); b++) {
+      for (size_t c = 0; c < etas.size(); c++) {
+        for (size_t d = 0; d < lambdas.size(); d++) {
+          GridParam param = { static_cast<size_t>(nclusters[a]),
+                          static_cast<size_t>(niters[b]), etas[c], lambdas[d] };
+          params.push_back(param);
+        }
+      }
+    }
+  }
+  FILE *stats_fp = NULL;
+  if (option.stats != NULL) {
+    stats_fp = (std::string(option.stats) == "-") ? stderr
+                                                   : fopen(option.stats, "a");
+    if (stats_fp == NULL) {
+      fprintf(stderr, "[Error] cannot open %s\n", option.stats);
+      exit(1);
+    }
+  }
+  TrainOption job_option = option;
+  job_option.nthread = 1;
+  job_option.stats = NULL;
+
+  int njob = static_cast<int>(params.size()) * nfold;
+  std::vector<double> rmses(njob);
+  std::vector<std::string> job_stats(njob);
+  #pragma omp parallel for num_threads(option.nthread) schedule(dynamic, 1)
+  for (int job = 0; job < njob; job++) {
+    const GridParam &param = params[job / nfold];
+    FILE *tmp = (stats_fp != NULL) ? tmpfile() : NULL;
+    {
+      MF mf;
+      set_train_option(job_option, mf);
+      if (tmp != NULL) mf.open_stats(tmp);
+      mf.train(mat, nfold, job % nfold);
+      mf.factorize(param.ncluster, param.niter, param.eta, param.lambda);
+      rmses[job] = mf.test_fold();
+    }
+    read_tmpfile(tmp, job_stats[job]);
+  }
+  if (stats_fp != NULL) {
+    for (int job = 0; job < njob; job++) {
+      write_cv_stats(job_stats[job], params[job / nfold], job % nfold,
+                     stats_fp);
+    }
+    if (stats_fp == stderr) {
+      fflush(stats_fp);
+    } else {
+      fclose(stats_fp);
+    }
+  }
+
+  size_t best = 0;
+  std::vector<double> averages(params.size(), 0.0);
+  for (size_t i = 0; i < params.size(); i++) {
+    for (int j = 0; j < nfold; j++) averages[i] += rmses[i * nfold + j];
+    averages[i] /= nfold;
+    printf("ncluster=%ld niter=%ld eta=%g lambda=%g RMSE=%.3f\n",
+           static_cast<long>(params[i].ncluster),
+           static_cast<long>(params[i].niter),
+           params[i].eta, params[i].lambda, averages[i]);
+    if (averages[i] < averages[best]) best = i;
+  }
+  printf("Best: ncluster=%ld niter=%ld eta=%g lambda=%g RMSE=%.3f\n",
+         static_cast<long>(params[best].ncluster),
+         static_cast<long>(params[best].niter),
+         params[best].eta, params[best].lambda, averages[best]);
+  return 0;
+}
+
 /**
  * Make test sets to split a file into a training file and a test file.
  */
@@ -175,3 +523,146 @@ static int run_mktest(int argc, char **argv) {
   ifs.close();
   return 0;
 }
+
+/**
+ * Convert a text rating file into a binary rating file.
+ */
+static int run_convert(int argc, char **argv) {
+  const char *progname = argv[0];
+  if (argc != 4) usage(progname);
+  char *filename = argv[2];
+  char *binname  = argv[3];
+
+  mf::SMat mat;
+  mf::read_rating_text(filename, mat);
+  mf::write_rating_binary(binname, mat);
+  fprintf(stderr, "%ld rates (%ld users x %ld items) saved to %s\n",
+          static_cast<long>(mat.nonZeros()), static_cast<long>(mat.rows()),
+          static_cast<long>(mat.cols()), binname);
+  return 0;
+}
+
+/**
+ * Print top-N items of each user from a model snapshot.
+ */
+static int run_recommend(int argc, char **argv) {
+  const char *progname = argv[0];
+  size_t nthread = 1;
+  size_t num = MAX_RECOMMEND;
+  const char *ratename = NULL;
+  const char *idname = NULL;
+  int opt;
+  while ((opt = getopt(argc - 1, argv + 1, "t:n:r:i:")) != -1) {
+    switch (opt) {
+    case 't':
+      nthread = atoi(optarg);
+      break;
+    case 'n':
+      num = atoi(optarg);
+      break;
+    case 'r':
+      ratename = optarg;
+      break;
+    case 'i':
+      idname = optarg;
+      break;
+    default:
+      usage(progname);
+    }
+  }
+  if (argc - 1 - optind != 1) usage(progname);
+  char *modelname = argv[1 + optind];
+
+  MF mf;
+  mf.set_threads(nthread);
+  mf.load_snapshot(modelname);
+  if (idname != NULL) mf.load_id_maps(idname);
+  if (ratename != NULL) mf.read_rated(ratename);
+  mf.recommend(stdout, num, ratename != NULL);
+  return 0;
+}
+
+/**
+ * Split a rating file into blocks for out-of-core training.
+ */
+static int run_shard(int argc, char **argv) {
+  const char *progname = argv[0];
+  TrainOption option;
+  int index = parse_train_option(argc - 1, argv + 1, option);
+  if (index < 0 || argc - 1 - index != 4) usage(progname);
+  char **args = argv + 1 + index;
+  char *filename  = args[0];
+  char *dirname   = args[1];
+  int nblock      = atoi(args[2]);
+  size_t ncluster = atoi(args[3]);
+  if (nblock < 1 || ncluster < 1) usage(progname);
+
+  mf::ShardedSgd shards;
+  shards.set_seed(option.seed);
+  if (option.stats != NULL && !shards.open_stats(option.stats)) {
+    fprintf(stderr, "[Error] cannot open %s\n", option.stats);
+    exit(1);
+  }
+  shards.make_shards(filename, dirname, nblock, ncluster);
+  const mf::ShardFileHeader &header = shards.header();
+  fprintf(stderr, "%ld rates (%d users x %d items) split into %d x %d blocks"
+          " in %s\n", static_cast<long>(header.nonzeros), header.users - 1,
+          header.items - 1, header.blocks, header.blocks, dirname);
+  return 0;
+}
+
+/**
+ * Train blocks of a shard directory.
+ */
+static int run_shard_train(int argc, char **argv) {
+  const char *progname = argv[0];
+  TrainOption option;
+  int index = parse_train_option(argc - 1, argv + 1, option);
+  if (index < 0 || argc - 1 - index != 4) usage(progname);
+  char **args = argv + 1 + index;
+  char *dirname = args[0];
+  size_t niter  = atoi(args[1]);
+  double eta    = atof(args[2]);
+  double lambda = atof(args[3]);
+
+  mf::ShardedSgd shards;
+  shards.set_threads(option.nthread);
+  shards.set_seed(option.seed);
+  shards.set_worker(option.worker, option.nworker);
+  if (option.stats != NULL && !shards.open_stats(option.stats)) {
+    fprintf(stderr, "[Error] cannot open %s\n", option.stats);
+    exit(1);
+  }
+  shards.open(dirname);
+  shards.train(niter, eta, lambda);
+  return 0;
+}
+
+/**
+ * Average item blocks trained by workers.
+ */
+static int run_shard_average(int argc, char **argv) {
+  const char *progname = argv[0];
+  if (argc != 4) usage(progname);
+  char *dirname = argv[2];
+  int nworker   = atoi(argv[3]);
+  if (nworker < 1) usage(progname);
+
+  mf::ShardedSgd::average_workers(dirname, nworker);
+  return 0;
+}
+
+/**
+ * Save a model snapshot of a shard directory.
+ */
+static int run_shard_model(int argc, char **argv) {
+  const char *progname = argv[0];
+  if (argc != 4) usage(progname);
+  char *dirname   = argv[2];
+  char *modelname = argv[3];
+
+  mf::ShardedSgd shards;
+  shards.open(dirname);
+  shards.save_snapshot(modelname);
+  return 0;
+}
@@ -0,0 +1,484 @@
+//
+// Rating matrix reader and writer
+//
+// Copyright(C) 2010  Mizuki Fujisawa <fujisawa@bayon.cc>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 2 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include "rating.h"
+#include "util.h"
+
+namespace mf {
+
+namespace {
+
+/**
+ * Compare rates of a user by items.
+ */
+bool less_rating(const Rating &left, const Rating &right) {
+  return left.item < right.item;
+}
+
+/**
+ * Parse a number (with an optional '-') and skip trailing characters of
+ * the field.
+ * @param p current position (moved to the end of the field)
+ * @param end end of the line
+ * @param value parsed value
+ * @return return false if no digit was found
+ */
+bool parse_field(const char *&p, const char *end, double &value) {
+  while (p < end && *p == '\t') p++;
+  bool negative = (p < end && *p == '-');
+  if (negative) p++;
+  const char *start = p;
+  double num = 0.0;
+  while (p < end && *p >= '0' && *p <= '9') num = num * 10 + (*p++ - '0');
+  if (p < end && *p == '.') {
+    double scale = 0.1;
+    for (p++; p < end && *p >= '0' && *p <= '9'; p++, scale *= 0.1) {
+      num += (*p - '0') * scale;
+    }
+  }
+  if (p == start) return false;
+  while (p < end && *p != '\t') p++;
+  value = negative ? -num : num;
+  return true;
+}
+
+/**
+ * Parse a line of "user_id \t item_id \t rate". A broken line, or a line
+ * with a negative id or a number out of the range of int, is reported.
+ * @param p current position (moved to the next line)
+ * @param end end of the file
+ * @param rating parsed rate
+ * @return return false if the line is empty or broken
+ */
+bool parse_line(const char *&p, const char *end, Rating &rating) {
+  const char *eol = static_cast<const char *>(memchr(p, '\n', end - p));
+  if (eol == NULL) eol = end;
+  const char *q = p;
+  double userid, itemid, rate;
+  bool parsed = parse_field(q, eol, userid) && parse_field(q, eol, itemid) &&
+                parse_field(q, eol, rate) &&
+                userid >= 0 && userid < INT_MAX &&
+                itemid >= 0 && itemid < INT_MAX &&
+                rate > INT_MIN && rate < INT_MAX;
+  if (parsed) {
+    rating.user = static_cast<int>(userid);
+    rating.item = static_cast<int>(itemid);
+    rating.rate = static_cast<int>(rate);
+  } else if (eol > p && *p != '\r') {
+    fprintf(stderr, "format error: %.*s\n", static_cast<int>(eol - p), p);
+  }
+  p = eol + 1;
+  return parsed;
+}
+
+/**
+ * Check the header, the size and the offsets of a mapped binary rating
+ * file.
+ * @param file mapped file
+ * @param header output header
+ * @return return false if the file is broken
+ */
+bool check_rating_binary(const MappedFile &file, RatingFileHeader &header) {
+  if (file.size() < sizeof(header)) return false;
+  memcpy(&header, file.data(), sizeof(header));
+  if (memcmp(header.magic, RATING_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != RATING_FILE_VERSION || header.rows < 0 ||
+      header.cols < 0 || header.nonzeros < 0 ||
+      header.nonzeros > static_cast<int64_t>(file.size() / 8)) {
+    return false;
+  }
+  size_t nnz = static_cast<size_t>(header.nonzeros);
+  if (file.size() != sizeof(header) +
+        sizeof(int32_t) * (static_cast<size_t>(header.rows) + 1 + 2 * nnz)) {
+    return false;
+  }
+  // offsets of rows from 0 to the number of rates, and items in range
+  const int32_t *outer =
+    reinterpret_cast<const int32_t *>(file.data() + sizeof(header));
+  const int32_t *inner = outer + header.rows + 1;
+  if (outer[0] != 0 || outer[header.rows] != header.nonzeros) return false;
+  for (int32_t i = 0; i < header.rows; i++) {
+    if (outer[i] > outer[i+1]) return false;
+  }
+  for (size_t p = 0; p < nnz; p++) {
+    if (inner[p] < 0 || inner[p] >= header.cols) return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+/**
+ * Build a map of ids.
+ */
+void IdMap::build(std::vector<int> &ids) {
+  std::sort(ids.begin(), ids.end());
+  ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+  ids_.assign(1, -1);
+  ids_.insert(ids_.end(), ids.begin(), ids.end());
+}
+
+/**
+ * Set ids of indexes.
+ */
+void IdMap::assign(const int *ids, size_t size) {
+  ids_.assign(1, -1);
+  ids_.insert(ids_.end(), ids, ids + size);
+}
+
+/**
+ * Get the index of an id.
+ */
+int IdMap::index(int id) const {
+  std::vector<int>::const_iterator it =
+    std::lower_bound(ids_.begin() + 1, ids_.end(), id);
+  if (it == ids_.end() || *it != id) return -1;
+  return static_cast<int>(it - ids_.begin());
+}
+
+/**
+ * Open a rating file.
+ */
+bool RatingReader::open(const char *filename) {
+  binary_ = is_rating_binary(filename);
+  if (!file_.open(filename)) return false;
+  if (binary_) {
+    RatingFileHeader header;
+    if (!check_rating_binary(file_, header)) return false;
+    outer_ = reinterpret_cast<const int32_t *>(file_.data() + sizeof(header));
+    inner_ = outer_ + header.rows + 1;
+    values_ = inner_ + header.nonzeros;
+    rows_ = header.rows;
+  }
+  rewind();
+  return true;
+}
+
+/**
+ * Read rates again from the first one.
+ */
+void RatingReader::rewind() {
+  cursor_ = file_.data();
+  row_ = 0;
+  pos_ = 0;
+}
+
+/**
+ * Read the next rate.
+ */
+bool RatingReader::next(Rating &rating) {
+  if (binary_) {
+    while (row_ < rows_ && pos_ >= outer_[row_+1]) row_++;
+    if (row_ >= rows_) return false;
+    rating.user = row_;
+    rating.item = inner_[pos_];
+    rating.rate = values_[pos_];
+    pos_++;
+    return true;
+  }
+  const char *end = file_.data() + file_.size();
+  while (cursor_ < end) {
+    if (parse_line(cursor_, end, rating)) return true;
+  }
+  return false;
+}
+
+/**
+ * Build a matrix from rates in any order.
+ */
+void build_rating_matrix(std::vector<Rating> &ratings, int rows, int cols,
+                         SMat &mat) {
+  // counting sort by users, then sort each row by items
+  std::vector<int> offsets(rows + 1, 0);
+  for (size_t i = 0; i < ratings.size(); i++) offsets[ratings[i].user + 1]++;
+  for (int i = 0; i < rows; i++) offsets[i+1] += offsets[i];
+  std::vector<Rating> sorted(ratings.size());
+  std::vector<int> fill(offsets.begin(), offsets.end() - 1);
+  for (size_t i = 0; i < ratings.size(); i++) {
+    sorted[fill[ratings[i].user]++] = ratings[i];
+  }
+  ratings.swap(sorted);
+  sorted.clear();
+
+  mat.resize(rows, cols);
+  mat.resizeNonZeros(ratings.size());
+  int *outer = mat.outerIndexPtr();
+  int *inner = mat.innerIndexPtr();
+  int *values = mat.valuePtr();
+  int nnz = 0;
+  for (int i = 0; i < rows; i++) {
+    outer[i] = nnz;
+    std::stable_sort(ratings.begin() + offsets[i],
+                     ratings.begin() + offsets[i+1], less_rating);
+    for (int j = offsets[i]; j < offsets[i+1]; j++) {
+      if (nnz > outer[i] && inner[nnz-1] == ratings[j].item) {
+        values[nnz-1] = ratings[j].rate;
+      } else {
+        inner[nnz] = ratings[j].item;
+        values[nnz] = ratings[j].rate;
+        nnz++;
+      }
+    }
+  }
+  outer[rows] = nnz;
+  mat.resizeNonZeros(nnz);
+}
+
+/**
+ * Split a matrix into a training fold and a test fold.
+ */
+void split_rating_fold(const SMat &mat, int nfold, int fold,
+                       SMat &train, SMat &test) {
+  int rows = mat.rows();
+  int nnz = mat.nonZeros();
+  int ntest = nnz / nfold + ((fold < nnz % nfold) ? 1 : 0);
+  train.resize(rows, mat.cols());
+  train.resizeNonZeros(nnz - ntest);
+  test.resize(rows, mat.cols());
+  test.resizeNonZeros(ntest);
+
+  const int *outer = mat.outerIndexPtr();
+  const int *inner = mat.innerIndexPtr();
+  const int *values = mat.valuePtr();
+  int ntrain = 0;
+  ntest = 0;
+  for (int i = 0; i < rows; i++) {
+    train.outerIndexPtr()[i] = ntrain;
+    test.outerIndexPtr()[i] = ntest;
+    for (int j = outer[i]; j < outer[i+1]; j++) {
+      SMat &dst = (j % nfold == fold) ? test : train;
+      int &n = (j % nfold == fold) ? ntest : ntrain;
+      dst.innerIndexPtr()[n] = inner[j];
+      dst.valuePtr()[n] = values[j];
+      n++;
+    }
+  }
+  train.outerIndexPtr()[rows] = ntrain;
+  test.outerIndexPtr()[rows] = ntest;
+}
+
+/**
+ * Read a text file of ratings in one pass.
+ */
+void read_rating_text(const char *filename, SMat &mat) {
+  MappedFile file;
+  if (!file.open(filename)) {
+    fprintf(stderr, "cannot open %s\n", filename);
+    exit(1);
+  }
+  std::vector<Rating> ratings;
+  ratings.reserve(file.size() / 12);
+  int max_userid = 0;
+  int max_itemid = 0;
+  const char *p = file.data();
+  const char *end = p + file.size();
+  while (p < end) {
+    Rating rating;
+    if (parse_line(p, end, rating)) {
+      if (max_userid < rating.user) max_userid = rating.user;
+      if (max_itemid < rating.item) max_itemid = rating.item;
+      ratings.push_back(rating);
+    }
+  }
+  build_rating_matrix(ratings, max_userid + 1, max_itemid + 1, mat);
+}
+
+/**
+ * Read a binary rating file.
+ */
+void read_rating_binary(const char *filename, SMat &mat) {
+  MappedFile file;
+  if (!file.open(filename)) {
+    fprintf(stderr, "cannot open %s\n", filename);
+    exit(1);
+  }
+  RatingFileHeader header;
+  if (!check_rating_binary(file, header)) {
+    fprintf(stderr, "[Error] broken rating file: %s\n", filename);
+    exit(1);
+  }
+  size_t nnz = static_cast<size_t>(header.nonzeros);
+  const int32_t *outer =
+    reinterpret_cast<const int32_t *>(file.data() + sizeof(header));
+  const int32_t *inner = outer + header.rows + 1;
+  const int32_t *values = inner + nnz;
+  mat.resize(header.rows, header.cols);
+  mat.resizeNonZeros(nnz);
+  memcpy(mat.outerIndexPtr(), outer, sizeof(int32_t) * (header.rows + 1));
+  memcpy(mat.innerIndexPtr(), inner, sizeof(int32_t) * nnz);
+  memcpy(mat.valuePtr(), values, sizeof(int32_t) * nnz);
+}
+
+/**
+ * Check whether a file is a binary rating file.
+ */
+bool is_rating_binary(const char *filename) {
+  FILE *fp = fopen(filename, "rb");
+  if (fp == NULL) return false;
+  char magic[4];
+  bool ret = fread(magic, 1, sizeof(magic), fp) == sizeof(magic) &&
+             memcmp(magic, RATING_FILE_MAGIC, sizeof(magic)) == 0;
+  fclose(fp);
+  return ret;
+}
+
+/**
+ * Read a rating file in text or binary format.
+ */
+void read_rating_file(const char *filename, SMat &mat) {
+  if (is_rating_binary(filename)) {
+    read_rating_binary(filename, mat);
+  } else {
+    read_rating_text(filename, mat);
+  }
+}
+
+/**
+ * Read all rates of a rating file.
+ */
+void read_ratings(const char *filename, std::vector<Rating> &ratings) {
+  RatingReader reader;
+  if (!reader.open(filename)) {
+    fprintf(stderr, "[Error] cannot read %s\n", filename);
+    exit(1);
+  }
+  ratings.clear();
+  Rating rating;
+  while (reader.next(rating)) ratings.push_back(rating);
+}
+
+/**
+ * Map user ids and item ids of rates to compact indexes.
+ */
+void compact_ratings(std::vector<Rating> &ratings, IdMap &users,
+                     IdMap &items) {
+  std::vector<int> ids(ratings.size());
+  for (size_t i = 0; i < ratings.size(); i++) ids[i] = ratings[i].user;
+  users.build(ids);
+  ids.resize(ratings.size());
+  for (size_t i = 0; i < ratings.size(); i++) ids[i] = ratings[i].item;
+  items.build(ids);
+  remap_ratings(ratings, users, items);
+}
+
+/**
+ * Map user ids and item ids of rates by given maps.
+ */
+size_t remap_ratings(std::vector<Rating> &ratings, const IdMap &users,
+                     const IdMap &items) {
+  size_t n = 0;
+  for (size_t i = 0; i < ratings.size(); i++) {
+    Rating rating = ratings[i];
+    rating.user = users.index(rating.user);
+    rating.item = items.index(rating.item);
+    if (rating.user > 0 && rating.item > 0) ratings[n++] = rating;
+  }
+  size_t removed = ratings.size() - n;
+  ratings.resize(n);
+  return removed;
+}
+
+/**
+ * Write maps of user ids and item ids to a file.
+ */
+void write_id_maps(const char *filename, const IdMap &users,
+                   const IdMap &items) {
+  FILE *fp = fopen(filename, "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "[Error] cannot open %s\n", filename);
+    exit(1);
+  }
+  IdFileHeader header;
+  memcpy(header.magic, ID_FILE_MAGIC, sizeof(header.magic));
+  header.version = ID_FILE_VERSION;
+  header.users = users.size();
+  header.items = items.size();
+  std::vector<int32_t> ids;
+  for (int i = 1; i < users.size(); i++) ids.push_back(users.id(i));
+  for (int i = 1; i < items.size(); i++) ids.push_back(items.id(i));
+  if (fwrite(&header, sizeof(header), 1, fp) != 1 ||
+      (!ids.empty() &&
+       fwrite(&ids[0], sizeof(int32_t), ids.size(), fp) != ids.size())) {
+    fprintf(stderr, "[Error] cannot write %s\n", filename);
+    exit(1);
+  }
+  fclose(fp);
+}
+
+/**
+ * Read maps of user ids and item ids.
+ */
+void read_id_maps(const char *filename, IdMap &users, IdMap &items) {
+  MappedFile file;
+  if (!file.open(filename)) {
+    fprintf(stderr, "[Error] cannot open %s\n", filename);
+    exit(1);
+  }
+  IdFileHeader header;
+  if (file.size() >= sizeof(header)) memcpy(&header, file.data(), sizeof(header));
+  if (file.size() < sizeof(header) ||
+      memcmp(header.magic, ID_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != ID_FILE_VERSION ||
+      header.users < 1 || header.items < 1 ||
+      file.size() != sizeof(header) +
+        sizeof(int32_t) * (header.users - 1 + header.items - 1)) {
+    fprintf(stderr, "[Error] broken id map file: %s\n", filename);
+    exit(1);
+  }
+  const int32_t *ids =
+    reinterpret_cast<const int32_t *>(file.data() + sizeof(header));
+  users.assign(ids, header.users - 1);
+  items.assign(ids + header.users - 1, header.items - 1);
+}
+
+/**
+ * Write a matrix to a binary rating file.
+ */
+void write_rating_binary(const char *filename, const SMat &mat) {
+  SMat compressed(mat);
+  compressed.makeCompressed();
+  FILE *fp = fopen(filename, "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "[Error] cannot open %s\n", filename);
+    exit(1);
+  }
+  RatingFileHeader header;
+  memcpy(header.magic, RATING_FILE_MAGIC, sizeof(header.magic));
+  header.version = RATING_FILE_VERSION;
+  header.rows = static_cast<int32_t>(compressed.rows());
+  header.cols = static_cast<int32_t>(compressed.cols());
+  header.nonzeros = compressed.nonZeros();
+  size_t nnz = static_cast<size_t>(header.nonzeros);
+  if (fwrite(&header, sizeof(header), 1, fp) != 1 ||
+      fwrite(compressed.outerIndexPtr(), sizeof(int32_t),
+             header.rows + 1, fp) != static_cast<size_t>(header.rows + 1) ||
+      fwrite(compressed.innerIndexPtr(), sizeof(int32_t), nnz, fp) != nnz ||
+      fwrite(compressed.valuePtr(), sizeof(int32_t), nnz, fp) != nnz) {
+    fprintf(stderr, "[Error] cannot write %s\n", filename);
+    exit(1);
+  }
+  fclose(fp);
+}
+
+} /* namespace mf */
@@ -0,0 +1,276 @@
+//
+// Rating matrix reader and writer
+//
+// Copyright(C) 2010  Mizuki Fujisawa <fujisawa@bayon.cc>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 2 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+
+#ifndef MF_RATING_H_
+#define MF_RATING_H_
+
+#include <stdint.h>
+#include <vector>
+#include <Eigen/Core>
+#include <Eigen/Sparse>
+#include "util.h"
+
+namespace mf {
+
+/* typedef */
+typedef Eigen::MatrixXf Mat;
+typedef Eigen::SparseMatrix<int, Eigen::RowMajor> SMat;
+
+/**
+ * A rate given by a user to an item.
+ */
+struct Rating {
+  int user;  ///< user id
+  int item;  ///< item id
+  int rate;  ///< rate
+};
+
+/**
+ * Header of a binary rating file.
+ * The header is followed by int32 arrays of a row-major compressed
+ * matrix: row offsets (rows + 1), item ids (nonzeros), rates (nonzeros).
+ */
+struct RatingFileHeader {
+  char magic[4];     ///< "MFRB"
+  uint32_t version;  ///< format version
+  int32_t rows;      ///< the number of rows (max user id + 1)
+  int32_t cols;      ///< the number of columns (max item id + 1)
+  int64_t nonzeros;  ///< the number of rates
+};
+
+const char RATING_FILE_MAGIC[] = "MFRB";  ///< magic of binary rating files
+const uint32_t RATING_FILE_VERSION = 1;   ///< version of binary rating files
+
+/**
+ * Header of an id map file.
+ * The header is followed by int32 arrays of the ids of user indexes
+ * (users - 1, from index 1) and of item indexes (items - 1).
+ */
+struct IdFileHeader {
+  char magic[4];     ///< "MFID"
+  uint32_t version;  ///< format version
+  int32_t users;     ///< the number of user indexes (max index + 1)
+  int32_t items;     ///< the number of item indexes (max index + 1)
+};
+
+const char ID_FILE_MAGIC[] = "MFID";  ///< magic of id map files
+const uint32_t ID_FILE_VERSION = 1;   ///< version of id map files
+
+/**
+ * Map of sparse ids to compact indexes 1, 2, ... in order of ids.
+ * (index 0 is not used, as in matrices read from rating files)
+ */
+class IdMap {
+ private:
+  std::vector<int> ids_;  ///< id of each index (ids_[0] = -1)
+
+ public:
+  /**
+   * Constructor. (an empty map)
+   */
+  IdMap() : ids_(1, -1) { }
+
+  /**
+   * Build a map of ids.
+   * @param ids ids in any order with duplicates (sorted in place)
+   */
+  void build(std::vector<int> &ids);
+
+  /**
+   * Set ids of indexes.
+   * @param ids sorted ids of indexes 1, 2, ...
+   * @param size the number of ids
+   */
+  void assign(const int *ids, size_t size);
+
+  /**
+   * Get the number of indexes.
+   * @return max index + 1
+   */
+  int size() const { return static_cast<int>(ids_.size()); }
+
+  /**
+   * Get the index of an id.
+   * @param id id
+   * @return index (-1 if the id is not in the map)
+   */
+  int index(int id) const;
+
+  /**
+   * Get the id of an index.
+   * @param index index (1 <= index < size())
+   * @return id
+   */
+  int id(int index) const { return ids_[index]; }
+};
+
+/**
+ * Reader of rates in a text or binary rating file one by one.
+ * The file is mapped into memory, so that it is never read at once.
+ */
+class RatingReader {
+ private:
+  MappedFile file_;        ///< mapped rating file
+  bool binary_;            ///< binary rating file or text file
+  const char *cursor_;     ///< next line (text)
+  const int32_t *outer_;   ///< row offsets (binary)
+  const int32_t *inner_;   ///< item ids (binary)
+  const int32_t *values_;  ///< rates (binary)
+  int32_t rows_;           ///< the number of rows (binary)
+  int32_t row_;            ///< current row (binary)
+  int64_t pos_;            ///< next rate (binary)
+
+  RatingReader(const RatingReader &);
+  RatingReader &operator=(const RatingReader &);
+
+ public:
+  /**
+   * Constructor.
+   */
+  RatingReader() : binary_(false), cursor_(NULL), outer_(NULL),
+                   inner_(NULL), values_(NULL), rows_(0), row_(0), pos_(0) { }
+
+  /**
+   * Open a rating file.
+   * @param filename a text file or a binary rating file
+   * @return return false if the file cannot be opened or is broken
+   */
+  bool open(const char *filename);
+
+  /**
+   * Read rates again from the first one.
+   */
+  void rewind();
+
+  /**
+   * Read the next rate.
+   * Broken lines of a text file are reported and skipped.
+   * @param rating output rate
+   * @return return false at the end of the file
+   */
+  bool next(Rating &rating);
+};
+
+/**
+ * Build a matrix from rates in any order.
+ * If a user rates an item twice, the rate appearing later is used.
+ * @param ratings rates (sorted in place)
+ * @param rows the number of rows
+ * @param cols the number of columns
+ * @param mat output matrix
+ */
+void build_rating_matrix(std::vector<Rating> &ratings, int rows, int cols,
+                         SMat &mat);
+
+/**
+ * Split a matrix into a training fold and a test fold in memory.
+ * The i-th rate of the matrix (in row-major order) belongs to
+ * the test fold i % nfold, so that the rates of each user are spread
+ * over all folds.
+ * @param mat matrix of all rates
+ * @param nfold the number of folds
+ * @param fold index of the test fold (0 <= fold < nfold)
+ * @param train output matrix of rates not in the fold
+ * @param test output matrix of rates in the fold
+ */
+void split_rating_fold(const SMat &mat, int nfold, int fold,
+                       SMat &train, SMat &test);
+
+/**
+ * Read a text file of "user_id \t item_id \t rate" lines in one pass.
+ * @param filename a text file
+ * @param mat output matrix
+ */
+void read_rating_text(const char *filename, SMat &mat);
+
+/**
+ * Read a binary rating file written by write_rating_binary().
+ * @param filename a binary file
+ * @param mat output matrix
+ */
+void read_rating_binary(const char *filename, SMat &mat);
+
+/**
+ * Read a rating file in text or binary format.
+ * @param filename a text or binary file
+ * @param mat output matrix
+ */
+void read_rating_file(const char *filename, SMat &mat);
+
+/**
+ * Read all rates of a rating file in text or binary format.
+ * @param filename a text or binary file
+ * @param ratings output rates (in order of the file)
+ */
+void read_ratings(const char *filename, std::vector<Rating> &ratings);
+
+/**
+ * Map user ids and item ids of rates to compact indexes.
+ * @param ratings rates (changed to indexes)
+ * @param users output map of user ids
+ * @param items output map of item ids
+ */
+void compact_ratings(std::vector<Rating> &ratings, IdMap &users,
+                     IdMap &items);
+
+/**
+ * Map user ids and item ids of rates by given maps.
+ * Rates of ids not in the maps are removed.
+ * @param ratings rates (changed to indexes)
+ * @param users map of user ids
+ * @param items map of item ids
+ * @return the number of removed rates
+ */
+size_t remap_ratings(std::vector<Rating> &ratings, const IdMap &users,
+                     const IdMap &items);
+
+/**
+ * Write maps of user ids and item ids to a file.
+ * @param filename output file name
+ * @param users map of user ids
+ * @param items map of item ids
+ */
+void write_id_maps(const char *filename, const IdMap &users,
+                   const IdMap &items);
+
+/**
+ * Read maps of user ids and item ids written by write_id_maps().
+ * @param filename id map file
+ * @param users output map of user ids
+ * @param items output map of item ids
+ */
+void read_id_maps(const char *filename, IdMap &users, IdMap &items);
+
+/**
+ * Check whether a file is a binary rating file.
+ * @param filename file name
+ * @return return true if the file starts with the magic
+ */
+bool is_rating_binary(const char *filename);
+
+/**
+ * Write a matrix to a binary rating file.
+ * @param filename output file name
+ * @param mat matrix
+ */
+void write_rating_binary(const char *filename, const SMat &mat);
+
+} /* namespace mf */
+
+#endif  // MF_RATING_H_
@@ -0,0 +1,276 @@
+//
+// Tests for rating matrix reader and writer
+//
+// Copyright(C) 2010  Mizuki Fujisawa <fujisawa@bayon.cc>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 2 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+
+#include <cstdio>
+#include <gtest/gtest.h>
+#include "rating.h"
+
+namespace {
+
+void write_text(const char *filename, const char *text) {
+  FILE *fp = fopen(filename, "w");
+  ASSERT_TRUE(fp != NULL);
+  fputs(text, fp);
+  fclose(fp);
+}
+
+}  // namespace
+
+/* read_rating_text */
+TEST(RatingTest, ReadRatingTextTest) {
+  const char *filename = "ratingtest_text.tmp";
+  write_text(filename,
+             "3\t1\t4\t881250949\n"
+             "1\t2\t3\n"
+             "1\t1\t5.0\n"
+             "\n"
+             "broken line\n"
+             "4\t2\t-2\n"
+             "-1\t2\t3\n"
+             "1\t4294967296\t3\n"
+             "2\t4\t1");
+  mf::SMat mat;
+  mf::read_rating_text(filename, mat);
+  remove(filename);
+
+  EXPECT_EQ(5, mat.rows());
+  EXPECT_EQ(5, mat.cols());
+  EXPECT_EQ(5, mat.nonZeros());
+  EXPECT_EQ(5, mat.coeff(1, 1));
+  EXPECT_EQ(3, mat.coeff(1, 2));
+  EXPECT_EQ(1, mat.coeff(2, 4));
+  EXPECT_EQ(4, mat.coeff(3, 1));
+  EXPECT_EQ(-2, mat.coeff(4, 2));  // negative rates are read
+  EXPECT_EQ(0, mat.coeff(2, 1));
+  EXPECT_FALSE(mf::is_rating_binary(filename));
+}
+
+/* build_rating_matrix */
+TEST(RatingTest, BuildRatingMatrixTest) {
+  std::vector<mf::Rating> ratings;
+  int triplets[][3] = {{2, 3, 1}, {0, 2, 2}, {2, 0, 3}, {0, 2, 4}, {1, 1, 5}};
+  for (size_t i = 0; i < sizeof(triplets) / sizeof(triplets[0]); i++) {
+    mf::Rating rating = {triplets[i][0], triplets[i][1], triplets[i][2]};
+    ratings.push_back(rating);
+  }
+  mf::SMat mat;
+  mf::build_rating_matrix(ratings, 3, 4, mat);
+
+  EXPECT_EQ(4, mat.nonZeros());
+  EXPECT_EQ(4, mat.coeff(0, 2));  // the later rate is used
+  EXPECT_EQ(5, mat.coeff(1, 1));
+  EXPECT_EQ(3, mat.coeff(2, 0));
+  EXPECT_EQ(1, mat.coeff(2, 3));
+  // items are sorted in each row
+  EXPECT_EQ(0, mat.innerIndexPtr()[mat.outerIndexPtr()[2]]);
+  EXPECT_EQ(3, mat.innerIndexPtr()[mat.outerIndexPtr()[2] + 1]);
+}
+
+/* split_rating_fold */
+TEST(RatingTest, SplitRatingFoldTest) {
+  std::vector<mf::Rating> ratings;
+  for (int i = 0; i < 7; i++) {
+    mf::Rating rating = {i % 3, i, i + 1};
+    ratings.push_back(rating);
+  }
+  mf::SMat mat;
+  mf::build_rating_matrix(ratings, 3, 7, mat);
+
+  int ntest = 0;
+  for (int fold = 0; fold < 3; fold++) {
+    mf::SMat train, test;
+    mf::split_rating_fold(mat, 3, fold, train, test);
+    EXPECT_EQ(mat.nonZeros(), train.nonZeros() + test.nonZeros());
+    for (int i = 0; i < mat.rows(); i++) {
+      for (mf::SMat::InnerIterator it(mat, i); it; ++it) {
+        EXPECT_EQ(it.value(), train.coeff(it.row(), it.col()) +
+                  test.coeff(it.row(), it.col()));
+      }
+    }
+    ntest += test.nonZeros();
+  }
+  EXPECT_EQ(7, ntest);  // each rate is tested once
+}
+
+/* write_rating_binary, read_rating_binary */
+TEST(RatingTest, BinaryRoundTripTest) {
+  const char *textname = "ratingtest_round.tmp";
+  const char *binname = "ratingtest_round.bin";
+  write_text(textname, "1\t3\t2\n2\t1\t5\n1\t1\t4\n");
+  mf::SMat expected;
+  mf::read_rating_text(textname, expected);
+  mf::write_rating_binary(binname, expected);
+  EXPECT_TRUE(mf::is_rating_binary(binname));
+
+  mf::SMat mat;
+  mf::read_rating_file(binname, mat);
+  remove(textname);
+  remove(binname);
+
+  EXPECT_EQ(expected.rows(), mat.rows());
+  EXPECT_EQ(expected.cols(), mat.cols());
+  EXPECT_EQ(expected.nonZeros(), mat.nonZeros());
+  for (int i = 0; i < expected.rows(); i++) {
+    for (int j = 0; j < expected.cols(); j++) {
+      EXPECT_EQ(expected.coeff(i, j), mat.coeff(i, j));
+    }
+  }
+}
+
+/* broken binary rating files */
+TEST(RatingTest, BrokenBinaryTest) {
+  const char *binname = "ratingtest_broken.bin";
+  std::vector<mf::Rating> ratings;
+  for (int i = 0; i < 6; i++) {
+    mf::Rating rating = {i % 3, i, i + 1};
+    ratings.push_back(rating);
+  }
+  mf::SMat mat;
+  mf::build_rating_matrix(ratings, 3, 6, mat);
+  mf::write_rating_binary(binname, mat);
+  mf::RatingReader reader;
+  EXPECT_TRUE(reader.open(binname));
+
+  // row offsets: 0, 2, 4, 6 after the header
+  const long outer = sizeof(mf::RatingFileHeader);
+  const int32_t broken[][2] = {
+    {1, 5},   // decreasing
+    {3, 7},   // beyond the number of rates
+    {0, 1},   // not from 0
+  };
+  for (size_t i = 0; i < sizeof(broken) / sizeof(broken[0]); i++) {
+    mf::write_rating_binary(binname, mat);
+    FILE *fp = fopen(binname, "r+b");
+    ASSERT_TRUE(fp != NULL);
+    fseek(fp, outer + sizeof(int32_t) * broken[i][0], SEEK_SET);
+    fwrite(&broken[i][1], sizeof(int32_t), 1, fp);
+    fclose(fp);
+    mf::RatingReader broken_reader;
+    EXPECT_FALSE(broken_reader.open(binname)) << i;
+  }
+  // an item out of the columns
+  mf::write_rating_binary(binname, mat);
+  FILE *fp = fopen(binname, "r+b");
+  ASSERT_TRUE(fp != NULL);
+  int32_t item = 6;
+  fseek(fp, outer + sizeof(int32_t) * 4, SEEK_SET);
+  fwrite(&item, sizeof(int32_t), 1, fp);
+  fclose(fp);
+  mf::RatingReader broken_reader;
+  EXPECT_FALSE(broken_reader.open(binname));
+  remove(binname);
+}
+
+/* IdMap, compact_ratings, remap_ratings */
+TEST(RatingTest, CompactRatingsTest) {
+  std::vector<mf::Rating> ratings;
+  int triplets[][3] = {{900, 70, 1}, {5, 3000, 2}, {900, 3000, 3}};
+  for (size_t i = 0; i < sizeof(triplets) / sizeof(triplets[0]); i++) {
+    mf::Rating rating = {triplets[i][0], triplets[i][1], triplets[i][2]};
+    ratings.push_back(rating);
+  }
+  mf::IdMap users, items;
+  mf::compact_ratings(ratings, users, items);
+
+  EXPECT_EQ(3, users.size());
+  EXPECT_EQ(5, users.id(1));
+  EXPECT_EQ(900, users.id(2));
+  EXPECT_EQ(2, users.index(900));
+  EXPECT_EQ(-1, users.index(6));
+  EXPECT_EQ(3, items.size());
+  EXPECT_EQ(2, ratings[0].user);
+  EXPECT_EQ(1, ratings[0].item);
+  EXPECT_EQ(1, ratings[1].user);
+  EXPECT_EQ(2, ratings[1].item);
+
+  std::vector<mf::Rating> tests;
+  int test_triplets[][3] = {{5, 70, 4}, {6, 70, 5}, {900, 71, 1}};
+  for (size_t i = 0; i < 3; i++) {
+    mf::Rating rating = {test_triplets[i][0], test_triplets[i][1],
+                         test_triplets[i][2]};
+    tests.push_back(rating);
+  }
+  EXPECT_EQ(2, mf::remap_ratings(tests, users, items));
+  ASSERT_EQ(1, tests.size());
+  EXPECT_EQ(1, tests[0].user);
+  EXPECT_EQ(1, tests[0].item);
+  EXPECT_EQ(4, tests[0].rate);
+}
+
+/* write_id_maps, read_id_maps */
+TEST(RatingTest, IdMapRoundTripTest) {
+  const char *filename = "ratingtest_ids.bin";
+  std::vector<int> ids;
+  ids.push_back(30);
+  ids.push_back(10);
+  ids.push_back(30);
+  mf::IdMap users, items;
+  users.build(ids);
+  mf::write_id_maps(filename, users, items);
+
+  mf::IdMap users2, items2;
+  mf::read_id_maps(filename, users2, items2);
+  remove(filename);
+  EXPECT_EQ(3, users2.size());
+  EXPECT_EQ(10, users2.id(1));
+  EXPECT_EQ(30, users2.id(2));
+  EXPECT_EQ(1, items2.size());
+}
+
+/* RatingReader */
+TEST(RatingTest, RatingReaderTest) {
+  const char *textname = "ratingtest_reader.tmp";
+  const char *binname = "ratingtest_reader.bin";
+  write_text(textname, "2\t1\t5\nbroken line\n1\t3\t2\n");
+  mf::RatingReader reader;
+  ASSERT_TRUE(reader.open(textname));
+  mf::Rating rating;
+  ASSERT_TRUE(reader.next(rating));
+  EXPECT_EQ(2, rating.user);
+  EXPECT_EQ(1, rating.item);
+  EXPECT_EQ(5, rating.rate);
+  ASSERT_TRUE(reader.next(rating));
+  EXPECT_EQ(1, rating.user);
+  EXPECT_FALSE(reader.next(rating));
+  reader.rewind();
+  ASSERT_TRUE(reader.next(rating));
+  EXPECT_EQ(2, rating.user);
+
+  // binary files are read in order of users
+  mf::SMat mat;
+  mf::read_rating_text(textname, mat);
+  mf::write_rating_binary(binname, mat);
+  mf::RatingReader binary;
+  ASSERT_TRUE(binary.open(binname));
+  ASSERT_TRUE(binary.next(rating));
+  EXPECT_EQ(1, rating.user);
+  EXPECT_EQ(3, rating.item);
+  EXPECT_EQ(2, rating.rate);
+  ASSERT_TRUE(binary.next(rating));
+  EXPECT_EQ(2, rating.user);
+  EXPECT_FALSE(binary.next(rating));
+  remove(textname);
+  remove(binname);
+  EXPECT_FALSE(binary.open(textname));
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
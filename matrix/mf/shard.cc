@@ -0,0 +1,592 @@
+//
+// Out-of-core SGD on blocks of a rating matrix stored in a directory
+//
+// Copyright(C) 2010  Mizuki Fujisawa <fujisawa@bayon.cc>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 2 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+
+#include <sys/types.h>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include "factorizer.h"
+#include "shard.h"
+
+namespace mf {
+
+namespace {
+
+/**
+ * Add an id to ids, removing duplicates when the ids grow twice.
+ * @param ids ids
+ * @param limit size of ids to remove duplicates
+ * @param id id to be added
+ */
+void push_id(std::vector<int> &ids, size_t &limit, int id) {
+  ids.push_back(id);
+  if (ids.size() >= limit) {
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    if (limit < 2 * ids.size()) limit = 2 * ids.size();
+  }
+}
+
+/**
+ * Split indexes 1, 2, .. into contiguous blocks holding almost the same
+ * number of rates.
+ * @param counts the number of rates of each index (counts[0] is unused)
+ * @param nblock the number of blocks
+ * @param begins output first index of each block (nblock + 1)
+ */
+void split_blocks(const std::vector<int64_t> &counts, int nblock,
+                  std::vector<int32_t> &begins) {
+  int n = static_cast<int>(counts.size());
+  int64_t total = 0;
+  for (int j = 1; j < n; j++) total += counts[j];
+  begins.assign(nblock + 1, n);
+  begins[0] = 1;
+  int64_t sum = 0;
+  int last = 0;
+  for (int j = 1; j < n; j++) {
+    int b = static_cast<int>(sum * nblock / (total + 1));
+    if (b >= nblock) b = nblock - 1;
+    for (; last < b; last++) begins[last + 1] = j;
+    sum += counts[j];
+  }
+}
+
+/**
+ * Get the block of an index.
+ * @param begins first index of each block
+ * @param index index (begins.front() <= index < begins.back())
+ * @return block
+ */
+int find_block(const std::vector<int32_t> &begins, int index) {
+  return static_cast<int>(
+    std::upper_bound(begins.begin(), begins.end(), index) - begins.begin()) - 1;
+}
+
+/**
+ * Read float32 values.
+ * @param filename file name
+ * @param size the number of values
+ * @param values output values
+ */
+void read_floats(const std::string &filename, size_t size,
+                 std::vector<float> &values) {
+  values.resize(size);
+  FILE *fp = fopen(filename.c_str(), "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "[Error] cannot open %s\n", filename.c_str());
+    exit(1);
+  }
+  if (size > 0 && fread(&values[0], sizeof(float), size, fp) != size) {
+    fprintf(stderr, "[Error] broken factor file: %s\n", filename.c_str());
+    exit(1);
+  }
+  fclose(fp);
+}
+
+/**
+ * Write float32 values.
+ * @param filename file name
+ * @param values values
+ */
+void write_floats(const std::string &filename,
+                  const std::vector<float> &values) {
+  FILE *fp = fopen(filename.c_str(), "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "[Error] cannot open %s\n", filename.c_str());
+    exit(1);
+  }
+  if (!values.empty() &&
+      fwrite(&values[0], sizeof(float), values.size(), fp) != values.size()) {
+    fprintf(stderr, "[Error] cannot write %s\n", filename.c_str());
+    exit(1);
+  }
+  fclose(fp);
+}
+
+/**
+ * Write float32 values at a position of a file.
+ * @param fp output file
+ * @param offset position in bytes
+ * @param values values
+ * @param size the number of values
+ */
+void write_floats_at(FILE *fp, off_t offset, const float *values,
+                     size_t size) {
+  if (size == 0) return;
+  if (fseeko(fp, offset, SEEK_SET) != 0 ||
+      fwrite(values, sizeof(float), size, fp) != size) {
+    fprintf(stderr, "[Error] cannot write a snapshot\n");
+    exit(1);
+  }
+}
+
+}  // namespace
+
+/**
+ * Constructor.
+ */
+ShardedSgd::ShardedSgd()
+  : nthread_(1), seed_(DEFAULT_SEED), worker_(0), nworker_(1),
+    stats_("ratings") {
+  memset(&header_, 0, sizeof(header_));
+}
+
+/**
+ * Get the path of a file in the directory.
+ */
+std::string ShardedSgd::path(const char *name, int p, int q) const {
+  char str[64];
+  snprintf(str, sizeof(str), name, p, q);
+  return dir_ + "/" + str;
+}
+
+/**
+ * Get the path of an item block updated by this worker.
+ */
+std::string ShardedSgd::item_path(int q) const {
+  if (nworker_ > 1) return path("item.%d.%d.bin", q, worker_);
+  return path("item.%d.bin", q);
+}
+
+/**
+ * Read the header of a directory.
+ */
+void ShardedSgd::read_header(const char *filename) {
+  MappedFile file;
+  if (!file.open(filename)) {
+    fprintf(stderr, "[Error] cannot open %s\n", filename);
+    exit(1);
+  }
+  if (file.size() >= sizeof(header_)) {
+    memcpy(&header_, file.data(), sizeof(header_));
+  }
+  size_t nblock = header_.blocks;
+  if (file.size() < sizeof(header_) ||
+      memcmp(header_.magic, SHARD_FILE_MAGIC, sizeof(header_.magic)) != 0 ||
+      header_.version != SHARD_FILE_VERSION || header_.blocks < 1 ||
+      file.size() != sizeof(header_) + sizeof(int32_t) * 2 * (nblock + 1) +
+        sizeof(int64_t) * nblock * nblock) {
+    fprintf(stderr, "[Error] broken shard file: %s\n", filename);
+    exit(1);
+  }
+  const int32_t *begins =
+    reinterpret_cast<const int32_t *>(file.data() + sizeof(header_));
+  user_begins_.assign(begins, begins + nblock + 1);
+  item_begins_.assign(begins + nblock + 1, begins + 2 * (nblock + 1));
+  nonzeros_.resize(nblock * nblock);
+  memcpy(&nonzeros_[0], begins + 2 * (nblock + 1),
+         sizeof(int64_t) * nonzeros_.size());
+}
+
+/**
+ * Write the header of a directory.
+ */
+void ShardedSgd::write_header(const char *filename) const {
+  FILE *fp = fopen(filename, "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "[Error] cannot open %s\n", filename);
+    exit(1);
+  }
+  if (fwrite(&header_, sizeof(header_), 1, fp) != 1 ||
+      fwrite(&user_begins_[0], sizeof(int32_t), user_begins_.size(), fp) !=
+        user_begins_.size() ||
+      fwrite(&item_begins_[0], sizeof(int32_t), item_begins_.size(), fp) !=
+        item_begins_.size() ||
+      fwrite(&nonzeros_[0], sizeof(int64_t), nonzeros_.size(), fp) !=
+        nonzeros_.size()) {
+    fprintf(stderr, "[Error] cannot write %s\n", filename);
+    exit(1);
+  }
+  fclose(fp);
+}
+
+/**
+ * Write random factors and biases of a block.
+ */
+void ShardedSgd::write_random_block(const char *filename, int rows) {
+  std::vector<float> values(static_cast<size_t>(rows) *
+                            (header_.factors + 1));
+  for (size_t i = 0; i < values.size(); i++) {
+    values[i] = static_cast<double>(myrand(&seed_)) / RAND_MAX;
+  }
+  write_floats(filename, values);
+}
+
+/**
+ * Split a rating file into blocks in a directory with random factors.
+ */
+void ShardedSgd::make_shards(const char *filename, const char *dir,
+                             int nblock, size_t ncluster) {
+  double start = stats_.start();
+  dir_ = dir;
+  if (nblock < 1) nblock = 1;
+  RatingReader reader;
+  if (!reader.open(filename)) {
+    fprintf(stderr, "[Error] cannot read %s\n", filename);
+    exit(1);
+  }
+
+  // ids
+  std::vector<int> user_ids, item_ids;
+  size_t user_limit = 1 << 20, item_limit = 1 << 20;
+  Rating rating;
+  while (reader.next(rating)) {
+    push_id(user_ids, user_limit, rating.user);
+    push_id(item_ids, item_limit, rating.item);
+  }
+  IdMap users, items;
+  users.build(user_ids);
+  items.build(item_ids);
+  std::vector<int>().swap(user_ids);
+  std::vector<int>().swap(item_ids);
+  write_id_maps(path("ids.bin").c_str(), users, items);
+
+  // blocks of users and items
+  std::vector<int64_t> user_counts(users.size(), 0);
+  std::vector<int64_t> item_counts(items.size(), 0);
+  reader.rewind();
+  while (reader.next(rating)) {
+    user_counts[users.index(rating.user)]++;
+    item_counts[items.index(rating.item)]++;
+  }
+  split_blocks(user_counts, nblock, user_begins_);
+  split_blocks(item_counts, nblock, item_begins_);
+  std::vector<int64_t>().swap(user_counts);
+  std::vector<int64_t>().swap(item_counts);
+
+  // rates of each user block, then of each block
+  std::vector<FILE *> tmps(nblock);
+  for (int p = 0; p < nblock; p++) {
+    tmps[p] = fopen(path("ratings.%d.tmp", p).c_str(), "wb+");
+    if (tmps[p] == NULL) {
+      fprintf(stderr, "[Error] cannot open %s\n",
+              path("ratings.%d.tmp", p).c_str());
+      exit(1);
+    }
+  }
+  reader.rewind();
+  while (reader.next(rating)) {
+    rating.user = users.index(rating.user);
+    rating.item = items.index(rating.item);
+    if (fwrite(&rating, sizeof(rating), 1,
+               tmps[find_block(user_begins_, rating.user)]) != 1) {
+      fprintf(stderr, "[Error] cannot write %s\n", dir);
+      exit(1);
+    }
+  }
+  nonzeros_.assign(static_cast<size_t>(nblock) * nblock, 0);
+  int64_t nonzeros = 0;
+  double sum = 0.0;
+  for (int p = 0; p < nblock; p++) {
+    off_t size = ftello(tmps[p]);
+    std::vector<Rating> ratings(size / sizeof(Rating));
+    rewind(tmps[p]);
+    if (!ratings.empty() &&
+        fread(&ratings[0], sizeof(Rating), ratings.size(), tmps[p]) !=
+          ratings.size()) {
+      fprintf(stderr, "[Error] cannot read %s\n",
+              path("ratings.%d.tmp", p).c_str());
+      exit(1);
+    }
+    fclose(tmps[p]);
+    remove(path("ratings.%d.tmp", p).c_str());
+    std::vector<std::vector<Rating> > blocks(nblock);
+    for (size_t i = 0; i < ratings.size(); i++) {
+      int q = find_block(item_begins_, ratings[i].item);
+      ratings[i].user -= user_begins_[p];
+      ratings[i].item -= item_begins_[q];
+      blocks[q].push_back(ratings[i]);
+    }
+    std::vector<Rating>().swap(ratings);
+    for (int q = 0; q < nblock; q++) {
+      SMat mat;
+      build_rating_matrix(blocks[q], user_begins_[p+1] - user_begins_[p],
+                          item_begins_[q+1] - item_begins_[q], mat);
+      std::vector<Rating>().swap(blocks[q]);
+      nonzeros_[p * nblock + q] = mat.nonZeros();
+      nonzeros += mat.nonZeros();
+      for (int j = 0; j < mat.outerSize(); j++) {
+        for (SMat::InnerIterator it(mat, j); it; ++it) sum += it.value();
+      }
+      write_rating_binary(path("ratings.%d.%d.bin", p, q).c_str(), mat);
+    }
+  }
+
+  memcpy(header_.magic, SHARD_FILE_MAGIC, sizeof(header_.magic));
+  header_.version = SHARD_FILE_VERSION;
+  header_.blocks = nblock;
+  header_.users = users.size();
+  header_.items = items.size();
+  header_.factors = static_cast<int32_t>(ncluster);
+  header_.nonzeros = nonzeros;
+  header_.epochs = 0;
+  header_.average = (nonzeros > 0) ? sum / nonzeros : 0.0;
+  write_header(path("shards.bin").c_str());
+  for (int p = 0; p < nblock; p++) {
+    write_random_block(path("user.%d.bin", p).c_str(),
+                       user_begins_[p+1] - user_begins_[p]);
+  }
+  for (int q = 0; q < nblock; q++) {
+    write_random_block(path("item.%d.bin", q).c_str(),
+                       item_begins_[q+1] - item_begins_[q]);
+  }
+  stats_.phase("shard", start, nonzeros);
+}
+
+/**
+ * Open a directory made by make_shards().
+ */
+void ShardedSgd::open(const char *dir) {
+  dir_ = dir;
+  read_header(path("shards.bin").c_str());
+}
+
+/**
+ * Update the factors of a user block and an item block.
+ */
+double ShardedSgd::train_block(int p, int q, int64_t epoch, double eta,
+                               double lambda) const {
+  int k = header_.factors;
+  size_t dim = k + 1;
+  int nblock = header_.blocks;
+  int rows = user_begins_[p+1] - user_begins_[p];
+  int cols = item_begins_[q+1] - item_begins_[q];
+  std::string rname = path("ratings.%d.%d.bin", p, q);
+  RatingReader reader;
+  if (!reader.open(rname.c_str())) {
+    fprintf(stderr, "[Error] cannot read %s\n", rname.c_str());
+    exit(1);
+  }
+  std::string uname = path("user.%d.bin", p);
+  std::string iname = item_path(q);
+  std::vector<float> U, V;
+  read_floats(uname, rows * dim, U);
+  read_floats(iname, cols * dim, V);
+
+  // position of the first rate of the block in all iterations
+  double N = static_cast<double>(header_.nonzeros);
+  double count = epoch * N;
+  for (int b = 0; b < p * nblock + q; b++) count += nonzeros_[b];
+  double sse = 0.0;
+  Rating rating;
+  while (reader.next(rating)) {
+    if (rating.user < 0 || rating.user >= rows ||
+        rating.item < 0 || rating.item >= cols) {
+      fprintf(stderr, "[Error] broken rating file: %s\n", rname.c_str());
+      exit(1);
+    }
+    float *u = &U[rating.user * dim];
+    float *v = &V[rating.item * dim];
+    double val = header_.average + u[k] + v[k];
+    for (int f = 0; f < k; f++) val += u[f] * v[f];
+    val = rating.rate - val;
+    // decayed as MatrixFactorizerSgd
+    double eta_2 = eta / (1 + ++count / N);
+    for (int f = 0; f < k; f++) u[f] += eta_2 * (val * v[f] - lambda * u[f]);
+    for (int f = 0; f < k; f++) v[f] += eta_2 * (val * u[f] - lambda * v[f]);
+    u[k] += eta_2 * (val - lambda * u[k]);
+    v[k] += eta_2 * (val - lambda * v[k]);
+    sse += val * val;
+  }
+  write_floats(uname, U);
+  write_floats(iname, V);
+  return sse;
+}
+
+/**
+ * Update the factors by all rates niter times.
+ */
+void ShardedSgd::train(size_t niter, double eta, double lambda) {
+  int nblock = header_.blocks;
+  if (nworker_ > 1) {
+    std::vector<float> values;
+    for (int q = 0; q < nblock; q++) {
+      read_floats(path("item.%d.bin", q),
+                  (item_begins_[q+1] - item_begins_[q]) *
+                  static_cast<size_t>(header_.factors + 1), values);
+      write_floats(item_path(q), values);
+    }
+  }
+  size_t N = 0;
+  for (int p = worker_; p < nblock; p += nworker_) {
+    for (int q = 0; q < nblock; q++) N += nonzeros_[p * nblock + q];
+  }
+
+  double start = stats_.start();
+  // different strata in each round of workers
+  unsigned int seed = seed_ + static_cast<unsigned int>(header_.epochs);
+  std::vector<int> strata(nblock);
+  for (int s = 0; s < nblock; s++) strata[s] = s;
+  for (size_t i = 0; i < niter; i++) {
+    double iter_start = stats_.start();
+    double sse = 0.0;
+    for (int s = nblock - 1; s > 0; s--) {
+      std::swap(strata[s], strata[myrand(&seed) % (s + 1)]);
+    }
+    for (int s = 0; s < nblock; s++) {
+      #pragma omp parallel for num_threads(nthread_) schedule(dynamic, 1) \
+        reduction(+:sse)
+      for (int p = worker_; p < nblock; p += nworker_) {
+        sse += train_block(p, (p + strata[s]) % nblock, header_.epochs + i,
+                           eta, lambda);
+      }
+    }
+    stats_.iteration(i + 1, iter_start, N)
+          .value("train_rmse", (N > 0) ? sqrt(sse / N) : 0.0).end();
+  }
+  header_.epochs += niter;
+  if (nworker_ > 1) {
+    write_header(path("shards.%d.bin", worker_).c_str());
+  } else {
+    write_header(path("shards.bin").c_str());
+  }
+  stats_.phase("update", start, niter * N);
+}
+
+/**
+ * Save a model snapshot loadable by MatrixFactorizerSgdBias.
+ * The blocks are read once, and written at their positions in the
+ * column-major matrices (index 0, not used, is zero).
+ */
+void ShardedSgd::save_snapshot(const char *filename) const {
+  double start = stats_.start();
+  FILE *fp = fopen(filename, "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "[Error] cannot open %s\n", filename);
+    exit(1);
+  }
+  ModelFileHeader header;
+  memcpy(header.magic, MODEL_FILE_MAGIC, sizeof(header.magic));
+  header.version = MODEL_FILE_VERSION;
+  header.type = MatrixFactorizer::MODEL_SGD_BIAS;
+  header.users = header_.users;
+  header.items = header_.items;
+  header.factors = header_.factors;
+  if (fwrite(&header, sizeof(header), 1, fp) != 1) {
+    fprintf(stderr, "[Error] cannot write a snapshot\n");
+    exit(1);
+  }
+  int k = header_.factors;
+  size_t dim = k + 1;
+  off_t users = header_.users, items = header_.items;
+  off_t ubase = sizeof(header);
+  off_t vbase = ubase + sizeof(float) * users * k;
+  off_t bbase = vbase + sizeof(float) * k * items;
+  std::vector<float> zeros(k + 1, 0.0f);
+  std::vector<float> values;
+  std::vector<float> section;
+
+  // U (users x factors) and user biases
+  for (int f = 0; f < k; f++) {
+    write_floats_at(fp, ubase + sizeof(float) * f * users, &zeros[0], 1);
+  }
+  for (int p = 0; p < header_.blocks; p++) {
+    size_t rows = user_begins_[p+1] - user_begins_[p];
+    off_t begin = user_begins_[p];
+    if (rows == 0) continue;
+    read_floats(path("user.%d.bin", p), rows * dim, values);
+    section.resize(rows);
+    for (int f = 0; f <= k; f++) {
+      for (size_t r = 0; r < rows; r++) section[r] = values[r * dim + f];
+      off_t offset = (f < k) ? ubase + sizeof(float) * (f * users + begin)
+                             : bbase + sizeof(float) * (1 + begin);
+      write_floats_at(fp, offset, &section[0], rows);
+    }
+  }
+  // V (factors x items) and item biases
+  write_floats_at(fp, vbase, &zeros[0], k);
+  for (int q = 0; q < header_.blocks; q++) {
+    size_t rows = item_begins_[q+1] - item_begins_[q];
+    off_t begin = item_begins_[q];
+    if (rows == 0) continue;
+    read_floats(path("item.%d.bin", q), rows * dim, values);
+    section.resize(rows * k);
+    for (size_t r = 0; r < rows; r++) {
+      for (int f = 0; f < k; f++) section[r * k + f] = values[r * dim + f];
+    }
+    write_floats_at(fp, vbase + sizeof(float) * begin * k, &section[0],
+                    rows * k);
+    section.resize(rows);
+    for (size_t r = 0; r < rows; r++) section[r] = values[r * dim + k];
+    write_floats_at(fp, bbase + sizeof(float) * (1 + users + begin),
+                    &section[0], rows);
+  }
+  float average = static_cast<float>(header_.average);
+  write_floats_at(fp, bbase, &average, 1);
+  write_floats_at(fp, bbase + sizeof(float), &zeros[0], 1);
+  write_floats_at(fp, bbase + sizeof(float) * (1 + users), &zeros[0], 1);
+  fclose(fp);
+  stats_.phase("save", start, 0);
+}
+
+/**
+ * Average the item blocks trained by workers into the directory. A block
+ * is averaged over the workers which updated it, i.e. which have a user
+ * block with rates in it; the copies of the other workers are unchanged.
+ */
+void ShardedSgd::average_workers(const char *dir, int nworker) {
+  ShardedSgd shards;
+  shards.open(dir);
+  int64_t epochs = -1;
+  for (int w = 0; w < nworker; w++) {
+    ShardedSgd worker;
+    worker.dir_ = dir;
+    worker.read_header(shards.path("shards.%d.bin", w).c_str());
+    if (epochs >= 0 && worker.header_.epochs != epochs) {
+      fprintf(stderr, "[Error] workers trained different iterations: %s\n",
+              dir);
+      exit(1);
+    }
+    epochs = worker.header_.epochs;
+  }
+  int nblock = shards.header_.blocks;
+  size_t dim = shards.header_.factors + 1;
+  std::vector<float> values;
+  std::vector<double> sums;
+  for (int q = 0; q < nblock; q++) {
+    size_t size = (shards.item_begins_[q+1] - shards.item_begins_[q]) * dim;
+    sums.assign(size, 0.0);
+    int nupdated = 0;
+    for (int w = 0; w < nworker; w++) {
+      bool updated = false;
+      for (int p = w; p < nblock && !updated; p += nworker) {
+        updated = shards.nonzeros_[p * nblock + q] > 0;
+      }
+      if (!updated) continue;
+      read_floats(shards.path("item.%d.%d.bin", q, w), size, values);
+      for (size_t i = 0; i < size; i++) sums[i] += values[i];
+      nupdated++;
+    }
+    if (nupdated == 0) continue;
+    for (size_t i = 0; i < size; i++) values[i] = sums[i] / nupdated;
+    write_floats(shards.path("item.%d.bin", q), values);
+  }
+  shards.header_.epochs = epochs;
+  shards.write_header(shards.path("shards.bin").c_str());
+  for (int w = 0; w < nworker; w++) {
+    remove(shards.path("shards.%d.bin", w).c_str());
+    for (int q = 0; q < shards.header_.blocks; q++) {
+      remove(shards.path("item.%d.%d.bin", q, w).c_str());
+    }
+  }
+}
+
+}  // namespace mf
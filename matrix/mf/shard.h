@@ -0,0 +1,233 @@
+//
+// Out-of-core SGD on blocks of a rating matrix stored in a directory
+//
+// Copyright(C) 2010  Mizuki Fujisawa <fujisawa@bayon.cc>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 2 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+
+#ifndef MF_SHARD_H_
+#define MF_SHARD_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "rating.h"
+#include "util.h"
+
+namespace mf {
+
+/**
+ * Header of a shard directory (dir/shards.bin).
+ * The header is followed by int32 arrays of the first user index of
+ * each user block (blocks + 1) and the first item index of each item
+ * block (blocks + 1), and an int64 array of the number of rates in each
+ * block (blocks x blocks, row-major).
+ */
+struct ShardFileHeader {
+  char magic[4];      ///< "MFSH"
+  uint32_t version;   ///< format version
+  int32_t blocks;     ///< the number of user blocks and item blocks
+  int32_t users;      ///< the number of user indexes (max index + 1)
+  int32_t items;      ///< the number of item indexes (max index + 1)
+  int32_t factors;    ///< the number of factors (clusters)
+  int64_t nonzeros;   ///< the number of rates
+  int64_t epochs;     ///< the number of trained iterations
+  double average;     ///< average of rates
+};
+
+const char SHARD_FILE_MAGIC[] = "MFSH";  ///< magic of shard directories
+const uint32_t SHARD_FILE_VERSION = 1;   ///< version of shard directories
+
+/**
+ * Matrix factorization using stochastic gradient descent with biases
+ * (the model of MatrixFactorizerSgdBias) on a rating matrix split into
+ * blocks x blocks files. Only the rates and the factors of the blocks
+ * being updated are in memory, so the matrices may be larger than it.
+ *
+ * A directory holds
+ * - shards.bin: ShardFileHeader, ids.bin: maps of ids (see IdMap)
+ * - ratings.P.Q.bin: binary rating file of the user block P and the
+ *   item block Q (local indexes from 0)
+ * - user.P.bin, item.Q.bin: float32 rows of the factors and the bias of
+ *   each user (item) of the block
+ *
+ * As in TRAIN_BLOCK, the blocks of a stratum share no users and no items
+ * and are updated in parallel. Several processes (or hosts sharing the
+ * directory) can train disjoint user blocks with their own copies of
+ * the item blocks, which are averaged by average_workers() after each
+ * round of iterations.
+ */
+class ShardedSgd {
+ private:
+  std::string dir_;                   ///< shard directory
+  ShardFileHeader header_;            ///< header of the directory
+  std::vector<int32_t> user_begins_;  ///< first user index of each block
+  std::vector<int32_t> item_begins_;  ///< first item index of each block
+  std::vector<int64_t> nonzeros_;     ///< the number of rates of each block
+  size_t nthread_;                    ///< the number of threads
+  unsigned int seed_;                 ///< seed of random number generator
+  int worker_;                        ///< index of this worker
+  int nworker_;                       ///< the number of workers
+  Stats stats_;                       ///< statistics of phases and iterations
+
+  ShardedSgd(const ShardedSgd &);
+  ShardedSgd &operator=(const ShardedSgd &);
+
+  /**
+   * Get the path of a file in the directory.
+   * @param name file name, with "%d" replaced by p and q
+   * @param p user block (or worker)
+   * @param q item block
+   * @return path
+   */
+  std::string path(const char *name, int p = 0, int q = 0) const;
+
+  /**
+   * Get the path of an item block updated by this worker.
+   * @param q item block
+   * @return path
+   */
+  std::string item_path(int q) const;
+
+  /**
+   * Read the header of a directory.
+   * @param filename shards.bin (or shards.W.bin of a worker)
+   */
+  void read_header(const char *filename);
+
+  /**
+   * Write the header of a directory.
+   * @param filename output file name
+   */
+  void write_header(const char *filename) const;
+
+  /**
+   * Write random factors and biases of a block.
+   * @param filename output file name
+   * @param rows the number of users (items) of the block
+   */
+  void write_random_block(const char *filename, int rows);
+
+  /**
+   * Update the factors of a user block and an item block by the rates
+   * of the block.
+   * @param p user block
+   * @param q item block
+   * @param epoch the number of trained iterations
+   * @param eta a tuning parameter
+   * @param lambda a tuning parameter
+   * @return sum of squared prediction errors before the updates
+   */
+  double train_block(int p, int q, int64_t epoch, double eta,
+                     double lambda) const;
+
+ public:
+  /**
+   * Constructor.
+   */
+  ShardedSgd();
+
+  /**
+   * Set the number of threads (blocks updated at once).
+   * @param nthread the number of threads
+   */
+  void set_threads(size_t nthread) {
+    nthread_ = (nthread > 0) ? nthread : 1;
+  }
+
+  /**
+   * Set a seed of random number generator.
+   * @param seed seed
+   */
+  void set_seed(unsigned int seed) {
+    seed_ = seed;
+  }
+
+  /**
+   * Train only user blocks P with P % nworker == worker, updating copies
+   * of the item blocks (item.Q.W.bin) to be averaged by
+   * average_workers().
+   * @param worker index of this worker (0 <= worker < nworker)
+   * @param nworker the number of workers
+   */
+  void set_worker(int worker, int nworker) {
+    worker_ = worker;
+    nworker_ = (nworker > 0) ? nworker : 1;
+  }
+
+  /**
+   * Record statistics of making shards and training into a file.
+   * @param filename output file name ("-": standard error)
+   * @return return true if succeeded
+   */
+  bool open_stats(const char *filename) {
+    return stats_.open(filename);
+  }
+
+  /**
+   * Split a rating file into blocks in a directory with random factors.
+   * User ids and item ids are mapped to compact indexes, and each block
+   * of users (items) holds almost the same number of rates. The file is
+   * read three times, keeping only the ids and one user block of rates
+   * in memory.
+   * @param filename a text file or a binary rating file
+   * @param dir output directory (existing)
+   * @param nblock the number of user blocks and item blocks
+   * @param ncluster the number of clusters
+   */
+  void make_shards(const char *filename, const char *dir, int nblock,
+                   size_t ncluster);
+
+  /**
+   * Open a directory made by make_shards().
+   * @param dir shard directory
+   */
+  void open(const char *dir);
+
+  /**
+   * Update the factors by all rates (of the user blocks of this worker)
+   * niter times. The learning rate is decayed by the number of updated
+   * rates since the first iteration of the directory.
+   * @param niter the number of iterations
+   * @param eta a tuning parameter
+   * @param lambda a tuning parameter
+   */
+  void train(size_t niter, double eta, double lambda);
+
+  /**
+   * Save a model snapshot loadable by MatrixFactorizerSgdBias.
+   * @param filename output file name
+   */
+  void save_snapshot(const char *filename) const;
+
+  /**
+   * Get the header of the directory.
+   * @return header
+   */
+  const ShardFileHeader &header() const { return header_; }
+
+  /**
+   * Average the item blocks trained by workers into the directory, and
+   * remove the files of the workers. Only the copies of the workers
+   * which have rates in an item block are averaged.
+   * @param dir shard directory
+   * @param nworker the number of workers
+   */
+  static void average_workers(const char *dir, int nworker);
+};
+
+}  // namespace mf
+
+#endif  // MF_SHARD_H_
@@ -0,0 +1,233 @@
+//
+// Tests for out-of-core SGD on blocks of a rating matrix
+//
+// Copyright(C) 2010  Mizuki Fujisawa <fujisawa@bayon.cc>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; version 2 of the License.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+//
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <cstdio>
+#include <cstdlib>
+#include <gtest/gtest.h>
+#include "factorizer.h"
+#include "shard.h"
+
+namespace {
+
+const char *DIRNAME = "shardtest.tmp";
+const char *RATENAME = "shardtest_rates.tmp";
+
+// rates of 60 users with sparse ids for 30 items
+void write_rates() {
+  FILE *fp = fopen(RATENAME, "w");
+  ASSERT_TRUE(fp != NULL);
+  for (int user = 1; user <= 60; user++) {
+    for (int item = 1; item <= 30; item++) {
+      if ((user * 7 + item * 3) % 4 == 0) {
+        fprintf(fp, "%d\t%d\t%d\n", user * 1000003, item * 65537,
+                1 + (user + item) % 5);
+      }
+    }
+  }
+  fclose(fp);
+}
+
+void make_dir() {
+  system("rm -rf shardtest.tmp");
+  ASSERT_EQ(0, mkdir(DIRNAME, 0755));
+}
+
+void clean() {
+  system("rm -rf shardtest.tmp");
+  remove(RATENAME);
+}
+
+// RMSE of a snapshot of a directory for the rates
+double snapshot_rmse(const mf::ShardedSgd &shards) {
+  std::string model = std::string(DIRNAME) + "/model.bin";
+  std::string ids = std::string(DIRNAME) + "/ids.bin";
+  shards.save_snapshot(model.c_str());
+  mf::MatrixFactorizerSgdBias mf;
+  mf.load_snapshot(model.c_str());
+  mf.load_id_maps(ids.c_str());
+  return mf.test(RATENAME);
+}
+
+// float32 values of a file
+std::vector<float> read_floats(const std::string &path) {
+  std::vector<float> values;
+  FILE *fp = fopen(path.c_str(), "rb");
+  if (fp == NULL) return values;
+  float value;
+  while (fread(&value, sizeof(value), 1, fp) == 1) values.push_back(value);
+  fclose(fp);
+  return values;
+}
+
+}  // namespace
+
+/* make_shards */
+TEST(ShardTest, MakeShardsTest) {
+  write_rates();
+  make_dir();
+  mf::ShardedSgd shards;
+  shards.make_shards(RATENAME, DIRNAME, 3, 4);
+
+  mf::SMat mat;
+  mf::read_rating_file(RATENAME, mat);
+  mf::ShardedSgd opened;
+  opened.open(DIRNAME);
+  const mf::ShardFileHeader &header = opened.header();
+  EXPECT_EQ(3, header.blocks);
+  EXPECT_EQ(61, header.users);
+  EXPECT_EQ(31, header.items);
+  EXPECT_EQ(4, header.factors);
+  EXPECT_EQ(mat.nonZeros(), header.nonzeros);
+  EXPECT_EQ(0, header.epochs);
+
+  // blocks hold all rates with local indexes
+  long nonzeros = 0;
+  for (int p = 0; p < 3; p++) {
+    for (int q = 0; q < 3; q++) {
+      char path[256];
+      snprintf(path, sizeof(path), "%s/ratings.%d.%d.bin", DIRNAME, p, q);
+      mf::SMat block;
+      mf::read_rating_file(path, block);
+      nonzeros += block.nonZeros();
+    }
+  }
+  EXPECT_EQ(mat.nonZeros(), nonzeros);
+
+  mf::IdMap users, items;
+  mf::read_id_maps((std::string(DIRNAME) + "/ids.bin").c_str(), users, items);
+  EXPECT_EQ(61, users.size());
+  EXPECT_EQ(1000003, users.id(1));
+  EXPECT_EQ(30 * 65537, items.id(30));
+  clean();
+}
+
+/* train, save_snapshot */
+TEST(ShardTest, TrainTest) {
+  write_rates();
+  make_dir();
+  mf::ShardedSgd shards;
+  shards.set_threads(2);
+  shards.make_shards(RATENAME, DIRNAME, 3, 4);
+  double initial = snapshot_rmse(shards);
+  shards.train(10, 0.01, 0.02);
+  EXPECT_EQ(10, shards.header().epochs);
+  EXPECT_LT(snapshot_rmse(shards), initial);
+
+  mf::ShardedSgd opened;
+  opened.open(DIRNAME);
+  EXPECT_EQ(10, opened.header().epochs);
+  clean();
+}
+
+/* average_workers */
+TEST(ShardTest, AverageWorkersTest) {
+  write_rates();
+  make_dir();
+  mf::ShardedSgd shards;
+  shards.make_shards(RATENAME, DIRNAME, 2, 4);
+  double initial = snapshot_rmse(shards);
+  for (int round = 0; round < 5; round++) {
+    for (int w = 0; w < 2; w++) {
+      mf::ShardedSgd worker;
+      worker.set_worker(w, 2);
+      worker.open(DIRNAME);
+      worker.train(2, 0.01, 0.02);
+    }
+    mf::ShardedSgd::average_workers(DIRNAME, 2);
+  }
+  mf::ShardedSgd opened;
+  opened.open(DIRNAME);
+  EXPECT_EQ(10, opened.header().epochs);
+  EXPECT_LT(snapshot_rmse(opened), initial);
+
+  struct stat st;
+  std::string worker_item = std::string(DIRNAME) + "/item.0.1.bin";
+  EXPECT_NE(0, stat(worker_item.c_str(), &st));
+  clean();
+}
+
+/* average_workers with workers having no user blocks */
+TEST(ShardTest, AverageIdleWorkersTest) {
+  write_rates();
+  make_dir();
+  mf::ShardedSgd shards;
+  shards.make_shards(RATENAME, DIRNAME, 2, 4);
+  for (int w = 0; w < 3; w++) {
+    mf::ShardedSgd worker;
+    worker.set_worker(w, 3);
+    worker.open(DIRNAME);
+    worker.train(1, 0.01, 0.02);
+  }
+  std::vector<float> copies[3];
+  for (int w = 0; w < 3; w++) {
+    char path[256];
+    sprintf(path, "%s/item.0.%d.bin", DIRNAME, w);
+    copies[w] = read_floats(path);
+    ASSERT_FALSE(copies[w].empty());
+  }
+  mf::ShardedSgd::average_workers(DIRNAME, 3);
+  // the worker 2 has no user blocks, and its copy is not averaged
+  std::vector<float> averaged = read_floats(std::string(DIRNAME) +
+                                            "/item.0.bin");
+  ASSERT_EQ(copies[0].size(), averaged.size());
+  for (size_t i = 0; i < averaged.size(); i++) {
+    EXPECT_FLOAT_EQ((copies[0][i] + copies[1][i]) / 2, averaged[i]);
+  }
+  clean();
+}
+
+/* save_user_matrix, save_item_matrix with compact indexes */
+TEST(ShardTest, CompactMatrixTest) {
+  write_rates();
+  make_dir();
+  mf::MatrixFactorizerSgdBias mf;
+  mf.train_compact(RATENAME);
+  mf.factorize(4, 1, 0.01, 0.02);
+  std::string upath = std::string(DIRNAME) + "/usermat.tsv";
+  std::string ipath = std::string(DIRNAME) + "/itemmat.tsv";
+  mf.save_user_matrix(upath.c_str());
+  mf.save_item_matrix(ipath.c_str());
+  // a row per original id, in order of ids
+  const char *paths[] = { upath.c_str(), ipath.c_str() };
+  const int steps[] = { 1000003, 65537 };
+  const int counts[] = { 60, 30 };
+  for (int m = 0; m < 2; m++) {
+    FILE *fp = fopen(paths[m], "r");
+    ASSERT_TRUE(fp != NULL);
+    char line[1024];
+    int rows = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+      std::vector<std::string> fields;
+      mf::split_string(line, "\t", fields);
+      ASSERT_EQ(5U, fields.size());
+      ++rows;
+      EXPECT_EQ(rows * steps[m], atoi(fields[0].c_str()));
+    }
+    fclose(fp);
+    EXPECT_EQ(counts[m], rows);
+  }
+  clean();
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
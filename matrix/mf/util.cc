@@ -17,12 +17,53 @@
 // Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 //
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <cstdlib>
 #include <sstream>
 #include "util.h"
 
 namespace mf {
 
+/**
+ * Map a file into memory.
+ */
+bool MappedFile::open(const char *filename, bool writable) {
+  close();
+  int fd = ::open(filename, O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    ::close(fd);
+    return false;
+  }
+  size_ = static_cast<size_t>(st.st_size);
+  if (size_ > 0) {
+    int prot = writable ? (PROT_READ | PROT_WRITE) : PROT_READ;
+    void *addr = mmap(NULL, size_, prot, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+      ::close(fd);
+      size_ = 0;
+      return false;
+    }
+    madvise(addr, size_, MADV_SEQUENTIAL);
+    data_ = static_cast<const char *>(addr);
+  }
+  ::close(fd);
+  return true;
+}
+
+/**
+ * Unmap the file.
+ */
+void MappedFile::close() {
+  if (data_) munmap(const_cast<char *>(data_), size_);
+  data_ = NULL;
+  size_ = 0;
+}
+
 /**
  * Set seed for random number generator.
  */
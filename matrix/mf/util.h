@@ -20,8 +20,11 @@
 #ifndef MF_UTIL_H_
 #define MF_UTIL_H_
 
+#include <cstddef>
+#include <cstdio>
 #include <string>
 #include <vector>
+#include "job_stats.h"
 
 namespace mf {
 
@@ -65,6 +68,66 @@ void split_string(const std::string &s, const std::string &delimiter,
 std::string join_strings(const std::vector<std::string> &splited,
                          const std::string &delimiter);
 
+/**
+ * Read-only memory-mapped file.
+ */
+class MappedFile {
+ private:
+  const char *data_;  ///< mapped address
+  size_t size_;       ///< file size
+
+  MappedFile(const MappedFile &);
+  MappedFile &operator=(const MappedFile &);
+
+ public:
+  /**
+   * Constructor.
+   */
+  MappedFile() : data_(NULL), size_(0) { }
+
+  /**
+   * Destructor.
+   */
+  ~MappedFile() { close(); }
+
+  /**
+   * Map a file into memory.
+   * @param filename file name
+   * @param writable map pages copy-on-write so that they can be modified
+   *                 without changing the file
+   * @return return true if succeeded
+   */
+  bool open(const char *filename, bool writable = false);
+
+  /**
+   * Unmap the file.
+   */
+  void close();
+
+  /**
+   * Get the mapped address. (NULL if the file is empty)
+   * @return mapped address
+   */
+  const char *data() const { return data_; }
+
+  /**
+   * Get the file size.
+   * @return file size
+   */
+  size_t size() const { return size_; }
+};
+
+/**
+ * Statistics of a long-running job, shared with the tools of ../../sparse.
+ * Each phase and each iteration is written as a line of tab separated
+ * key=value pairs, e.g.
+ *   phase=load       seconds=0.52  ratings=100000  ratings/s=192307.69
+ *   iteration=3      train_rmse=0.912300  seconds=0.11  ratings/s=909090.91
+ * and the file is flushed at each line. Nothing is recorded until a file
+ * is opened, and nothing is compiled in with -DDISABLE_STATS.
+ */
+typedef sparse::JobStats Stats;
+
 /**
  * Set seed for random number generator.
  * @param seed seed
@@ -17,6 +17,8 @@
 // Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 //
 
+#include <unistd.h>
+#include <fstream>
 #include <gtest/gtest.h>
 #include "util.h"
 
@@ -74,6 +76,53 @@ TEST(UtilTest, JoinStringsTest) {
   EXPECT_EQ("a\tbc\tdef\tgh", joined);
 }
 
+#ifndef DISABLE_STATS
+/* Stats */
+TEST(UtilTest, StatsTest) {
+  const char *filename = "stats_test.tsv";
+  unlink(filename);
+  mf::Stats stats("ratings");
+  EXPECT_FALSE(stats.enabled());
+  EXPECT_EQ(0.0, stats.start());
+  EXPECT_TRUE(stats.open(filename));
+  EXPECT_TRUE(stats.enabled());
+  double start = stats.start();
+  EXPECT_LT(0.0, start);
+  stats.phase("load", start, 100);
+  stats.phase("seed", start, 0);
+  stats.iteration(1, start, 100).value("train_rmse", 0.5).end();
+  stats.close();
+  EXPECT_FALSE(stats.enabled());
+  stats.phase("save", start, 0);
+
+  std::ifstream ifs(filename);
+  std::string line;
+  std::vector<std::string> splited;
+  ASSERT_TRUE(std::getline(ifs, line));
+  mf::split_string(line, mf::DELIMITER, splited);
+  ASSERT_EQ(4, splited.size());
+  EXPECT_EQ("phase=load", splited[0]);
+  EXPECT_EQ(0, splited[1].find("seconds="));
+  EXPECT_EQ("ratings=100", splited[2]);
+  EXPECT_EQ(0, splited[3].find("ratings/s="));
+  splited.clear();
+  ASSERT_TRUE(std::getline(ifs, line));
+  mf::split_string(line, mf::DELIMITER, splited);
+  ASSERT_EQ(2, splited.size());
+  EXPECT_EQ("phase=seed", splited[0]);
+  splited.clear();
+  ASSERT_TRUE(std::getline(ifs, line));
+  mf::split_string(line, mf::DELIMITER, splited);
+  ASSERT_EQ(4, splited.size());
+  EXPECT_EQ("iteration=1", splited[0]);
+  EXPECT_EQ("train_rmse=0.500000", splited[1]);
+  EXPECT_EQ(0, splited[2].find("seconds="));
+  EXPECT_EQ(0, splited[3].find("ratings/s="));
+  EXPECT_FALSE(std::getline(ifs, line));
+  unlink(filename);
+}
+#endif
+
 int main(int argc, char **argv) {
   srand((unsigned int)time(NULL));
   testing::InitGoogleTest(&argc, argv);
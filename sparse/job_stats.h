@@ -0,0 +1,137 @@
+//
+// Statistics of phases and iterations of long-running jobs
+//
+// Each phase and each iteration is written as a line of tab separated
+// key=value pairs, and the file is flushed at each line, e.g.
+//   phase=load	seconds=2.105	points=100000	points/s=47505.94
+//   iteration=3	sse=1234.567800	changed=210	seconds=0.318	points/s=314465.41
+// Nothing is recorded until a file is opened (enabled() is false, so
+// that objectives only for the statistics can be skipped), and nothing
+// is compiled in with -DDISABLE_STATS.
+//
+// Usage:
+//   sparse::JobStats stats("points");
+//   stats.open("-");  // stderr
+//   double start = stats.start();
+//   ...
+//   stats.phase("assign", start, npoints);
+//   stats.iteration(i, start, npoints).value("sse", sse).count("changed", n)
+//        .end();
+//
+
+#ifndef JOB_STATS_H_
+#define JOB_STATS_H_
+
+#include <sys/time.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+namespace sparse {
+
+class JobStats {
+ public:
+  explicit JobStats(const char *unit)
+    : fp_(NULL), owned_(false), unit_(unit), start_(0.0), nitems_(0) { }
+  ~JobStats() { close(); }
+
+  // append the lines to a file ("-": stderr)
+  bool open(const char *path) {
+    close();
+    if (!strcmp(path, "-")) {
+      fp_ = stderr;
+      return true;
+    }
+    fp_ = fopen(path, "a");
+    owned_ = true;
+    return fp_ != NULL;
+  }
+
+  // append the lines to an open file (which is not closed by close())
+  void open(FILE *fp) {
+    close();
+    fp_ = fp;
+  }
+
+  void close() {
+    if (fp_ != NULL && owned_) fclose(fp_);
+    fp_ = NULL;
+    owned_ = false;
+  }
+
+  bool enabled() const {
+#ifdef DISABLE_STATS
+    return false;
+#else
+    return fp_ != NULL;
+#endif
+  }
+
+  static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+  }
+
+  // the start time of a phase or an iteration (0 if not recording)
+  double start() const { return enabled() ? now() : 0.0; }
+
+  // a phase which processed nitems (0: no throughput)
+  void phase(const char *name, double start, size_t nitems) const {
+    if (!enabled()) return;
+    double seconds = now() - start;
+    fprintf(fp_, "phase=%s\tseconds=%.6f", name, seconds);
+    if (nitems > 0) {
+      fprintf(fp_, "\t%s=%lu\t%s/s=%.2f", unit_.c_str(),
+              static_cast<unsigned long>(nitems), unit_.c_str(),
+              (seconds > 0) ? nitems / seconds : 0.0);
+    }
+    fprintf(fp_, "\n");
+    fflush(fp_);
+  }
+
+  // Begin a line of an iteration which processed nitems.  The values are
+  // appended by value(), and the time and the throughput by end().
+  JobStats &iteration(size_t iter, double start, size_t nitems) {
+    start_ = start;
+    nitems_ = nitems;
+    if (enabled()) {
+      fprintf(fp_, "iteration=%lu", static_cast<unsigned long>(iter));
+    }
+    return *this;
+  }
+
+  JobStats &value(const char *key, double value) {
+    if (enabled()) fprintf(fp_, "\t%s=%.6f", key, value);
+    return *this;
+  }
+
+  JobStats &count(const char *key, size_t count) {
+    if (enabled()) {
+      fprintf(fp_, "\t%s=%lu", key, static_cast<unsigned long>(count));
+    }
+    return *this;
+  }
+
+  void end() {
+    if (!enabled()) return;
+    double seconds = now() - start_;
+    fprintf(fp_, "\tseconds=%.6f\t%s/s=%.2f\n", seconds, unit_.c_str(),
+            (seconds > 0) ? nitems_ / seconds : 0.0);
+    fflush(fp_);
+  }
+
+ private:
+  FILE *fp_;          // NULL: not recording
+  bool owned_;        // fp_ is closed by close()
+  std::string unit_;  // name of processed items
+  double start_;      // of the current iteration
+  size_t nitems_;     // of the current iteration
+
+  JobStats(const JobStats &);
+  JobStats &operator=(const JobStats &);
+};
+
+}  // namespace sparse
+
+#endif  // JOB_STATS_H_
@@ -0,0 +1,339 @@
+//
+// Benchmark of the sparse vector kernels and the jobs on them
+//
+// Usage:
+//   % sparse_bench [-s min_seconds] [-j] [-f filter]
+//     -s min_seconds ... run each benchmark for min_seconds at least
+//                        (default: 0.2)
+//     -j             ... print the results in JSON (the format of Google
+//                        Benchmark) instead of TSV
+//     -f filter      ... run the benchmarks whose names contain filter
+//
+// Synthetic data sets are made from a fixed seed, so every run measures
+// the same work:
+//   dot, squared_distance ... dense kernels (float/double, by length)
+//   spdot                 ... sparse-dense dot (by non-zeros)
+//   spspdot, cosine       ... sparse-sparse merge (by non-zeros)
+//   synthetic-kmeans      ... one Lloyd iteration (assignment and centers)
+//                             by vectors N and centers K
+//   synthetic-lsh-*       ... signatures by signs of dot products
+//                             (signature) and cosine of candidate pairs
+//                             (verify)
+//
+// The synthetic-* benchmarks are loops written here on the kernels of
+// sparse_matrix.h after the jobs of kmeanspp_mp and lsh.  They do not call
+// the code of the tools, so they follow changes of the kernels but not
+// changes of kmeanspp_mp.cc or lsh.cc (e.g. the bounds of kmeanspp_mp).
+//
+// Build:
+//   % g++ -Wall -O3 sparse_bench.cc -o sparse_bench
+//   (or "./waf build" in matrix/mf with mfbench: build/default/sparse_bench)
+//
+
+#include <stdint.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+#include "job_stats.h"
+#include "sparse_matrix.h"
+
+/* constants of synthetic data */
+const unsigned int DATA_SEED = 20100101;
+const size_t DENSE_LENGTHS[] = { 64, 1024, 16384 };
+const size_t SPARSE_LENGTHS[] = { 16, 128, 1024 };
+const size_t SPARSE_DIMENSION = 1 << 16;
+const size_t KMEANS_SIZES[] = { 1000, 10000 };
+const size_t KMEANS_CENTERS[] = { 10, 100 };
+const size_t KMEANS_DIMENSION = 10000;
+const size_t KMEANS_NONZEROS = 50;
+const size_t LSH_VECTORS = 2000;
+const size_t LSH_BITS = 100;
+const size_t LSH_NONZEROS = 50;
+
+/* result of a benchmark */
+struct Result {
+  std::string name;
+  size_t iterations;
+  double seconds;  // per iteration
+  double items;    // per iteration
+};
+
+/* options */
+struct Option {
+  double min_seconds;
+  bool json;
+  const char *filter;
+};
+
+std::vector<Result> results;
+volatile double sink;  // keeps the results of kernels alive
+
+// run stmt repeatedly for min_seconds at least, and record the time per
+// iteration and the items processed by an iteration
+#define BENCH(option, label, nitems, stmt) do {             \
+    if (selected((option), (label))) {                      \
+      double start_ = sparse::JobStats::now();              \
+      size_t loops_ = 0;                                    \
+      do {                                                  \
+        stmt;                                               \
+        loops_++;                                           \
+      } while (sparse::JobStats::now() - start_ <           \
+               (option).min_seconds);                       \
+      Result result_;                                       \
+      result_.name = (label);                               \
+      result_.iterations = loops_;                          \
+      result_.seconds =                                     \
+        (sparse::JobStats::now() - start_) / loops_;        \
+      result_.items = (nitems);                             \
+      results.push_back(result_);                           \
+      progress(result_);                                    \
+    }                                                       \
+  } while (0)
+
+bool selected(const Option &option, const std::string &name) {
+  return option.filter == NULL || name.find(option.filter) != name.npos;
+}
+
+void progress(const Result &result) {
+  fprintf(stderr, "%s\t%ld\n", result.name.c_str(), result.iterations);
+}
+
+std::string bench_name(const char *kernel, const char *type, size_t size) {
+  char buf[128];
+  snprintf(buf, sizeof(buf), "%s/%s/%ld", kernel, type, size);
+  return buf;
+}
+
+template <typename T> const char *type_name();
+template <> const char *type_name<float>() { return "float"; }
+template <> const char *type_name<double>() { return "double"; }
+
+// uniform in [0, 1)
+double random_value(unsigned int *seed) {
+  return static_cast<double>(rand_r(seed)) / (static_cast<double>(RAND_MAX) + 1);
+}
+
+template <typename T>
+void random_dense(size_t size, unsigned int *seed, std::vector<T> &vec) {
+  vec.resize(size);
+  for (size_t i = 0; i < size; i++) vec[i] = random_value(seed) - 0.5;
+}
+
+// rows of nonzeros random ids in [0, dimension)
+template <typename T>
+void random_sparse(size_t rows, size_t nonzeros, size_t dimension,
+                   unsigned int *seed, sparse::Matrix<T> &matrix) {
+  std::vector<typename sparse::Matrix<T>::Element> elements;
+  for (size_t r = 0; r < rows; r++) {
+    elements.clear();
+    for (size_t i = 0; i < nonzeros; i++) {
+      elements.push_back(std::make_pair(rand_r(seed) % dimension,
+                                        random_value(seed)));
+    }
+    matrix.add(elements);
+  }
+}
+
+template <typename T>
+void bench_dense(const Option &option) {
+  unsigned int seed = DATA_SEED;
+  for (size_t l = 0; l < sizeof(DENSE_LENGTHS) / sizeof(DENSE_LENGTHS[0]); l++) {
+    size_t size = DENSE_LENGTHS[l];
+    std::vector<T> x, y;
+    random_dense(size, &seed, x);
+    random_dense(size, &seed, y);
+    BENCH(option, bench_name("dot", type_name<T>(), size), size,
+          sink = sparse::dot(&x[0], &y[0], size));
+    BENCH(option, bench_name("squared_distance", type_name<T>(), size), size,
+          sink = sparse::squared_distance(&x[0], &y[0], size));
+  }
+}
+
+template <typename T>
+void bench_sparse(const Option &option) {
+  unsigned int seed = DATA_SEED;
+  std::vector<T> dense;
+  random_dense(SPARSE_DIMENSION, &seed, dense);
+  for (size_t l = 0; l < sizeof(SPARSE_LENGTHS) / sizeof(SPARSE_LENGTHS[0]); l++) {
+    size_t nonzeros = SPARSE_LENGTHS[l];
+    // rows share about half of their ids
+    sparse::Matrix<T> matrix;
+    random_sparse(2, nonzeros, nonzeros * 4, &seed, matrix);
+    BENCH(option, bench_name("spdot", type_name<T>(), nonzeros),
+          matrix.length(0), sink = matrix.dot(0, &dense[0]));
+    BENCH(option, bench_name("spspdot", type_name<T>(), nonzeros),
+          matrix.length(0) + matrix.length(1), sink = matrix.dot(0, 1));
+    BENCH(option, bench_name("cosine", type_name<T>(), nonzeros),
+          matrix.length(0) + matrix.length(1), sink = matrix.cosine(0, 1));
+  }
+}
+
+// one Lloyd iteration after kmeanspp_mp (without its bounds): the nearest
+// centers by
+// ||x||^2 + ||c||^2 - 2 x.c, and the means of the clusters
+void kmeans_iteration(const sparse::Matrix<float> &vectors, size_t ncenters,
+                      std::vector<float> &centers,
+                      std::vector<double> &center_norms,
+                      std::vector<size_t> &assign) {
+  size_t dim = KMEANS_DIMENSION;
+  for (size_t i = 0; i < vectors.size(); i++) {
+    double min_dist = vectors.squared_distance(i, &centers[0], center_norms[0]);
+    assign[i] = 0;
+    for (size_t c = 1; c < ncenters; c++) {
+      double dist = vectors.squared_distance(i, &centers[0] + c * dim,
+                                             center_norms[c]);
+      if (dist < min_dist) {
+        min_dist = dist;
+        assign[i] = c;
+      }
+    }
+  }
+  std::vector<size_t> counts(ncenters, 0);
+  std::fill(centers.begin(), centers.end(), 0.0f);
+  for (size_t i = 0; i < vectors.size(); i++) {
+    vectors.add_to(i, &centers[0] + assign[i] * dim);
+    counts[assign[i]]++;
+  }
+  for (size_t c = 0; c < ncenters; c++) {
+    float *center = &centers[0] + c * dim;
+    if (counts[c] > 0) {
+      for (size_t k = 0; k < dim; k++) center[k] /= counts[c];
+    }
+    center_norms[c] = sparse::dot(center, center, dim);
+  }
+}
+
+void bench_kmeans(const Option &option) {
+  unsigned int seed = DATA_SEED;
+  for (size_t n = 0; n < sizeof(KMEANS_SIZES) / sizeof(KMEANS_SIZES[0]); n++) {
+    sparse::Matrix<float> vectors;
+    random_sparse(KMEANS_SIZES[n], KMEANS_NONZEROS, KMEANS_DIMENSION, &seed,
+                  vectors);
+    for (size_t k = 0; k < sizeof(KMEANS_CENTERS) / sizeof(KMEANS_CENTERS[0]); k++) {
+      size_t ncenters = KMEANS_CENTERS[k];
+      char name[128];
+      snprintf(name, sizeof(name), "synthetic-kmeans/N:%ld/K:%ld",
+               vectors.size(), ncenters);
+      if (!selected(option, name)) continue;
+      // the first vectors are the initial centers
+      std::vector<float> centers(ncenters * KMEANS_DIMENSION, 0.0f);
+      std::vector<double> center_norms(ncenters);
+      for (size_t c = 0; c < ncenters; c++) {
+        vectors.add_to(c, &centers[0] + c * KMEANS_DIMENSION);
+        center_norms[c] = vectors.squared_norm(c);
+      }
+      std::vector<size_t> assign(vectors.size());
+      BENCH(option, name, vectors.size(),
+            kmeans_iteration(vectors, ncenters, centers, center_norms, assign));
+    }
+  }
+}
+
+// Bits of signatures are the signs of the dot products with random
+// vectors of the data, and candidates are verified by cosine (after
+// lsh.cc).
+void bench_lsh(const Option &option) {
+  unsigned int seed = DATA_SEED;
+  sparse::Matrix<double> vectors;
+  random_sparse(LSH_VECTORS, LSH_NONZEROS, LSH_NONZEROS * 20, &seed, vectors);
+  std::vector<size_t> randrows(LSH_BITS);
+  for (size_t b = 0; b < LSH_BITS; b++) randrows[b] = rand_r(&seed) % LSH_VECTORS;
+  size_t nwords = (LSH_BITS + 63) / 64;
+  std::vector<uint64_t> signatures(LSH_VECTORS * nwords);
+  BENCH(option, "synthetic-lsh-signature", LSH_VECTORS,
+        std::fill(signatures.begin(), signatures.end(), 0);
+        for (size_t i = 0; i < LSH_VECTORS; i++) {
+          uint64_t *sig = &signatures[0] + i * nwords;
+          for (size_t b = 0; b < LSH_BITS; b++) {
+            if (vectors.dot(i, randrows[b]) > 0) sig[b / 64] |= 1ULL << (b % 64);
+          }
+        }
+        sink = signatures[0]);
+
+  std::vector<std::pair<size_t, size_t> > candidates(LSH_VECTORS * 10);
+  for (size_t i = 0; i < candidates.size(); i++) {
+    candidates[i].first = rand_r(&seed) % LSH_VECTORS;
+    candidates[i].second = rand_r(&seed) % LSH_VECTORS;
+  }
+  BENCH(option, "synthetic-lsh-verify", candidates.size(),
+        double sum = 0;
+        for (size_t i = 0; i < candidates.size(); i++) {
+          sum += vectors.cosine(candidates[i].first, candidates[i].second);
+        }
+        sink = sum);
+}
+
+void print_tsv() {
+  printf("name\titerations\tns/iteration\titems/s\n");
+  for (size_t i = 0; i < results.size(); i++) {
+    const Result &r = results[i];
+    printf("%s\t%ld\t%.1f\t%.4g\n", r.name.c_str(), r.iterations,
+           r.seconds * 1e9, r.items / r.seconds);
+  }
+}
+
+void print_json(const char *progname) {
+  char date[64];
+  time_t now = time(NULL);
+  strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&now));
+  printf("{\n");
+  printf("  \"context\": {\n");
+  printf("    \"date\": \"%s\",\n", date);
+  printf("    \"executable\": \"%s\",\n", progname);
+  printf("    \"num_cpus\": %ld\n", sysconf(_SC_NPROCESSORS_ONLN));
+  printf("  },\n");
+  printf("  \"benchmarks\": [\n");
+  for (size_t i = 0; i < results.size(); i++) {
+    const Result &r = results[i];
+    printf("    {\n");
+    printf("      \"name\": \"%s\",\n", r.name.c_str());
+    printf("      \"iterations\": %ld,\n", r.iterations);
+    printf("      \"real_time\": %.3f,\n", r.seconds * 1e9);
+    printf("      \"cpu_time\": %.3f,\n", r.seconds * 1e9);
+    printf("      \"time_unit\": \"ns\",\n");
+    printf("      \"items_per_second\": %.6g\n", r.items / r.seconds);
+    printf("    }%s\n", (i + 1 < results.size()) ? "," : "");
+  }
+  printf("  ]\n");
+  printf("}\n");
+}
+
+int main(int argc, char **argv) {
+  Option option;
+  option.min_seconds = 0.2;
+  option.json = false;
+  option.filter = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:jf:")) != -1) {
+    switch (opt) {
+    case 's':
+      option.min_seconds = atof(optarg);
+      break;
+    case 'j':
+      option.json = true;
+      break;
+    case 'f':
+      option.filter = optarg;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-s min_seconds] [-j] [-f filter]\n", argv[0]);
+      exit(1);
+    }
+  }
+  bench_dense<float>(option);
+  bench_dense<double>(option);
+  bench_sparse<float>(option);
+  bench_sparse<double>(option);
+  bench_kmeans(option);
+  bench_lsh(option);
+  if (option.json) {
+    print_json(argv[0]);
+  } else {
+    print_tsv();
+  }
+  return 0;
+}
@@ -0,0 +1,297 @@
+//
+// Sparse vectors in CSR and the kernels on them
+//
+// Matrix<T> keeps rows of (id, value) sorted by ids in contiguous arrays
+// with their norms computed when they are added.  The dense kernels use
+// SSE2 when the target has it (__SSE2__, always on x86-64), and the same
+// independent partial sums in plain C++ otherwise, so both give the same
+// results.  The sparse kernels are scalar loops (unrolled with partial
+// sums), as SSE2 has no gather for dense[ids[i]].
+//
+// Usage:
+//   sparse::Matrix<float> matrix;
+//   std::vector<sparse::Matrix<float>::Element> elements;
+//   ...
+//   matrix.add(elements);
+//   double cos = matrix.cosine(row1, row2);
+//   double dist = matrix.squared_distance(row, center, center_norm2);
+//
+
+#ifndef SPARSE_MATRIX_H_
+#define SPARSE_MATRIX_H_
+
+#include <stdint.h>
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace sparse {
+
+// pointer to the elements of a vector (NULL for an empty vector)
+template <typename T>
+inline T *data(std::vector<T> &v) { return v.empty() ? NULL : &v[0]; }
+
+template <typename T>
+inline const T *data(const std::vector<T> &v) {
+  return v.empty() ? NULL : &v[0];
+}
+
+// dot product of dense vectors
+template <typename T>
+inline T dot(const T *x, const T *y, size_t size) {
+  T sums[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+  size_t i = 0, blocked = size - size % 8;
+  for (; i < blocked; i += 8) {
+    for (size_t k = 0; k < 8; k++) sums[k] += x[i + k] * y[i + k];
+  }
+  T sum = 0;
+  for (; i < size; i++) sum += x[i] * y[i];
+  return ((sums[0] + sums[1]) + (sums[2] + sums[3])) +
+         ((sums[4] + sums[5]) + (sums[6] + sums[7])) + sum;
+}
+
+// squared euclidean distance of dense vectors
+template <typename T>
+inline T squared_distance(const T *x, const T *y, size_t size) {
+  T sums[4] = { 0, 0, 0, 0 };
+  size_t i = 0, blocked = size - size % 4;
+  for (; i < blocked; i += 4) {
+    for (size_t k = 0; k < 4; k++) {
+      T d = x[i + k] - y[i + k];
+      sums[k] += d * d;
+    }
+  }
+  T sum = 0;
+  for (; i < size; i++) sum += (x[i] - y[i]) * (x[i] - y[i]);
+  return (sums[0] + sums[1]) + (sums[2] + sums[3]) + sum;
+}
+
+#ifdef __SSE2__
+// SSE2 kernels with the lanes of the partial sums above
+template <>
+inline float dot<float>(const float *x, const float *y, size_t size) {
+  __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+  size_t i = 0, blocked = size - size % 8;
+  for (; i < blocked; i += 8) {
+    acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(x + i),
+                                       _mm_loadu_ps(y + i)));
+    acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(x + i + 4),
+                                       _mm_loadu_ps(y + i + 4)));
+  }
+  float sums[8];
+  _mm_storeu_ps(sums, acc0);
+  _mm_storeu_ps(sums + 4, acc1);
+  float sum = 0;
+  for (; i < size; i++) sum += x[i] * y[i];
+  return ((sums[0] + sums[1]) + (sums[2] + sums[3])) +
+         ((sums[4] + sums[5]) + (sums[6] + sums[7])) + sum;
+}
+
+template <>
+inline double dot<double>(const double *x, const double *y, size_t size) {
+  __m128d acc[4] = { _mm_setzero_pd(), _mm_setzero_pd(),
+                     _mm_setzero_pd(), _mm_setzero_pd() };
+  size_t i = 0, blocked = size - size % 8;
+  for (; i < blocked; i += 8) {
+    for (size_t k = 0; k < 4; k++) {
+      acc[k] = _mm_add_pd(acc[k], _mm_mul_pd(_mm_loadu_pd(x + i + 2 * k),
+                                             _mm_loadu_pd(y + i + 2 * k)));
+    }
+  }
+  double sums[8];
+  for (size_t k = 0; k < 4; k++) _mm_storeu_pd(sums + 2 * k, acc[k]);
+  double sum = 0;
+  for (; i < size; i++) sum += x[i] * y[i];
+  return ((sums[0] + sums[1]) + (sums[2] + sums[3])) +
+         ((sums[4] + sums[5]) + (sums[6] + sums[7])) + sum;
+}
+
+template <>
+inline float squared_distance<float>(const float *x, const float *y,
+                                     size_t size) {
+  __m128 acc = _mm_setzero_ps();
+  size_t i = 0, blocked = size - size % 4;
+  for (; i < blocked; i += 4) {
+    __m128 d = _mm_sub_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i));
+    acc = _mm_add_ps(acc, _mm_mul_ps(d, d));
+  }
+  float sums[4];
+  _mm_storeu_ps(sums, acc);
+  float sum = 0;
+  for (; i < size; i++) sum += (x[i] - y[i]) * (x[i] - y[i]);
+  return (sums[0] + sums[1]) + (sums[2] + sums[3]) + sum;
+}
+
+template <>
+inline double squared_distance<double>(const double *x, const double *y,
+                                       size_t size) {
+  __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+  size_t i = 0, blocked = size - size % 4;
+  for (; i < blocked; i += 4) {
+    __m128d d0 = _mm_sub_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i));
+    __m128d d1 = _mm_sub_pd(_mm_loadu_pd(x + i + 2), _mm_loadu_pd(y + i + 2));
+    acc0 = _mm_add_pd(acc0, _mm_mul_pd(d0, d0));
+    acc1 = _mm_add_pd(acc1, _mm_mul_pd(d1, d1));
+  }
+  double sums[4];
+  _mm_storeu_pd(sums, acc0);
+  _mm_storeu_pd(sums + 2, acc1);
+  double sum = 0;
+  for (; i < size; i++) sum += (x[i] - y[i]) * (x[i] - y[i]);
+  return (sums[0] + sums[1]) + (sums[2] + sums[3]) + sum;
+}
+#endif  // __SSE2__
+
+// dot product of a sparse vector and a dense vector
+template <typename T>
+inline T dot(const uint32_t *ids, const T *values, size_t size,
+             const T *dense) {
+  T sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0;
+  size_t i = 0;
+  for (; i + 4 <= size; i += 4) {
+    sum0 += values[i] * dense[ids[i]];
+    sum1 += values[i+1] * dense[ids[i+1]];
+    sum2 += values[i+2] * dense[ids[i+2]];
+    sum3 += values[i+3] * dense[ids[i+3]];
+  }
+  for (; i < size; i++) sum0 += values[i] * dense[ids[i]];
+  return (sum0 + sum1) + (sum2 + sum3);
+}
+
+// dot product of sparse vectors (merge of sorted ids)
+template <typename T>
+inline T dot(const uint32_t *ids1, const T *values1, size_t size1,
+             const uint32_t *ids2, const T *values2, size_t size2) {
+  T sum = 0;
+  size_t p1 = 0, p2 = 0;
+  while (p1 < size1 && p2 < size2) {
+    if (ids1[p1] < ids2[p2]) {
+      p1++;
+    } else if (ids1[p1] > ids2[p2]) {
+      p2++;
+    } else {
+      sum += values1[p1++] * values2[p2++];
+    }
+  }
+  return sum;
+}
+
+/* sparse rows in one contiguous array (CSR) */
+template <typename T>
+class Matrix {
+ public:
+  typedef std::pair<uint32_t, T> Element;
+
+  // the value used for an id which appears twice in a row
+  enum Duplicate {
+    DUPLICATE_FIRST,
+    DUPLICATE_LAST,
+    DUPLICATE_SUM
+  };
+
+  Matrix() : offsets_(1, 0), dimension_(0) { }
+
+  // Append a row.  elements are sorted by ids.
+  void add(std::vector<Element> &elements,
+           Duplicate duplicate = DUPLICATE_FIRST) {
+    std::stable_sort(elements.begin(), elements.end(), less_id);
+    size_t begin = ids_.size();
+    for (size_t i = 0; i < elements.size(); i++) {
+      if (i > 0 && elements[i].first == elements[i-1].first) {
+        if (duplicate == DUPLICATE_SUM) {
+          values_.back() += elements[i].second;
+        } else if (duplicate == DUPLICATE_LAST) {
+          values_.back() = elements[i].second;
+        }
+        continue;
+      }
+      ids_.push_back(elements[i].first);
+      values_.push_back(elements[i].second);
+      if (dimension_ <= elements[i].first) dimension_ = elements[i].first + 1;
+    }
+    offsets_.push_back(ids_.size());
+    double norm2 = 0.0;
+    for (size_t i = begin; i < ids_.size(); i++) {
+      norm2 += static_cast<double>(values_[i]) * values_[i];
+    }
+    squared_norms_.push_back(norm2);
+    norms_.push_back(sqrt(norm2));
+  }
+
+  void clear() {
+    offsets_.resize(1);
+    ids_.clear();
+    values_.clear();
+    squared_norms_.clear();
+    norms_.clear();
+    dimension_ = 0;
+  }
+
+  // the number of rows
+  size_t size() const { return norms_.size(); }
+  size_t nonzeros() const { return ids_.size(); }
+  // the maximum id + 1
+  size_t dimension() const { return dimension_; }
+
+  size_t length(size_t row) const { return offsets_[row+1] - offsets_[row]; }
+  // (NULL for a matrix without elements)
+  const uint32_t *ids(size_t row) const {
+    return ids_.empty() ? NULL : data(ids_) + offsets_[row];
+  }
+  const T *values(size_t row) const {
+    return values_.empty() ? NULL : data(values_) + offsets_[row];
+  }
+  double norm(size_t row) const { return norms_[row]; }
+  double squared_norm(size_t row) const { return squared_norms_[row]; }
+
+  double dot(size_t row, const T *dense) const {
+    return sparse::dot(ids(row), values(row), length(row), dense);
+  }
+
+  double dot(size_t row1, size_t row2) const {
+    return sparse::dot(ids(row1), values(row1), length(row1),
+                       ids(row2), values(row2), length(row2));
+  }
+
+  // cosine of rows (0 for a zero vector)
+  double cosine(size_t row1, size_t row2) const {
+    double norm1 = norms_[row1], norm2 = norms_[row2];
+    if (norm1 == 0 || norm2 == 0) return 0;
+    return dot(row1, row2) / (norm1 * norm2);
+  }
+
+  // ||x||^2 + ||c||^2 - 2 x.c for the squared norm of the dense vector c
+  double squared_distance(size_t row, const T *dense,
+                          double dense_squared_norm) const {
+    double dist = squared_norms_[row] + dense_squared_norm
+                  - 2.0 * dot(row, dense);
+    return (dist > 0.0) ? dist : 0.0;
+  }
+
+  // dense[id] += scale * value
+  void add_to(size_t row, T *dense, T scale = 1) const {
+    const uint32_t *ids = this->ids(row);
+    const T *values = this->values(row);
+    for (size_t i = 0; i < length(row); i++) dense[ids[i]] += scale * values[i];
+  }
+
+ private:
+  std::vector<size_t> offsets_;  // start of each row (size: rows + 1)
+  std::vector<uint32_t> ids_;
+  std::vector<T> values_;
+  std::vector<double> squared_norms_;
+  std::vector<double> norms_;
+  size_t dimension_;
+
+  static bool less_id(const Element &left, const Element &right) {
+    return left.first < right.first;
+  }
+};
+
+}  // namespace sparse
+
+#endif  // SPARSE_MATRIX_H_
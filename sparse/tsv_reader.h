@@ -0,0 +1,221 @@
+//
+// Zero-copy reader of tab separated lines and a feature dictionary
+//
+// TsvReader reads a file in large blocks and splits each line into
+// fields which point into its buffer, so no string is made per field.
+// FeatureDict interns feature names into ids 0, 1, ... in order of
+// appearance.
+//
+// Usage:
+//   sparse::TsvReader reader;
+//   reader.open(path);
+//   std::vector<sparse::Field> fields;
+//   while (reader.next('\t', fields)) {
+//     uint32_t id = dict.intern(fields[1]);
+//     double value = fields[2].to_double();
+//     ...
+//   }
+//
+
+#ifndef TSV_READER_H_
+#define TSV_READER_H_
+
+#include <stdint.h>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <tr1/unordered_map>
+#include <vector>
+
+namespace sparse {
+
+/* a field of a line (not terminated) */
+struct Field {
+  const char *data;
+  size_t size;
+
+  Field() : data(NULL), size(0) { }
+  Field(const char *d, size_t s) : data(d), size(s) { }
+
+  bool empty() const { return size == 0; }
+  std::string str() const { return std::string(data, size); }
+
+  bool equals(const char *s) const {
+    return strlen(s) == size && !memcmp(data, s, size);
+  }
+
+  // the number at the head of the field (0 if empty)
+  double to_double() const {
+    if (size == 0) return 0.0;
+    char buf[64];
+    if (size < sizeof(buf) && !isspace(static_cast<unsigned char>(data[0]))) {
+      // strtod may read over the end of the field, e.g. "1\t2"
+      memcpy(buf, data, size);
+      buf[size] = '\0';
+      return strtod(buf, NULL);
+    }
+    return atof(str().c_str());
+  }
+};
+
+// Split [begin, end) at each delimiter (empty fields are kept).
+inline void split(const char *begin, const char *end, char delimiter,
+                  std::vector<Field> &fields) {
+  fields.clear();
+  const char *p = begin;
+  while (true) {
+    const char *q = static_cast<const char *>(memchr(p, delimiter, end - p));
+    if (q == NULL) {
+      fields.push_back(Field(p, end - p));
+      return;
+    }
+    fields.push_back(Field(p, q - p));
+    p = q + 1;
+  }
+}
+
+// Split [begin, end) at runs of white spaces (no empty fields).
+inline void split_spaces(const char *begin, const char *end,
+                         std::vector<Field> &fields) {
+  fields.clear();
+  const char *p = begin;
+  while (true) {
+    while (p < end && isspace(static_cast<unsigned char>(*p))) p++;
+    if (p >= end) return;
+    const char *q = p;
+    while (q < end && !isspace(static_cast<unsigned char>(*q))) q++;
+    fields.push_back(Field(p, q - p));
+    p = q;
+  }
+}
+
+/* lines of a file */
+class TsvReader {
+ public:
+  static const size_t BLOCK_SIZE = 1 << 20;
+
+  TsvReader() : fp_(NULL), begin_(0), end_(0), eof_(true) { }
+  ~TsvReader() { close(); }
+
+  bool open(const char *path) {
+    close();
+    fp_ = fopen(path, "rb");
+    if (fp_ == NULL) return false;
+    buffer_.resize(BLOCK_SIZE + 1);
+    begin_ = end_ = 0;
+    eof_ = false;
+    return true;
+  }
+
+  void close() {
+    if (fp_ != NULL) fclose(fp_);
+    fp_ = NULL;
+    eof_ = true;
+  }
+
+  // read the file again from the head
+  bool rewind() {
+    if (fp_ == NULL) return false;
+    ::rewind(fp_);
+    begin_ = end_ = 0;
+    eof_ = false;
+    return true;
+  }
+
+  // The next line without the newline (false at the end of the file).
+  // It is terminated by '\0' and valid until the next call.
+  bool next_line(const char **line, size_t *size) {
+    while (true) {
+      char *head = &buffer_[0] + begin_;
+      char *nl = static_cast<char *>(memchr(head, '\n', end_ - begin_));
+      if (nl != NULL) {
+        *nl = '\0';
+        *line = head;
+        *size = nl - head;
+        begin_ = nl + 1 - &buffer_[0];
+        return true;
+      }
+      if (eof_) {
+        if (begin_ == end_) return false;
+        *line = head;
+        *size = end_ - begin_;
+        begin_ = end_;
+        return true;
+      }
+      fill();
+    }
+  }
+
+  // the fields of the next line
+  bool next(char delimiter, std::vector<Field> &fields) {
+    const char *line;
+    size_t size;
+    if (!next_line(&line, &size)) return false;
+    split(line, line + size, delimiter, fields);
+    return true;
+  }
+
+ private:
+  FILE *fp_;
+  std::vector<char> buffer_;  // [begin_, end_) is unread, and '\0' at end_
+  size_t begin_;
+  size_t end_;
+  bool eof_;
+
+  // keep the unread part, and read a block after it
+  void fill() {
+    size_t rest = end_ - begin_;
+    if (begin_ > 0) memmove(&buffer_[0], &buffer_[0] + begin_, rest);
+    begin_ = 0;
+    end_ = rest;
+    if (buffer_.size() - 1 - end_ < BLOCK_SIZE / 2) {
+      buffer_.resize(buffer_.size() * 2);  // a long line
+    }
+    size_t nread = fread(&buffer_[0] + end_, 1, buffer_.size() - 1 - end_,
+                         fp_);
+    if (nread == 0) eof_ = true;
+    end_ += nread;
+    buffer_[end_] = '\0';
+  }
+};
+
+/* feature names to ids */
+class FeatureDict {
+ public:
+  FeatureDict() { }
+
+  // the id of the name, which is added if it is new
+  uint32_t intern(const char *name, size_t size) {
+    key_.assign(name, size);
+    Ids::iterator it = ids_.find(key_);
+    if (it != ids_.end()) return it->second;
+    uint32_t id = static_cast<uint32_t>(names_.size());
+    ids_.insert(std::make_pair(key_, id));
+    names_.push_back(key_);
+    return id;
+  }
+  uint32_t intern(const Field &field) {
+    return intern(field.data, field.size);
+  }
+
+  // the id of the name (-1 if not found)
+  int64_t find(const char *name, size_t size) const {
+    Ids::const_iterator it = ids_.find(std::string(name, size));
+    return (it != ids_.end()) ? static_cast<int64_t>(it->second) : -1;
+  }
+
+  size_t size() const { return names_.size(); }
+  const std::string &name(uint32_t id) const { return names_[id]; }
+
+ private:
+  typedef std::tr1::unordered_map<std::string, uint32_t> Ids;
+  Ids ids_;
+  std::vector<std::string> names_;
+  std::string key_;
+};
+
+}  // namespace sparse
+
+#endif  // TSV_READER_H_